@@ -0,0 +1,587 @@
+/*
+ * netsniff-bench - microbenchmarks of the counter table and of the
+ * serialization of stats
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+/*
+ * The capture module is compiled into the harness, so its internal
+ * entry points are driven as the daemon calls them, without a socket,
+ * a capture thread or a disk in the way.
+ */
+#include "capture_module.c"
+
+#include <getopt.h>
+
+#include "addr_dist.h"
+
+const char *program_name = "netsniff-bench";
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+#define BENCH_DEFAULT_SIZES "10000,100000,1000000"
+#define BENCH_DEFAULT_OPS 1000000
+#define BENCH_DEFAULT_RUNS 3
+#define BENCH_SIZES_MAX 16
+/* addresses are taken from 10.0.0.0/8 */
+#define BENCH_ADDR_BASE 0x0a000000U
+#define BENCH_SIZE_MAX (1U << 24)
+/* addresses per packet_get_ip_counts(), as in a DOPT_IP_COUNT_BATCH */
+#define BENCH_BATCH 256
+
+/**
+ * @struct s_bench_stream
+ * @typedef bench_stream
+ * @brief Addresses of a benchmark, generated before anything is timed.
+ */
+typedef struct s_bench_stream
+{
+    addr_dist dist;
+    uint32_t size;      /* addresses in the population */
+    size_t length;      /* addresses in the stream */
+    uint32_t *addrs;    /* network byte order */
+    char (*strs)[INET_ADDRSTRLEN];
+} bench_stream;
+
+/**
+ * @struct s_bench_result
+ * @typedef bench_result
+ */
+typedef struct s_bench_result
+{
+    uint64_t ops;
+    uint64_t ns;        /* best run */
+    uint64_t allocs;    /* of the best run */
+    uint64_t entries;
+    double bytes_per_entry;
+} bench_result;
+
+/*********************/
+/* Allocation counts */
+/*********************/
+
+/* The harness is linked with --wrap for these, so every allocation
+ * made by the daemon code is counted. Single threaded, no atomics. */
+static uint64_t alloc_count;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    ++alloc_count;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+    ++alloc_count;
+    return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+    ++alloc_count;
+    return __real_realloc(ptr, size);
+}
+
+/**********/
+/* Timing */
+/**********/
+
+typedef struct s_bench_clock
+{
+    uint64_t start_ns;
+    uint64_t start_allocs;
+} bench_clock;
+
+static void
+bench_clock_start(bench_clock *clock)
+{
+    clock->start_allocs = alloc_count;
+    clock->start_ns = monotonic_ns();
+}
+
+/* Keep the run if it is the fastest so far */
+static void
+bench_clock_stop(bench_clock *clock, bench_result *result)
+{
+    uint64_t ns = monotonic_ns() - clock->start_ns;
+
+    if(!result->ns || ns < result->ns)
+    {
+        result->ns = ns;
+        result->allocs = alloc_count - clock->start_allocs;
+    }
+}
+
+/***********/
+/* Streams */
+/***********/
+
+/* addr_rng_next() state, the streams are drawn one after another */
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static int
+stream_create(bench_stream *stream, addr_dist dist, uint32_t size, size_t length,
+              double zipf_s)
+{
+    int err;
+
+    stream->dist = dist;
+    stream->size = size;
+    stream->length = length;
+
+    /* !!! malloc !!! */
+    stream->addrs = malloc(length * sizeof(*stream->addrs));
+    stream->strs = malloc(length * sizeof(*stream->strs));
+    if(!stream->addrs || !stream->strs)
+    {
+        free(stream->addrs);
+        free(stream->strs);
+        return ENOMEM;
+    }
+
+    /* indexes into the population first */
+    err = addr_dist_fill(stream->addrs, length, dist, size, zipf_s, &rng_state);
+    if(err)
+    {
+        free(stream->addrs);
+        free(stream->strs);
+        return err;
+    }
+
+    /* packet_get_ip_count() takes the address as the client sends it */
+    for(size_t i = 0; i < length; ++i)
+    {
+        stream->addrs[i] = htonl(BENCH_ADDR_BASE + stream->addrs[i]);
+        inet_ntop(AF_INET, &stream->addrs[i], stream->strs[i], INET_ADDRSTRLEN);
+    }
+
+    return 0;
+}
+
+static void
+stream_destroy(bench_stream *stream)
+{
+    free(stream->addrs);
+    free(stream->strs);
+}
+
+/**************/
+/* Benchmarks */
+/**************/
+
+/* Empty g_stats, as before the first packet */
+static int
+stats_reset(void)
+{
+    counter_table_destroy(&g_stats.table);
+    /* private memfd, the table of a running daemon is left alone */
+    return counter_table_create(&g_stats.table, NULL, 0);
+}
+
+static double
+table_bytes_per_entry(const counter_table *table)
+{
+    return table->hdr->entries ? (double) table->map_size / table->hdr->entries : 0;
+}
+
+/* One packet after another into an empty table, growth included */
+static int
+bench_add(const bench_stream *stream, unsigned runs, bench_result *result)
+{
+    for(unsigned run = 0; run < runs; ++run)
+    {
+        bench_clock clock;
+        int err = stats_reset();
+        if(err)
+            return err;
+
+        bench_clock_start(&clock);
+        for(size_t i = 0; i < stream->length; ++i)
+        {
+            struct in_addr addr = { stream->addrs[i] };
+            err = work_with_addr(&addr, &g_stats);
+            if(err)
+                return err;
+        }
+        bench_clock_stop(&clock, result);
+    }
+
+    result->ops = stream->length;
+    result->entries = g_stats.table.hdr->entries;
+    result->bytes_per_entry = table_bytes_per_entry(&g_stats.table);
+    return 0;
+}
+
+/* Lookups of the stream's addresses, as DOPT_IP_COUNT does them.
+ * Expects the table filled by bench_add(). */
+static int
+bench_get(const bench_stream *stream, unsigned runs, bench_result *result)
+{
+    volatile uint64_t sink = 0;
+
+    for(unsigned run = 0; run < runs; ++run)
+    {
+        bench_clock clock;
+
+        bench_clock_start(&clock);
+        for(size_t i = 0; i < stream->length; ++i)
+            sink += packet_get_ip_count(stream->strs[i]);
+        bench_clock_stop(&clock, result);
+    }
+
+    (void) sink;
+    result->ops = stream->length;
+    result->entries = g_stats.table.hdr->entries;
+    result->bytes_per_entry = table_bytes_per_entry(&g_stats.table);
+    return 0;
+}
+
+/* Lookups in batches, as DOPT_IP_COUNT_BATCH does them */
+static int
+bench_get_batch(const bench_stream *stream, unsigned runs, bench_result *result)
+{
+    uint64_t counts[BENCH_BATCH];
+
+    for(unsigned run = 0; run < runs; ++run)
+    {
+        bench_clock clock;
+
+        bench_clock_start(&clock);
+        for(size_t i = 0; i < stream->length; i += BENCH_BATCH)
+        {
+            size_t n = stream->length - i < BENCH_BATCH ? stream->length - i : BENCH_BATCH;
+            packet_get_ip_counts(stream->addrs + i, n, counts);
+        }
+        bench_clock_stop(&clock, result);
+    }
+
+    result->ops = stream->length;
+    result->entries = g_stats.table.hdr->entries;
+    result->bytes_per_entry = table_bytes_per_entry(&g_stats.table);
+    return 0;
+}
+
+/* Snapshot text of the table, as the persistence engine makes it for
+ * packet_stats_dump(). An op is an entry. Keeps the text for bench_load(). */
+static int
+bench_dump(dump_buffer *text, unsigned runs, bench_result *result)
+{
+    for(unsigned run = 0; run < runs; ++run)
+    {
+        bench_clock clock;
+        dump_job *job;
+        int err;
+
+        free(text->data);
+        memset(text, 0, sizeof(*text));
+
+        bench_clock_start(&clock);
+        err = packet_stats_dump_collect(&g_stats, &job);
+        if(!err)
+        {
+            err = packet_stats_dump_render_fn(job, &text->data, &text->size);
+            free(job);
+        }
+        bench_clock_stop(&clock, result);
+        if(err)
+            return err;
+    }
+
+    result->ops = g_stats.table.hdr->entries;
+    result->entries = g_stats.table.hdr->entries;
+    result->bytes_per_entry = result->entries ? (double) text->size / result->entries : 0;
+    return 0;
+}
+
+/* Parsing of a snapshot into an empty table, as the background loader
+ * does it. An op is an entry. */
+static int
+bench_load(const dump_buffer *text, unsigned runs, bench_result *result)
+{
+    counter_table table;
+    char *data;
+
+    /* the parser cuts the text into lines in place */
+    /* !!! malloc !!! */
+    data = malloc(text->size + 1);
+    if(!data)
+        return ENOMEM;
+
+    for(unsigned run = 0; run < runs; ++run)
+    {
+        bench_clock clock;
+        int err;
+
+        memcpy(data, text->data, text->size);
+        data[text->size] = '\0';
+        err = counter_table_create(&table, NULL, 0);
+        if(err)
+        {
+            free(data);
+            return err;
+        }
+
+        pthread_mutex_lock(&load_mutex);
+        bench_clock_start(&clock);
+        err = packet_stats_parse(&table, data);
+        bench_clock_stop(&clock, result);
+        pthread_mutex_unlock(&load_mutex);
+
+        result->ops = table.hdr->entries;
+        result->entries = table.hdr->entries;
+        result->bytes_per_entry = table_bytes_per_entry(&table);
+        counter_table_destroy(&table);
+        if(err)
+        {
+            free(data);
+            return err;
+        }
+    }
+
+    free(data);
+    return 0;
+}
+
+/**********/
+/* Output */
+/**********/
+
+/* One JSON object per line, so runs of different commits can be diffed or
+ * loaded as they are */
+static void
+result_print(const char *bench, const bench_stream *stream, const bench_result *result)
+{
+    printf("{\"revision\":\"%s\",\"bench\":\"%s\",\"dist\":\"%s\",\"size\":%u,"
+           "\"ops\":%" PRIu64 ",\"entries\":%" PRIu64 ",\"ns_per_op\":%.2f,"
+           "\"allocs_per_op\":%.6f,\"bytes_per_entry\":%.2f}\n",
+           BENCH_REVISION, bench, addr_dist_names[stream->dist], stream->size,
+           result->ops, result->entries,
+           result->ops ? (double) result->ns / result->ops : 0,
+           result->ops ? (double) result->allocs / result->ops : 0,
+           result->bytes_per_entry);
+    fflush(stdout);
+}
+
+/* All benchmarks over one stream */
+static int
+bench_stream_run(const bench_stream *stream, unsigned runs)
+{
+    bench_result result;
+    dump_buffer text = { 0 };
+    int err;
+
+    memset(&result, 0, sizeof(result));
+    err = bench_add(stream, runs, &result);
+    if(err)
+        return err;
+    result_print("add", stream, &result);
+
+    memset(&result, 0, sizeof(result));
+    bench_get(stream, runs, &result);
+    result_print("get", stream, &result);
+
+    memset(&result, 0, sizeof(result));
+    bench_get_batch(stream, runs, &result);
+    result_print("get_batch", stream, &result);
+
+    memset(&result, 0, sizeof(result));
+    err = bench_dump(&text, runs, &result);
+    if(!err)
+    {
+        result_print("dump", stream, &result);
+
+        memset(&result, 0, sizeof(result));
+        err = bench_load(&text, runs, &result);
+        if(!err)
+            result_print("load", stream, &result);
+    }
+
+    free(text.data);
+    return err;
+}
+
+/*****************/
+/* Documentation */
+/*****************/
+
+void
+doc_usage(void)
+{
+    printf("Usage: %s [-s SIZE,...] [-d DIST,...] [-n OPS] [-r RUNS] [-z S] [-S SEED]\n",
+           program_name);
+    printf("\n");
+    printf("-s SIZE,... :   addresses in the population, default %s.\n",
+           BENCH_DEFAULT_SIZES);
+    printf("-d DIST,... :   uniform, zipf or scan, default all of them.\n");
+    printf("-n OPS      :   addresses per stream, default %d, at least SIZE.\n",
+           BENCH_DEFAULT_OPS);
+    printf("-r RUNS     :   runs of every benchmark, the fastest is reported,\n");
+    printf("                default %d.\n", BENCH_DEFAULT_RUNS);
+    printf("-z S        :   exponent of the Zipf distribution, default 1.0.\n");
+    printf("-S SEED     :   seed of the address generator.\n");
+    printf("\n");
+    printf("Benchmarks, per stream:\n");
+    printf("add         :   count every address into an empty table.\n");
+    printf("get         :   look up every address, one by one.\n");
+    printf("get_batch   :   look up every address, %d at a time.\n", BENCH_BATCH);
+    printf("dump        :   serialize the table as a snapshot, per entry.\n");
+    printf("load        :   parse the snapshot into an empty table, per entry.\n");
+    printf("\n");
+    printf("Results are printed as one JSON object per line.\n");
+}
+
+/* Parse "a,b,c" into sizes, returns the number of them or 0 if invalid */
+static unsigned
+sizes_parse(char *list, uint32_t *sizes)
+{
+    unsigned count = 0;
+
+    for(char *tok = strtok(list, ","); tok; tok = strtok(NULL, ","))
+    {
+        char *endptr;
+        unsigned long size;
+
+        errno = 0;
+        size = strtoul(tok, &endptr, 10);
+        if(errno || *endptr || !size || size > BENCH_SIZE_MAX || count == BENCH_SIZES_MAX)
+            return 0;
+        sizes[count++] = size;
+    }
+
+    return count;
+}
+
+/* Parse "a,b" into a mask of distributions, 0 if invalid */
+static unsigned
+dists_parse(char *list)
+{
+    unsigned mask = 0;
+
+    for(char *tok = strtok(list, ","); tok; tok = strtok(NULL, ","))
+    {
+        int found = 0;
+
+        for(int d = 0; d < DIST_COUNT; ++d)
+        {
+            if(!strcmp(tok, addr_dist_names[d]))
+            {
+                mask |= 1U << d;
+                found = 1;
+            }
+        }
+        if(!found)
+            return 0;
+    }
+
+    return mask;
+}
+
+int
+main(int argc, char **argv)
+{
+    char default_sizes[] = BENCH_DEFAULT_SIZES;
+    uint32_t sizes[BENCH_SIZES_MAX];
+    unsigned size_count, dist_mask = (1U << DIST_COUNT) - 1;
+    unsigned long ops = BENCH_DEFAULT_OPS;
+    unsigned runs = BENCH_DEFAULT_RUNS;
+    double zipf_s = 1.0;
+    int opt;
+
+    size_count = sizes_parse(default_sizes, sizes);
+
+    while((opt = getopt(argc, argv, "s:d:n:r:z:S:h")) != -1)
+    {
+        char *endptr = NULL;
+
+        errno = 0;
+        switch(opt)
+        {
+        case 's':
+            size_count = sizes_parse(optarg, sizes);
+            if(!size_count)
+                goto invalid;
+            break;
+        case 'd':
+            dist_mask = dists_parse(optarg);
+            if(!dist_mask)
+                goto invalid;
+            break;
+        case 'n':
+            ops = strtoul(optarg, &endptr, 10);
+            break;
+        case 'r':
+            runs = strtoul(optarg, &endptr, 10);
+            if(!runs)
+                goto invalid;
+            break;
+        case 'z':
+            zipf_s = strtod(optarg, &endptr);
+            if(zipf_s <= 0)
+                goto invalid;
+            break;
+        case 'S':
+            rng_state = strtoull(optarg, &endptr, 0);
+            if(!rng_state)
+                goto invalid;
+            break;
+        default:
+            doc_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+
+        if(errno || (endptr && *endptr))
+            goto invalid;
+    }
+
+    if(optind != argc)
+        goto invalid;
+
+    strncpy(g_stats.iface_str, "bench", IFNAMSIZ - 1);
+
+    for(unsigned s = 0; s < size_count; ++s)
+    {
+        for(int d = 0; d < DIST_COUNT; ++d)
+        {
+            bench_stream stream;
+            int err;
+
+            if(!(dist_mask & 1U << d))
+                continue;
+
+            err = stream_create(&stream, d, sizes[s], ops > sizes[s] ? ops : sizes[s],
+                                zipf_s);
+            if(!err)
+            {
+                err = bench_stream_run(&stream, runs);
+                stream_destroy(&stream);
+            }
+
+            if(err)
+            {
+                fprintf(stderr, "%s: %s, %u addresses: %s\n", program_name,
+                        addr_dist_names[d], sizes[s], strerror(err));
+                return 1;
+            }
+        }
+    }
+
+    counter_table_destroy(&g_stats.table);
+    return 0;
+
+invalid:
+    doc_usage();
+    return 1;
+}
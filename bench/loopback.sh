@@ -0,0 +1,168 @@
+#!/bin/sh
+#
+# loopback.sh - find the packet rate netsniffd sustains before the
+# kernel starts dropping, using netsniff-gen as the load
+#
+# Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+#
+# SPDX-License-Identifier: MIT
+# License-Filename: LICENSE
+#
+# A fresh daemon is started and fed one rate after another. For every
+# rate, one JSON line compares what was sent, received by the capture
+# thread, dropped by the kernel and counted in the table, with the CPU
+# time of the daemon per received packet. The last line names the knee:
+# the first rate dropping more than the threshold.
+#
+# The daemon is killed at the end rather than stopped, so the synthetic
+# counts never reach the saved stats.
+
+BUILD_DIR=build
+RATES="25000 50000 100000 200000 400000 800000 0"
+SECONDS_PER_RATE=3
+DIST=uniform
+SIZE=65536
+NET=10.0.0.0/8
+DST=127.0.0.1
+IFACE=
+THRESHOLD=0.1
+
+SOCKET_PATH=/tmp/netsniffd.sock
+SHM_TABLE=/dev/shm/netsniffd.table
+
+usage()
+{
+    cat <<EOF
+Usage: $0 [-r "RATE..."] [-t SECONDS] [-s DIST] [-N SIZE] [-b NET/LEN]
+       [-d DST] [-i IFACE] [-T PERCENT] [-B BUILD_DIR]
+
+-r RATE...  :   packets per second to try in order, 0 for as fast as
+                possible, default "$RATES".
+-t SECONDS  :   time at every rate, default $SECONDS_PER_RATE.
+-s DIST     :   uniform, zipf or scan, default $DIST.
+-N SIZE     :   number of source addresses, default $SIZE.
+-b NET/LEN  :   network of the source addresses, default $NET.
+-d DST      :   destination, default $DST.
+-i IFACE    :   send through IFACE, e.g. one end of a veth pair.
+-T PERCENT  :   drops above this are past the knee, default $THRESHOLD.
+-B DIR      :   where the binaries are, default $BUILD_DIR.
+
+Run as root, with no netsniffd running.
+EOF
+}
+
+while getopts "r:t:s:N:b:d:i:T:B:h" opt
+do
+    case $opt in
+    r) RATES=$OPTARG ;;
+    t) SECONDS_PER_RATE=$OPTARG ;;
+    s) DIST=$OPTARG ;;
+    N) SIZE=$OPTARG ;;
+    b) NET=$OPTARG ;;
+    d) DST=$OPTARG ;;
+    i) IFACE=$OPTARG ;;
+    T) THRESHOLD=$OPTARG ;;
+    B) BUILD_DIR=$OPTARG ;;
+    h) usage; exit 0 ;;
+    *) usage; exit 1 ;;
+    esac
+done
+
+DAEMON=$BUILD_DIR/netsniffd.app
+CLI=$BUILD_DIR/netsniff.app
+GEN=$BUILD_DIR/netsniff-gen.app
+
+fail()
+{
+    echo "$0: $*" >&2
+    exit 1
+}
+
+for bin in "$DAEMON" "$CLI" "$GEN"
+do
+    [ -x "$bin" ] || fail "$bin not found, run make first"
+done
+[ "$(id -u)" -eq 0 ] || fail "raw sockets need root"
+# a second daemon would take over the running one
+pidof netsniffd.app >/dev/null && fail "netsniffd is running, stop it first"
+
+cleanup()
+{
+    [ -n "$DAEMON_PID" ] && kill -KILL "$DAEMON_PID" 2>/dev/null
+    rm -f "$SOCKET_PATH" "$SHM_TABLE"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+"$DAEMON" || fail "netsniffd did not start"
+tries=50
+until [ -S "$SOCKET_PATH" ] && DAEMON_PID=$(pidof netsniffd.app)
+do
+    tries=$((tries - 1))
+    [ $tries -gt 0 ] || fail "netsniffd did not start"
+    sleep 0.1
+done
+"$CLI" start >/dev/null || fail "capture did not start"
+
+# "packets: R received, B bytes, D dropped by kernel, E receive errors"
+selfstat()
+{
+    "$CLI" selfstat | awk '$1 == "packets:" { print $2, $6 }'
+}
+
+# "M of N matching addresses, P packets"
+counted()
+{
+    "$CLI" query in "$NET" limit 1 | awk 'NR == 1 { print $(NF - 1) }'
+}
+
+# utime + stime of all threads, in clock ticks
+cpu_ticks()
+{
+    awk '{ print $14 + $15 }' "/proc/$DAEMON_PID/stat"
+}
+
+CLK_TCK=$(getconf CLK_TCK)
+KNEE=
+SUSTAINED=0
+
+for rate in $RATES
+do
+    set -- $(selfstat) $(counted) $(cpu_ticks)
+    received0=$1 drops0=$2 counted0=$3 ticks0=$4
+
+    gen=$("$GEN" -d "$DST" ${IFACE:+-i "$IFACE"} -r "$rate" -t "$SECONDS_PER_RATE" \
+                 -s "$DIST" -N "$SIZE" -b "${NET%/*}") || fail "netsniff-gen failed"
+    # let the daemon drain its socket
+    sleep 1
+
+    set -- $(selfstat) $(counted) $(cpu_ticks)
+    received1=$1 drops1=$2 counted1=$3 ticks1=$4
+
+    sent=$(echo "$gen" | sed 's/.*"sent":\([0-9]*\).*/\1/')
+    pps=$(echo "$gen" | sed 's/.*"pps":\([0-9]*\).*/\1/')
+
+    line=$(awk -v rate="$rate" -v pps="$pps" -v sent="$sent" \
+               -v received=$((received1 - received0)) -v drops=$((drops1 - drops0)) \
+               -v counted=$((counted1 - counted0)) -v ticks=$((ticks1 - ticks0)) \
+               -v tck="$CLK_TCK" 'BEGIN {
+        total = received + drops
+        ratio = total ? 100 * drops / total : 0
+        cpu = received ? ticks * 1e9 / tck / received : 0
+        printf "{\"rate\":%d,\"pps\":%d,\"sent\":%d,\"received\":%d,\"kernel_drops\":%d,", \
+               rate, pps, sent, received, drops
+        printf "\"counted\":%d,\"drop_percent\":%.3f,\"cpu_ns_per_packet\":%.0f}\n", \
+               counted, ratio, cpu
+    }')
+    echo "$line"
+
+    over=$(echo "$line" | awk -v t="$THRESHOLD" -F'"drop_percent":' '{ split($2, v, ","); print (v[1] > t) }')
+    if [ "$over" -eq 1 ]
+    then
+        KNEE=$pps
+        break
+    fi
+    SUSTAINED=$pps
+done
+
+echo "{\"dist\":\"$DIST\",\"size\":$SIZE,\"threshold_percent\":$THRESHOLD,\"sustained_pps\":$SUSTAINED,\"knee_pps\":${KNEE:-null}}"
@@ -13,13 +13,15 @@
 #include <string.h>
 #include <errno.h>
 
+#include <poll.h>
+#include <inttypes.h>
+
 #include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/un.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 
-#include "custom_com_def.h"
+#include "netsniff.h"
 
 
 const char *program_name = "netsniff";
@@ -55,12 +57,32 @@ doc_help(void)
 {
     printf("Supported commands:\n");
     printf("--help                  :   print this message.\n");
+    printf("--shm [command]         :   answer `show` and `stat` from the shared\n");
+    printf("                            counter table, without asking the daemon.\n");
     printf("--about                 :   print info about the application.\n");
     printf("start                   :   start sniffing packets on a default interface.\n");
     printf("stop                    :   stop sniffing.\n");
     printf("show [ip] count         :   print information about the IP.\n");
+    printf("show [ip...] count      :   same for many IPs, pipelined over one connection.\n");
+    printf("count [file]            :   print counts of IPv4/IPv6 addresses listed one\n");
+    printf("                            per line in file or stdin, in batches.\n");
     printf("select iface   [iface]  :   select interface for sniffing.\n");
     printf("stat [iface]            :   show statistics for a particular interface.\n");
+    printf("query [in NET[/LEN]] [min N] [max N] [sort KEY] [limit N]\n");
+    printf("                        :   print the entries matching a prefix and a count\n");
+    printf("                            range, filtered and sorted by the daemon. KEY is\n");
+    printf("                            count (busiest first), count-asc, addr, addr-desc\n");
+    printf("                            or none.\n");
+    printf("dump [cursor]           :   stream all entries unsorted, as they are read\n");
+    printf("                            from the live table.\n");
+    printf("snapshot                :   print all entries from a point-in-time copy\n");
+    printf("                            of the table shared as a sealed memfd.\n");
+    printf("load                    :   show progress of loading saved statistics.\n");
+    printf("selfstat                :   show health of the capture thread: kernel drops,\n");
+    printf("                            errors, ring use, stats lock waits and processing\n");
+    printf("                            time.\n");
+    printf("watch                   :   print addresses counted every interval, with\n");
+    printf("                            their count and increase, until interrupted.\n");
 }
 
 /**
@@ -72,7 +94,7 @@ doc_help(void)
 void
 doc_usage(void)
 {
-    printf("Usage: %s [OPTIONS...]\n", program_name);
+    printf("Usage: %s [--shm] [OPTIONS...]\n", program_name);
     printf("Use --help for details.\n");
 }
 
@@ -80,186 +102,858 @@ doc_usage(void)
 /* Daemon control functions */
 /****************************/
 
-#define SOCKET_INIT()\
-    int ipc_socket;\
-    struct sockaddr_un remote;\
-    ipc_socket = socket(AF_UNIX, SOCK_STREAM, 0);\
-    if(ipc_socket == -1)\
-    {\
-        perror("socket");\
-        exit(1);\
-    }\
-    remote.sun_family = AF_UNIX;\
-    strcpy(remote.sun_path, IPC_SOCKET_PATH);\
-    if (connect(ipc_socket, (struct sockaddr *) &remote, sizeof(remote)) == -1) {\
-        perror("connect");\
-        exit(1);\
+/* Requests in flight on the async connection */
+#define FRAMED_WINDOW 256
+/* Batches in flight, each holds up to DOPT_BATCH_MAX addresses */
+#define BATCH_WINDOW 4
+
+/* All requests to the daemon go through one client */
+static netsniff_client *client;
+
+/**
+ * @fn daemon_client
+ * @brief Get the client, creating it on first use.
+ * @return client, exits on failure.
+ */
+static netsniff_client *
+daemon_client(void)
+{
+    int err;
+
+    if(client)
+        return client;
+
+    err = netsniff_client_open(&client, NULL, 1);
+    if(err)
+    {
+        fprintf(stderr, "%s: %s\n", program_name, strerror(err));
+        exit(1);
     }
 
+    return client;
+}
 
-#define SOCKET_CLEANUP() close(ipc_socket);
+/**
+ * @fn daemon_error
+ * @brief Print an error of netsniffd or of the connection to it.
+ * @return 1, to be used as the exit code.
+ */
+static int
+daemon_error(int err)
+{
+    printf("Error occured on netstiffd: %s\n", strerror(err));
+    return 1;
+}
+
+/* Print one address and its count */
+static void
+print_entry(uint32_t addr, uint64_t count)
+{
+    char ip[INET_ADDRSTRLEN];
+    struct in_addr in = { addr };
+
+    inet_ntop(AF_INET, &in, ip, sizeof(ip));
+    printf("%s %" PRIu64 "\n", ip, count);
+}
 
 /**
  * @fn daemon_start
  * @brief Start netsniffd.
- * @return 0 on success, errno code on failure.
+ * @return 0 on success, 1 on failure.
  *
  * Start sniffing packets on a default interface (eth0).
  * Used as a handler to command line parameter.
  */
-void
+int
 daemon_start(void)
 {
-    SOCKET_INIT();
-    /* send command */
-    uint32_t command = DOPT_START, status;
-    if (send(ipc_socket, &command, sizeof(command), 0) == -1)
+    int err = netsniff_start(daemon_client());
+
+    return err ? daemon_error(err) : 0;
+}
+
+/**
+ * @fn daemon_stop
+ * @brief Stop netsniffd.
+ * @return 0 on success, 1 on failure.
+ *
+ * Used as a handler to command line parameter.
+ */
+int
+daemon_stop(void)
+{
+    int err = netsniff_stop(daemon_client());
+
+    return err ? daemon_error(err) : 0;
+}
+
+/**
+ * @fn daemon_print_ip
+ * @brief Print packet count for a single IP.
+ * @param ip_addr ip address string, cannot be NULL.
+ * @return 0 on success, 1 on failure.
+ *
+ * Prints packet count for a single IP, if it was registered previously.
+ * Used as a handler to command line parameter.
+ */
+int
+daemon_print_ip(const char *ip_str)
+{
+    uint32_t count;
+    int err;
+
+    err = netsniff_ip_count(daemon_client(), ip_str, &count);
+    if(err)
+        return daemon_error(err);
+
+    printf("%u packets passed thru\n", count);
+    return 0;
+}
+
+/**
+ * @fn daemon_load_status
+ * @brief Print progress of loading saved stats.
+ * @return 0 on success, 1 on failure.
+ *
+ * Used as a handler to command line parameter.
+ */
+int
+daemon_load_status(void)
+{
+    static const char *state_names[] = {
+        [LOAD_IDLE] = "not started",
+        [LOAD_READING] = "reading",
+        [LOAD_PARSING] = "parsing",
+        [LOAD_MERGING] = "merging",
+        [LOAD_DONE] = "done",
+        [LOAD_FAILED] = "failed"
+    };
+    dopt_load_status progress;
+    int err;
+
+    err = netsniff_load_status(daemon_client(), &progress);
+    if(err)
+        return daemon_error(err);
+
+    printf("load: %s", progress.state <= LOAD_FAILED ? state_names[progress.state] : "unknown");
+    if(progress.bytes_total)
+        printf(", %" PRIu64 "/%" PRIu64 " bytes (%" PRIu64 "%%)",
+               progress.bytes_done, progress.bytes_total,
+               progress.bytes_done * 100 / progress.bytes_total);
+    printf(", %" PRIu64 " entries\n", progress.entries);
+    if(progress.state == LOAD_FAILED)
+        printf("Error: %s\n", strerror(progress.error));
+
+    return 0;
+}
+
+/**
+ * @fn daemon_select_iface
+ * @brief Select interface to sniff by a daemon.
+ * @param iface_str interface name, cannot be NULL.
+ * @return 0 on success, 1 on failure.
+ *
+ * Used as a handler to command line parameter.
+ */
+int
+daemon_select_iface(const char *iface_str)
+{
+    return 0;
+}
+
+/**
+ * @fn daemon_selfstat
+ * @brief Print the health counters of the capture thread.
+ * @return 0 on success, 1 on failure.
+ *
+ * Used as a handler to command line parameter.
+ */
+int
+daemon_selfstat(void)
+{
+    static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    dopt_selfstat stats;
+    uint64_t *hist, counted;
+    int err;
+
+    err = netsniff_selfstat(daemon_client(), &stats, &hist);
+    if(err)
+        return daemon_error(err);
+
+    printf("capture: %s, last error: %s, up %" PRIu64 ".%03u s\n",
+           stats.running ? "running" : "stopped",
+           stats.last_error ? strerror(stats.last_error) : "none",
+           stats.elapsed_ms / 1000, (unsigned)(stats.elapsed_ms % 1000));
+    printf("packets: %" PRIu64 " received, %" PRIu64 " bytes, %" PRIu64
+           " dropped by kernel, %" PRIu64 " receive errors\n",
+           stats.packets, stats.bytes, stats.kernel_drops, stats.recv_errors);
+    printf("ring: %" PRIu32 " of %" PRIu32 " used, %" PRIu32 " max, %" PRIu64
+           " overflows, %" PRIu64 " batches\n",
+           stats.ring_used, stats.ring_capacity, stats.ring_max_used,
+           stats.ring_overflows, stats.batches);
+    printf("stats lock: %" PRIu64 " waits, %" PRIu64 " ns total, %" PRIu64 " ns max\n",
+           stats.lock_waits, stats.lock_wait_ns, stats.lock_wait_max_ns);
+    if(stats.backend == CAPTURE_BACKEND_BPF)
+        printf("in-kernel counting: %" PRIu32 " addresses, %" PRIu64 " packets missed\n",
+               stats.bpf_entries, stats.bpf_misses);
+    if(stats.backend == CAPTURE_BACKEND_XDP)
     {
-        perror("send");
-        SOCKET_CLEANUP();
-        exit(1);
+        printf("AF_XDP: %" PRIu32 " queues, %s mode, %s\n", stats.xdp_queues,
+               stats.xdp_flags & CAPTURE_XDP_NATIVE ? "native" : "generic",
+               stats.xdp_flags & CAPTURE_XDP_ZEROCOPY ? "zero-copy" : "copy");
+        printf("  %" PRIu64 " dropped, %" PRIu64 " RX ring full, %" PRIu64
+               " fill ring empty, %" PRIu64 " invalid descriptors\n",
+               stats.xdp_rx_dropped, stats.xdp_rx_ring_full, stats.xdp_fill_ring_empty,
+               stats.xdp_invalid_descs);
     }
-    /* receive response */
-    if (recv(ipc_socket, &status, sizeof(status), 0) == -1)
+    if(stats.busy_poll_us)
     {
-        perror("recv");
-        SOCKET_CLEANUP();
-        exit(1);
+        printf("busy poll: %" PRIu32 " us, %" PRIu64 " packets while spinning, %" PRIu64
+               " fallbacks to blocking\n",
+               stats.busy_poll_us, stats.spin_packets, stats.busy_poll_fallbacks);
+        printf("  receive: %" PRIu64 " ms spinning, %" PRIu64 " ms working\n",
+               stats.recv_spin_ns / 1000000, stats.recv_work_ns / 1000000);
+        printf("  aggregate: %" PRIu64 " ms spinning, %" PRIu64 " ms working\n",
+               stats.aggregate_spin_ns / 1000000, stats.aggregate_work_ns / 1000000);
     }
 
-    if(status)
+    counted = stats.packets - stats.ring_overflows - stats.ring_used;
+    printf("processing:");
+    if(counted)
+        printf(" mean %" PRIu64 " ns,", stats.process_total_ns / counted);
+    for(size_t i = 0; i < sizeof(percentiles) / sizeof(*percentiles); ++i)
+        printf(" p%g <= %" PRIu64 " ns,", percentiles[i] * 100,
+               netsniff_hist_percentile(hist, percentiles[i]));
+    printf(" max %" PRIu64 " ns\n", stats.process_max_ns);
+
+    free(hist);
+    return 0;
+}
+
+/* Orders stat entries by address */
+static int
+stat_entry_compare_fn(const void *a, const void *b)
+{
+    uint32_t x = ntohl(((const dopt_stat_entry *) a)->addr);
+    uint32_t y = ntohl(((const dopt_stat_entry *) b)->addr);
+    return (x > y) - (x < y);
+}
+
+/**
+ * @fn daemon_stat
+ * @brief Show statistics for a particular interface.
+ * @param iface_str interface name, optional.
+ * @return 0 on success, 1 on failure.
+ *
+ * Used as a handler to command line parameter.
+ */
+int
+daemon_stat(const char *iface_str)
+{
+    dopt_stat_v2_header header;
+    dopt_stat_entry *entries;
+    int err;
+
+    err = netsniff_stat(daemon_client(), iface_str, &header, &entries);
+    if(err)
+        return daemon_error(err);
+
+    printf("%s: %u addresses, %" PRIu64 " packets\n",
+           header.ifname, header.entry_count, header.packets);
+
+    qsort(entries, header.entry_count, sizeof(*entries), stat_entry_compare_fn);
+    for(uint32_t i = 0; i < header.entry_count; ++i)
+        print_entry(entries[i].addr, entries[i].count);
+
+    free(entries);
+    return 0;
+}
+
+/**
+ * @fn query_parse
+ * @brief Parse `[in NET[/LEN]] [min N] [max N] [sort KEY] [limit N]`.
+ * @return 0 on success, 1 if an argument is invalid.
+ */
+static int
+query_parse(int argc, char **argv, dopt_query *query)
+{
+    static const char *sort_names[] = {
+        [DOPT_SORT_NONE] = "none",
+        [DOPT_SORT_COUNT_DESC] = "count",
+        [DOPT_SORT_COUNT_ASC] = "count-asc",
+        [DOPT_SORT_ADDR_ASC] = "addr",
+        [DOPT_SORT_ADDR_DESC] = "addr-desc"
+    };
+
+    memset(query, 0, sizeof(*query));
+    for(int i = 0; i < argc; i += 2)
     {
-        printf("Error occured on netstiffd: %s\n", strerror(status));
+        const char *key = argv[i], *value = i + 1 < argc ? argv[i + 1] : NULL;
+        char *end;
+
+        if(!value)
+            goto invalid;
+
+        if(!strcmp(key, "in"))
+        {
+            char net[INET_ADDRSTRLEN];
+            const char *slash = strchr(value, '/');
+            size_t len = slash ? (size_t)(slash - value) : strlen(value);
+            struct in_addr addr;
+
+            if(len >= sizeof(net))
+                goto invalid;
+            memcpy(net, value, len);
+            net[len] = '\0';
+            if(inet_pton(AF_INET, net, &addr) != 1)
+                goto invalid;
+
+            query->prefix = addr.s_addr;
+            query->prefix_len = slash ? strtoul(slash + 1, &end, 10) : 32;
+            if(slash && (end == slash + 1 || *end))
+                goto invalid;
+        }
+        else if(!strcmp(key, "min"))
+        {
+            query->count_min = strtoull(value, &end, 0);
+            if(end == value || *end)
+                goto invalid;
+        }
+        else if(!strcmp(key, "max"))
+        {
+            query->count_max = strtoull(value, &end, 0);
+            if(end == value || *end)
+                goto invalid;
+        }
+        else if(!strcmp(key, "limit"))
+        {
+            unsigned long n = strtoul(value, &end, 0);
+            if(end == value || *end || n > UINT32_MAX)
+                goto invalid;
+            query->limit = n;
+        }
+        else if(!strcmp(key, "sort"))
+        {
+            uint32_t sort;
+            for(sort = 0; sort <= DOPT_SORT_ADDR_DESC; ++sort)
+                if(!strcmp(value, sort_names[sort]))
+                    break;
+            if(sort > DOPT_SORT_ADDR_DESC)
+                goto invalid;
+            query->sort = sort;
+        }
+        else
+            goto invalid;
     }
-    SOCKET_CLEANUP();
+
+    return 0;
+
+invalid:
+    fprintf(stderr, "%s: invalid query\n", program_name);
+    return 1;
 }
 
 /**
- * @fn daemon_stop
- * @brief Stop netsniffd.
- * @return 0 on success, errno code on failure.
+ * @fn daemon_query
+ * @brief Print the entries matching a query.
+ * @param argc  number of query arguments.
+ * @param argv  query arguments, see query_parse().
+ * @return 0 on success, 1 on failure.
  *
- * Used as a handler to command line parameter.
+ * Filtering, sorting and limiting happen in the daemon, only the rows
+ * to print are transferred. Used as a handler to command line parameter.
  */
-void
-daemon_stop(void)
+int
+daemon_query(int argc, char **argv)
+{
+    dopt_query query;
+    dopt_query_result result;
+    dopt_stat_entry *rows;
+    int err;
+
+    if(query_parse(argc, argv, &query))
+        return 1;
+
+    err = netsniff_query(daemon_client(), &query, &result, &rows);
+    if(err)
+        return daemon_error(err);
+
+    printf("%u of %" PRIu64 " matching addresses, %" PRIu64 " packets\n",
+           result.row_count, result.matched, result.packets);
+    for(uint32_t i = 0; i < result.row_count; ++i)
+        print_entry(rows[i].addr, rows[i].count);
+
+    free(rows);
+    return 0;
+}
+
+/* Print a page of daemon_dump(), remembering where to resume */
+static int
+dump_page_fn(void *ctx, const dopt_stat_entry *entries, uint32_t count, uint64_t cursor)
+{
+    for(uint32_t i = 0; i < count; ++i)
+        print_entry(entries[i].addr, entries[i].count);
+
+    *(uint64_t *) ctx = cursor;
+    return 0;
+}
+
+/**
+ * @fn daemon_dump
+ * @brief Stream all entries, printing them as they arrive.
+ * @param cursor_str cursor to resume from, optional.
+ * @return 0 on success, 1 on failure.
+ *
+ * Entries come in table order, unsorted. Neither side holds the whole
+ * table. Used as a handler to command line parameter.
+ */
+int
+daemon_dump(const char *cursor_str)
+{
+    uint64_t last = cursor_str ? strtoull(cursor_str, NULL, 0) : 0;
+    int err;
+
+    err = netsniff_dump(daemon_client(), last, dump_page_fn, &last);
+    if(!err)
+        return 0;
+
+    /* a stale cursor cannot be resumed from */
+    if(err == ESTALE || err == EAGAIN || err == ENOMEM)
+        return daemon_error(err);
+
+    fprintf(stderr, "%s: dump interrupted, resume with: %s dump %" PRIu64 "\n",
+            program_name, program_name, last);
+    return 1;
+}
+
+/**
+ * @fn daemon_snapshot
+ * @brief Print all entries from a snapshot memfd sent by the daemon.
+ * @return 0 on success, 1 on failure.
+ *
+ * The table copy is mapped read-only and walked in place, nothing
+ * but the descriptor goes through the socket. Used as a handler to
+ * command line parameter.
+ */
+int
+daemon_snapshot(void)
 {
-    SOCKET_INIT();
-    /* send command */
-    uint32_t command = DOPT_STOP, status;
-    if (send(ipc_socket, &command, sizeof(command), 0) == -1)
+    netsniff_snapshot snapshot;
+    const shm_table_entry *slots;
+    int err;
+
+    err = netsniff_snapshot_take(daemon_client(), &snapshot);
+    if(err)
+        return daemon_error(err);
+
+    printf("%.*s: %" PRIu64 " addresses, %" PRIu64 " packets\n",
+           IFNAMSIZ, snapshot.hdr->ifname, snapshot.info.entries, snapshot.info.packets);
+
+    slots = SHM_TABLE_SLOTS(snapshot.hdr);
+    for(uint32_t i = 0; i < snapshot.info.capacity; ++i)
+        if(slots[i].count)
+            print_entry(slots[i].addr, slots[i].count);
+
+    netsniff_snapshot_release(&snapshot);
+    return 0;
+}
+
+/**
+ * @fn daemon_watch
+ * @brief Print the changes pushed by the daemon until interrupted.
+ * @return 1, a subscription only ends with an error.
+ *
+ * Every interval the daemon sends the addresses counted since the
+ * previous one, with their count and increase. Used as a handler to
+ * command line parameter.
+ */
+int
+daemon_watch(void)
+{
+    netsniff_watch *watch;
+    dopt_watch_info info;
+    dopt_watch_header header;
+    const dopt_watch_entry *entries;
+    int err;
+
+    err = netsniff_watch_open(daemon_client(), &watch, &info);
+    if(err)
+        return daemon_error(err);
+
+    printf("watching, every %u ms\n", info.interval_ms);
+    fflush(stdout);
+
+    while(!(err = netsniff_watch_next(watch, &header, &entries)))
     {
-        perror("send");
-        SOCKET_CLEANUP();
-        exit(1);
+        printf("#%" PRIu64 ": %u changed, %" PRIu64 " packets%s\n", header.sequence,
+               header.entry_count, header.packets,
+               header.flags & DOPT_WATCH_RESET ? " (cleared)" : "");
+        for(uint32_t i = 0; i < header.entry_count; ++i)
+        {
+            char ip[INET_ADDRSTRLEN];
+            struct in_addr addr = { entries[i].addr };
+
+            inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+            printf("%s %" PRIu64 " +%" PRIu64 "%s\n", ip, entries[i].count,
+                   entries[i].delta, entries[i].flags & DOPT_WATCH_NEW ? " new" : "");
+        }
+        fflush(stdout);
     }
-    /* receive response */
-    if (recv(ipc_socket, &status, sizeof(status), 0) == -1)
+
+    /* only the daemon ends a subscription */
+    netsniff_watch_close(watch);
+    if(err == ENOMEM)
+        return daemon_error(err);
+    fprintf(stderr, "%s: disconnected by netsniffd\n", program_name);
+    return 1;
+}
+
+/*****************************************/
+/* Many requests in flight               */
+/*****************************************/
+
+/**
+ * @fn async_open
+ * @brief Open the async connection used for pipelined requests.
+ * @return connection, exits on failure.
+ */
+static netsniff_async *
+async_open(void)
+{
+    netsniff_async *async;
+    int err;
+
+    err = netsniff_async_open(&async, NULL);
+    if(err)
     {
-        perror("recv");
-        SOCKET_CLEANUP();
+        daemon_error(err);
         exit(1);
     }
 
+    return async;
+}
+
+/**
+ * @fn async_wait
+ * @brief Wait for the connection and process it once.
+ * @return 0 on success or an error code on failure.
+ */
+static int
+async_wait(netsniff_async *async)
+{
+    struct pollfd pfd = { netsniff_async_fd(async), netsniff_async_events(async), 0 };
+
+    if(poll(&pfd, 1, -1) == -1 && errno != EINTR)
+        return errno;
+
+    return netsniff_async_process(async);
+}
+
+/* Print the reply of daemon_print_ips() for the IP in ctx */
+static void
+print_ips_fn(void *ctx, int status, uint32_t count)
+{
     if(status)
+        printf("%s: error: %s\n", (const char *) ctx, strerror(status));
+    else
+        printf("%s: %u packets passed thru\n", (const char *) ctx, count);
+}
+
+/**
+ * @fn daemon_print_ips
+ * @brief Print hit counts of many IPs over one connection.
+ * @param ips   IP strings.
+ * @param count number of IPs.
+ * @return 0 on success, 1 on failure.
+ *
+ * Requests are pipelined: up to FRAMED_WINDOW of them are sent ahead
+ * of the replies, which come back in order.
+ */
+int
+daemon_print_ips(char **ips, uint32_t count)
+{
+    netsniff_async *async = async_open();
+    uint32_t next = 0;
+    int err = 0;
+
+    while(!err && (next < count || netsniff_async_pending(async)))
     {
-        printf("Error occured on netstiffd: %s\n", strerror(status));
+        /* refill the window */
+        while(!err && next < count && netsniff_async_pending(async) < FRAMED_WINDOW)
+        {
+            err = netsniff_async_ip_count(async, ips[next], print_ips_fn, ips[next]);
+            ++next;
+        }
+
+        if(!err)
+            err = async_wait(async);
     }
-    SOCKET_CLEANUP();
+
+    netsniff_async_close(async);
+    return err ? daemon_error(err) : 0;
 }
 
 /**
- * @fn daemon_print_ip
- * @brief Print packet count for a single IP.
- * @param ip_addr ip address string, cannot be NULL.
- * @return 0 on success, errno code on failure.
+ * @struct s_batch_addr
+ * @typedef batch_addr
+ * @brief An address read by daemon_count_file().
+ */
+typedef struct s_batch_addr
+{
+    char *str;
+    uint32_t family;
+    unsigned char addr[sizeof(struct in6_addr)];
+} batch_addr;
+
+/**
+ * @struct s_batch_state
+ * @typedef batch_state
+ * @brief Progress of daemon_count_file().
+ */
+typedef struct s_batch_state
+{
+    const batch_addr *addrs;
+    size_t done;            /* addresses printed */
+    int status;             /* first error of the daemon */
+} batch_state;
+
+/* Print the counts of the next batch, replies come back in order */
+static void
+count_batch_fn(void *ctx, int status, const uint64_t *counts, uint32_t count)
+{
+    batch_state *state = ctx;
+
+    if(status)
+    {
+        if(!state->status)
+            state->status = status;
+        return;
+    }
+
+    for(uint32_t i = 0; i < count; ++i)
+        printf("%s %" PRIu64 "\n", state->addrs[state->done + i].str, counts[i]);
+    state->done += count;
+}
+
+/**
+ * @fn daemon_count_file
+ * @brief Print hit counts of addresses listed in a file.
+ * @param path  file with one IPv4 or IPv6 address per line, stdin if
+ *              NULL or "-".
+ * @return 0 on success, 1 on failure.
  *
- * Prints packet count for a single IP, if it was registered previously.
- * Used as a handler to command line parameter.
+ * Addresses are sent in binary DOPT_IP_COUNT_BATCH requests of up to
+ * DOPT_BATCH_MAX addresses of the same family, pipelined over one
+ * framed connection. Output lines are "address count" in input order.
  */
-void
-daemon_print_ip(const char *ip_str)
+int
+daemon_count_file(const char *path)
 {
-    SOCKET_INIT()
-    /* send command */
-    uint32_t command = DOPT_IP_COUNT, status, count;
-    if (send(ipc_socket, &command, sizeof(command), 0) == -1)
+    FILE *in = stdin;
+    char line[INET6_ADDRSTRLEN + 64];
+    batch_addr *addrs = NULL;
+    unsigned char *packed = NULL;
+    size_t count = 0, capacity = 0, next = 0;
+    batch_state state = { 0 };
+    netsniff_async *async;
+    int err = 0;
+
+    if(path && strcmp(path, "-"))
     {
-        perror("send");
-        SOCKET_CLEANUP();
-        exit(1);
+        in = fopen(path, "r");
+        if(!in)
+        {
+            perror(path);
+            exit(1);
+        }
     }
-    /* send arg */
-    char *arg = calloc(INET_ADDRSTRLEN * sizeof(char), 1);
-    if(!arg)
+
+    while(fgets(line, sizeof(line), in))
     {
-        perror("calloc");
-        SOCKET_CLEANUP();
-        exit(1);
+        char *str = line + strspn(line, " \t");
+        batch_addr *a;
+
+        str[strcspn(str, " \t\r\n")] = '\0';
+        if(!*str || *str == '#')
+            continue;
+
+        if(count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            addrs = realloc(addrs, capacity * sizeof(*addrs));
+            if(!addrs)
+            {
+                perror("realloc");
+                exit(1);
+            }
+        }
+
+        a = &addrs[count];
+        a->family = strchr(str, ':') ? AF_INET6 : AF_INET;
+        if(inet_pton(a->family, str, a->addr) != 1)
+        {
+            fprintf(stderr, "%s: invalid address: %s\n", program_name, str);
+            continue;
+        }
+
+        a->str = strdup(str);
+        if(!a->str)
+        {
+            perror("strdup");
+            exit(1);
+        }
+        ++count;
     }
 
-    strcpy(arg, ip_str);
-    if (send(ipc_socket, &arg, INET_ADDRSTRLEN * sizeof(char), 0) == -1)
+    if(in != stdin)
+        fclose(in);
+
+    packed = malloc(DOPT_BATCH_MAX * sizeof(struct in6_addr));
+    if(!packed)
     {
-        perror("send");
-        SOCKET_CLEANUP();
+        perror("malloc");
         exit(1);
     }
 
-    /* receive response */
-    if (recv(ipc_socket, &status, sizeof(status), 0) == -1)
+    state.addrs = addrs;
+    async = async_open();
+    while(!err && !state.status && (next < count || netsniff_async_pending(async)))
     {
-        perror("recv");
-        SOCKET_CLEANUP();
-        exit(1);
+        /* queue batches until the window is full */
+        while(!err && next < count && netsniff_async_pending(async) < BATCH_WINDOW)
+        {
+            uint32_t family = addrs[next].family, batch = 0;
+            size_t addr_size = family == AF_INET ? sizeof(struct in_addr)
+                                                 : sizeof(struct in6_addr);
+
+            while(next < count && batch < DOPT_BATCH_MAX && addrs[next].family == family)
+                memcpy(packed + batch++ * addr_size, addrs[next++].addr, addr_size);
+
+            /* the addresses are copied into the request */
+            err = netsniff_async_ip_counts(async, family, packed, batch, count_batch_fn, &state);
+        }
+
+        if(!err)
+            err = async_wait(async);
     }
+    netsniff_async_close(async);
+
+    for(size_t i = 0; i < count; ++i)
+        free(addrs[i].str);
+    free(addrs);
+    free(packed);
+
+    if(err || state.status)
+        return daemon_error(err ? err : state.status);
+    return 0;
+}
+
+/*****************************************/
+/* Read-only shared counter table access */
+/*****************************************/
+
+/**
+ * @fn shm_open_table
+ * @brief Map the counter table published by netsniffd.
+ *
+ * Exits the process when the table is not available.
+ */
+static void
+shm_open_table(netsniff_shm *shm)
+{
+    int err = netsniff_shm_open(shm);
 
-    if (recv(ipc_socket, &count, sizeof(count), 0) == -1)
+    if(err == ENOENT)
     {
-        perror("recv");
-        SOCKET_CLEANUP();
+        fprintf(stderr, "%s: counter table is not initialized\n", program_name);
         exit(1);
     }
-    /* print response */
-    printf("%d packets passed thru\n", count);
-
-    if(status)
+    if(err == EPROTO)
+    {
+        fprintf(stderr, "%s: counter table version mismatch\n", program_name);
+        exit(1);
+    }
+    if(err)
     {
-        printf("Error occured on netstiffd: %s\n", strerror(status));
+        fprintf(stderr, "%s: counter table: %s\n", program_name, strerror(err));
+        exit(1);
     }
-    SOCKET_CLEANUP()
 }
 
 /**
- * @fn daemon_select_iface
- * @brief Select interface to sniff by a daemon.
- * @param iface_str interface name, cannot be NULL.
- * @return 0 on success, errno code on failure.
- *
- * Used as a handler to command line parameter.
+ * @fn shm_print_ip
+ * @brief Print packet count for a single IP from the shared table.
+ * @param ip_str ip address string, cannot be NULL.
+ * @return 0 on success, 1 on failure.
  */
-void
-daemon_select_iface(const char *iface_str)
+int
+shm_print_ip(const char *ip_str)
 {
- //   SOCKET_INIT()
+    netsniff_shm shm;
+    struct in_addr ip;
+    uint64_t count;
+    int err;
 
- //   SOCKET_CLEANUP()
+    if(inet_pton(AF_INET, ip_str, &ip) != 1)
+    {
+        fprintf(stderr, "%s: invalid IPv4 address: %s\n", program_name, ip_str);
+        return 1;
+    }
+
+    shm_open_table(&shm);
+    err = netsniff_shm_ip_count(&shm, ip.s_addr, &count);
+    netsniff_shm_close(&shm);
+    if(err)
+    {
+        fprintf(stderr, "%s: counter table: %s\n", program_name, strerror(err));
+        return 1;
+    }
+
+    printf("%" PRIu64 " packets passed thru\n", count);
+    return 0;
 }
 
 /**
- * @fn daemon_stat
- * @brief Show statistics for a particular interface.
+ * @fn shm_stat
+ * @brief Show statistics from the shared table.
  * @param iface_str interface name, optional.
- * @return 0 on success, errno code on failure.
- *
- * Used as a handler to command line parameter.
+ * @return 0 on success, 1 on failure.
  */
-void
-daemon_stat(const char *iface_str)
+int
+shm_stat(const char *iface_str)
 {
-//    SOCKET_INIT()
+    netsniff_shm shm;
+    shm_table_entry *entries;
+    char ifname[IFNAMSIZ];
+    uint64_t count, packets;
+    int err;
+
+    shm_open_table(&shm);
+    err = netsniff_shm_copy(&shm, &entries, &count, &packets, ifname);
+    netsniff_shm_close(&shm);
+    if(err)
+    {
+        fprintf(stderr, "%s: counter table: %s\n", program_name, strerror(err));
+        return 1;
+    }
+
+    if(iface_str && strcmp(iface_str, ifname))
+    {
+        printf("No stats for %s\n", iface_str);
+        free(entries);
+        return 0;
+    }
 
- //   SOCKET_CLEANUP()
+    printf("%s: %" PRIu64 " addresses, %" PRIu64 " packets\n", ifname, count, packets);
+    for(uint64_t i = 0; i < count; ++i)
+    {
+        char ip_buffer[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &entries[i].addr, ip_buffer, INET_ADDRSTRLEN);
+        printf("%-16s %" PRIu64 "\n", ip_buffer, entries[i].count);
+    }
+
+    free(entries);
+    return 0;
 }
 
 int 
@@ -269,23 +963,51 @@ main(int argc, char **argv)
      * FIXME: I would prefer to use argp, but it does not allow
      *        parameters without dashes. */
 
+    int shm_mode = 0;
+    int ret = 0;
+
+    /* read-only mode, skip the flag */
+    if (argc > 1 && !strcmp(argv[1], "--shm"))
+    {
+        shm_mode = 1;
+        --argc;
+        ++argv;
+    }
+
     /* if no option is given or it's invalid, show usage */
-    if (argc < 2 || argc > 4)
+    if (argc < 2 || (argc > 4 && strcmp(argv[1], "show") && strcmp(argv[1], "query")))
     {
         doc_usage();
         return 0;
     }
 
+    if (shm_mode)
+    {
+        if(argc == 4 && !strcmp(argv[1], "show") && !strcmp(argv[3], "count"))
+            ret = shm_print_ip(argv[2]);
+        else if(argc <= 3 && !strcmp(argv[1], "stat"))
+            ret = shm_stat(argc == 3 ? argv[2] : NULL);
+        else
+            doc_usage();
+
+        return ret;
+    }
+
     /* parse individual options, skipping the app name */
     if(argc == 4 && !strcmp(argv[1], "show") && !strcmp(argv[3], "count"))
     {
         /* handling `show [ip] count` */
-        daemon_print_ip(argv[2]);
+        ret = daemon_print_ip(argv[2]);
+    }
+    else if(argc > 4 && !strcmp(argv[1], "show") && !strcmp(argv[argc - 1], "count"))
+    {
+        /* handling `show [ip...] count` over one connection */
+        ret = daemon_print_ips(argv + 2, argc - 3);
     }
     else if(argc == 4 && !strcmp(argv[1], "select") && !strcmp(argv[2], "iface"))
     {
         /* handling `select iface [iface]` */
-        daemon_select_iface(argv[3]);
+        ret = daemon_select_iface(argv[3]);
     }
     else if(!strcmp(argv[1], "--help"))
     {
@@ -297,11 +1019,42 @@ main(int argc, char **argv)
     }
     else if(!strcmp(argv[1], "start"))
     {
-        daemon_start();
+        ret = daemon_start();
     }
     else if(!strcmp(argv[1], "stop"))
     {
-        daemon_stop();
+        ret = daemon_stop();
+    }
+    else if(!strcmp(argv[1], "load"))
+    {
+        ret = daemon_load_status();
+    }
+    else if(argc == 2 && !strcmp(argv[1], "snapshot"))
+    {
+        ret = daemon_snapshot();
+    }
+    else if(argc == 2 && !strcmp(argv[1], "selfstat"))
+    {
+        ret = daemon_selfstat();
+    }
+    else if(argc == 2 && !strcmp(argv[1], "watch"))
+    {
+        ret = daemon_watch();
+    }
+    else if(!strcmp(argv[1], "query"))
+    {
+        /* handling `query [key value]...` */
+        ret = daemon_query(argc - 2, argv + 2);
+    }
+    else if(argc <= 3 && !strcmp(argv[1], "dump"))
+    {
+        /* handling `dump [cursor]` */
+        ret = daemon_dump(argc == 3 ? argv[2] : NULL);
+    }
+    else if(argc <= 3 && !strcmp(argv[1], "count"))
+    {
+        /* handling `count [file]` */
+        ret = daemon_count_file(argc == 3 ? argv[2] : NULL);
     }
     else if(!strcmp(argv[1], "stat"))
     {
@@ -309,12 +1062,12 @@ main(int argc, char **argv)
         if (argc == 3)
         {
             /* parameter is present */
-            daemon_stat(argv[2]);
+            ret = daemon_stat(argv[2]);
         }
         else if(argc == 2)
         {
             /* parameter is absent */
-            daemon_stat(NULL);
+            ret = daemon_stat(NULL);
         }
         else /* too many parameters */
             doc_usage();
@@ -322,5 +1075,6 @@ main(int argc, char **argv)
     else  /* invalid option given, show usage */
         doc_usage();
 
-    return 0;
+    netsniff_client_close(client);
+    return ret;
 }
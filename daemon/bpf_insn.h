@@ -0,0 +1,64 @@
+/*
+ * eBPF instruction encoding and loading shared by the netsniffd programs
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef BPF_INSN_H
+#define BPF_INSN_H
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+/* Instruction encoding, as in the kernel's tools/include/linux/filter.h.
+ * The programs are small enough to be written out rather than to need
+ * a compiler and an ELF loader. */
+#define INSN(c, d, s, o, i) \
+    ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV64_REG(d, s)     INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i)     INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i)     INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define TO_BE32(d)          INSN(BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, 32)
+#define LD_ABS_W(off)       INSN(BPF_LD | BPF_W | BPF_ABS, 0, 0, 0, off)
+#define LDX_B(d, s, o)      INSN(BPF_LDX | BPF_MEM | BPF_B, d, s, o, 0)
+#define LDX_H(d, s, o)      INSN(BPF_LDX | BPF_MEM | BPF_H, d, s, o, 0)
+#define LDX_W(d, s, o)      INSN(BPF_LDX | BPF_MEM | BPF_W, d, s, o, 0)
+#define LDX_DW(d, s, o)     INSN(BPF_LDX | BPF_MEM | BPF_DW, d, s, o, 0)
+#define STX_W(d, s, o)      INSN(BPF_STX | BPF_MEM | BPF_W, d, s, o, 0)
+#define STX_DW(d, s, o)     INSN(BPF_STX | BPF_MEM | BPF_DW, d, s, o, 0)
+#define ST_W(d, o, i)       INSN(BPF_ST | BPF_MEM | BPF_W, d, 0, o, i)
+#define ST_DW(d, o, i)      INSN(BPF_ST | BPF_MEM | BPF_DW, d, 0, o, i)
+#define JEQ_IMM(d, i, o)    INSN(BPF_JMP | BPF_JEQ | BPF_K, d, 0, o, i)
+#define JNE_IMM(d, i, o)    INSN(BPF_JMP | BPF_JNE | BPF_K, d, 0, o, i)
+#define JGT_REG(d, s, o)    INSN(BPF_JMP | BPF_JGT | BPF_X, d, s, o, 0)
+#define JA(o)               INSN(BPF_JMP | BPF_JA, 0, 0, o, 0)
+#define CALL(f)             INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()              INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+/* two instructions, the map is referred to by its descriptor */
+#define LD_MAP_FD(d, fd) \
+    INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+
+static inline int
+sys_bpf(int cmd, union bpf_attr *attr)
+{
+    /* glibc has no wrapper */
+    return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * @fn bpf_prog_load_logged
+ * @brief Load a program, writing the verifier log to syslog if it is
+ *        rejected.
+ *
+ * @param attr  BPF_PROG_LOAD attributes without a log buffer.
+ *
+ * @return program descriptor, or -1 with errno set.
+ */
+int
+bpf_prog_load_logged(union bpf_attr *attr);
+
+#endif // BPF_INSN_H
@@ -0,0 +1,408 @@
+/*
+ * In-kernel packet counting of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include "stdafx.h"
+
+#include <netinet/ip.h>
+#include "bpf_insn.h"
+
+/* kernel internal, leaks out of bpf() for operations a map lacks */
+#ifndef ENOTSUPP
+#define ENOTSUPP 524
+#endif
+
+/* addresses per read chunk, and per BPF_MAP_LOOKUP_BATCH */
+#define BPF_READ_CHUNK 256
+#define BPF_LOG_SIZE 65536
+
+/* Values of a per-CPU map come for every possible CPU */
+static uint32_t
+possible_cpus(void)
+{
+    FILE *file = fopen("/sys/devices/system/cpu/possible", "re");
+    unsigned first, last;
+    uint32_t cpus = 0;
+    int c = ',';
+
+    if(!file)
+        return 0;
+
+    /* "0-3,8-11" */
+    while(c == ',' && fscanf(file, "%u", &first) == 1)
+    {
+        last = first;
+        c = fgetc(file);
+        if(c == '-')
+        {
+            if(fscanf(file, "%u", &last) != 1)
+                break;
+            c = fgetc(file);
+        }
+        cpus += last - first + 1;
+    }
+
+    fclose(file);
+    return cpus;
+}
+
+static int
+map_create(uint32_t type, uint32_t max_entries, uint32_t flags, const char *name)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint64_t);
+    attr.max_entries = max_entries;
+    attr.map_flags = flags;
+    strncpy(attr.map_name, name, sizeof(attr.map_name) - 1);
+
+    return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+int
+bpf_prog_load_logged(union bpf_attr *attr)
+{
+    char *log;
+    int fd;
+
+    fd = sys_bpf(BPF_PROG_LOAD, attr);
+    if(fd >= 0 || (errno != EACCES && errno != EINVAL))
+        return fd;
+
+    /* !!! malloc !!! */
+    /* load again for the verifier to tell why */
+    log = calloc(1, BPF_LOG_SIZE);
+    if(!log)
+        return -1;
+    attr->log_buf = (uintptr_t) log;
+    attr->log_size = BPF_LOG_SIZE;
+    attr->log_level = 1;
+    fd = sys_bpf(BPF_PROG_LOAD, attr);
+    if(fd < 0)
+    {
+        int err = errno;
+        syslog(LOG_ERR, "BPF verifier: %s", log);
+        errno = err;
+    }
+    attr->log_buf = 0;
+    attr->log_size = attr->log_level = 0;
+    free(log);
+    return fd;
+}
+
+static int
+prog_load(int counts_fd, int misses_fd)
+{
+    /*
+     * r6 = skb, for the packet loads
+     * key = htonl(saddr), the data starts at the IP header
+     * if((value = lookup(counts, &key)))
+     *     ++*value;
+     * else if(update(counts, &key, &one, BPF_NOEXIST))
+     *     another CPU inserted it meanwhile, or the map is full:
+     *     ++*(lookup(counts, &key) ?: lookup(misses, &zero))
+     * return 0, the packet is not queued
+     *
+     * Stack: key at -4, zero at -8, one at -16. Jump offsets count
+     * instructions after the jump, LD_MAP_FD counts as two.
+     */
+    struct bpf_insn prog[] = {
+        MOV64_REG(BPF_REG_6, BPF_REG_1),
+        LD_ABS_W(offsetof(struct iphdr, saddr)),
+        TO_BE32(BPF_REG_0),
+        STX_W(BPF_REG_10, BPF_REG_0, -4),
+        /* 4: lookup */
+        LD_MAP_FD(BPF_REG_1, counts_fd),
+        MOV64_REG(BPF_REG_2, BPF_REG_10),
+        ADD64_IMM(BPF_REG_2, -4),
+        CALL(BPF_FUNC_map_lookup_elem),
+        JEQ_IMM(BPF_REG_0, 0, 4),               /* to 14 */
+        LDX_DW(BPF_REG_1, BPF_REG_0, 0),
+        ADD64_IMM(BPF_REG_1, 1),
+        STX_DW(BPF_REG_0, BPF_REG_1, 0),
+        JA(30),                                 /* to 44 */
+        /* 14: insert */
+        ST_DW(BPF_REG_10, -16, 1),
+        LD_MAP_FD(BPF_REG_1, counts_fd),
+        MOV64_REG(BPF_REG_2, BPF_REG_10),
+        ADD64_IMM(BPF_REG_2, -4),
+        MOV64_REG(BPF_REG_3, BPF_REG_10),
+        ADD64_IMM(BPF_REG_3, -16),
+        MOV64_IMM(BPF_REG_4, BPF_NOEXIST),
+        CALL(BPF_FUNC_map_update_elem),
+        JEQ_IMM(BPF_REG_0, 0, 20),              /* to 44 */
+        /* 24: lookup again */
+        LD_MAP_FD(BPF_REG_1, counts_fd),
+        MOV64_REG(BPF_REG_2, BPF_REG_10),
+        ADD64_IMM(BPF_REG_2, -4),
+        CALL(BPF_FUNC_map_lookup_elem),
+        JEQ_IMM(BPF_REG_0, 0, 4),               /* to 34 */
+        LDX_DW(BPF_REG_1, BPF_REG_0, 0),
+        ADD64_IMM(BPF_REG_1, 1),
+        STX_DW(BPF_REG_0, BPF_REG_1, 0),
+        JA(10),                                 /* to 44 */
+        /* 34: miss */
+        ST_W(BPF_REG_10, -8, 0),
+        LD_MAP_FD(BPF_REG_1, misses_fd),
+        MOV64_REG(BPF_REG_2, BPF_REG_10),
+        ADD64_IMM(BPF_REG_2, -8),
+        CALL(BPF_FUNC_map_lookup_elem),
+        JEQ_IMM(BPF_REG_0, 0, 3),               /* to 44 */
+        LDX_DW(BPF_REG_1, BPF_REG_0, 0),
+        ADD64_IMM(BPF_REG_1, 1),
+        STX_DW(BPF_REG_0, BPF_REG_1, 0),
+        /* 44: drop */
+        MOV64_IMM(BPF_REG_0, 0),
+        EXIT(),
+    };
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insns = (uintptr_t) prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(*prog);
+    attr.license = (uintptr_t) "GPL";
+    /* names are at most 15 characters */
+    memcpy(attr.prog_name, "netsniffd_count", sizeof("netsniffd_count"));
+
+    return bpf_prog_load_logged(&attr);
+}
+
+int
+bpf_counter_create(bpf_counter *counter, uint32_t max_entries)
+{
+    int err;
+
+    memset(counter, 0, sizeof(*counter));
+    counter->prog_fd = counter->counts_fd = counter->misses_fd = -1;
+    counter->max_entries = max_entries;
+    counter->batch_ok = 1;
+
+    counter->cpus = possible_cpus();
+    if(!counter->cpus)
+        return ENOENT;
+
+    /* entries are allocated as addresses show up */
+    counter->counts_fd = map_create(BPF_MAP_TYPE_PERCPU_HASH, max_entries,
+                                    BPF_F_NO_PREALLOC, "netsniffd_cnt");
+    if(counter->counts_fd < 0)
+        goto fail;
+
+    counter->misses_fd = map_create(BPF_MAP_TYPE_PERCPU_ARRAY, 1, 0, "netsniffd_miss");
+    if(counter->misses_fd < 0)
+        goto fail;
+
+    counter->prog_fd = prog_load(counter->counts_fd, counter->misses_fd);
+    if(counter->prog_fd < 0)
+        goto fail;
+
+    return 0;
+
+fail:
+    err = errno;
+    bpf_counter_destroy(counter);
+    return err;
+}
+
+void
+bpf_counter_destroy(bpf_counter *counter)
+{
+    if(counter->prog_fd >= 0)
+        close(counter->prog_fd);
+    if(counter->counts_fd >= 0)
+        close(counter->counts_fd);
+    if(counter->misses_fd >= 0)
+        close(counter->misses_fd);
+    counter->prog_fd = counter->counts_fd = counter->misses_fd = -1;
+}
+
+int
+bpf_counter_attach(const bpf_counter *counter, int sock)
+{
+    if(setsockopt(sock, SOL_SOCKET, SO_ATTACH_BPF, &counter->prog_fd,
+                  sizeof(counter->prog_fd)) == -1)
+        return errno;
+
+    return 0;
+}
+
+int
+bpf_counter_detach(int sock)
+{
+    if(setsockopt(sock, SOL_SOCKET, SO_DETACH_BPF, &(int){ 0 }, sizeof(int)) == -1)
+        return errno;
+
+    return 0;
+}
+
+/* Sum per-CPU values, values holds cpus for each of n keys */
+static void
+sum_values(const bpf_counter *counter, const uint64_t *values, uint32_t n, uint64_t *sums)
+{
+    for(uint32_t i = 0; i < n; ++i)
+    {
+        const uint64_t *cpu = values + (size_t) i * counter->cpus;
+        uint64_t sum = 0;
+
+        for(uint32_t c = 0; c < counter->cpus; ++c)
+            sum += cpu[c];
+        sums[i] = sum;
+    }
+}
+
+/* Read with BPF_MAP_LOOKUP_BATCH, a syscall per chunk */
+static int
+read_batch(bpf_counter *counter, uint32_t *addrs, uint64_t *values, uint64_t *sums,
+           bpf_counts_fn fn, void *ctx, uint32_t *entries)
+{
+    uint32_t token, total = 0;
+    union bpf_attr attr;
+    int first = 1, done = 0, err;
+
+    while(!done)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.batch.map_fd = counter->counts_fd;
+        attr.batch.in_batch = first ? 0 : (uintptr_t) &token;
+        attr.batch.out_batch = (uintptr_t) &token;
+        attr.batch.keys = (uintptr_t) addrs;
+        attr.batch.values = (uintptr_t) values;
+        attr.batch.count = BPF_READ_CHUNK;
+
+        if(sys_bpf(BPF_MAP_LOOKUP_BATCH, &attr))
+        {
+            /* ENOENT is the end, with the last entries */
+            if(errno != ENOENT)
+                return errno;
+            done = 1;
+        }
+        first = 0;
+
+        if(!attr.batch.count)
+            continue;
+
+        sum_values(counter, values, attr.batch.count, sums);
+        err = fn(ctx, addrs, sums, attr.batch.count);
+        if(err)
+            return err;
+        total += attr.batch.count;
+    }
+
+    if(entries)
+        *entries = total;
+    return 0;
+}
+
+/* Read key by key, for kernels without batch operations (before 5.6) */
+static int
+read_keys(bpf_counter *counter, uint32_t *addrs, uint64_t *values, uint64_t *sums,
+          bpf_counts_fn fn, void *ctx, uint32_t *entries)
+{
+    uint32_t key, n = 0, total = 0;
+    union bpf_attr attr;
+    int first = 1, err;
+
+    for(;;)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = counter->counts_fd;
+        attr.key = first ? 0 : (uintptr_t) &key;
+        attr.next_key = (uintptr_t) &addrs[n];
+        if(sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr))
+        {
+            if(errno != ENOENT)
+                return errno;
+            break;
+        }
+        first = 0;
+        key = addrs[n];
+
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = counter->counts_fd;
+        attr.key = (uintptr_t) &addrs[n];
+        attr.value = (uintptr_t) (values + (size_t) n * counter->cpus);
+        if(sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr))
+            continue; /* never deleted, but be safe */
+
+        if(++n == BPF_READ_CHUNK)
+        {
+            sum_values(counter, values, n, sums);
+            err = fn(ctx, addrs, sums, n);
+            if(err)
+                return err;
+            total += n;
+            n = 0;
+        }
+    }
+
+    if(n)
+    {
+        sum_values(counter, values, n, sums);
+        err = fn(ctx, addrs, sums, n);
+        if(err)
+            return err;
+        total += n;
+    }
+
+    if(entries)
+        *entries = total;
+    return 0;
+}
+
+int
+bpf_counter_read(bpf_counter *counter, bpf_counts_fn fn, void *ctx, uint32_t *entries)
+{
+    uint32_t addrs[BPF_READ_CHUNK];
+    uint64_t sums[BPF_READ_CHUNK];
+    uint64_t *values;
+    int err = EINVAL;
+
+    /* !!! malloc !!! */
+    values = malloc((size_t) BPF_READ_CHUNK * counter->cpus * sizeof(*values));
+    if(!values)
+        return ENOMEM;
+
+    if(counter->batch_ok)
+    {
+        err = read_batch(counter, addrs, values, sums, fn, ctx, entries);
+        if(err == EINVAL || err == ENOTSUP || err == ENOTSUPP)
+        {
+            syslog(LOG_INFO, "BPF map batch reads not supported, reading by key");
+            counter->batch_ok = 0;
+        }
+    }
+    /* A bucket larger than a chunk needs the slow path too. Addresses
+       handed to fn twice are harmless, counts are totals. */
+    if(!counter->batch_ok || err == ENOSPC)
+        err = read_keys(counter, addrs, values, sums, fn, ctx, entries);
+
+    free(values);
+    return err;
+}
+
+uint64_t
+bpf_counter_misses(const bpf_counter *counter)
+{
+    uint64_t values[counter->cpus], sum = 0;
+    uint32_t key = 0;
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = counter->misses_fd;
+    attr.key = (uintptr_t) &key;
+    attr.value = (uintptr_t) values;
+    if(sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr))
+        return 0;
+
+    for(uint32_t c = 0; c < counter->cpus; ++c)
+        sum += values[c];
+    return sum;
+}
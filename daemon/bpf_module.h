@@ -0,0 +1,103 @@
+/*
+ * Header for in-kernel packet counting of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef BPF_MODULE_H
+#define BPF_MODULE_H
+
+#include <stdint.h>
+
+/**
+ * @struct s_bpf_counter
+ * @typedef bpf_counter
+ * @brief eBPF socket filter counting packets per source address.
+ *
+ * The program keeps a count per CPU of every source address in a
+ * BPF_MAP_TYPE_PERCPU_HASH and drops the packet, so nothing is queued
+ * to the socket or copied to user space. Counts only grow; readers
+ * keep what they have seen to get the increase.
+ */
+typedef struct s_bpf_counter
+{
+    int prog_fd;
+    int counts_fd;      /* source address (network order) -> u64 per CPU */
+    int misses_fd;      /* u64 per CPU, packets not counted, map full */
+    uint32_t max_entries;
+    uint32_t cpus;      /* possible CPUs, values per key */
+    int batch_ok;       /* BPF_MAP_LOOKUP_BATCH is supported */
+} bpf_counter;
+
+/**
+ * @brief Receives the counts read by bpf_counter_read().
+ * @param addrs   Source addresses, network byte order.
+ * @param counts  Total of every address, summed over CPUs.
+ * @return 0 to go on, an error code to stop reading.
+ */
+typedef int (*bpf_counts_fn)(void *ctx, const uint32_t *addrs, const uint64_t *counts,
+                             uint32_t n);
+
+/**
+ * @fn bpf_counter_create
+ * @brief Create the maps and load the program.
+ *
+ * @param max_entries  Most addresses counted, packets of others are
+ *                     counted as misses.
+ *
+ * @return 0 on success or an error code on failure, the verifier log
+ *         is written to syslog.
+ */
+int
+bpf_counter_create(bpf_counter *counter, uint32_t max_entries);
+
+/**
+ * @fn bpf_counter_destroy
+ */
+void
+bpf_counter_destroy(bpf_counter *counter);
+
+/**
+ * @fn bpf_counter_attach
+ * @brief Count the packets of a socket instead of queueing them.
+ *
+ * The socket has to see packets with the IP header first, like a raw
+ * AF_INET socket.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+bpf_counter_attach(const bpf_counter *counter, int sock);
+
+/**
+ * @fn bpf_counter_detach
+ * @brief Queue the packets of sock again.
+ */
+int
+bpf_counter_detach(int sock);
+
+/**
+ * @fn bpf_counter_read
+ * @brief Read all counts, in chunks handed to fn.
+ *
+ * Not a snapshot: addresses counted during the read may or may not be
+ * included, a later read has them.
+ *
+ * @param entries  Optional, receives the number of addresses.
+ *
+ * @return 0 on success, the error code of fn or of the read otherwise.
+ */
+int
+bpf_counter_read(bpf_counter *counter, bpf_counts_fn fn, void *ctx, uint32_t *entries);
+
+/**
+ * @fn bpf_counter_misses
+ * @return packets that could not be counted, the map being full.
+ */
+uint64_t
+bpf_counter_misses(const bpf_counter *counter);
+
+#endif // BPF_MODULE_H
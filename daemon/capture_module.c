@@ -10,16 +10,14 @@
 #include "stdafx.h"
 
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
-/**
- * @struct s_internal_ip_stat
- * @typedef internal_ip_stat
- */
-typedef struct s_internal_ip_stat {
-    struct in_addr ip;
-    long count;
-} internal_ip_stat;
+#include "custom_com_def.h"
 
 /**
  * @struct s_internal_iface_stat
@@ -27,13 +25,14 @@ typedef struct s_internal_ip_stat {
  */
 typedef struct s_internal_iface_stat {
     char iface_str[IFNAMSIZ];
-    void *ip_stats_tree;
-    long entries_count;
+    counter_table table;
 } internal_iface_stat;
 
 internal_iface_stat g_stats;
 
 pthread_t capture_thread;
+/* applies the records capture_thread queues in packet_ring */
+pthread_t aggregate_thread;
 
 /* Mutex is used as a thread cancellation flag.
  * It locks upon thread creation and releases when thread should exit.
@@ -42,136 +41,275 @@ pthread_mutex_t stop_mutex = PTHREAD_MUTEX_INITIALIZER;
 /* Mutex to control access to stats */
 pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-#define STATSFILE_TEMPLATE "/var/tmp/netsniffd/%s.stat"
-#define DEFAULT_IFACE "ens33"
+#define STATSFILE_TEMPLATE STATSDIR "/%s.stat"
 #define SOCKET_DATA_SIZE_MAX 65536
-
+/* slots scanned by one packet_stats_page() */
+#define STATS_PAGE_SCAN_MAX 65536
+/* walks started later than this after the copy was made get a new one */
+#define STATS_PAGE_COPY_MAX_AGE_NS 1000000000ULL
+#define STATS_INITIAL_CAPACITY (1 << 16)
+/* records between the receive and aggregation stages, 16 bytes each */
+#define CAPTURE_RING_CAPACITY (1 << 16)
+/* records applied per hold of stats_mutex */
+#define CAPTURE_BATCH_MAX 256
+/* The aggregation stage lets packets gather this long before counting
+ * them, unless a full batch is queued sooner. Counts lag by about as
+ * much. */
+#define CAPTURE_BATCH_INTERVAL_MS 1
+#define CAPTURE_BUSY_POLL_MAX_US 1000000
+/* addresses the in-kernel counter holds, see bpf_module.h */
+#define CAPTURE_BPF_MAP_ENTRIES (1 << 20)
+
+/* interface of the first start, see packet_set_capture_iface() */
 char *iface_name = DEFAULT_IFACE;
 
+/* set while changes are watched, see packet_stats_track() */
+static int stats_tracked;
+
 /***********************************/
 /* structure manipulation helpers */
 /***********************************/
 
 static int
-ip_stat_new(internal_ip_stat ** stat, struct in_addr *ip)
+iface_stat_init(internal_iface_stat * stats)
 {
-    /* !!! malloc !!! */
-    *stat = malloc(sizeof(struct s_internal_iface_stat));
-    if(!stat)
-        return errno;
+    int err;
+
+    if(!stats)
+        return -1; /* nothing to work with */
+
+    /* copy and ensure NUL-termination */
+    strncpy(stats->iface_str, iface_name, IFNAMSIZ-1);
+    stats->iface_str[IFNAMSIZ-1] = '\0';
+
+    /* the table is published for read-only clients */
+    err = counter_table_create(&stats->table, SHM_TABLE_NAME, STATS_INITIAL_CAPACITY);
+    if(err)
+    {
+        syslog(LOG_ERR, "counter table creation failed: %s", strerror(err));
+        return err;
+    }
+    counter_table_set_ifname(&stats->table, stats->iface_str);
 
-    (*stat)->ip = *ip;
-    (*stat)->count = 1;
+    /* the table is written by the capture threads, near the device */
+    placement_select_node(stats->iface_str);
+    err = counter_table_place(&stats->table);
+    if(err)
+        syslog(LOG_WARNING, "counter table placement failed: %s", strerror(err));
+
+    if(stats_tracked)
+    {
+        err = counter_table_track(&stats->table, 1);
+        if(err)
+            syslog(LOG_ERR, "change tracking failed: %s", strerror(err));
+    }
 
     return 0;
 }
 
-static void
-ip_stat_delete(void *stat)
+/***************************/
+/* Serialization functions */
+/***************************/
+
+/* superfluous buffer to store an entry */
+#define MAX_INT_CHARS 24
+#define IP_STAT_STRING_BUFSIZ INET_ADDRSTRLEN + MAX_INT_CHARS + 3
+#define DUMP_BUFFER_INITIAL (1 << 16)
+const char *entry_pattern = "%s;%" PRIu64 "\n";
+
+/**
+ * @struct s_dump_buffer
+ * @typedef dump_buffer
+ *
+ * Stats are serialized in memory and handed over to the persistence
+ * engine, so the caller never waits on the disk.
+ */
+typedef struct s_dump_buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+    int err;
+} dump_buffer;
+
+static int
+dump_buffer_reserve(dump_buffer *buf, size_t size)
+{
+    char *data;
+    size_t capacity = buf->capacity ? buf->capacity : DUMP_BUFFER_INITIAL;
+
+    if(buf->size + size <= buf->capacity)
+        return 0;
+
+    while(capacity < buf->size + size)
+        capacity *= 2;
+
+    /* !!! realloc !!! */
+    data = realloc(buf->data, capacity);
+    if(!data)
+        return ENOMEM;
+
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+/* Copy occupied slots out of the table, so it can be sorted and
+ * serialized without holding stats_mutex. */
+static int
+packet_stats_collect(counter_table *table, shm_table_entry **entries_out,
+                     size_t *count_out)
 {
-    free((internal_ip_stat *)stat);
+    shm_table_entry *entries;
+    size_t count = 0;
+
+    /* !!! malloc !!! */
+    entries = malloc((table->hdr->entries + 1) * sizeof(*entries));
+    if(!entries)
+        return ENOMEM;
+
+    for(uint32_t i = 0; i < table->hdr->capacity; ++i)
+        if(table->slots[i].count)
+            entries[count++] = table->slots[i];
+
+    *entries_out = entries;
+    *count_out = count;
+    return 0;
 }
 
+/* Orders entries by address, as numbers */
 static int
-ip_stat_compare_fn(const void *l, const void *r)
+entry_compare_fn(const void *l, const void *r)
 {
-    const internal_ip_stat *stat_l = (const internal_ip_stat *) l;
-    const internal_ip_stat *stat_r = (const internal_ip_stat *) r;
+    uint32_t addr_l = ntohl(((const shm_table_entry *) l)->addr);
+    uint32_t addr_r = ntohl(((const shm_table_entry *) r)->addr);
 
-    if(stat_l->ip.s_addr > stat_r->ip.s_addr)
+    if(addr_l > addr_r)
         return 1;
 
-    if(stat_l->ip.s_addr < stat_r->ip.s_addr)
+    if(addr_l < addr_r)
         return -1;
 
     return 0;
 }
 
 static int
-iface_stat_init(internal_iface_stat * stats)
+packet_stats_serialize(const shm_table_entry *entries, size_t count, dump_buffer *buf)
 {
-    if(!stats)
-        return -1; /* nothing to work with */
+    for(size_t i = 0; i < count; ++i)
+    {
+        char ip_buffer[INET_ADDRSTRLEN];
+        int n;
 
-    /* copy and ensure NUL-termination */
-    strncpy(stats->iface_str, DEFAULT_IFACE, IFNAMSIZ-1);
-    stats->iface_str[IFNAMSIZ-1] = '\0';
+        buf->err = dump_buffer_reserve(buf, IP_STAT_STRING_BUFSIZ);
+        if(buf->err)
+            return buf->err;
 
-    stats->ip_stats_tree = NULL;
-    stats->entries_count = 0;
+        /* convert IP address */
+        if(!inet_ntop(AF_INET, &entries[i].addr, ip_buffer, INET_ADDRSTRLEN))
+            continue;
+
+        n = snprintf(buf->data + buf->size, IP_STAT_STRING_BUFSIZ,
+                     entry_pattern, ip_buffer, entries[i].count);
+        if(n > 0)
+            buf->size += n;
+    }
 
     return 0;
 }
 
-/***************************/
-/* Serialization functions */
-/***************************/
-
-/* supefluos buffer to store int */
-#define MAX_INT_CHARS 256
-#define IP_STAT_STRING_BUFSIZ INET_ADDRSTRLEN + MAX_INT_CHARS + 3
-const char *entry_pattern = "%s;%d\n";
-FILE *fd;
+/**
+ * @struct s_dump_job
+ * @typedef dump_job
+ *
+ * Entries of a dump on their way to the persistence engine, which
+ * sorts and serializes them on its own thread.
+ */
+typedef struct s_dump_job {
+    shm_table_entry *entries;
+    size_t count;
+    char iface_str[IFNAMSIZ];
+} dump_job;
 
-static char *
-ipstat2str(internal_ip_stat *stat)
+/* Copy the stats out for a dump. Capture may still be running when the
+ * loader dumps, only the copy is made under the lock. */
+static int
+packet_stats_dump_collect(internal_iface_stat *stats, dump_job **job_out)
 {
-    char *result;
-    char ip_buffer[INET_ADDRSTRLEN];
+    dump_job *job;
+    int err;
 
-    /* convert IP address */
-    if(!inet_ntop(AF_INET, &stat->ip, ip_buffer, INET_ADDRSTRLEN))
+    NETSNIFF_PROBE1(snapshot__start, "dump");
+
+    /* !!! malloc !!! */
+    job = calloc(1, sizeof(*job));
+    if(!job)
     {
-        return NULL;
+        NETSNIFF_PROBE3(snapshot__done, "dump", ENOMEM, 0);
+        return ENOMEM;
     }
+    memcpy(job->iface_str, stats->iface_str, sizeof(job->iface_str));
 
-    /* !!! malloc !!! */
-    result = malloc(IP_STAT_STRING_BUFSIZ);
-    if(!result)
-        return NULL;
-    if(snprintf(result, IP_STAT_STRING_BUFSIZ, entry_pattern, result, stat->count) < 0)
+    pthread_mutex_lock(&stats_mutex);
+    err = packet_stats_collect(&stats->table, &job->entries, &job->count);
+    pthread_mutex_unlock(&stats_mutex);
+    if(err)
     {
-        /* errno is set on POSIX */
-        free(result);
-        return NULL;
+        NETSNIFF_PROBE3(snapshot__done, "dump", err, 0);
+        free(job);
+        return err;
+    }
+
+    *job_out = job;
+    return 0;
+}
+
+/* Serialize the entries of a dump, as they are saved. See
+ * persist_render_fn, runs on a persistence thread. */
+static int
+packet_stats_dump_render_fn(void *ctx, char **data_out, size_t *size_out)
+{
+    dump_job *job = ctx;
+    dump_buffer buf = { 0 };
+
+    /* snapshots are sorted by address, so they can be merged by streaming */
+    qsort(job->entries, job->count, sizeof(*job->entries), entry_compare_fn);
+
+    /* Put entries to the buffer in defined strings */
+    packet_stats_serialize(job->entries, job->count, &buf);
+    free(job->entries);
+    job->entries = NULL;
+    NETSNIFF_PROBE3(snapshot__done, "dump", buf.err, job->count);
+    if(buf.err)
+    {
+        free(buf.data);
+        return buf.err;
     }
 
-    return result;
+    *data_out = buf.data;
+    *size_out = buf.size;
+    return 0;
 }
 
+/* Snapshot is on disk, keep a copy of it in the history */
 static void
-ip_stat_tree_serialize_fn(const void *nodep, VISIT order, int depth)
+packet_stats_dump_done_fn(int err, void *ctx)
 {
-    /* ignore depth */
-    (void)depth;
+    dump_job *job = ctx;
+    char filename[FILENAME_MAX];
 
-    /* we are interested in preorder and leaf */
-    switch(order)
-    {
-    case preorder:
-    case leaf:
-        {
-            internal_ip_stat * data = *((internal_ip_stat **) nodep);
-            char *string_to_print = ipstat2str(data);
-            if(string_to_print)
-            {
-                fputs(string_to_print, fd);
-                /* !!! free !!! */
-                free(string_to_print);
-            }
-        }
-        break;
+    if(!err && snprintf(filename, FILENAME_MAX, STATSFILE_TEMPLATE, job->iface_str) > 0)
+        history_record(filename, job->iface_str);
 
-    case postorder:
-    case endorder:
-        break;
-    }
+    free(job->entries);
+    free(job);
 }
 
 static int
 packet_stats_dump(internal_iface_stat *stats)
 {
     char filename_buffer[FILENAME_MAX];
+    dump_job *job;
+    int err;
 
     if(snprintf(filename_buffer,
                 FILENAME_MAX,
@@ -182,107 +320,348 @@ packet_stats_dump(internal_iface_stat *stats)
         return errno;
     }
 
-    fd = fopen(filename_buffer, "w");
-    if(!fd)
+    if(mkdir(STATSDIR, 0755) && errno != EEXIST)
     {
-        return errno;
+        err = errno;
+        syslog(LOG_ERR, "mkdir(%s) failed: %s", STATSDIR, strerror(err));
+        return err;
+    }
+
+    err = packet_stats_dump_collect(stats, &job);
+    if(err)
+        return err;
+
+    /* the engine owns the job now */
+    err = persist_write_rendered(filename_buffer, packet_stats_dump_render_fn,
+                                 packet_stats_dump_done_fn, job);
+    if(err)
+    {
+        free(job->entries);
+        free(job);
     }
 
-    /* Walk the tree and put nodes to the file in defined strings.
-       It will use the global fd that we have set up earlier */
-    twalk(stats->ip_stats_tree, ip_stat_tree_serialize_fn);
+    return err;
+}
+
+/*********************/
+/* Background loading */
+/*********************/
+
+/* Lines parsed and slots merged between releases of load_mutex */
+#define LOAD_BATCH 4096
+
+/* Snapshot being loaded in background. Until it is fully merged into
+ * g_stats, queries add the counts from both tables.
+ * All of the following is protected by load_mutex, which is always
+ * taken before stats_mutex. */
+pthread_mutex_t load_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t load_cond = PTHREAD_COND_INITIALIZER;
+pthread_t load_thread;
+counter_table load_base;
+packet_load_progress load_progress;
+/* slots of load_base below the cursor are already in g_stats */
+uint32_t load_merge_cursor;
+/* a stop came in while loading, dump when the merge is done */
+int load_dump_pending;
+/* merged copy paged over while loading, its generation is odd */
+counter_table page_copy;
+uint32_t page_copy_seq;
+uint64_t page_copy_ns;
+
+static int
+load_in_progress(void)
+{
+    return load_progress.state == LOAD_READING
+        || load_progress.state == LOAD_PARSING
+        || load_progress.state == LOAD_MERGING;
+}
+
+/* Let queries in between batches. Called with load_mutex held. */
+static void
+load_yield(void)
+{
+    pthread_mutex_unlock(&load_mutex);
+    pthread_mutex_lock(&load_mutex);
+}
+
+/* Count of addr in the saved stats that is not in g_stats yet.
+ * Called with load_mutex held. */
+static uint64_t
+load_unmerged_count(uint32_t addr)
+{
+    const shm_table_entry *slot;
+
+    if(!load_in_progress() || !load_base.hdr)
+        return 0;
 
-    fclose(fd);
+    slot = counter_table_find(&load_base, addr);
+    if(slot && (uint32_t)(slot - load_base.slots) >= load_merge_cursor)
+        return slot->count;
     return 0;
 }
 
+/* Copy of g_stats with the saved counts not merged yet added in.
+ * Called with load_mutex held while loading. */
 static int
-packet_stats_load(internal_iface_stat *stats)
+load_merged_copy(counter_table *copy)
 {
-    char filename[FILENAME_MAX];
+    counter_table *table = &g_stats.table;
+    int err;
 
-    if(snprintf(filename,
-                FILENAME_MAX,
-                STATSFILE_TEMPLATE,
-                stats->iface_str) < 0)
+    pthread_mutex_lock(&stats_mutex);
+    err = counter_table_create(copy, NULL, table->hdr->capacity);
+    if(err)
     {
-        /* errno is set on POSIX */
-        return errno;
+        pthread_mutex_unlock(&stats_mutex);
+        return err;
     }
 
-    fd = fopen(filename, "r");
-    if(!fd)
-        return errno;
+    for(uint32_t i = 0; i < table->hdr->capacity && !err; ++i)
+    {
+        if(table->slots[i].count)
+            err = counter_table_add(copy, table->slots[i].addr, table->slots[i].count, NULL);
+    }
+    pthread_mutex_unlock(&stats_mutex);
 
-    char *ip_buffer = NULL, *count_buffer = NULL;
-    size_t len_ip = 0, len_count = 0;
-    ssize_t read_ip = 0, read_count = 0;
-    int err = 0;
-    /*
-     * Assuming the following format:
-     * 255.255.255.255;12345\n
-     */
-    while((read_ip >= 0) && (read_count >= 0))
-    {
-        char *endptr;
-        internal_ip_stat *new_stat, *tree_stat;
-        read_ip = getdelim(&ip_buffer, &len_ip, ';', fd);
-        /* getdelim might fail */
-        if(errno)
-        {
-            err = errno;
-            syslog(LOG_ERR, "getdelim() failed: %s", strerror(err));
-            break;
-        }
+    /* capture goes on, the rest only reads load_base */
+    for(uint32_t i = load_merge_cursor; i < load_base.hdr->capacity && !err; ++i)
+    {
+        if(load_base.slots[i].count)
+            err = counter_table_add(copy, load_base.slots[i].addr,
+                                    load_base.slots[i].count, NULL);
+    }
 
-        read_count = getline(&count_buffer, &len_count, fd);
-        /* getline might fail */
-        if(errno)
-        {
-            err = errno;
-            syslog(LOG_ERR, "getline() failed: %s", strerror(err));
-            break;
-        }
+    if(err)
+    {
+        counter_table_destroy(copy);
+        return err;
+    }
+
+    counter_table_set_ifname(copy, g_stats.iface_str);
+    return 0;
+}
+
+/*
+ * Parse stats file contents into the table.
+ * Assuming the following format:
+ * 255.255.255.255;12345\n
+ *
+ * Called with load_mutex held.
+ */
+static int
+packet_stats_parse(counter_table *table, char *data)
+{
+    char *line = data;
+    unsigned lines = 0;
+
+    while(*line)
+    {
+        char *endptr, *sep, *eol;
+        struct in_addr ip;
+        uint64_t count;
+        int err;
+
+        eol = strchr(line, '\n');
+        if(eol)
+            *eol = '\0';
 
-        new_stat = malloc(sizeof(new_stat));
-        if(!new_stat)
+        sep = strchr(line, ';');
+        if(!sep)
         {
-            syslog(LOG_ERR, "malloc() failed: %s", strerror(ENOMEM));
-            fclose(fd);
-            return ENOMEM;
+            syslog(LOG_ERR, "stats: malformed line: %s", line);
+            goto next;
         }
+        *sep = '\0';
 
-        /* a line is read, converting */
         /* convert IP */
-        if(!inet_pton(AF_INET, ip_buffer, &new_stat->ip))
-            continue;
+        if(inet_pton(AF_INET, line, &ip) != 1)
+        {
+            syslog(LOG_ERR, "stats: bad address: %s", line);
+            goto next;
+        }
 
         /* convert count */
-        new_stat->count = strtol(count_buffer, &endptr, 10);
-        if(errno)
+        errno = 0;
+        count = strtoull(sep + 1, &endptr, 10);
+        if(errno || endptr == sep + 1 || !count)
         {
-            err = errno;
-            syslog(LOG_ERR, "strtol() failed: %s", strerror(err));
-            continue;
+            syslog(LOG_ERR, "strtoull() failed: No digits were found (%s)", sep + 1);
+            goto next;
         }
-        if(endptr == count_buffer)
+
+        /* add entry to the table */
+        err = counter_table_add(table, ip.s_addr, count, NULL);
+        if(err)
+            return err;
+
+next:
+        if(!eol)
+            break;
+        line = eol + 1;
+
+        if(++lines % LOAD_BATCH == 0)
         {
-            syslog(LOG_ERR, "strtol() failed: No digits were found (%s)", endptr);
-            continue;
+            load_progress.bytes_done = line - data;
+            load_progress.entries = table->hdr->entries;
+            load_yield();
         }
+    }
+
+    load_progress.bytes_done = load_progress.bytes_total;
+    load_progress.entries = table->hdr->entries;
+    return 0;
+}
 
-        /* add new_stat to tree */
-        tree_stat = tsearch((void *) new_stat,
-                            g_stats.ip_stats_tree,
-                            ip_stat_compare_fn);
-        if(tree_stat != new_stat)
+/* Move load_base into g_stats in batches, so capture keeps running.
+ * Called with load_mutex held. */
+static int
+packet_stats_merge(void)
+{
+    uint32_t capacity = load_base.hdr->capacity;
+    int err = 0;
+
+    while(load_merge_cursor < capacity && !err)
+    {
+        uint32_t end = load_merge_cursor + LOAD_BATCH;
+        if(end > capacity)
+            end = capacity;
+
+        pthread_mutex_lock(&stats_mutex);
+        for(uint32_t i = load_merge_cursor; i < end && !err; ++i)
         {
-            /* in this case value was found and overwritten */
-            free(new_stat);
+            shm_table_entry *slot = &load_base.slots[i];
+            if(slot->count)
+                err = counter_table_add(&g_stats.table, slot->addr, slot->count, NULL);
         }
+        pthread_mutex_unlock(&stats_mutex);
+
+        load_merge_cursor = end;
+        load_yield();
+    }
+
+    return err;
+}
+
+/* Returns NULL */
+static void *
+packet_load_fn(void *arg)
+{
+    char *filename = arg;
+    char *data = NULL;
+    size_t size;
+    int err;
+
+    placement_apply(PLACEMENT_PERSIST);
+
+    err = persist_read_file_wait(filename, &data, &size);
+    free(filename);
+
+    pthread_mutex_lock(&load_mutex);
+    if(err)
+        goto done;
+
+    load_progress.state = LOAD_PARSING;
+    load_progress.bytes_total = size;
+    err = packet_stats_parse(&load_base, data);
+    free(data);
+    if(err)
+        goto done;
+
+    load_progress.state = LOAD_MERGING;
+    err = packet_stats_merge();
+
+done:
+    if(err == ENOENT)
+    {
+        /* nothing was saved yet */
+        syslog(LOG_DEBUG, "previous stats not found");
+        err = 0;
+    }
+
+    if(err)
+        syslog(LOG_ERR, "stats load failed: %s", strerror(err));
+    else
+        syslog(LOG_DEBUG, "previous stats loaded");
+
+    counter_table_destroy(&load_base);
+
+    if(load_dump_pending)
+    {
+        load_dump_pending = 0;
+        packet_stats_dump(&g_stats);
+    }
+
+    load_progress.error = err;
+    load_progress.state = err ? LOAD_FAILED : LOAD_DONE;
+    pthread_cond_broadcast(&load_cond);
+    pthread_mutex_unlock(&load_mutex);
+
+    return NULL;
+}
+
+/*
+ * Start loading the saved stats in background.
+ * Only the first start of the process loads them, later starts keep
+ * what is in memory.
+ */
+static int
+packet_stats_load_start(internal_iface_stat *stats)
+{
+    char *filename;
+    int err;
+
+    pthread_mutex_lock(&load_mutex);
+    if(load_progress.state != LOAD_IDLE)
+    {
+        pthread_mutex_unlock(&load_mutex);
+        return 0;
+    }
+
+    /* !!! malloc !!! */
+    filename = malloc(FILENAME_MAX);
+    if(!filename)
+    {
+        pthread_mutex_unlock(&load_mutex);
+        return ENOMEM;
+    }
+
+    if(snprintf(filename,
+                FILENAME_MAX,
+                STATSFILE_TEMPLATE,
+                stats->iface_str) < 0)
+    {
+        /* errno is set on POSIX */
+        err = errno;
+        goto fail;
+    }
+
+    /* private table, it is never published */
+    err = counter_table_create(&load_base, NULL, 0);
+    if(err)
+        goto fail;
+
+    memset(&load_progress, 0, sizeof(load_progress));
+    load_progress.state = LOAD_READING;
+    load_merge_cursor = 0;
+
+    /* !!! create thread !!! */
+    err = pthread_create(&load_thread, NULL, &packet_load_fn, filename);
+    if(err)
+    {
+        counter_table_destroy(&load_base);
+        load_progress.state = LOAD_FAILED;
+        load_progress.error = err;
+        goto fail;
     }
+    pthread_detach(load_thread);
+
+    pthread_mutex_unlock(&load_mutex);
+    return 0;
 
-    fclose(fd);
+fail:
+    syslog(LOG_ERR, "stats load not started: %s", strerror(err));
+    pthread_mutex_unlock(&load_mutex);
+    free(filename);
     return err;
 }
 
@@ -313,164 +692,1335 @@ is_running(pthread_mutex_t *mtx)
 int
 work_with_addr(struct in_addr *addr, internal_iface_stat *stat)
 {
-    internal_ip_stat *new_ip_stat = NULL, *found_stat;
-    void *returned_value;
+    return counter_table_add(&stat->table, addr->s_addr, 1, NULL);
+}
+
+/* last capture error, kept until the next one, read by other threads */
+int thread_last_error;
+/* error that ended the capture thread */
+static int thread_fatal_error;
+
+/* capture thread is running, read by other threads */
+static int capture_running;
+
+/* spin this long without traffic before blocking, 0 never spins,
+   see packet_set_busy_poll() */
+static unsigned busy_poll_us;
+
+/* CAPTURE_BACKEND_*, see packet_set_backend() */
+static int capture_backend = CAPTURE_BACKEND_SOCKET;
+
+/* In-kernel counter of the bpf backend, created on the first start.
+ * packet_bpf_seen holds the counts already added to the table, only
+ * the capture thread uses it. */
+static bpf_counter packet_bpf;
+static int packet_bpf_ready;
+static counter_table packet_bpf_seen;
+
+/* AF_XDP sockets of the xdp backend, open while capturing.
+ * XDP_CAPTURE_*, see packet_set_xdp_mode() */
+static xdp_capture packet_xdp;
+static int xdp_mode = XDP_CAPTURE_AUTO;
+
+/* Packets go from capture_thread, which only receives them, to
+ * aggregate_thread, which counts them in batches. Created on the first
+ * start. */
+static capture_ring packet_ring;
+
+/* Health counters of the capture threads, see packet_get_selfstat().
+ * Each is written by one of the threads only, others read them
+ * atomically. */
+static struct
+{
+    uint64_t started_ns;
+    /* receive stage */
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t kernel_drops;
+    uint64_t recv_errors;
+    uint64_t ring_overflows;
+    uint64_t spin_packets;
+    uint64_t recv_spin_ns;
+    uint64_t recv_work_ns;
+    uint64_t recv_fallbacks;
+    uint32_t socket_drops;  /* last total reported by capture_socket */
+    /* aggregation stage */
+    uint32_t ring_max_used;
+    uint64_t batches;
+    uint64_t aggregate_spin_ns;
+    uint64_t aggregate_work_ns;
+    uint64_t aggregate_fallbacks;
+    uint64_t bpf_misses;
+    uint32_t bpf_entries;
+    uint32_t xdp_queues;
+    uint32_t xdp_flags;
+    uint64_t xdp_rx_dropped;
+    uint64_t xdp_rx_ring_full;
+    uint64_t xdp_fill_ring_empty;
+    uint64_t xdp_invalid_descs;
+    uint64_t lock_waits;
+    uint64_t lock_wait_ns;
+    uint64_t lock_wait_max_ns;
+    uint64_t process_max_ns;
+    uint64_t process_total_ns;
+    uint64_t hist[HIST_BUCKETS];
+} selfstat;
+
+/* with a single writer, a plain load and an atomic store are enough */
+#define SELFSTAT_ADD(field, n) \
+    __atomic_store_n(&selfstat.field, selfstat.field + (n), __ATOMIC_RELAXED)
+#define SELFSTAT_MAX(field, v) \
+    do { if((v) > selfstat.field) __atomic_store_n(&selfstat.field, (v), __ATOMIC_RELAXED); } while(0)
+
+static inline uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* pause between polls of a spinning loop */
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* Capture socket lives outside of the thread, so it can be handed over
+ * to a new daemon without losing queued packets. -1 when closed. */
+int capture_socket = -1;
+
+/* How often a blocked capture thread checks whether it should stop */
+#define CAPTURE_POLL_TIMEOUT_MS 200
+
+/* Have the kernel poll the device queue from recvmsg() as well, where
+ * the driver supports it. The capture thread spins either way. */
+static void
+capture_socket_busy_poll(void)
+{
+    if(!busy_poll_us)
+        return;
+
+    if(setsockopt(capture_socket, SOL_SOCKET, SO_BUSY_POLL,
+                  &(int){ busy_poll_us }, sizeof(int)) == -1)
+        syslog(LOG_WARNING, "SO_BUSY_POLL: %s", strerror(errno));
+#ifdef SO_PREFER_BUSY_POLL
+    if(setsockopt(capture_socket, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                  &(int){ 1 }, sizeof(int)) == -1)
+        syslog(LOG_WARNING, "SO_PREFER_BUSY_POLL: %s", strerror(errno));
+#endif
+}
+
+static int
+capture_socket_open(void)
+{
+    struct timeval timeout = {
+        .tv_sec = 0,
+        .tv_usec = CAPTURE_POLL_TIMEOUT_MS * 1000
+    };
+
+    /* open socket for sniffing, its drop counter starts over */
+    selfstat.socket_drops = 0;
+    capture_socket = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_TCP);
+    if(capture_socket < 0)
+    {
+        int err = errno;
+        syslog(LOG_ERR, "Socket creation failed: %s", strerror(err));
+        return err;
+    }
+
+    /* configure socket interface */
+    setsockopt(capture_socket,
+               SOL_SOCKET,
+               SO_BINDTODEVICE,
+               &(g_stats.iface_str),
+               IFNAMSIZ);
+
+    /* wake up from recvmsg() to check the stop flag */
+    setsockopt(capture_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    /* have the kernel report how many packets it dropped */
+    if(setsockopt(capture_socket, SOL_SOCKET, SO_RXQ_OVFL, &(int){ 1 }, sizeof(int)) == -1)
+        syslog(LOG_WARNING, "SO_RXQ_OVFL: %s, drops are not counted", strerror(errno));
+
+    capture_socket_busy_poll();
+    return 0;
+}
+
+/* Take the drop counter of the socket from a received message */
+static void
+capture_note_drops(struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+
+    for(cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+        {
+            uint32_t drops;
+
+            /* the socket's total, it wraps at 2^32 */
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            SELFSTAT_ADD(kernel_drops, (uint32_t)(drops - selfstat.socket_drops));
+            selfstat.socket_drops = drops;
+        }
+    }
+}
+
+/*
+ * Receive stage. Only takes what counting needs off the socket, so it
+ * never waits for the table and the socket is drained as fast as it
+ * can be. Returns NULL.
+ */
+static void *
+packet_loop_fn(void *arg)
+{
+    ssize_t data_retrieved_size;
+    struct sockaddr_in saddr;
+    unsigned char buffer[SOCKET_DATA_SIZE_MAX];
+    char control[CMSG_SPACE(sizeof(uint32_t))];
+    struct iovec iov = { buffer, sizeof(buffer) };
+    struct msghdr msg = { 0 };
+    capture_record record;
+    uint64_t spin_limit_ns = (uint64_t) busy_poll_us * 1000;
+    uint64_t mark = monotonic_ns(), idle_ns = 0, now;
+    int spinning = spin_limit_ns != 0;
+    int err;
+
+    /* ignore arg */
+    (void) arg;
+
+    placement_apply(PLACEMENT_CAPTURE);
+
+    syslog(LOG_DEBUG, "start capture: %s", g_stats.iface_str);
+    /* capture packets, until stopped or the aggregation stage failed */
+    while(is_running(&stop_mutex)
+          && !__atomic_load_n(&thread_fatal_error, __ATOMIC_RELAXED))
+    {
+        msg.msg_name = &saddr;
+        msg.msg_namelen = sizeof(saddr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        data_retrieved_size = recvmsg(capture_socket, &msg, spinning ? MSG_DONTWAIT : 0);
+        if(data_retrieved_size < 0)
+        {
+            /* nothing yet, or a timeout, check the stop flag */
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                if(!spinning)
+                    continue;
+
+                now = monotonic_ns();
+                idle_ns += now - mark;
+                SELFSTAT_ADD(recv_spin_ns, now - mark);
+                mark = now;
+                /* traffic stopped, block until it comes back */
+                if(idle_ns >= spin_limit_ns)
+                {
+                    spinning = 0;
+                    SELFSTAT_ADD(recv_fallbacks, 1);
+                }
+                cpu_relax();
+                continue;
+            }
+
+            err = errno;
+            SELFSTAT_ADD(recv_errors, 1);
+            __atomic_store_n(&thread_last_error, err, __ATOMIC_RELAXED);
+            syslog(LOG_WARNING, "recvmsg failed: %s", strerror(err));
+            continue;
+        }
+        NETSNIFF_PROBE2(packet__receive, saddr.sin_addr.s_addr, data_retrieved_size);
+
+        record.recv_ns = monotonic_ns();
+        capture_note_drops(&msg);
+        SELFSTAT_ADD(packets, 1);
+        SELFSTAT_ADD(bytes, data_retrieved_size);
+        if(spin_limit_ns)
+        {
+            /* time blocked in recvmsg() is neither spinning nor work */
+            if(spinning)
+                SELFSTAT_ADD(spin_packets, 1);
+            else
+                mark = record.recv_ns;
+            spinning = 1;
+            idle_ns = 0;
+        }
+
+        /* we only need to analyze sockaddr_in structure here to retrieve IP */
+        record.addr = saddr.sin_addr.s_addr;
+        record.size = data_retrieved_size;
+        if(capture_ring_push(&packet_ring, &record))
+        {
+            /* aggregation is behind, the packet is lost like a kernel drop */
+            SELFSTAT_ADD(ring_overflows, 1);
+            NETSNIFF_PROBE1(ring__overflow, record.addr);
+        }
+        else
+        {
+            capture_ring_notify(&packet_ring);
+        }
+
+        if(spin_limit_ns)
+        {
+            now = monotonic_ns();
+            SELFSTAT_ADD(recv_work_ns, now - mark);
+            mark = now;
+        }
+    }
+    syslog(LOG_DEBUG, "stop capture: %s", g_stats.iface_str);
+    return NULL;
+}
+
+/* Take the ring statistics of the AF_XDP sockets, last holds the totals
+ * seen so far */
+static void
+capture_note_xdp_drops(xdp_capture_stats *last)
+{
+    xdp_capture_stats now;
+    int err;
+
+    err = xdp_capture_read_stats(&packet_xdp, &now);
+    if(err)
+    {
+        syslog(LOG_WARNING, "XDP_STATISTICS: %s", strerror(err));
+        return;
+    }
+
+    /* frames the kernel had for us but could not hand over */
+    SELFSTAT_ADD(kernel_drops, now.rx_dropped - last->rx_dropped
+                               + now.rx_ring_full - last->rx_ring_full);
+    SELFSTAT_ADD(xdp_rx_dropped, now.rx_dropped - last->rx_dropped);
+    SELFSTAT_ADD(xdp_rx_ring_full, now.rx_ring_full - last->rx_ring_full);
+    SELFSTAT_ADD(xdp_fill_ring_empty, now.fill_ring_empty - last->fill_ring_empty);
+    SELFSTAT_ADD(xdp_invalid_descs, now.rx_invalid_descs - last->rx_invalid_descs);
+    *last = now;
+}
+
+/*
+ * Receive stage of the xdp backend. Takes batches of frames off the
+ * AF_XDP RX rings, gives the frames straight back to the kernel and
+ * queues records for the aggregation stage as packet_loop_fn() does.
+ * Returns NULL.
+ */
+static void *
+packet_xdp_fn(void *arg)
+{
+    capture_record records[CAPTURE_BATCH_MAX];
+    xdp_capture_stats last = { 0 };
+    uint64_t spin_limit_ns = (uint64_t) busy_poll_us * 1000;
+    uint64_t mark = monotonic_ns(), idle_ns = 0, stats_ns = mark, now;
+    int spinning = spin_limit_ns != 0;
+    int err;
+
+    (void) arg;
+
+    placement_apply(PLACEMENT_CAPTURE);
+
+    syslog(LOG_DEBUG, "start AF_XDP capture: %s", g_stats.iface_str);
+    while(is_running(&stop_mutex)
+          && !__atomic_load_n(&thread_fatal_error, __ATOMIC_RELAXED))
+    {
+        uint32_t n, frames;
+
+        n = xdp_capture_receive(&packet_xdp, records, CAPTURE_BATCH_MAX, &frames);
+        now = monotonic_ns();
+        if(now - stats_ns >= (uint64_t) CAPTURE_BPF_INTERVAL_MS * 1000000)
+        {
+            capture_note_xdp_drops(&last);
+            stats_ns = now;
+        }
+
+        if(!frames)
+        {
+            if(spinning)
+            {
+                idle_ns += now - mark;
+                SELFSTAT_ADD(recv_spin_ns, now - mark);
+                mark = now;
+                /* traffic stopped, block until it comes back */
+                if(idle_ns >= spin_limit_ns)
+                {
+                    spinning = 0;
+                    SELFSTAT_ADD(recv_fallbacks, 1);
+                }
+                cpu_relax();
+                continue;
+            }
+
+            err = xdp_capture_wait(&packet_xdp, CAPTURE_POLL_TIMEOUT_MS);
+            if(err)
+            {
+                SELFSTAT_ADD(recv_errors, 1);
+                __atomic_store_n(&thread_last_error, err, __ATOMIC_RELAXED);
+                syslog(LOG_WARNING, "poll failed: %s", strerror(err));
+            }
+            /* time blocked is neither spinning nor work */
+            mark = monotonic_ns();
+            continue;
+        }
+
+        SELFSTAT_ADD(packets, n);
+        if(spin_limit_ns)
+        {
+            if(spinning)
+                SELFSTAT_ADD(spin_packets, n);
+            spinning = 1;
+            idle_ns = 0;
+        }
+
+        for(uint32_t i = 0; i < n; ++i)
+        {
+            NETSNIFF_PROBE2(packet__receive, records[i].addr, records[i].size);
+            SELFSTAT_ADD(bytes, records[i].size);
+            records[i].recv_ns = now;
+            if(capture_ring_push(&packet_ring, &records[i]))
+            {
+                SELFSTAT_ADD(ring_overflows, 1);
+                NETSNIFF_PROBE1(ring__overflow, records[i].addr);
+            }
+        }
+        capture_ring_notify(&packet_ring);
+
+        if(spin_limit_ns)
+        {
+            now = monotonic_ns();
+            SELFSTAT_ADD(recv_work_ns, now - mark);
+            mark = now;
+        }
+    }
+    capture_note_xdp_drops(&last);
+    syslog(LOG_DEBUG, "stop AF_XDP capture: %s", g_stats.iface_str);
+
+    return NULL;
+}
+
+/* Take stats_mutex for the capture threads, timing only a contended lock */
+static void
+stats_lock_timed(void)
+{
+    uint64_t wait;
+
+    if(!pthread_mutex_trylock(&stats_mutex))
+    {
+        NETSNIFF_PROBE1(capture__lock__acquire, 0);
+        return;
+    }
+
+    wait = monotonic_ns();
+    pthread_mutex_lock(&stats_mutex);
+    wait = monotonic_ns() - wait;
+
+    SELFSTAT_ADD(lock_waits, 1);
+    SELFSTAT_ADD(lock_wait_ns, wait);
+    SELFSTAT_MAX(lock_wait_max_ns, wait);
+    NETSNIFF_PROBE1(capture__lock__acquire, 1);
+}
+
+/* Spin until a packet is queued or the ring is closed, for at most
+ * limit_ns. Returns 0 if none came. */
+static int
+aggregate_spin(uint64_t limit_ns)
+{
+    uint64_t start = monotonic_ns(), now = start;
+    int woken = 0;
+
+    while(now - start < limit_ns)
+    {
+        if(capture_ring_used(&packet_ring)
+           || __atomic_load_n(&packet_ring.closing, __ATOMIC_ACQUIRE))
+        {
+            woken = 1;
+            break;
+        }
+        cpu_relax();
+        now = monotonic_ns();
+    }
+
+    SELFSTAT_ADD(aggregate_spin_ns, now - start);
+    return woken;
+}
+
+/*
+ * Aggregation stage. Counts queued packets in batches, so stats_mutex
+ * is taken once per batch rather than per packet. Drains the ring
+ * before returning NULL, once it is closed.
+ */
+static void *
+packet_aggregate_fn(void *arg)
+{
+    uint64_t spin_limit_ns = (uint64_t) busy_poll_us * 1000;
+    int napped = 0;
+
+    (void) arg;
+
+    placement_apply(PLACEMENT_AGGREGATE);
+
+    for(;;)
+    {
+        capture_record *records;
+        uint64_t start, now;
+        uint32_t n, used, done;
+        int closing, err = 0;
+
+        n = capture_ring_peek(&packet_ring, &records, CAPTURE_BATCH_MAX, &used);
+        /* closed only after the producer stopped, so nothing follows */
+        closing = __atomic_load_n(&packet_ring.closing, __ATOMIC_ACQUIRE);
+        if(!n && closing && !capture_ring_used(&packet_ring))
+            break;
+
+        if(spin_limit_ns && !used && !closing)
+        {
+            /* count each packet as soon as it is queued, until the
+               receive stage goes quiet */
+            if(!aggregate_spin(spin_limit_ns))
+            {
+                SELFSTAT_ADD(aggregate_fallbacks, 1);
+                capture_ring_wait(&packet_ring, 1, CAPTURE_POLL_TIMEOUT_MS);
+            }
+            continue;
+        }
+
+        if(!spin_limit_ns && used < CAPTURE_BATCH_MAX && !closing && !napped)
+        {
+            /* Sleep until a packet comes, then let a batch gather: woken
+             * per packet, we would take the CPU from the receive stage. */
+            if(used)
+                capture_ring_wait(&packet_ring, CAPTURE_BATCH_MAX, CAPTURE_BATCH_INTERVAL_MS);
+            else
+                capture_ring_wait(&packet_ring, 1, CAPTURE_POLL_TIMEOUT_MS);
+            napped = used != 0;
+            continue;
+        }
+        napped = 0;
+        if(!n)
+            continue;
+
+        SELFSTAT_MAX(ring_max_used, used);
+
+        start = monotonic_ns();
+        stats_lock_timed();
+        for(done = 0; done < n && !err; ++done)
+            err = work_with_addr(&(struct in_addr){ records[done].addr }, &g_stats);
+        pthread_mutex_unlock(&stats_mutex);
+        NETSNIFF_PROBE(capture__lock__release);
+        NETSNIFF_PROBE2(aggregate__batch, done, used);
+
+        /* every packet, from recvmsg() until it is counted */
+        now = monotonic_ns();
+        SELFSTAT_ADD(aggregate_work_ns, now - start);
+        for(uint32_t i = 0; i < done; ++i)
+        {
+            uint64_t elapsed = now - records[i].recv_ns;
+
+            SELFSTAT_ADD(hist[hist_bucket(elapsed)], 1);
+            SELFSTAT_ADD(process_total_ns, elapsed);
+            SELFSTAT_MAX(process_max_ns, elapsed);
+        }
+        SELFSTAT_ADD(batches, 1);
+        capture_ring_consume(&packet_ring, n);
+
+        if(err)
+        {
+            /* the receive stage sees it and stops too */
+            __atomic_store_n(&thread_last_error, err, __ATOMIC_RELAXED);
+            __atomic_store_n(&thread_fatal_error, err, __ATOMIC_RELAXED);
+            syslog(LOG_ERR, "work_with_addr failed: %s", strerror(err));
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/* Adds what the kernel counted since the last read to the table */
+static int
+bpf_apply_fn(void *ctx, const uint32_t *addrs, const uint64_t *counts, uint32_t n)
+{
+    uint64_t start, packets = 0;
+    int err = 0;
+
+    (void) ctx;
+
+    start = monotonic_ns();
+    stats_lock_timed();
+    for(uint32_t i = 0; i < n && !err; ++i)
+    {
+        uint64_t seen = counter_table_get(&packet_bpf_seen, addrs[i]);
+
+        /* counts only grow */
+        if(counts[i] <= seen)
+            continue;
+
+        err = counter_table_add(&packet_bpf_seen, addrs[i], counts[i] - seen, NULL);
+        if(!err)
+            err = counter_table_add(&g_stats.table, addrs[i], counts[i] - seen, NULL);
+        packets += counts[i] - seen;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    NETSNIFF_PROBE(capture__lock__release);
+
+    SELFSTAT_ADD(packets, packets);
+    SELFSTAT_ADD(batches, 1);
+    SELFSTAT_ADD(aggregate_work_ns, monotonic_ns() - start);
+    return err;
+}
+
+/*
+ * Capture thread of the bpf backend. Packets are counted by the kernel,
+ * the thread only moves the counts to the table, a last time after
+ * being stopped. Returns NULL.
+ */
+static void *
+packet_bpf_fn(void *arg)
+{
+    uint32_t entries;
+    int running, err;
+
+    (void) arg;
+
+    placement_apply(PLACEMENT_CAPTURE);
+
+    syslog(LOG_DEBUG, "start in-kernel counting: %s", g_stats.iface_str);
+    do
+    {
+        running = is_running(&stop_mutex);
+
+        err = bpf_counter_read(&packet_bpf, bpf_apply_fn, NULL, &entries);
+        if(err)
+        {
+            __atomic_store_n(&thread_last_error, err, __ATOMIC_RELAXED);
+            __atomic_store_n(&thread_fatal_error, err, __ATOMIC_RELAXED);
+            syslog(LOG_ERR, "reading in-kernel counts failed: %s", strerror(err));
+            break;
+        }
+        __atomic_store_n(&selfstat.bpf_entries, entries, __ATOMIC_RELAXED);
+        __atomic_store_n(&selfstat.bpf_misses, bpf_counter_misses(&packet_bpf),
+                         __ATOMIC_RELAXED);
+
+        if(running)
+            poll(NULL, 0, CAPTURE_BPF_INTERVAL_MS);
+    } while(running);
+    syslog(LOG_DEBUG, "stop in-kernel counting: %s", g_stats.iface_str);
+
+    return NULL;
+}
+
+/* Count in the kernel on capture_socket, see packet_bpf_fn() */
+static int
+capture_bpf_start(void)
+{
+    int err;
+
+    if(!packet_bpf_ready)
+    {
+        err = bpf_counter_create(&packet_bpf, CAPTURE_BPF_MAP_ENTRIES);
+        if(err)
+        {
+            syslog(LOG_ERR, "in-kernel counter not loaded: %s", strerror(err));
+            return err;
+        }
+
+        err = counter_table_create(&packet_bpf_seen, NULL, 0);
+        if(err)
+        {
+            bpf_counter_destroy(&packet_bpf);
+            syslog(LOG_ERR, "counter table creation failed: %s", strerror(err));
+            return err;
+        }
+        packet_bpf_ready = 1;
+    }
+
+    err = bpf_counter_attach(&packet_bpf, capture_socket);
+    if(err)
+    {
+        syslog(LOG_ERR, "in-kernel counter not attached: %s", strerror(err));
+        return err;
+    }
+
+    /* !!! create thread !!! */
+    pthread_mutex_lock(&stop_mutex);
+    err = pthread_create(&capture_thread, NULL, &packet_bpf_fn, NULL);
+    if(err)
+    {
+        pthread_mutex_unlock(&stop_mutex);
+        bpf_counter_detach(capture_socket);
+        syslog(LOG_ERR, "pthread_create failed: %s", strerror(err));
+        return err;
+    }
+
+    return 0;
+}
+
+/* Open the AF_XDP sockets of the xdp backend, see packet_xdp_fn() */
+static int
+capture_xdp_open(void)
+{
+    int err;
+
+    err = xdp_capture_open(&packet_xdp, g_stats.iface_str, xdp_mode);
+    if(err)
+    {
+        syslog(LOG_ERR, "AF_XDP capture on %s failed: %s", g_stats.iface_str, strerror(err));
+        return err;
+    }
+
+    __atomic_store_n(&selfstat.xdp_queues, packet_xdp.queue_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&selfstat.xdp_flags,
+                     (packet_xdp.native ? CAPTURE_XDP_NATIVE : 0)
+                     | (packet_xdp.zerocopy ? CAPTURE_XDP_ZEROCOPY : 0), __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Start the capture threads on capture_socket, or on AF_XDP sockets,
+ * opening them as needed. */
+static int
+capture_thread_start(void)
+{
+    int err;
+
+    /* the xdp backend reads no raw socket, the kernel would keep
+       cloning packets into it for nothing */
+    if(capture_backend != CAPTURE_BACKEND_XDP && capture_socket < 0)
+    {
+        err = capture_socket_open();
+        if(err)
+            return err;
+    }
+
+    if(capture_backend == CAPTURE_BACKEND_BPF)
+    {
+        if(!selfstat.started_ns)
+            __atomic_store_n(&selfstat.started_ns, monotonic_ns(), __ATOMIC_RELAXED);
+        __atomic_store_n(&thread_fatal_error, 0, __ATOMIC_RELAXED);
+
+        err = capture_bpf_start();
+        if(!err)
+            __atomic_store_n(&capture_running, 1, __ATOMIC_RELAXED);
+        return err;
+    }
+
+    if(!packet_ring.records)
+    {
+        err = capture_ring_create(&packet_ring, CAPTURE_RING_CAPACITY);
+        if(err)
+        {
+            syslog(LOG_ERR, "capture ring creation failed: %s", strerror(err));
+            return err;
+        }
+
+        /* next to the table, nothing touched the records yet */
+        err = placement_bind(packet_ring.records,
+                             (size_t)(packet_ring.mask + 1) * sizeof(*packet_ring.records));
+        if(err)
+            syslog(LOG_WARNING, "capture ring placement failed: %s", strerror(err));
+    }
+    else
+    {
+        capture_ring_reset(&packet_ring);
+    }
+
+    if(capture_backend == CAPTURE_BACKEND_XDP)
+    {
+        err = capture_xdp_open();
+        if(err)
+            return err;
+    }
+
+    if(!selfstat.started_ns)
+        __atomic_store_n(&selfstat.started_ns, monotonic_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&thread_fatal_error, 0, __ATOMIC_RELAXED);
+
+    /* !!! create thread !!! */
+    err = pthread_create(&aggregate_thread, NULL, &packet_aggregate_fn, NULL);
+    if(err)
+    {
+        if(capture_backend == CAPTURE_BACKEND_XDP)
+            xdp_capture_close(&packet_xdp);
+        syslog(LOG_ERR, "pthread_create failed: %s", strerror(err));
+        return err;
+    }
+
+    /* !!! create thread !!! */
+    pthread_mutex_lock(&stop_mutex);
+    err = pthread_create(&capture_thread, NULL,
+                         capture_backend == CAPTURE_BACKEND_XDP ? &packet_xdp_fn
+                                                                : &packet_loop_fn, NULL);
+    if(err)
+    {
+        pthread_mutex_unlock(&stop_mutex);
+        capture_ring_close(&packet_ring);
+        pthread_join(aggregate_thread, NULL);
+        if(capture_backend == CAPTURE_BACKEND_XDP)
+            xdp_capture_close(&packet_xdp);
+        syslog(LOG_ERR, "pthread_create failed: %s", strerror(err));
+        return err;
+    }
+
+    __atomic_store_n(&capture_running, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Stop the capture threads once every received packet is counted,
+ * the socket stays open. */
+static void
+capture_thread_join(void)
+{
+    /* Unlock mutex used as a cancelation flag and wait for thread to return. */
+    /* !!! join thread !!! */
+    pthread_mutex_unlock(&stop_mutex);
+    pthread_join(capture_thread, NULL);
+
+    if(capture_backend == CAPTURE_BACKEND_BPF)
+    {
+        /* whoever reads the socket next gets the packets */
+        bpf_counter_detach(capture_socket);
+    }
+    else
+    {
+        /* frames are passed to the network stack again */
+        if(capture_backend == CAPTURE_BACKEND_XDP)
+            xdp_capture_close(&packet_xdp);
+
+        /* !!! join thread !!! */
+        capture_ring_close(&packet_ring);
+        pthread_join(aggregate_thread, NULL);
+    }
+    __atomic_store_n(&capture_running, 0, __ATOMIC_RELAXED);
+}
+
+/*********************/
+/* Library interface */
+/*********************/
+
+int
+packet_capture_start()
+{
+    int err;
+
+    syslog(LOG_DEBUG, "start capture");
+    /* Trylock a mutex. If it locks then thread was stopped.
+       Do nothing when mutex was already locked. */
+    if(is_running(&stop_mutex))
+    {
+        syslog(LOG_DEBUG, "mutex locked");
+        return 0;
+    }
+
+    /* first start - create new record */
+    if(!g_stats.table.hdr)
+    {
+        err = iface_stat_init(&g_stats);
+        if(err)
+            return err;
+    }
+
+    /* Capture starts right away into the live table,
+       saved stats are merged in as they are loaded */
+    packet_stats_load_start(&g_stats);
+
+    return capture_thread_start();
+}
+
+int
+packet_set_backend(const char *name)
+{
+    if(!strcmp(name, "socket"))
+        capture_backend = CAPTURE_BACKEND_SOCKET;
+    else if(!strcmp(name, "bpf"))
+        capture_backend = CAPTURE_BACKEND_BPF;
+    else if(!strcmp(name, "xdp"))
+        capture_backend = CAPTURE_BACKEND_XDP;
+    else
+        return EINVAL;
+
+    return 0;
+}
+
+int
+packet_set_xdp_mode(const char *name)
+{
+    if(!strcmp(name, "auto"))
+        xdp_mode = XDP_CAPTURE_AUTO;
+    else if(!strcmp(name, "native"))
+        xdp_mode = XDP_CAPTURE_NATIVE;
+    else if(!strcmp(name, "generic"))
+        xdp_mode = XDP_CAPTURE_GENERIC;
+    else
+        return EINVAL;
+
+    return 0;
+}
+
+int
+packet_set_capture_iface(const char *iface_str)
+{
+    size_t len = strlen(iface_str);
+
+    if(!len || len >= IFNAMSIZ)
+        return EINVAL;
+
+    /* !!! malloc !!! */
+    iface_str = strdup(iface_str);
+    if(!iface_str)
+        return ENOMEM;
+
+    iface_name = (char *) iface_str;
+    return 0;
+}
+
+int
+packet_set_busy_poll(unsigned usec)
+{
+    if(usec > CAPTURE_BUSY_POLL_MAX_US)
+        return EINVAL;
+
+    busy_poll_us = usec;
+    return 0;
+}
+
+int
+packet_set_iface(const char *iface_str)
+{
+    return 0;
+}
+
+int packet_get_iface_stats(packet_interface_stats **stats_out,
+                           size_t *stats_size_out,
+                           const char *iface_str)
+{
+    return 0;
+}
+
+int
+packet_stats_export(const char *iface_str, packet_stats_alloc_fn alloc, void *ctx,
+                    dopt_stat_v2_header *header)
+{
+    counter_table *table = &g_stats.table;
+    dopt_stat_entry *entries;
+    uint64_t room, loaded = 0;
+    uint32_t count = 0;
+    int loading, err = 0;
+
+    memset(header, 0, sizeof(*header));
+
+    pthread_mutex_lock(&load_mutex);
+    if(iface_str && strncmp(iface_str, g_stats.iface_str, IFNAMSIZ))
+    {
+        err = ENODEV;
+        goto out;
+    }
+
+    pthread_mutex_lock(&stats_mutex);
+    if(!table->hdr)
+    {
+        /* not started yet, no entries */
+        pthread_mutex_unlock(&stats_mutex);
+        memcpy(header->ifname, g_stats.iface_str, sizeof(header->ifname));
+        err = alloc(ctx, 0, &entries);
+        goto out;
+    }
+    loading = load_in_progress() && load_base.hdr;
+
+    /* saved entries not merged yet are added in, as for queries */
+    room = table->hdr->entries;
+    if(loading)
+        room += load_base.hdr->entries;
+
+    err = alloc(ctx, room, &entries);
+    if(!err)
+    {
+        for(uint32_t i = 0; i < table->hdr->capacity; ++i)
+        {
+            if(table->slots[i].count)
+            {
+                uint64_t n = load_unmerged_count(table->slots[i].addr);
+
+                entries[count].addr = table->slots[i].addr;
+                entries[count].count = table->slots[i].count + n;
+                loaded += n;
+                ++count;
+            }
+        }
+
+        for(uint32_t i = load_merge_cursor; loading && i < load_base.hdr->capacity; ++i)
+        {
+            const shm_table_entry *slot = &load_base.slots[i];
+
+            if(slot->count && !counter_table_find(table, slot->addr))
+            {
+                entries[count].addr = slot->addr;
+                entries[count].count = slot->count;
+                loaded += slot->count;
+                ++count;
+            }
+        }
+
+        header->entry_count = count;
+        header->packets = table->hdr->packets + loaded;
+        memcpy(header->ifname, g_stats.iface_str, sizeof(header->ifname));
+    }
+    pthread_mutex_unlock(&stats_mutex);
+
+out:
+    pthread_mutex_unlock(&load_mutex);
+    return err;
+}
+
+/* Copy the entries of the next slots of table, whose layout generation
+ * is seq, into a page. */
+static int
+stats_page_scan(const counter_table *table, uint32_t seq, uint64_t cursor, uint32_t max,
+                packet_stats_alloc_fn alloc, void *ctx, uint32_t *count_out, uint64_t *next_out)
+{
+    dopt_stat_entry *entries;
+    uint32_t capacity = table->hdr->capacity, start = 0, i, count = 0;
     int err;
 
-    syslog(LOG_DEBUG, "work: creating new struct");
-    err = ip_stat_new(&new_ip_stat, addr);
+    /* a cursor is the layout generation and the next slot */
+    if(cursor)
+    {
+        start = (uint32_t) cursor;
+        if((uint32_t)(cursor >> 32) != seq || start > capacity)
+            return ESTALE;
+    }
+
+    err = alloc(ctx, max, &entries);
     if(err)
         return err;
 
-    syslog(LOG_DEBUG, "work: adding to tree");
-    returned_value = tsearch((void *) new_ip_stat, &stat->ip_stats_tree, &ip_stat_compare_fn);
-    if(!returned_value)
+    for(i = start; i < capacity && count < max && i - start < STATS_PAGE_SCAN_MAX; ++i)
     {
-        /* tsearch fails when no element can be allocated */
-        return ENOMEM;
+        if(table->slots[i].count)
+        {
+            entries[count].addr = table->slots[i].addr;
+            entries[count].count = table->slots[i].count;
+            ++count;
+        }
     }
 
-    found_stat = (*(internal_ip_stat **)returned_value);
+    *count_out = count;
+    if(i < capacity)
+        *next_out = (uint64_t) seq << 32 | i;
+    return 0;
+}
+
+int
+packet_stats_page(uint64_t cursor, uint32_t max, packet_stats_alloc_fn alloc, void *ctx,
+                  uint32_t *count_out, uint64_t *next_out)
+{
+    int err;
+
+    *count_out = 0;
+    *next_out = 0;
+
+    pthread_mutex_lock(&load_mutex);
 
-    if(found_stat != new_ip_stat)
+    /* The live table is not complete while loading, walks go over a
+     * merged copy then. Its generation is odd, the live one is even at
+     * rest, so a cursor tells which table it is for. */
+    if(cursor ? (cursor >> 32) & 1 : load_in_progress() && load_base.hdr)
     {
-        /* increment count if a value was found */
-        ++found_stat->count;
-        free(new_ip_stat);
+        if(!cursor && (!page_copy.hdr
+                       || monotonic_ns() - page_copy_ns > STATS_PAGE_COPY_MAX_AGE_NS))
+        {
+            counter_table_destroy(&page_copy);
+            err = load_merged_copy(&page_copy);
+            if(err)
+                goto out;
+            page_copy_seq = (page_copy_seq + 2) | 1;
+            page_copy_ns = monotonic_ns();
+        }
+
+        if(!page_copy.hdr)
+        {
+            err = ESTALE;
+            goto out;
+        }
+
+        err = stats_page_scan(&page_copy, page_copy_seq, cursor, max, alloc, ctx,
+                              count_out, next_out);
+        /* the last walk over it after the load is done */
+        if(!err && !*next_out && !load_in_progress())
+            counter_table_destroy(&page_copy);
+        goto out;
     }
+
+    if(!cursor)
+        counter_table_destroy(&page_copy);
+
+    pthread_mutex_lock(&stats_mutex);
+    if(g_stats.table.hdr)
+        err = stats_page_scan(&g_stats.table, g_stats.table.hdr->seq, cursor, max,
+                              alloc, ctx, count_out, next_out);
+    else if(cursor)
+        err = ESTALE;
     else
     {
-        /* new entry was added, increment entries_count */
-        ++stat->entries_count;
+        /* not started yet, the only page is empty */
+        dopt_stat_entry *entries;
+        err = alloc(ctx, 0, &entries);
     }
+    pthread_mutex_unlock(&stats_mutex);
 
-    return 0;
+out:
+    pthread_mutex_unlock(&load_mutex);
+    return err;
 }
 
-/* thread errors */
-int thread_last_error;
-
-/* Returns NULL */
-static void *
-packet_loop_fn(void *arg)
+/* Rows collected by packet_stats_query */
+typedef struct s_query_rows
 {
-    int data_retrieved_size;
-    socklen_t saddr_len;
-    struct sockaddr_in saddr;
-    unsigned char buffer[SOCKET_DATA_SIZE_MAX];
+    dopt_stat_entry *rows;
+    size_t count;
+    size_t room;
+} query_rows;
 
-    /* ignore arg */
-    (void) arg;
+static void
+query_add_row(const dopt_query *query, uint32_t mask, uint32_t addr, uint64_t n,
+              query_rows *rows, dopt_query_result *result)
+{
+    if(!query_match(query, mask, addr, n))
+        return;
 
-    thread_last_error = 0;
+    ++result->matched;
+    result->packets += n;
+    if(rows->count < rows->room)
+    {
+        rows->rows[rows->count].addr = addr;
+        rows->rows[rows->count].count = n;
+        ++rows->count;
+    }
+}
 
-    /* open socket for sniffing */
-    int capture_socket = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+int
+packet_stats_query(const dopt_query *query, packet_stats_alloc_fn alloc, void *ctx,
+                   dopt_query_result *result)
+{
+    counter_table *table = &g_stats.table;
+    dopt_stat_entry *out;
+    query_rows rows;
+    uint32_t mask = query_mask(query);
+    int loading, err;
 
-    if(capture_socket < 0)
-    {
-        thread_last_error = errno;
-        syslog(LOG_ERR, "Socket creation failed: %s", strerror(thread_last_error));
+    memset(result, 0, sizeof(*result));
 
-        return NULL;
-    }
+    err = query_validate(query);
+    if(err)
+        return err;
 
-    /* configure socket interface */
+    pthread_mutex_lock(&load_mutex);
     pthread_mutex_lock(&stats_mutex);
-    setsockopt(capture_socket,
-               SOL_SOCKET,
-               SO_BINDTODEVICE,
-               &(g_stats.iface_str),
-               IFNAMSIZ);
-    pthread_mutex_unlock(&stats_mutex);
+    loading = load_in_progress() && load_base.hdr;
 
-    syslog(LOG_DEBUG, "start capture: %s", g_stats.iface_str);
-    /* capture packets */
-    while(is_running(&stop_mutex))
-    {
-        saddr_len = sizeof(saddr);
-        data_retrieved_size = recvfrom(capture_socket,
-                                       (void *)&buffer,
-                                       SOCKET_DATA_SIZE_MAX, 0,
-                                       (struct sockaddr *)&saddr,
-                                       &saddr_len);
-        if(data_retrieved_size < 0)
+    /* unsorted queries only keep the first matches */
+    rows.count = 0;
+    rows.room = table->hdr ? table->hdr->entries : 0;
+    if(loading)
+        rows.room += load_base.hdr->entries;
+    if(query->sort == DOPT_SORT_NONE && query->limit && query->limit < rows.room)
+        rows.room = query->limit;
+
+    /* !!! malloc !!! */
+    rows.rows = malloc((rows.room + 1) * sizeof(*rows.rows));
+    if(rows.rows)
+    {
+        /* none before the first start */
+        for(uint32_t i = 0; table->hdr && i < table->hdr->capacity; ++i)
         {
-            thread_last_error = errno;
-            syslog(LOG_WARNING, "recvfrom failed: %s", strerror(thread_last_error));
-            continue;
-        } else {
-            char addr[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &saddr.sin_addr, addr, INET_ADDRSTRLEN);
-            syslog(LOG_DEBUG, "recvfrom succeeded: %s", addr);
+            uint32_t addr = table->slots[i].addr;
+            uint64_t n = table->slots[i].count;
+
+            if(n)
+                query_add_row(query, mask, addr, n + load_unmerged_count(addr),
+                              &rows, result);
         }
 
-        /* process packet */
-        /* we only need to analyze sockaddr_in structure here to retrieve IP */
-        pthread_mutex_lock(&stats_mutex);
-        thread_last_error = work_with_addr(&saddr.sin_addr, &g_stats);
-        pthread_mutex_unlock(&stats_mutex);
-        if(thread_last_error)
+        /* saved entries not merged yet and not counted since the start */
+        for(uint32_t i = load_merge_cursor; loading && i < load_base.hdr->capacity; ++i)
         {
-            syslog(LOG_ERR, "work_with_addr failed: %s", strerror(thread_last_error));
-            return NULL;
+            uint32_t addr = load_base.slots[i].addr;
+            uint64_t n = load_base.slots[i].count;
+
+            if(n && !counter_table_find(table, addr))
+                query_add_row(query, mask, addr, n, &rows, result);
         }
     }
-    syslog(LOG_DEBUG, "stop capture: %s", g_stats.iface_str);
-    return NULL;
-}
+    else
+        err = ENOMEM;
 
-/*********************/
-/* Library interface */
-/*********************/
+    pthread_mutex_unlock(&stats_mutex);
+    pthread_mutex_unlock(&load_mutex);
+    if(err)
+        return err;
+
+    /* the copy is ours, ordering it does not hold up capture */
+    rows.count = query_select(rows.rows, rows.count, query);
+
+    err = alloc(ctx, rows.count, &out);
+    if(!err)
+    {
+        memcpy(out, rows.rows, rows.count * sizeof(*rows.rows));
+        result->row_count = rows.count;
+    }
+
+    free(rows.rows);
+    return err;
+}
 
 int
-packet_capture_start()
+packet_stats_snapshot_fd(int *fd_out, dopt_snapshot_info *info)
 {
-    int err;
+    counter_table *table = &g_stats.table;
+    counter_table merged;
+    size_t size, done = 0;
+    int fd, err = 0;
 
-    syslog(LOG_DEBUG, "start capture");
-    /* Trylock a mutex. If it locks then thread was stopped.
-       Do nothing when mutex was already locked. */
-    if(is_running(&stop_mutex))
+    memset(info, 0, sizeof(*info));
+    NETSNIFF_PROBE1(snapshot__start, "memfd");
+
+    fd = memfd_create("netsniffd.snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(fd == -1)
     {
-        syslog(LOG_DEBUG, "mutex locked");
-        return 0;
+        err = errno;
+        NETSNIFF_PROBE3(snapshot__done, "memfd", err, 0);
+        return err;
     }
 
-    /* load stats */
-    if(packet_stats_load(&g_stats))
+    pthread_mutex_lock(&load_mutex);
+    if(load_in_progress() && load_base.hdr)
     {
-        /* load failed - create new record */
-        syslog(LOG_DEBUG, "previous stats not loaded");
-        iface_stat_init(&g_stats);
-    } else {
-        syslog(LOG_DEBUG, "previous stats loaded");
+        /* a private table with the saved counts, nothing else writes to it */
+        err = load_merged_copy(&merged);
+        if(err)
+            goto out;
+        table = &merged;
+    }
+    else if(!table->hdr)
+    {
+        /* not started yet, an empty table */
+        err = counter_table_create(&merged, NULL, 0);
+        if(err)
+            goto out;
+        table = &merged;
     }
 
-    /* !!! create thread !!! */
-    pthread_mutex_lock(&stop_mutex);
-    err = pthread_create(&capture_thread, NULL, &packet_loop_fn, NULL);
+    /* one copy straight into the page cache of the memfd */
+    if(table != &merged)
+        pthread_mutex_lock(&stats_mutex);
+    size = SHM_TABLE_SIZE(table->hdr->capacity);
+    while(done < size)
+    {
+        ssize_t n = pwrite(fd, (char *) table->hdr + done, size - done, done);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            err = errno;
+            break;
+        }
+        done += n;
+    }
+    info->size = size;
+    info->entries = table->hdr->entries;
+    info->packets = table->hdr->packets;
+    info->capacity = table->hdr->capacity;
+    if(table == &merged)
+        counter_table_destroy(&merged);
+    else
+        pthread_mutex_unlock(&stats_mutex);
+
+    /* nothing maps it writable, so it can be sealed for good */
+    if(!err && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+                                      | F_SEAL_WRITE | F_SEAL_SEAL))
+        err = errno;
+
+out:
+    pthread_mutex_unlock(&load_mutex);
+    NETSNIFF_PROBE3(snapshot__done, "memfd", err, info->entries);
     if(err)
     {
-        syslog(LOG_ERR, "pthread_create failed: %s", strerror(err));
+        close(fd);
         return err;
     }
 
+    *fd_out = fd;
     return 0;
 }
 
 int
-packet_set_iface(const char *iface_str)
+packet_stats_track(int enable)
 {
-    return 0;
+    int err;
+
+    pthread_mutex_lock(&stats_mutex);
+    /* a table created later starts tracking on its own */
+    stats_tracked = enable;
+    err = counter_table_track(&g_stats.table, enable);
+    if(err)
+        stats_tracked = 0;
+    pthread_mutex_unlock(&stats_mutex);
+
+    return err;
 }
 
-int packet_get_iface_stats(packet_interface_stats **stats_out,
-                           size_t *stats_size_out,
-                           const char *iface_str)
+/* Fills dopt_watch_entry records, see counter_change_fn */
+typedef struct s_changes_ctx
 {
-    return 0;
+    dopt_watch_entry *entries;
+    size_t count;
+} changes_ctx;
+
+static void
+packet_stats_change_fn(void *ctx, uint32_t addr, uint64_t count, uint64_t delta)
+{
+    changes_ctx *changes = ctx;
+    dopt_watch_entry *entry = &changes->entries[changes->count++];
+
+    entry->addr = addr;
+    entry->flags = delta == count ? DOPT_WATCH_NEW : 0;
+    entry->count = count;
+    entry->delta = delta;
+}
+
+int
+packet_stats_changes(packet_changes_alloc_fn alloc, void *ctx, dopt_watch_header *header)
+{
+    counter_table *table = &g_stats.table;
+    changes_ctx changes = { NULL, 0 };
+    int reset, err;
+
+    header->entry_count = 0;
+    header->flags = 0;
+    header->packets = 0;
+
+    pthread_mutex_lock(&stats_mutex);
+    if(!table->hdr)
+    {
+        /* not started yet, nothing changes */
+        pthread_mutex_unlock(&stats_mutex);
+        return alloc(ctx, 0, &changes.entries);
+    }
+
+    err = alloc(ctx, table->dirty_count, &changes.entries);
+    if(!err)
+    {
+        counter_table_collect(table, packet_stats_change_fn, &changes, &reset);
+        header->entry_count = changes.count;
+        header->flags = reset ? DOPT_WATCH_RESET : 0;
+        header->packets = table->hdr->packets;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+
+    return err;
 }
 
 int packet_get_ip_stats(const char *ip_str, packet_ip_stats *stats)
@@ -480,21 +2030,42 @@ int packet_get_ip_stats(const char *ip_str, packet_ip_stats *stats)
 
 int packet_get_ip_count(const char *ip_str)
 {
-    internal_ip_stat search_stats, *result_stats;
+    struct in_addr ip;
+    uint64_t count;
 
-    if(inet_pton(AF_INET, ip_str, &search_stats.ip) == -1)
+    if(inet_pton(AF_INET, ip_str, &ip) != 1)
     {
-        int err = errno;
-        syslog(LOG_ERR, "inet_pton: %s", strerror(err));
+        syslog(LOG_ERR, "inet_pton: invalid address %s", ip_str);
         return 0;
     }
 
-    result_stats = tfind(&search_stats, &g_stats.ip_stats_tree, ip_stat_compare_fn);
-    if(!result_stats) {
-        return 0;
-    }
+    /* the capture thread may remap the table while growing it */
+    pthread_mutex_lock(&load_mutex);
+    pthread_mutex_lock(&stats_mutex);
+    count = counter_table_get(&g_stats.table, ip.s_addr);
+    pthread_mutex_unlock(&stats_mutex);
+
+    /* add the part of the saved stats that is not merged yet */
+    count += load_unmerged_count(ip.s_addr);
+    pthread_mutex_unlock(&load_mutex);
+
+    return count > INT_MAX ? INT_MAX : (int) count;
+}
 
-    return result_stats->count;
+void
+packet_get_ip_counts(const uint32_t *addrs, size_t count, uint64_t *counts)
+{
+    pthread_mutex_lock(&load_mutex);
+    pthread_mutex_lock(&stats_mutex);
+    counter_table_get_batch(&g_stats.table, addrs, count, counts);
+    pthread_mutex_unlock(&stats_mutex);
+
+    if(load_in_progress() && load_base.hdr)
+    {
+        for(size_t i = 0; i < count; ++i)
+            counts[i] += load_unmerged_count(addrs[i]);
+    }
+    pthread_mutex_unlock(&load_mutex);
 }
 
 int
@@ -504,25 +2075,186 @@ packet_capture_stop()
     if(!is_running(&stop_mutex))
             return 0;
 
-    /* Unlock mutex used as a cancelation flag and wait for thread to return. */
-    /* !!! join thread !!! */
-    pthread_mutex_unlock(&stop_mutex);
-    pthread_join(capture_thread, NULL);
+    capture_thread_join();
+    if(capture_socket >= 0)
+        close(capture_socket);
+    capture_socket = -1;
+
+    /* check the error that ended the thread, receive errors are not fatal */
+    if(thread_fatal_error)
+    {
+        syslog(LOG_ERR, "Error encountered in thread: %s", strerror(thread_fatal_error));
+        return thread_fatal_error;
+    }
 
-    /* check last error*/
-    if(thread_last_error)
+    /* saved stats are not merged yet, the loader will dump when done */
+    pthread_mutex_lock(&load_mutex);
+    if(load_in_progress())
     {
-        syslog(LOG_ERR, "Error encountered in thread: %s", strerror(thread_last_error));
-        return thread_last_error;
+        load_dump_pending = 1;
+        pthread_mutex_unlock(&load_mutex);
+        return 0;
     }
+    pthread_mutex_unlock(&load_mutex);
 
-    packet_stats_dump(&g_stats);
+    /* queued to the persistence engine, does not wait for the disk */
+    return packet_stats_dump(&g_stats);
+}
 
-    return 0;
+void
+packet_get_capture_info(packet_capture_info *info)
+{
+    info->running = __atomic_load_n(&capture_running, __ATOMIC_RELAXED);
+    info->last_error = __atomic_load_n(&thread_last_error, __ATOMIC_RELAXED);
+}
+
+void
+packet_get_selfstat(dopt_selfstat *stats, uint64_t hist[HIST_BUCKETS])
+{
+    uint64_t started = __atomic_load_n(&selfstat.started_ns, __ATOMIC_RELAXED);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->elapsed_ms = started ? (monotonic_ns() - started) / 1000000 : 0;
+    stats->packets = __atomic_load_n(&selfstat.packets, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&selfstat.bytes, __ATOMIC_RELAXED);
+    stats->kernel_drops = __atomic_load_n(&selfstat.kernel_drops, __ATOMIC_RELAXED);
+    stats->recv_errors = __atomic_load_n(&selfstat.recv_errors, __ATOMIC_RELAXED);
+    stats->lock_waits = __atomic_load_n(&selfstat.lock_waits, __ATOMIC_RELAXED);
+    stats->lock_wait_ns = __atomic_load_n(&selfstat.lock_wait_ns, __ATOMIC_RELAXED);
+    stats->lock_wait_max_ns = __atomic_load_n(&selfstat.lock_wait_max_ns, __ATOMIC_RELAXED);
+    stats->process_max_ns = __atomic_load_n(&selfstat.process_max_ns, __ATOMIC_RELAXED);
+    stats->process_total_ns = __atomic_load_n(&selfstat.process_total_ns, __ATOMIC_RELAXED);
+    stats->ring_overflows = __atomic_load_n(&selfstat.ring_overflows, __ATOMIC_RELAXED);
+    stats->batches = __atomic_load_n(&selfstat.batches, __ATOMIC_RELAXED);
+    stats->ring_capacity = packet_ring.records ? packet_ring.mask + 1 : 0;
+    stats->ring_used = packet_ring.records ? capture_ring_used(&packet_ring) : 0;
+    stats->ring_max_used = __atomic_load_n(&selfstat.ring_max_used, __ATOMIC_RELAXED);
+    stats->busy_poll_us = busy_poll_us;
+    stats->backend = capture_backend;
+    stats->bpf_entries = __atomic_load_n(&selfstat.bpf_entries, __ATOMIC_RELAXED);
+    stats->bpf_misses = __atomic_load_n(&selfstat.bpf_misses, __ATOMIC_RELAXED);
+    stats->xdp_queues = __atomic_load_n(&selfstat.xdp_queues, __ATOMIC_RELAXED);
+    stats->xdp_flags = __atomic_load_n(&selfstat.xdp_flags, __ATOMIC_RELAXED);
+    stats->xdp_rx_dropped = __atomic_load_n(&selfstat.xdp_rx_dropped, __ATOMIC_RELAXED);
+    stats->xdp_rx_ring_full = __atomic_load_n(&selfstat.xdp_rx_ring_full, __ATOMIC_RELAXED);
+    stats->xdp_fill_ring_empty = __atomic_load_n(&selfstat.xdp_fill_ring_empty,
+                                                 __ATOMIC_RELAXED);
+    stats->xdp_invalid_descs = __atomic_load_n(&selfstat.xdp_invalid_descs, __ATOMIC_RELAXED);
+    stats->spin_packets = __atomic_load_n(&selfstat.spin_packets, __ATOMIC_RELAXED);
+    stats->recv_spin_ns = __atomic_load_n(&selfstat.recv_spin_ns, __ATOMIC_RELAXED);
+    stats->recv_work_ns = __atomic_load_n(&selfstat.recv_work_ns, __ATOMIC_RELAXED);
+    stats->aggregate_spin_ns = __atomic_load_n(&selfstat.aggregate_spin_ns, __ATOMIC_RELAXED);
+    stats->aggregate_work_ns = __atomic_load_n(&selfstat.aggregate_work_ns, __ATOMIC_RELAXED);
+    stats->busy_poll_fallbacks = __atomic_load_n(&selfstat.recv_fallbacks, __ATOMIC_RELAXED)
+                                 + __atomic_load_n(&selfstat.aggregate_fallbacks, __ATOMIC_RELAXED);
+    stats->running = __atomic_load_n(&capture_running, __ATOMIC_RELAXED);
+    stats->last_error = __atomic_load_n(&thread_last_error, __ATOMIC_RELAXED);
+    stats->hist_sub_bits = HIST_SUB_BITS;
+    stats->hist_buckets = HIST_BUCKETS;
+
+    for(uint32_t i = 0; hist && i < HIST_BUCKETS; ++i)
+        hist[i] = __atomic_load_n(&selfstat.hist[i], __ATOMIC_RELAXED);
+}
+
+void
+packet_get_load_progress(packet_load_progress *progress)
+{
+    pthread_mutex_lock(&load_mutex);
+    *progress = load_progress;
+    pthread_mutex_unlock(&load_mutex);
+}
+
+void
+packet_stats_load_wait(void)
+{
+    pthread_mutex_lock(&load_mutex);
+    while(load_in_progress())
+        pthread_cond_wait(&load_cond, &load_mutex);
+    pthread_mutex_unlock(&load_mutex);
 }
 
 void packet_stats_clear()
 {
-    tdestroy(g_stats.ip_stats_tree, ip_stat_delete);
+    pthread_mutex_lock(&stats_mutex);
+    counter_table_clear(&g_stats.table);
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+int
+packet_handoff_export(packet_handoff_state *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->capture_fd = -1;
+    state->table_fd = -1;
+
+    /* nothing to hand over before the first start */
+    if(!g_stats.table.hdr)
+        return 0;
+
+    /* Packets keep queueing in the socket while nobody reads it */
+    state->capturing = is_running(&stop_mutex) == 1;
+    if(state->capturing)
+        capture_thread_join();
+
+    /* a loaded snapshot has to be in the table before it is passed on */
+    packet_stats_load_wait();
+
+    /* same size, NUL-terminated by iface_stat_init() */
+    memcpy(state->ifname, g_stats.iface_str, IFNAMSIZ);
+    state->capture_fd = capture_socket;
+    state->table_fd = g_stats.table.fd;
+
+    return 0;
+}
+
+int
+packet_handoff_abort(const packet_handoff_state *state)
+{
+    if(!state->capturing)
+        return 0;
+
+    return capture_thread_start();
 }
 
+int
+packet_handoff_import(const packet_handoff_state *state)
+{
+    int err;
+
+    if(state->table_fd < 0)
+        return 0; /* the old daemon was never started */
+
+    strncpy(g_stats.iface_str, state->ifname, IFNAMSIZ - 1);
+    g_stats.iface_str[IFNAMSIZ - 1] = '\0';
+
+    err = counter_table_adopt(&g_stats.table, state->table_fd, SHM_TABLE_NAME);
+    if(err)
+    {
+        syslog(LOG_ERR, "counter table adoption failed: %s", strerror(err));
+        return err;
+    }
+
+    placement_select_node(g_stats.iface_str);
+    err = counter_table_place(&g_stats.table);
+    if(err)
+        syslog(LOG_WARNING, "counter table placement failed: %s", strerror(err));
+
+    /* the table already holds the saved stats */
+    pthread_mutex_lock(&load_mutex);
+    load_progress.state = LOAD_DONE;
+    pthread_mutex_unlock(&load_mutex);
+
+    /* taken over from a socket or bpf daemon, not needed by xdp */
+    capture_socket = state->capture_fd;
+    if(capture_socket >= 0 && capture_backend == CAPTURE_BACKEND_XDP)
+    {
+        close(capture_socket);
+        capture_socket = -1;
+    }
+    if(capture_socket >= 0)
+        capture_socket_busy_poll();
+    if(!state->capturing)
+        return 0;
+
+    return capture_thread_start();
+}
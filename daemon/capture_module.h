@@ -10,6 +10,9 @@
 #ifndef CAPTURE_MODULE_H
 #define CAPTURE_MODULE_H
 
+/* Saved stats and their history live here */
+#define STATSDIR "/var/tmp/netsniffd"
+
 typedef struct s_ip_stats
 {
     char ip[INET_ADDRSTRLEN];
@@ -23,6 +26,46 @@ typedef struct s_iface_stats
     size_t size;
 } packet_interface_stats;
 
+/**
+ * @struct s_load_progress
+ * @typedef packet_load_progress
+ * @brief Progress of the background stats load.
+ *
+ * state is one of load_state from custom_com_def.h.
+ */
+typedef struct s_load_progress
+{
+    uint32_t state;
+    int32_t error;
+    uint64_t bytes_total;
+    uint64_t bytes_done;
+    uint64_t entries;
+} packet_load_progress;
+
+/**
+ * @struct s_capture_info
+ * @typedef packet_capture_info
+ * @brief State of the capture thread, see packet_get_capture_info().
+ */
+typedef struct s_capture_info
+{
+    int running;
+    int last_error;     /* errno code of the last failed receive, or 0 */
+} packet_capture_info;
+
+/**
+ * @struct s_handoff_state
+ * @typedef packet_handoff_state
+ * @brief Capture state passed from a running daemon to its replacement.
+ */
+typedef struct s_handoff_state
+{
+    char ifname[IFNAMSIZ];
+    int capturing;      /* capture thread was running */
+    int capture_fd;     /* capture socket, -1 if none, always with xdp */
+    int table_fd;       /* counter table segment, -1 if none */
+} packet_handoff_state;
+
 /**
  * @fn packet_capture_loop
  * @brief
@@ -31,6 +74,74 @@ typedef struct s_iface_stats
 int
 packet_capture_start();
 
+/* in-kernel counts of the bpf backend are read into the table this often */
+#define CAPTURE_BPF_INTERVAL_MS 100
+
+/**
+ * @fn packet_set_backend
+ * @brief Choose how packets are counted, from the next start.
+ *
+ * "socket", the default, receives every packet in the capture thread.
+ * "bpf" counts packets in the kernel with an eBPF socket filter on the
+ * capture socket, see bpf_module.h; nothing is copied to user space
+ * and the table is updated every CAPTURE_BPF_INTERVAL_MS.
+ * "xdp" receives IPv4 TCP frames of the interface on AF_XDP sockets,
+ * see xdp_module.h, and counts them as the socket backend does. The
+ * frames no longer reach the network stack, and those coming during a
+ * takeover are not counted. Busy polling applies to the socket and xdp
+ * backends.
+ *
+ * @return 0 on success or EINVAL for an unknown backend.
+ */
+int
+packet_set_backend(const char *name);
+
+/**
+ * @fn packet_set_xdp_mode
+ * @brief Choose where the xdp backend runs its program, from the next
+ *        start.
+ *
+ * "auto", the default, tries the driver and falls back to generic XDP.
+ * "native" fails if the driver has no XDP support, "generic" works on
+ * any interface but copies every frame.
+ *
+ * @return 0 on success or EINVAL for an unknown mode.
+ */
+int
+packet_set_xdp_mode(const char *name);
+
+/* interface captured unless packet_set_capture_iface() chose another */
+#define DEFAULT_IFACE "ens33"
+
+/**
+ * @fn packet_set_capture_iface
+ * @brief Set the interface captured from the first start on.
+ *
+ * A daemon taking over keeps the interface of the one it replaces.
+ *
+ * @return 0 on success or EINVAL if the name is not a valid interface
+ *         name.
+ */
+int
+packet_set_capture_iface(const char *iface_str);
+
+/**
+ * @fn packet_set_busy_poll
+ * @brief Spin instead of sleeping while packets keep coming.
+ *
+ * Both capture threads poll without blocking, each using a CPU, so a
+ * packet is received and counted without wakeup latency. A thread that
+ * sees no traffic for usec falls back to blocking until the next packet.
+ * usec is also set as SO_BUSY_POLL on the capture socket. Takes effect
+ * at the next start.
+ *
+ * @param usec  0 (the default) never spins, at most 1000000.
+ *
+ * @return 0 on success or EINVAL if usec is out of range.
+ */
+int
+packet_set_busy_poll(unsigned usec);
+
 /**
  * @fn packet_set_iface
  * @brief
@@ -63,6 +174,130 @@ packet_set_iface(const char* iface_str);
 int
 packet_get_iface_stats(packet_interface_stats **stats_out, size_t *stats_size_out, const char* iface_str);
 
+/**
+ * @brief Buffer provider of packet_stats_export().
+ *
+ * Called under the stats lock. Must set *entries to room for count
+ * records and return 0, or return an error code.
+ */
+typedef int (*packet_stats_alloc_fn)(void *ctx, size_t count, dopt_stat_entry **entries);
+
+/**
+ * @fn packet_stats_export
+ * @brief Copy all entries as packed records, in table order.
+ *
+ * While saved stats are merged, their entries that are not in the
+ * table yet are added in, so alloc may be asked for more records than
+ * are written.
+ *
+ * @param iface_str     Interface name, NULL for the current one.
+ * @param alloc         Provides the buffer the records are written to,
+ *                      so they can be placed right where they are sent from.
+ * @param ctx           Passed to alloc.
+ * @param header        Receives the totals and the interface name.
+ *
+ * @return 0 on success or an error code on failure. ENODEV if
+ *         iface_str is not the sniffed interface.
+ */
+int
+packet_stats_export(const char *iface_str, packet_stats_alloc_fn alloc, void *ctx,
+                    dopt_stat_v2_header *header);
+
+/**
+ * @fn packet_stats_page
+ * @brief Copy the entries of the next slots of the table.
+ *
+ * @param cursor    0 to start, otherwise a cursor returned before.
+ * @param max       Most entries to copy, alloc is asked for this many.
+ * @param count     Receives the number of entries copied.
+ * @param next      Receives the cursor of the next page, 0 at the end.
+ *
+ * A bounded number of slots is scanned per call, so the stats lock is
+ * held for a short time even on a sparse table.
+ *
+ * While saved stats are merged, walks go over a merged copy of the
+ * table made when they start, or shared with walks started less than
+ * a second before.
+ *
+ * @return 0 on success or an error code on failure. ESTALE if the
+ *         table was resized or cleared since the cursor was issued,
+ *         or the copy was remade for a later walk.
+ */
+int
+packet_stats_page(uint64_t cursor, uint32_t max, packet_stats_alloc_fn alloc, void *ctx,
+                  uint32_t *count, uint64_t *next);
+
+/**
+ * @fn packet_stats_query
+ * @brief Run a DOPT_QUERY against the table.
+ *
+ * The matching entries are copied under the stats lock, then selected
+ * and sorted after it is released. alloc is called without the lock,
+ * for the rows to send only. While saved stats are merged, their
+ * entries that are not in the table yet are added in, as
+ * packet_get_ip_counts() does.
+ *
+ * @param result    Receives the totals of the matches and the number
+ *                  of rows written.
+ *
+ * @return 0 on success or an error code on failure. EINVAL if the
+ *         query is malformed.
+ */
+int
+packet_stats_query(const dopt_query *query, packet_stats_alloc_fn alloc, void *ctx,
+                   dopt_query_result *result);
+
+/**
+ * @fn packet_stats_snapshot_fd
+ * @brief Copy the table into a new sealed memfd.
+ *
+ * @param fd_out    Receives the descriptor, owned by the caller.
+ * @param info      Receives the size and totals of the copy.
+ *
+ * The copy has the layout of the shared table and is taken under the
+ * stats lock, so it is consistent. It is sealed against writes, so
+ * receivers can trust it does not change under them. While saved
+ * stats are merged, the copy is rebuilt with their entries that are
+ * not in the table yet added in.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+packet_stats_snapshot_fd(int *fd_out, dopt_snapshot_info *info);
+
+/**
+ * @fn packet_stats_track
+ * @brief Start or stop tracking changed counters for packet_stats_changes().
+ * @return 0 on success or an error code on failure.
+ */
+int
+packet_stats_track(int enable);
+
+/**
+ * @brief Provides room for changed counters, see packet_stats_changes().
+ *
+ * Called under the stats lock with an upper bound of their number.
+ * Must set *entries to room for count records and return 0, or return
+ * an error code.
+ */
+typedef int (*packet_changes_alloc_fn)(void *ctx, size_t count, dopt_watch_entry **entries);
+
+/**
+ * @fn packet_stats_changes
+ * @brief Copy the counters changed since the previous call.
+ *
+ * Only the marked slots are visited, so the stats lock is held for a
+ * time proportional to the number of changes. Tracking must be
+ * enabled with packet_stats_track().
+ *
+ * @param header    Receives the number of entries, the totals and
+ *                  DOPT_WATCH_RESET if the stats were cleared.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+packet_stats_changes(packet_changes_alloc_fn alloc, void *ctx, dopt_watch_header *header);
+
 /**
  * @fn packet_ip_stats
  * @brief
@@ -83,6 +318,18 @@ packet_get_ip_stats(const char* ip_str, packet_ip_stats *stats);
 int
 packet_get_ip_count(const char* ip_str);
 
+/**
+ * @fn packet_get_ip_counts
+ * @brief Get packet counts of many IPv4 addresses at once.
+ * @param addrs     Addresses in network byte order.
+ * @param count     Number of addresses.
+ * @param counts    Receives count values, 0 for addresses not found.
+ *
+ * Takes the stats lock once for the whole batch.
+ */
+void
+packet_get_ip_counts(const uint32_t *addrs, size_t count, uint64_t *counts);
+
 /**
  * @fn packet_capture_stop
  * @brief
@@ -91,6 +338,79 @@ packet_get_ip_count(const char* ip_str);
 int
 packet_capture_stop();
 
+/**
+ * @fn packet_get_capture_info
+ * @brief Get the state of the capture thread, from any thread.
+ */
+void
+packet_get_capture_info(packet_capture_info *info);
+
+/**
+ * @fn packet_get_selfstat
+ * @brief Read the health counters of the capture thread, from any thread.
+ *
+ * The counters are always on. The capture thread updates them without
+ * locking and times only what it has to, so they cost a few clock
+ * reads per packet.
+ *
+ * @param hist  Receives the histogram of per-packet processing time,
+ *              from the return of recvmsg() until the packet is
+ *              counted, lock wait included. See hist_def.h. May
+ *              be NULL.
+ */
+void
+packet_get_selfstat(dopt_selfstat *stats, uint64_t hist[HIST_BUCKETS]);
+
+/**
+ * @fn packet_get_load_progress
+ * @brief Get progress of loading saved stats.
+ *
+ * Saved stats are loaded in background after the first start, while
+ * capture is already running. Until they are merged, queries add
+ * counts from both the saved and the live stats.
+ */
+void
+packet_get_load_progress(packet_load_progress *progress);
+
+/**
+ * @fn packet_stats_load_wait
+ * @brief Wait until saved stats are loaded and merged.
+ */
+void
+packet_stats_load_wait(void);
+
+/**
+ * @fn packet_handoff_export
+ * @brief Pause capture and describe the state to hand over.
+ *
+ * The capture thread is stopped but the capture socket is kept open,
+ * so packets are queued by the kernel until the new daemon reads them.
+ * Stats are not dumped.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+packet_handoff_export(packet_handoff_state *state);
+
+/**
+ * @fn packet_handoff_abort
+ * @brief Resume capture after a failed handoff.
+ */
+int
+packet_handoff_abort(const packet_handoff_state *state);
+
+/**
+ * @fn packet_handoff_import
+ * @brief Adopt the state received from the previous daemon.
+ *
+ * Maps the counter table as is and restarts capture on the received
+ * socket if it was running. Nothing is loaded from disk.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+packet_handoff_import(const packet_handoff_state *state);
+
 /**
  * @fn packet_stats_clear
  * @brief
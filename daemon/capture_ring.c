@@ -0,0 +1,111 @@
+/*
+ * Ring between the receive and aggregation stages of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include "stdafx.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+
+int
+capture_ring_create(capture_ring *ring, uint32_t capacity)
+{
+    uint32_t slots = 1;
+    int err;
+
+    while(slots < capacity && slots)
+        slots <<= 1;
+    if(!slots)
+        return EINVAL;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->mask = slots - 1;
+
+    /* !!! malloc !!! */
+    /* page aligned, so the records can be bound to a NUMA node */
+    err = posix_memalign((void **) &ring->records, sysconf(_SC_PAGESIZE),
+                         (size_t) slots * sizeof(*ring->records));
+    if(err)
+        return err;
+
+    ring->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(ring->event_fd == -1)
+    {
+        err = errno;
+        free(ring->records);
+        ring->records = NULL;
+        return err;
+    }
+
+    return 0;
+}
+
+void
+capture_ring_destroy(capture_ring *ring)
+{
+    if(!ring->records)
+        return;
+
+    close(ring->event_fd);
+    free(ring->records);
+    memset(ring, 0, sizeof(*ring));
+}
+
+void
+capture_ring_reset(capture_ring *ring)
+{
+    uint64_t value;
+
+    /* indexes carry on, the ring is empty */
+    ring->head_cache = ring->head;
+    ring->tail_cache = ring->tail;
+    ring->waiting = 0;
+    __atomic_store_n(&ring->closing, 0, __ATOMIC_RELAXED);
+    if(read(ring->event_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+        syslog(LOG_WARNING, "ring eventfd: %s", strerror(errno));
+}
+
+void
+capture_ring_signal(capture_ring *ring)
+{
+    uint64_t one = 1;
+
+    /* EAGAIN means the counter is full, the consumer is woken anyway */
+    if(write(ring->event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        syslog(LOG_WARNING, "ring eventfd: %s", strerror(errno));
+}
+
+void
+capture_ring_wait(capture_ring *ring, uint32_t wake_at, int timeout_ms)
+{
+    struct pollfd pfd = { ring->event_fd, POLLIN, 0 };
+    uint64_t value;
+
+    if(!wake_at)
+        wake_at = 1;
+    __atomic_store_n(&ring->waiting, wake_at, __ATOMIC_RELAXED);
+    /* pairs with the fence in capture_ring_notify() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) - ring->head < wake_at
+       && !__atomic_load_n(&ring->closing, __ATOMIC_RELAXED))
+        poll(&pfd, 1, timeout_ms);
+
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+
+    /* take the wakeups, whether we slept or not */
+    if(read(ring->event_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+        syslog(LOG_WARNING, "ring eventfd: %s", strerror(errno));
+}
+
+void
+capture_ring_close(capture_ring *ring)
+{
+    __atomic_store_n(&ring->closing, 1, __ATOMIC_RELEASE);
+    capture_ring_signal(ring);
+}
@@ -0,0 +1,203 @@
+/*
+ * Header for the ring between the receive and aggregation stages of
+ * netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef CAPTURE_RING_H
+#define CAPTURE_RING_H
+
+#include <stdint.h>
+#include <errno.h>
+
+#define CAPTURE_RING_CACHELINE 64
+
+/**
+ * @struct s_capture_record
+ * @typedef capture_record
+ * @brief What the aggregation stage needs to know of a packet.
+ */
+typedef struct s_capture_record
+{
+    uint32_t addr;      /* source, network byte order */
+    uint32_t size;      /* bytes received */
+    uint64_t recv_ns;   /* CLOCK_MONOTONIC when recvmsg() returned */
+} capture_record;
+
+/**
+ * @struct s_capture_ring
+ * @typedef capture_ring
+ * @brief Lock-free single-producer, single-consumer queue of records.
+ *
+ * head and tail run freely and wrap at 2^32, the slot of an index is
+ * index & mask. Each side keeps its own copy of the other's index and
+ * reads the shared one only when the copy runs short, so the cache
+ * lines are not passed back and forth per record.
+ * A consumer with nothing to do sleeps on an eventfd. It tells how
+ * many records are worth waking up for, and the producer writes the
+ * eventfd only once that many are queued, so a busy ring costs no
+ * wakeup per record.
+ */
+typedef struct s_capture_ring
+{
+    /* written by the producer */
+    uint32_t tail __attribute__((aligned(CAPTURE_RING_CACHELINE)));
+    uint32_t head_cache;
+
+    /* written by the consumer */
+    uint32_t head __attribute__((aligned(CAPTURE_RING_CACHELINE)));
+    uint32_t tail_cache;
+    uint32_t waiting;   /* records to wake the consumer at, 0 if awake */
+
+    /* set once */
+    int closing __attribute__((aligned(CAPTURE_RING_CACHELINE)));
+    int event_fd;
+    uint32_t mask;
+    capture_record *records;
+} capture_ring;
+
+/**
+ * @fn capture_ring_create
+ * @param capacity  Records, rounded up to a power of two.
+ * @return 0 on success or an error code on failure.
+ */
+int
+capture_ring_create(capture_ring *ring, uint32_t capacity);
+
+/**
+ * @fn capture_ring_destroy
+ */
+void
+capture_ring_destroy(capture_ring *ring);
+
+/**
+ * @fn capture_ring_reset
+ * @brief Reopen a drained and closed ring for a new producer and consumer.
+ */
+void
+capture_ring_reset(capture_ring *ring);
+
+/**
+ * @fn capture_ring_signal
+ * @brief Wake the consumer, see capture_ring_notify().
+ */
+void
+capture_ring_signal(capture_ring *ring);
+
+/**
+ * @fn capture_ring_wait
+ * @brief Sleep until wake_at records are queued, the ring is closed or
+ *        the timeout expires. Consumer only.
+ */
+void
+capture_ring_wait(capture_ring *ring, uint32_t wake_at, int timeout_ms);
+
+/**
+ * @fn capture_ring_close
+ * @brief Tell the consumer no more records come. Called once the
+ *        producer is gone.
+ */
+void
+capture_ring_close(capture_ring *ring);
+
+/**
+ * @fn capture_ring_push
+ * @brief Queue a record. Producer only.
+ * @return 0 on success or ENOBUFS if the ring is full.
+ */
+static inline int
+capture_ring_push(capture_ring *ring, const capture_record *record)
+{
+    uint32_t tail = ring->tail;
+
+    if(tail - ring->head_cache > ring->mask)
+    {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if(tail - ring->head_cache > ring->mask)
+            return ENOBUFS;
+    }
+
+    ring->records[tail & ring->mask] = *record;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @fn capture_ring_notify
+ * @brief Wake the consumer if it sleeps, after records were pushed.
+ *        Producer only.
+ */
+static inline void
+capture_ring_notify(capture_ring *ring)
+{
+    uint32_t wake_at;
+
+    /* pairs with the fence in capture_ring_wait(): either the consumer
+       sees the new tail, or we see it waiting */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    wake_at = __atomic_load_n(&ring->waiting, __ATOMIC_RELAXED);
+    /* head is only read while the consumer sleeps and cannot move it */
+    if(wake_at && ring->tail - __atomic_load_n(&ring->head, __ATOMIC_RELAXED) >= wake_at)
+        capture_ring_signal(ring);
+}
+
+/**
+ * @fn capture_ring_peek
+ * @brief Get the oldest records, without removing them. Consumer only.
+ *
+ * @param records   Receives the first record, the others follow it.
+ * @param max       Most records wanted.
+ * @param used      Optional, receives the number of records queued.
+ *
+ * @return number of records, 0 if the ring is empty.
+ */
+static inline uint32_t
+capture_ring_peek(capture_ring *ring, capture_record **records, uint32_t max,
+                  uint32_t *used)
+{
+    uint32_t head = ring->head, avail, contiguous;
+
+    if(ring->tail_cache - head < max)
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    avail = ring->tail_cache - head;
+    if(used)
+        *used = avail;
+
+    /* records do not wrap around the end of the array */
+    contiguous = ring->mask + 1 - (head & ring->mask);
+    if(avail > contiguous)
+        avail = contiguous;
+    if(avail > max)
+        avail = max;
+
+    *records = &ring->records[head & ring->mask];
+    return avail;
+}
+
+/**
+ * @fn capture_ring_consume
+ * @brief Give n peeked records back to the producer. Consumer only.
+ */
+static inline void
+capture_ring_consume(capture_ring *ring, uint32_t n)
+{
+    __atomic_store_n(&ring->head, ring->head + n, __ATOMIC_RELEASE);
+}
+
+/**
+ * @fn capture_ring_used
+ * @return records queued, from any thread.
+ */
+static inline uint32_t
+capture_ring_used(const capture_ring *ring)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    return __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) - head;
+}
+
+#endif // CAPTURE_RING_H
@@ -0,0 +1,548 @@
+/*
+ * Per-IP counter table of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include "stdafx.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* lookups prefetched together by counter_table_get_batch() */
+#define COUNTER_TABLE_PROBE_GROUP 16
+
+/* grow when more than 3/4 of the slots are taken */
+#define COUNTER_TABLE_FULL(entries, capacity) ((entries) * 4 >= (uint64_t)(capacity) * 3)
+
+static void
+seq_write_begin(shm_table_header *hdr)
+{
+    __atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+seq_write_end(shm_table_header *hdr)
+{
+    __atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Insert into a table known not to contain addr, nothing is published.
+ * Returns the slot used. */
+static uint32_t
+slot_insert_raw(shm_table_entry *slots, uint32_t mask, uint32_t addr, uint64_t count)
+{
+    uint32_t i = shm_table_hash(addr) & mask;
+    while(slots[i].count)
+        i = (i + 1) & mask;
+
+    slots[i].addr = addr;
+    slots[i].count = count;
+    return i;
+}
+
+/*******************/
+/* Change tracking */
+/*******************/
+
+/* capacity is a power of two of at least COUNTER_TABLE_MIN_CAPACITY */
+#define TRACK_WORDS(capacity) ((capacity) / 64)
+#define TRACK_SUMMARY_WORDS(capacity) ((TRACK_WORDS(capacity) + 63) / 64)
+
+static int
+track_alloc(uint32_t capacity, uint64_t **dirty, uint64_t **summary, uint64_t **base)
+{
+    /* !!! calloc !!! */
+    *dirty = calloc(TRACK_WORDS(capacity), sizeof(**dirty));
+    *summary = calloc(TRACK_SUMMARY_WORDS(capacity), sizeof(**summary));
+    *base = calloc(capacity, sizeof(**base));
+    if(*dirty && *summary && *base)
+        return 0;
+
+    free(*dirty);
+    free(*summary);
+    free(*base);
+    return ENOMEM;
+}
+
+static void
+track_free(counter_table *table)
+{
+    free(table->dirty);
+    free(table->dirty_summary);
+    free(table->base);
+    table->dirty = table->dirty_summary = table->base = NULL;
+    table->dirty_count = 0;
+    table->reset = 0;
+}
+
+static inline int
+track_set(uint64_t *dirty, uint64_t *summary, uint32_t i)
+{
+    uint64_t bit = 1ULL << (i & 63);
+
+    if(dirty[i / 64] & bit)
+        return 0;
+
+    dirty[i / 64] |= bit;
+    summary[i / 4096] |= 1ULL << (i / 64 & 63);
+    return 1;
+}
+
+static inline void
+track_mark(counter_table *table, uint32_t i)
+{
+    if(table->dirty && track_set(table->dirty, table->dirty_summary, i))
+        ++table->dirty_count;
+}
+
+static int
+counter_table_grow(counter_table *table)
+{
+    uint32_t old_capacity = table->hdr->capacity;
+    uint32_t new_capacity = old_capacity * 2;
+    size_t new_size = SHM_TABLE_SIZE(new_capacity);
+    shm_table_entry *old_slots;
+    uint64_t *dirty = NULL, *summary = NULL, *base = NULL;
+    void *mem;
+    int err;
+
+    if(!new_capacity)
+        return ENOSPC;
+
+    /* tracked changes move along with their slots */
+    if(table->dirty && track_alloc(new_capacity, &dirty, &summary, &base))
+        return ENOMEM;
+
+    /* !!! malloc !!! */
+    old_slots = malloc(old_capacity * sizeof(*old_slots));
+    if(!old_slots)
+    {
+        err = ENOMEM;
+        goto fail;
+    }
+    memcpy(old_slots, table->slots, old_capacity * sizeof(*old_slots));
+
+    if(ftruncate(table->fd, new_size))
+    {
+        err = errno;
+        goto fail;
+    }
+
+    mem = mremap(table->hdr, table->map_size, new_size, MREMAP_MAYMOVE);
+    if(mem == MAP_FAILED)
+    {
+        err = errno;
+        goto fail;
+    }
+
+    table->hdr = mem;
+    table->slots = SHM_TABLE_SLOTS(mem);
+    table->map_size = new_size;
+
+    /* the policy covers the old size only, extend it before the new
+       slots are touched */
+    if(table->placed)
+    {
+        err = placement_bind(table->hdr, new_size);
+        if(err)
+            syslog(LOG_WARNING, "counter table placement failed: %s", strerror(err));
+    }
+
+    /* readers wait until the layout is rebuilt */
+    seq_write_begin(table->hdr);
+    memset(table->slots, 0, new_capacity * sizeof(*table->slots));
+    for(uint32_t i = 0; i < old_capacity; ++i)
+    {
+        uint32_t j;
+
+        if(!old_slots[i].count)
+            continue;
+
+        j = slot_insert_raw(table->slots, new_capacity - 1,
+                            old_slots[i].addr, old_slots[i].count);
+        if(dirty)
+        {
+            base[j] = table->base[i];
+            if(table->dirty[i / 64] & 1ULL << (i & 63))
+                track_set(dirty, summary, j);
+        }
+    }
+    table->hdr->map_size = new_size;
+    table->hdr->capacity = new_capacity;
+    seq_write_end(table->hdr);
+
+    if(dirty)
+    {
+        free(table->dirty);
+        free(table->dirty_summary);
+        free(table->base);
+        table->dirty = dirty;
+        table->dirty_summary = summary;
+        table->base = base;
+    }
+
+    free(old_slots);
+    return 0;
+
+fail:
+    free(old_slots);
+    free(dirty);
+    free(summary);
+    free(base);
+    return err;
+}
+
+int
+counter_table_create(counter_table *table, const char *shm_name, uint32_t capacity)
+{
+    uint32_t slots = COUNTER_TABLE_MIN_CAPACITY;
+    size_t size;
+    int err;
+
+    while(slots < capacity && slots)
+        slots <<= 1;
+    if(!slots)
+        return EINVAL;
+    size = SHM_TABLE_SIZE(slots);
+
+    memset(table, 0, sizeof(*table));
+    if(shm_name)
+    {
+        strncpy(table->name, shm_name, NAME_MAX - 1);
+        table->fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    else
+    {
+        table->fd = memfd_create("netsniffd.table", MFD_CLOEXEC);
+    }
+
+    if(table->fd < 0)
+        return errno;
+
+    if(ftruncate(table->fd, size))
+        goto fail;
+
+    table->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, table->fd, 0);
+    if(table->hdr == MAP_FAILED)
+        goto fail;
+
+    table->slots = SHM_TABLE_SLOTS(table->hdr);
+    table->map_size = size;
+
+    table->hdr->version = SHM_TABLE_VERSION;
+    table->hdr->capacity = slots;
+    table->hdr->map_size = size;
+    /* the magic is published last, readers check it */
+    __atomic_store_n(&table->hdr->magic, SHM_TABLE_MAGIC, __ATOMIC_RELEASE);
+
+    return 0;
+
+fail:
+    err = errno;
+    close(table->fd);
+    if(shm_name)
+        shm_unlink(shm_name);
+    return err;
+}
+
+int
+counter_table_adopt(counter_table *table, int fd, const char *shm_name)
+{
+    struct stat st;
+
+    memset(table, 0, sizeof(*table));
+    if(fstat(fd, &st))
+        return errno;
+
+    if((size_t) st.st_size < sizeof(shm_table_header))
+        return EINVAL;
+
+    table->hdr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(table->hdr == MAP_FAILED)
+    {
+        table->hdr = NULL;
+        return errno;
+    }
+
+    if(table->hdr->magic != SHM_TABLE_MAGIC
+       || table->hdr->version != SHM_TABLE_VERSION
+       || SHM_TABLE_SIZE(table->hdr->capacity) > (size_t) st.st_size)
+    {
+        munmap(table->hdr, st.st_size);
+        table->hdr = NULL;
+        return EPROTO;
+    }
+
+    table->slots = SHM_TABLE_SLOTS(table->hdr);
+    table->map_size = st.st_size;
+    table->fd = fd;
+    if(shm_name)
+        strncpy(table->name, shm_name, NAME_MAX - 1);
+
+    return 0;
+}
+
+void
+counter_table_destroy(counter_table *table)
+{
+    if(!table->hdr)
+        return;
+
+    munmap(table->hdr, table->map_size);
+    close(table->fd);
+    if(table->name[0])
+        shm_unlink(table->name);
+    track_free(table);
+
+    memset(table, 0, sizeof(*table));
+}
+
+int
+counter_table_add(counter_table *table, uint32_t addr, uint64_t n, int *inserted)
+{
+    shm_table_header *hdr = table->hdr;
+    uint32_t mask = hdr->capacity - 1;
+    uint32_t i = shm_table_hash(addr) & mask;
+
+    if(inserted)
+        *inserted = 0;
+
+    for(;;)
+    {
+        shm_table_entry *slot = &table->slots[i];
+        if(!slot->count)
+            break;
+        if(slot->addr == addr)
+        {
+            /* single writer: a plain increment published atomically */
+            __atomic_store_n(&slot->count, slot->count + n, __ATOMIC_RELAXED);
+            __atomic_store_n(&hdr->packets, hdr->packets + n, __ATOMIC_RELAXED);
+            track_mark(table, i);
+            NETSNIFF_PROBE2(table__hit, addr, slot->count);
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
+
+    if(COUNTER_TABLE_FULL(hdr->entries + 1, hdr->capacity))
+    {
+        int err;
+
+        NETSNIFF_PROBE2(table__resize__start, hdr->capacity, hdr->entries);
+        err = counter_table_grow(table);
+        NETSNIFF_PROBE2(table__resize__done, table->hdr->capacity, err);
+        if(err)
+            return err;
+
+        hdr = table->hdr;
+        mask = hdr->capacity - 1;
+        i = shm_table_hash(addr) & mask;
+        while(table->slots[i].count)
+            i = (i + 1) & mask;
+    }
+
+    /* address first, the count makes the slot visible */
+    table->slots[i].addr = addr;
+    __atomic_store_n(&table->slots[i].count, n, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->entries, hdr->entries + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hdr->packets, hdr->packets + n, __ATOMIC_RELAXED);
+    track_mark(table, i);
+    NETSNIFF_PROBE2(table__insert, addr, hdr->entries);
+
+    if(inserted)
+        *inserted = 1;
+
+    return 0;
+}
+
+uint64_t
+counter_table_get(const counter_table *table, uint32_t addr)
+{
+    if(!table->hdr)
+        return 0;
+
+    return shm_table_lookup(table->hdr, table->hdr->capacity, addr);
+}
+
+void
+counter_table_get_batch(const counter_table *table, const uint32_t *addrs,
+                        size_t count, uint64_t *counts)
+{
+    uint32_t home[COUNTER_TABLE_PROBE_GROUP];
+    uint32_t mask;
+
+    if(!table->hdr)
+    {
+        memset(counts, 0, count * sizeof(*counts));
+        return;
+    }
+
+    mask = table->hdr->capacity - 1;
+    for(size_t base = 0; base < count; base += COUNTER_TABLE_PROBE_GROUP)
+    {
+        size_t group = count - base < COUNTER_TABLE_PROBE_GROUP
+                       ? count - base : COUNTER_TABLE_PROBE_GROUP;
+
+        for(size_t i = 0; i < group; ++i)
+        {
+            home[i] = shm_table_hash(addrs[base + i]) & mask;
+            __builtin_prefetch(&table->slots[home[i]]);
+        }
+
+        for(size_t i = 0; i < group; ++i)
+        {
+            uint32_t addr = addrs[base + i];
+            uint32_t j = home[i];
+
+            counts[base + i] = 0;
+            while(table->slots[j].count)
+            {
+                if(table->slots[j].addr == addr)
+                {
+                    counts[base + i] = table->slots[j].count;
+                    break;
+                }
+                j = (j + 1) & mask;
+            }
+        }
+    }
+}
+
+const shm_table_entry *
+counter_table_find(const counter_table *table, uint32_t addr)
+{
+    uint32_t mask, i;
+
+    if(!table->hdr)
+        return NULL;
+
+    mask = table->hdr->capacity - 1;
+    i = shm_table_hash(addr) & mask;
+    while(table->slots[i].count)
+    {
+        if(table->slots[i].addr == addr)
+            return &table->slots[i];
+        i = (i + 1) & mask;
+    }
+
+    return NULL;
+}
+
+void
+counter_table_clear(counter_table *table)
+{
+    if(!table->hdr)
+        return;
+
+    seq_write_begin(table->hdr);
+    memset(table->slots, 0, table->hdr->capacity * sizeof(*table->slots));
+    table->hdr->entries = 0;
+    table->hdr->packets = 0;
+    seq_write_end(table->hdr);
+
+    if(table->dirty)
+    {
+        uint32_t capacity = table->hdr->capacity;
+
+        memset(table->dirty, 0, TRACK_WORDS(capacity) * sizeof(*table->dirty));
+        memset(table->dirty_summary, 0,
+               TRACK_SUMMARY_WORDS(capacity) * sizeof(*table->dirty_summary));
+        memset(table->base, 0, capacity * sizeof(*table->base));
+        table->dirty_count = 0;
+        table->reset = 1;
+    }
+}
+
+int
+counter_table_track(counter_table *table, int enable)
+{
+    uint32_t capacity;
+
+    if(!enable)
+    {
+        track_free(table);
+        return 0;
+    }
+
+    if(table->dirty || !table->hdr)
+        return 0;
+
+    capacity = table->hdr->capacity;
+    if(track_alloc(capacity, &table->dirty, &table->dirty_summary, &table->base))
+        return ENOMEM;
+
+    /* changes count from now on */
+    for(uint32_t i = 0; i < capacity; ++i)
+        table->base[i] = table->slots[i].count;
+
+    return 0;
+}
+
+size_t
+counter_table_collect(counter_table *table, counter_change_fn fn, void *ctx, int *reset)
+{
+    size_t reported = 0;
+    size_t summary_words;
+
+    if(reset)
+        *reset = table->reset;
+    table->reset = 0;
+
+    if(!table->dirty)
+        return 0;
+
+    /* only words with a mark are visited */
+    summary_words = TRACK_SUMMARY_WORDS(table->hdr->capacity);
+    for(size_t s = 0; s < summary_words; ++s)
+    {
+        uint64_t words = table->dirty_summary[s];
+
+        table->dirty_summary[s] = 0;
+        while(words)
+        {
+            size_t w = s * 64 + __builtin_ctzll(words);
+            uint64_t bits = table->dirty[w];
+
+            words &= words - 1;
+            table->dirty[w] = 0;
+            while(bits)
+            {
+                uint32_t i = w * 64 + __builtin_ctzll(bits);
+                const shm_table_entry *slot = &table->slots[i];
+
+                bits &= bits - 1;
+                if(slot->count == table->base[i])
+                    continue;
+
+                fn(ctx, slot->addr, slot->count, slot->count - table->base[i]);
+                table->base[i] = slot->count;
+                ++reported;
+            }
+        }
+    }
+
+    table->dirty_count = 0;
+    return reported;
+}
+
+int
+counter_table_place(counter_table *table)
+{
+    table->placed = 1;
+    return placement_bind(table->hdr, table->map_size);
+}
+
+void
+counter_table_set_ifname(counter_table *table, const char *ifname)
+{
+    seq_write_begin(table->hdr);
+    strncpy(table->hdr->ifname, ifname, IFNAMSIZ - 1);
+    table->hdr->ifname[IFNAMSIZ - 1] = '\0';
+    seq_write_end(table->hdr);
+}
@@ -0,0 +1,174 @@
+/*
+ * Header for per-IP counter table of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef COUNTER_TABLE_H
+#define COUNTER_TABLE_H
+
+#include "shm_table_def.h"
+
+#define COUNTER_TABLE_MIN_CAPACITY 1024
+
+/**
+ * @struct s_counter_table
+ * @typedef counter_table
+ * @brief Hash table of per-IP counters in a shared memory segment.
+ *
+ * Layout is described in shared/shm_table_def.h. Only one thread may
+ * modify a table, readers use the lock-free protocol from that header.
+ */
+typedef struct s_counter_table
+{
+    shm_table_header *hdr;
+    shm_table_entry *slots;
+    size_t map_size;
+    int fd;
+    char name[NAME_MAX];
+
+    /* change tracking, private to the process, see counter_table_track() */
+    uint64_t *dirty;            /* bit per slot changed since the last collect */
+    uint64_t *dirty_summary;    /* bit per nonzero word of dirty */
+    uint64_t *base;             /* count of every slot at the last collect */
+    size_t dirty_count;
+    int reset;                  /* cleared since the last collect */
+
+    int placed;                 /* see counter_table_place() */
+} counter_table;
+
+/**
+ * @brief Receives a changed counter from counter_table_collect().
+ * @param delta  Increase since the previous collect, count if new.
+ */
+typedef void (*counter_change_fn)(void *ctx, uint32_t addr, uint64_t count, uint64_t delta);
+
+/**
+ * @fn counter_table_create
+ * @brief Create a table.
+ *
+ * @param table     Table to initialize.
+ * @param shm_name  Name of a POSIX shared memory segment, it is
+ *                  replaced if it exists. If NULL, an anonymous memfd
+ *                  is used.
+ * @param capacity  Initial number of slots, rounded up to a power of two.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+counter_table_create(counter_table *table, const char *shm_name, uint32_t capacity);
+
+/**
+ * @fn counter_table_adopt
+ * @brief Map an existing table, e.g. one received from another process.
+ *
+ * @param table     Table to initialize.
+ * @param fd        Descriptor of the segment, owned by the table afterwards.
+ * @param shm_name  Name to unlink on destroy, can be NULL.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+counter_table_adopt(counter_table *table, int fd, const char *shm_name);
+
+/**
+ * @fn counter_table_destroy
+ * @brief Unmap the table and unlink its segment.
+ */
+void
+counter_table_destroy(counter_table *table);
+
+/**
+ * @fn counter_table_add
+ * @brief Add n to the count of addr, inserting it if needed.
+ *
+ * @param inserted  Optional, set to 1 if a new entry was created.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+counter_table_add(counter_table *table, uint32_t addr, uint64_t n, int *inserted);
+
+/**
+ * @fn counter_table_get
+ * @return count for addr, 0 if not found.
+ */
+uint64_t
+counter_table_get(const counter_table *table, uint32_t addr);
+
+/**
+ * @fn counter_table_get_batch
+ * @brief Look up counts of many addresses, 0 for those not found.
+ *
+ * Probes are done in groups: the home slots of a group are prefetched
+ * before any of them is read, so cache misses overlap.
+ */
+void
+counter_table_get_batch(const counter_table *table, const uint32_t *addrs,
+                        size_t count, uint64_t *counts);
+
+/**
+ * @fn counter_table_find
+ * @return slot holding addr or NULL if not found.
+ *
+ * The pointer is valid until the table is modified.
+ */
+const shm_table_entry *
+counter_table_find(const counter_table *table, uint32_t addr);
+
+/**
+ * @fn counter_table_clear
+ * @brief Remove all entries, keeping the capacity.
+ */
+void
+counter_table_clear(counter_table *table);
+
+/**
+ * @fn counter_table_track
+ * @brief Start or stop tracking which slots change.
+ *
+ * While tracking, counter_table_add() marks the slots it touches in a
+ * bitmap, so changes can be collected at a cost proportional to their
+ * number rather than to the capacity. Uses a little over 8 bytes of
+ * process memory per slot.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+counter_table_track(counter_table *table, int enable);
+
+/**
+ * @fn counter_table_collect
+ * @brief Report the counters changed since the previous collect.
+ *
+ * fn gets every changed counter once, at most dirty_count times. The
+ * marks are cleared.
+ *
+ * @param reset     Set to 1 if the table was cleared since the previous
+ *                  collect, can be NULL.
+ *
+ * @return number of counters reported.
+ */
+size_t
+counter_table_collect(counter_table *table, counter_change_fn fn, void *ctx, int *reset);
+
+/**
+ * @fn counter_table_place
+ * @brief Keep the table on the NUMA node chosen by
+ *        placement_select_node(), now and after it grows.
+ * @return 0 on success or an error code on failure.
+ */
+int
+counter_table_place(counter_table *table);
+
+/**
+ * @fn counter_table_set_ifname
+ * @brief Set the interface name published in the header.
+ */
+void
+counter_table_set_ifname(counter_table *table, const char *ifname);
+
+#endif // COUNTER_TABLE_H
@@ -0,0 +1,165 @@
+/*
+ * Snapshot history of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include "stdafx.h"
+
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+static unsigned history_keep = HISTORY_DEFAULT_KEEP;
+static unsigned history_max_age_days = HISTORY_DEFAULT_MAX_AGE_DAYS;
+
+void
+history_set_retention(unsigned keep, unsigned max_age_days)
+{
+    history_keep = keep;
+    history_max_age_days = max_age_days;
+}
+
+static int
+name_compare_fn(const void *l, const void *r)
+{
+    return strcmp(*(char * const *) l, *(char * const *) r);
+}
+
+/* Returns the time of the snapshot from its name, "<prefix><timestamp>.stat",
+ * or -1 if the name is not one, e.g. the snapshot of an interface whose
+ * name merely starts with the prefix. */
+static time_t
+history_name_time(const char *name, const char *prefix, size_t prefix_len)
+{
+    struct tm tm;
+    const char *end;
+
+    if(strncmp(name, prefix, prefix_len))
+        return -1;
+
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(name + prefix_len, HISTORY_TIME_FORMAT, &tm);
+    if(!end || strcmp(end, ".stat"))
+        return -1;
+
+    return timegm(&tm);
+}
+
+/* Returns nonzero if the snapshot is older than the age limit. */
+static int
+history_expired(const char *name, const char *prefix, size_t prefix_len, time_t now)
+{
+    if(!history_max_age_days)
+        return 0;
+
+    return now - history_name_time(name, prefix, prefix_len)
+           > (time_t) history_max_age_days * 24 * 60 * 60;
+}
+
+/* Remove snapshots of the interface beyond the retention limits. */
+static void
+history_prune(const char *iface_str)
+{
+    char prefix[IFNAMSIZ + 2];
+    char path[FILENAME_MAX];
+    char **names = NULL;
+    size_t count = 0, capacity = 0, prefix_len;
+    time_t now = time(NULL);
+    struct dirent *entry;
+    DIR *dir;
+
+    prefix_len = snprintf(prefix, sizeof(prefix), "%s-", iface_str);
+
+    dir = opendir(HISTORY_DIR);
+    if(!dir)
+        return;
+
+    while((entry = readdir(dir)))
+    {
+        if(history_name_time(entry->d_name, prefix, prefix_len) == -1)
+            continue;
+
+        if(count == capacity)
+        {
+            char **grown;
+            capacity = capacity ? capacity * 2 : 64;
+            /* !!! realloc !!! */
+            grown = realloc(names, capacity * sizeof(*names));
+            if(!grown)
+                break;
+            names = grown;
+        }
+
+        names[count] = strdup(entry->d_name);
+        if(names[count])
+            ++count;
+    }
+    closedir(dir);
+
+    /* oldest first */
+    qsort(names, count, sizeof(*names), name_compare_fn);
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(count - i > history_keep || history_expired(names[i], prefix, prefix_len, now))
+        {
+            snprintf(path, sizeof(path), "%s/%s", HISTORY_DIR, names[i]);
+            if(unlink(path))
+                syslog(LOG_WARNING, "history: unlink(%s) failed: %s",
+                       path, strerror(errno));
+            else
+                syslog(LOG_DEBUG, "history: removed %s", names[i]);
+        }
+        free(names[i]);
+    }
+
+    free(names);
+}
+
+int
+history_record(const char *snapshot_path, const char *iface_str)
+{
+    char path[FILENAME_MAX];
+    char timestamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    int err;
+
+    if(!history_keep)
+        return 0;
+
+    if(mkdir(HISTORY_DIR, 0755) && errno != EEXIST)
+    {
+        err = errno;
+        syslog(LOG_ERR, "mkdir(%s) failed: %s", HISTORY_DIR, strerror(err));
+        return err;
+    }
+
+    gmtime_r(&now, &tm);
+    strftime(timestamp, sizeof(timestamp), HISTORY_TIME_FORMAT, &tm);
+    if(snprintf(path, sizeof(path), HISTORY_FILE_TEMPLATE, iface_str, timestamp)
+       >= (int) sizeof(path))
+        return ENAMETOOLONG;
+
+    if(link(snapshot_path, path))
+    {
+        /* two snapshots in one second, the later one wins */
+        if(errno != EEXIST || unlink(path) || link(snapshot_path, path))
+        {
+            err = errno;
+            syslog(LOG_ERR, "history: link(%s) failed: %s", path, strerror(err));
+            return err;
+        }
+    }
+
+    err = persist_fsync_dir(HISTORY_DIR);
+    if(err)
+        syslog(LOG_WARNING, "history: fsync(%s) failed: %s", HISTORY_DIR, strerror(err));
+
+    history_prune(iface_str);
+    return 0;
+}
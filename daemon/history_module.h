@@ -0,0 +1,47 @@
+/*
+ * Header for snapshot history of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef HISTORY_MODULE_H
+#define HISTORY_MODULE_H
+
+#define HISTORY_DIR STATSDIR "/history"
+/* <iface>-<UTC timestamp>.stat, names sort by time */
+#define HISTORY_FILE_TEMPLATE HISTORY_DIR "/%s-%s.stat"
+#define HISTORY_TIME_FORMAT "%Y%m%dT%H%M%SZ"
+
+#define HISTORY_DEFAULT_KEEP 48
+#define HISTORY_DEFAULT_MAX_AGE_DAYS 30
+
+/**
+ * @fn history_set_retention
+ * @brief Set how many snapshots are kept per interface.
+ *
+ * @param keep          Maximum count of snapshots, 0 disables history.
+ * @param max_age_days  Snapshots older than that are removed,
+ *                      0 means no age limit.
+ */
+void
+history_set_retention(unsigned keep, unsigned max_age_days);
+
+/**
+ * @fn history_record
+ * @brief Keep a timestamped copy of a written snapshot.
+ *
+ * @param snapshot_path Path of the snapshot that was just written.
+ * @param iface_str     Interface the snapshot belongs to.
+ *
+ * @return 0 on success or an error code on failure.
+ *
+ * The copy is a hard link, so it costs no I/O. Old snapshots of the
+ * interface are removed according to the retention settings.
+ */
+int
+history_record(const char *snapshot_path, const char *iface_str);
+
+#endif // HISTORY_MODULE_H
@@ -0,0 +1,853 @@
+/*
+ * Event driven IPC server of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include "stdafx.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#define IPC_BUFFER_MIN 4096
+/* empty buffers larger than this are released */
+#define IPC_BUFFER_KEEP (64 << 10)
+#define IPC_READ_CHUNK 16384
+#define IPC_EVENTS_MAX 64
+/* how often timeouts are checked */
+#define IPC_TICK_MS 1000
+/* producer calls per wakeup, so one stream does not starve the others */
+#define IPC_PRODUCE_ROUNDS 8
+/* how long pending replies are flushed on stop */
+#define IPC_STOP_FLUSH_MS 1000
+
+static struct
+{
+    int epoll_fd;
+    int listen_fd;
+    int signal_fd;      /* stop signals, -1 if none */
+    int listening;      /* listen_fd is in the epoll set */
+    int stopping;
+    ipc_request_fn on_request;
+    ipc_conn *conns;
+    unsigned conn_count;
+    void (*timer_fn)(void);
+    uint32_t timer_period;
+} server = { -1, -1, -1 };
+
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/***********/
+/* Buffers */
+/***********/
+
+static size_t
+buffer_pending(const ipc_buffer *buf)
+{
+    return buf->tail - buf->head;
+}
+
+/* Move data to the start, returns by how much it moved */
+static size_t
+buffer_compact(ipc_buffer *buf)
+{
+    size_t shift = buf->head;
+
+    if(shift)
+    {
+        memmove(buf->data, buf->data + shift, buffer_pending(buf));
+        buf->tail -= shift;
+        buf->head = 0;
+    }
+
+    return shift;
+}
+
+/* Make room for size more bytes after tail, the buffer may be compacted */
+static int
+buffer_reserve(ipc_buffer *buf, size_t size, size_t limit, size_t *shift)
+{
+    size_t need, capacity;
+    char *data;
+
+    *shift = 0;
+    if(buf->capacity - buf->tail >= size)
+        return 0;
+
+    *shift = buffer_compact(buf);
+    if(buf->capacity - buf->tail >= size)
+        return 0;
+
+    need = buf->tail + size;
+    if(need > limit)
+        return ENOBUFS;
+
+    capacity = buf->capacity ? buf->capacity : IPC_BUFFER_MIN;
+    while(capacity < need)
+        capacity *= 2;
+    if(capacity > limit)
+        capacity = limit;
+
+    /* !!! realloc !!! */
+    data = realloc(buf->data, capacity);
+    if(!data)
+        return ENOMEM;
+
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+/* Called when the buffer may be empty */
+static void
+buffer_trim(ipc_buffer *buf)
+{
+    if(buf->head != buf->tail)
+        return;
+
+    buf->head = buf->tail = 0;
+    if(buf->capacity > IPC_BUFFER_KEEP)
+    {
+        free(buf->data);
+        buf->data = NULL;
+        buf->capacity = 0;
+    }
+}
+
+/***************/
+/* Connections */
+/***************/
+
+/* Forget the pending descriptors, closing them if they were handed over */
+static void
+conn_release_fds(ipc_conn *conn)
+{
+    if(conn->fds_owned)
+        for(unsigned i = 0; i < conn->fd_count; ++i)
+            close(conn->fds[i]);
+
+    conn->fd_count = 0;
+    conn->fds_owned = 0;
+}
+
+static void
+conn_destroy(ipc_conn *conn)
+{
+    if(conn->on_close)
+        conn->on_close(conn);
+
+    /* closing removes it from the epoll set */
+    close(conn->fd);
+    conn_release_fds(conn);
+
+    if(conn->prev)
+        conn->prev->next = conn->next;
+    else
+        server.conns = conn->next;
+    if(conn->next)
+        conn->next->prev = conn->prev;
+
+    free(conn->produce_ctx);
+    free(conn->in.data);
+    free(conn->out.data);
+    free(conn);
+
+    --server.conn_count;
+}
+
+static int
+conn_set_events(ipc_conn *conn, uint32_t events)
+{
+    struct epoll_event ev;
+
+    if(conn->events == events)
+        return 0;
+
+    ev.events = events;
+    ev.data.ptr = conn;
+    if(epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev))
+        return errno;
+
+    conn->events = events;
+    return 0;
+}
+
+/* Send as much output as the socket takes, returns 0 or an error code */
+static int
+conn_flush(ipc_conn *conn)
+{
+    ipc_buffer *out = &conn->out;
+
+    while(out->head < out->tail)
+    {
+        ssize_t n;
+
+        if(conn->fd_count && out->head == conn->fds_at)
+        {
+            /* the descriptors go with the first byte of their reply */
+            char control[CMSG_SPACE(sizeof(conn->fds))];
+            struct iovec iov = { out->data + out->head, buffer_pending(out) };
+            struct msghdr msg = { 0 };
+            struct cmsghdr *cmsg;
+
+            memset(control, 0, sizeof(control));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(conn->fd_count * sizeof(int));
+            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(conn->fd_count * sizeof(int));
+            memcpy(CMSG_DATA(cmsg), conn->fds, conn->fd_count * sizeof(int));
+
+            n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if(n > 0)
+                conn_release_fds(conn);
+        }
+        else
+        {
+            size_t size = buffer_pending(out);
+            if(conn->fd_count && conn->fds_at > out->head)
+                size = conn->fds_at - out->head;
+
+            n = send(conn->fd, out->data + out->head, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return errno;
+        }
+
+        out->head += n;
+        conn->out_sent += n;
+        conn->last_activity = now_ms();
+    }
+
+    buffer_trim(out);
+    return 0;
+}
+
+/* Hand complete buffered requests to the handler */
+static int
+conn_process(ipc_conn *conn)
+{
+    ipc_buffer *in = &conn->in;
+
+    while(!conn->closing && !conn->paused && !conn->produce && in->head < in->tail)
+    {
+        ssize_t n = server.on_request(conn, in->data + in->head, buffer_pending(in));
+        if(n < 0)
+            return -n;
+        if(!n)
+            break;
+
+        in->head += n;
+        /* descriptors go one reply at a time */
+        if(buffer_pending(&conn->out) > IPC_OUT_HIGH_WATERMARK || conn->fd_count)
+            conn->paused = 1;
+    }
+
+    buffer_trim(in);
+    return 0;
+}
+
+/*
+ * Flush, apply backpressure and register the events the connection
+ * waits for. Returns nonzero if the connection was destroyed.
+ */
+static int
+conn_update(ipc_conn *conn)
+{
+    uint32_t events = 0;
+    unsigned rounds = 0;
+    int err;
+
+    for(;;)
+    {
+        err = conn_flush(conn);
+        if(err)
+        {
+            syslog(LOG_DEBUG, "IPC: send() failed: %s", strerror(err));
+            conn_destroy(conn);
+            return 1;
+        }
+
+        if(conn->produce)
+        {
+            int ret;
+
+            if(buffer_pending(&conn->out) > IPC_OUT_LOW_WATERMARK
+               || rounds++ == IPC_PRODUCE_ROUNDS)
+                break;
+
+            /* the long reply goes on as its output drains */
+            ret = conn->produce(conn, conn->produce_ctx);
+            if(ret < 0)
+            {
+                syslog(LOG_WARNING, "IPC: dropping client: %s", strerror(-ret));
+                conn_destroy(conn);
+                return 1;
+            }
+            if(ret > 0)
+            {
+                free(conn->produce_ctx);
+                conn->produce_ctx = NULL;
+                conn->produce = NULL;
+                conn->paused = 1;
+            }
+            continue;
+        }
+
+        if(!conn->paused || buffer_pending(&conn->out) > IPC_OUT_LOW_WATERMARK
+           || conn->fd_count)
+            break;
+
+        /* output drained, serve the requests read meanwhile */
+        conn->paused = 0;
+        err = conn_process(conn);
+        if(err)
+        {
+            syslog(LOG_WARNING, "IPC: dropping client: %s", strerror(err));
+            conn_destroy(conn);
+            return 1;
+        }
+    }
+
+    if(conn->closing && !conn->produce && !buffer_pending(&conn->out))
+    {
+        conn_destroy(conn);
+        return 1;
+    }
+
+    if(!conn->closing && !conn->paused && !conn->produce)
+        events |= EPOLLIN;
+    /* a producer is called again once the socket is writable */
+    if(buffer_pending(&conn->out) || conn->produce)
+        events |= EPOLLOUT;
+
+    err = conn_set_events(conn, events);
+    if(err)
+    {
+        syslog(LOG_ERR, "IPC: epoll_ctl() failed: %s", strerror(err));
+        conn_destroy(conn);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void
+conn_read(ipc_conn *conn)
+{
+    size_t shift;
+    ssize_t n;
+    int err;
+
+    err = buffer_reserve(&conn->in, IPC_READ_CHUNK, IPC_IN_MAX, &shift);
+    if(err == ENOBUFS && conn->in.tail < IPC_IN_MAX)
+    {
+        /* read what still fits under the limit */
+        err = buffer_reserve(&conn->in, IPC_IN_MAX - conn->in.tail, IPC_IN_MAX, &shift);
+    }
+    if(err || conn->in.tail == conn->in.capacity)
+    {
+        syslog(LOG_WARNING, "IPC: request too large, dropping client");
+        conn_destroy(conn);
+        return;
+    }
+
+    n = recv(conn->fd, conn->in.data + conn->in.tail,
+             conn->in.capacity - conn->in.tail, MSG_DONTWAIT);
+    if(n < 0)
+    {
+        if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        syslog(LOG_DEBUG, "IPC: recv() failed: %s", strerror(errno));
+        conn_destroy(conn);
+        return;
+    }
+
+    if(!n)
+    {
+        /* the client is done sending, still deliver its replies */
+        conn->closing = 1;
+        if(buffer_pending(&conn->in))
+            syslog(LOG_DEBUG, "IPC: client closed in the middle of a request");
+        conn_update(conn);
+        return;
+    }
+
+    conn->in.tail += n;
+    conn->last_activity = now_ms();
+
+    err = conn_process(conn);
+    if(err)
+    {
+        syslog(LOG_WARNING, "IPC: dropping client: %s", strerror(err));
+        conn_destroy(conn);
+        return;
+    }
+
+    conn_update(conn);
+}
+
+/**********/
+/* Server */
+/**********/
+
+static int
+listen_set(int enable)
+{
+    struct epoll_event ev;
+
+    if(server.listening == enable)
+        return 0;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(server.epoll_fd, enable ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                 server.listen_fd, &ev))
+        return errno;
+
+    server.listening = enable;
+    return 0;
+}
+
+static void
+server_accept(void)
+{
+    while(server.conn_count < IPC_CONN_MAX)
+    {
+        struct epoll_event ev;
+        ipc_conn *conn;
+        int fd;
+
+        fd = accept4(server.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd == -1)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+
+            /* e.g. out of descriptors, retry on the next tick */
+            syslog(LOG_ERR, "accept() failed: %s", strerror(errno));
+            listen_set(0);
+            return;
+        }
+
+        /* !!! calloc !!! */
+        conn = calloc(1, sizeof(*conn));
+        if(!conn)
+        {
+            syslog(LOG_ERR, "IPC: calloc() failed: %s", strerror(errno));
+            close(fd);
+            return;
+        }
+
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        conn->idle_timeout = IPC_IDLE_TIMEOUT_MS;
+        conn->last_activity = now_ms();
+
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        if(epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &ev))
+        {
+            syslog(LOG_ERR, "IPC: epoll_ctl() failed: %s", strerror(errno));
+            close(fd);
+            free(conn);
+            return;
+        }
+
+        conn->next = server.conns;
+        if(server.conns)
+            server.conns->prev = conn;
+        server.conns = conn;
+        ++server.conn_count;
+
+        syslog(LOG_DEBUG, "Connected!");
+    }
+
+    /* full, the rest waits in the backlog */
+    listen_set(0);
+}
+
+static void
+server_check_timeouts(uint64_t now)
+{
+    ipc_conn *conn = server.conns, *next;
+
+    for(; conn; conn = next)
+    {
+        uint64_t timeout = buffer_pending(&conn->out)
+                           ? IPC_WRITE_TIMEOUT_MS : conn->idle_timeout;
+        next = conn->next;
+
+        if(now - conn->last_activity >= timeout)
+        {
+            syslog(LOG_WARNING, "IPC: client timed out (%s)",
+                   buffer_pending(&conn->out) ? "not reading" : "idle");
+            conn_destroy(conn);
+        }
+    }
+}
+
+/* A stop signal came in */
+static void
+server_signal(void)
+{
+    struct signalfd_siginfo info;
+
+    if(read(server.signal_fd, &info, sizeof(info)) != sizeof(info))
+        return;
+
+    syslog(LOG_INFO, "%s received, stopping", strsignal(info.ssi_signo));
+    server.stopping = 1;
+}
+
+/* Best effort delivery of pending replies, then close everything */
+static void
+server_shutdown(void)
+{
+    uint64_t deadline = now_ms() + IPC_STOP_FLUSH_MS;
+
+    listen_set(0);
+    while(server.conns)
+    {
+        ipc_conn *conn = server.conns;
+        uint64_t now = now_ms();
+
+        if(buffer_pending(&conn->out) && now < deadline)
+            ipc_conn_flush_wait(conn, deadline - now);
+        conn_destroy(conn);
+    }
+
+    close(server.epoll_fd);
+    server.epoll_fd = -1;
+}
+
+int
+ipc_server_run(int listen_fd, ipc_request_fn on_request)
+{
+    struct epoll_event events[IPC_EVENTS_MAX];
+    uint64_t next_tick, next_timer = UINT64_MAX;
+    int flags, err;
+
+    flags = fcntl(listen_fd, F_GETFL);
+    if(flags == -1 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        return errno;
+
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(server.epoll_fd == -1)
+        return errno;
+
+    server.listen_fd = listen_fd;
+    server.listening = 0;
+    server.stopping = 0;
+    server.on_request = on_request;
+
+    err = listen_set(1);
+    if(!err && server.signal_fd >= 0)
+    {
+        /* tells the signal fd from the listening socket and connections */
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &server.signal_fd };
+        if(epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.signal_fd, &ev))
+            err = errno;
+    }
+    if(err)
+    {
+        close(server.epoll_fd);
+        server.epoll_fd = -1;
+        return err;
+    }
+
+    next_tick = now_ms() + IPC_TICK_MS;
+    if(server.timer_fn)
+        next_timer = now_ms() + server.timer_period;
+    while(!server.stopping)
+    {
+        uint64_t now = now_ms();
+        uint64_t wake;
+        int n;
+
+        if(now >= next_tick)
+        {
+            server_check_timeouts(now);
+            if(server.conn_count < IPC_CONN_MAX)
+                listen_set(1);
+            next_tick = now + IPC_TICK_MS;
+        }
+
+        if(now >= next_timer)
+        {
+            server.timer_fn();
+            /* a late run does not make up for missed periods */
+            next_timer += server.timer_period;
+            if(next_timer <= now)
+                next_timer = now + server.timer_period;
+            continue;
+        }
+
+        wake = next_tick < next_timer ? next_tick : next_timer;
+        n = epoll_wait(server.epoll_fd, events, IPC_EVENTS_MAX, wake - now);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            err = errno;
+            syslog(LOG_ERR, "epoll_wait() failed: %s", strerror(err));
+            server_shutdown();
+            return err;
+        }
+
+        for(int i = 0; i < n && !server.stopping; ++i)
+        {
+            ipc_conn *conn = events[i].data.ptr;
+
+            if(!conn)
+            {
+                server_accept();
+                continue;
+            }
+
+            if(events[i].data.ptr == &server.signal_fd)
+            {
+                server_signal();
+                continue;
+            }
+
+            /*
+             * A connection destroyed while handling an earlier event
+             * cannot be referenced here: only the connection an event
+             * belongs to is ever destroyed while handling it.
+             */
+            if(events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN))
+            {
+                conn_destroy(conn);
+                continue;
+            }
+
+            if(events[i].events & EPOLLIN)
+                conn_read(conn);
+            else if(events[i].events & EPOLLOUT)
+                conn_update(conn);
+        }
+    }
+
+    server_shutdown();
+    return 0;
+}
+
+void
+ipc_server_set_timer(uint32_t period_ms, void (*fn)(void))
+{
+    server.timer_fn = fn;
+    server.timer_period = period_ms ? period_ms : 1;
+}
+
+int
+ipc_server_set_stop_signals(const sigset_t *signals)
+{
+    int fd = signalfd(server.signal_fd, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(fd == -1)
+        return errno;
+
+    server.signal_fd = fd;
+    return 0;
+}
+
+void
+ipc_server_stop(void)
+{
+    server.stopping = 1;
+}
+
+int
+ipc_conn_reply_reserve(ipc_conn *conn, size_t size, void **data)
+{
+    size_t shift;
+    int err;
+
+    err = buffer_reserve(&conn->out, size, IPC_OUT_MAX, &shift);
+    if(conn->fd_count)
+        conn->fds_at -= shift;
+    if(err)
+    {
+        syslog(LOG_WARNING, "IPC: client is not reading replies: %s", strerror(err));
+        return err;
+    }
+
+    *data = conn->out.data + conn->out.tail;
+    return 0;
+}
+
+void
+ipc_conn_reply_commit(ipc_conn *conn, size_t size)
+{
+    conn->out.tail += size;
+    conn->out_queued += size;
+}
+
+int
+ipc_conn_reply(ipc_conn *conn, const void *data, size_t size)
+{
+    void *dst;
+    int err;
+
+    err = ipc_conn_reply_reserve(conn, size, &dst);
+    if(err)
+        return err;
+
+    memcpy(dst, data, size);
+    ipc_conn_reply_commit(conn, size);
+    return 0;
+}
+
+uint64_t
+ipc_conn_reply_mark(const ipc_conn *conn)
+{
+    return conn->out_queued;
+}
+
+int
+ipc_conn_reply_patch(ipc_conn *conn, uint64_t mark, const void *data, size_t size)
+{
+    if(mark < conn->out_sent || mark + size > conn->out_queued)
+        return EINVAL;
+
+    memcpy(conn->out.data + conn->out.head + (mark - conn->out_sent), data, size);
+    return 0;
+}
+
+int
+ipc_conn_reply_fds(ipc_conn *conn, const void *data, size_t size,
+                   const int *fds, unsigned fd_count, int owned)
+{
+    size_t at;
+    int err = 0;
+
+    if(conn->fd_count)
+        err = EBUSY;
+    else if(!size || fd_count > IPC_CONN_FD_MAX)
+        err = EINVAL;
+
+    at = conn->out.tail - conn->out.head;
+    if(!err)
+        err = ipc_conn_reply(conn, data, size);
+    if(err)
+    {
+        if(owned)
+            for(unsigned i = 0; i < fd_count; ++i)
+                close(fds[i]);
+        return err;
+    }
+
+    /* the buffer may have been compacted */
+    conn->fds_at = conn->out.head + at;
+    memcpy(conn->fds, fds, fd_count * sizeof(int));
+    conn->fd_count = fd_count;
+    conn->fds_owned = owned;
+    return 0;
+}
+
+int
+ipc_conn_flush_wait(ipc_conn *conn, int timeout_ms)
+{
+    uint64_t deadline = now_ms() + timeout_ms;
+
+    for(;;)
+    {
+        struct pollfd pfd = { conn->fd, POLLOUT, 0 };
+        uint64_t now;
+        int err = conn_flush(conn);
+
+        if(err)
+            return err;
+        if(!buffer_pending(&conn->out))
+            return 0;
+
+        now = now_ms();
+        if(now >= deadline)
+            return ETIMEDOUT;
+
+        if(poll(&pfd, 1, deadline - now) == -1 && errno != EINTR)
+            return errno;
+    }
+}
+
+int
+ipc_conn_recv_wait(ipc_conn *conn, void *data, size_t size, int timeout_ms)
+{
+    uint64_t deadline = now_ms() + timeout_ms;
+    size_t done = 0;
+
+    while(done < size)
+    {
+        struct pollfd pfd = { conn->fd, POLLIN, 0 };
+        uint64_t now;
+        ssize_t n;
+
+        n = recv(conn->fd, (char *) data + done, size - done, MSG_DONTWAIT);
+        if(n > 0)
+        {
+            done += n;
+            continue;
+        }
+        if(n == 0)
+            return EPIPE;
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return errno;
+
+        now = now_ms();
+        if(now >= deadline)
+            return ETIMEDOUT;
+
+        if(poll(&pfd, 1, deadline - now) == -1 && errno != EINTR)
+            return errno;
+    }
+
+    return 0;
+}
+
+void
+ipc_conn_set_producer(ipc_conn *conn, ipc_produce_fn produce, void *ctx)
+{
+    conn->produce = produce;
+    conn->produce_ctx = ctx;
+}
+
+int
+ipc_conn_send(ipc_conn *conn)
+{
+    return conn_update(conn);
+}
+
+void
+ipc_conn_drop(ipc_conn *conn)
+{
+    conn_destroy(conn);
+}
+
+void
+ipc_conn_close_when_done(ipc_conn *conn)
+{
+    conn->closing = 1;
+}
@@ -0,0 +1,277 @@
+/*
+ * Header for event driven IPC server of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef IPC_MODULE_H
+#define IPC_MODULE_H
+
+#include <signal.h>
+
+/* Connections beyond this wait in the listen backlog */
+#define IPC_CONN_MAX 1024
+
+/* A connection that sends nothing for this long is dropped */
+#define IPC_IDLE_TIMEOUT_MS 30000
+/* A connection that does not read its replies for this long is dropped */
+#define IPC_WRITE_TIMEOUT_MS 10000
+
+/* Largest request that may be buffered */
+#define IPC_IN_MAX (1 << 20)
+/* Stop reading requests when this much output is pending... */
+#define IPC_OUT_HIGH_WATERMARK (256 << 10)
+/* ...and resume when it drains below this */
+#define IPC_OUT_LOW_WATERMARK (64 << 10)
+/* A connection with more pending output is dropped */
+#define IPC_OUT_MAX (64 << 20)
+
+#define IPC_CONN_FD_MAX 4
+
+/**
+ * @struct s_ipc_buffer
+ * @typedef ipc_buffer
+ * @brief Growable byte buffer, data is between head and tail.
+ */
+typedef struct s_ipc_buffer
+{
+    char *data;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} ipc_buffer;
+
+struct s_ipc_conn;
+
+/**
+ * @brief Producer of a long reply, see ipc_conn_set_producer().
+ * @return 0 if more is to come, 1 when the reply is complete or a
+ *         negative error code to drop the connection.
+ */
+typedef int (*ipc_produce_fn)(struct s_ipc_conn *conn, void *ctx);
+
+/**
+ * @struct s_ipc_conn
+ * @typedef ipc_conn
+ * @brief A client connection of the IPC server.
+ *
+ * Owned by the server. Request handlers may queue replies and set
+ * flags, the connection is closed by the server.
+ */
+typedef struct s_ipc_conn
+{
+    int fd;
+    ipc_buffer in;
+    ipc_buffer out;
+
+    /* descriptors sent with the out byte at fds_at */
+    int fds[IPC_CONN_FD_MAX];
+    unsigned fd_count;
+    int fds_owned;              /* closed once sent */
+    size_t fds_at;
+
+    uint64_t out_queued;        /* bytes ever queued */
+    uint64_t out_sent;          /* bytes ever sent */
+
+    /* reply produced piece by piece, see ipc_conn_set_producer() */
+    ipc_produce_fn produce;
+    void *produce_ctx;
+
+    /* owned by the request handler, 0 initially */
+    int proto;
+    uint32_t request_id;
+    void (*on_close)(struct s_ipc_conn *conn);  /* called before it is freed */
+    uint32_t idle_timeout;      /* ms, IPC_IDLE_TIMEOUT_MS initially */
+    uint64_t last_activity;     /* monotonic, ms */
+    uint32_t events;            /* registered in epoll */
+    int paused;                 /* reading stopped by backpressure */
+    int closing;                /* close once output is flushed */
+
+    struct s_ipc_conn *prev;
+    struct s_ipc_conn *next;
+} ipc_conn;
+
+/**
+ * @brief Request handler of the IPC server.
+ *
+ * @param conn  Connection the request came from.
+ * @param data  Buffered bytes, starting at the request.
+ * @param size  Number of buffered bytes.
+ *
+ * @return size of the handled request, 0 if the request is not complete
+ *         yet or a negative error code to drop the connection.
+ */
+typedef ssize_t (*ipc_request_fn)(ipc_conn *conn, const char *data, size_t size);
+
+/**
+ * @fn ipc_server_run
+ * @brief Serve clients of a listening socket until ipc_server_stop().
+ *
+ * Single threaded epoll loop. Requests are handled in order per
+ * connection; a failing connection is dropped without affecting others.
+ *
+ * @return 0 when stopped or an error code if the loop failed.
+ */
+int
+ipc_server_run(int listen_fd, ipc_request_fn on_request);
+
+/**
+ * @fn ipc_server_set_timer
+ * @brief Call fn every period_ms from the loop of ipc_server_run().
+ *
+ * Set before the server runs. fn runs between events, so it may send
+ * to any connection with ipc_conn_send() or drop it.
+ */
+void
+ipc_server_set_timer(uint32_t period_ms, void (*fn)(void));
+
+/**
+ * @fn ipc_server_set_stop_signals
+ * @brief Make ipc_server_run() return when one of the signals arrives.
+ *
+ * Set before the server runs. The signals must be blocked in every
+ * thread: they are read from a signalfd by the loop, so what follows
+ * the stop runs on its thread rather than in a signal handler.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+ipc_server_set_stop_signals(const sigset_t *signals);
+
+/**
+ * @fn ipc_server_stop
+ * @brief Make ipc_server_run() return after flushing pending replies.
+ *
+ * Called from a request handler. No new connections are accepted.
+ */
+void
+ipc_server_stop(void);
+
+/**
+ * @fn ipc_conn_reply
+ * @brief Queue bytes to be sent to the client.
+ * @return 0 on success or an error code on failure.
+ */
+int
+ipc_conn_reply(ipc_conn *conn, const void *data, size_t size);
+
+/**
+ * @fn ipc_conn_reply_reserve
+ * @brief Get room for size bytes at the end of the output.
+ *
+ * Lets a reply be built right where it is sent from. The pointer is
+ * valid until the next reply call on the connection, nothing is
+ * queued until ipc_conn_reply_commit().
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+ipc_conn_reply_reserve(ipc_conn *conn, size_t size, void **data);
+
+/**
+ * @fn ipc_conn_reply_commit
+ * @brief Queue size bytes written after ipc_conn_reply_reserve().
+ */
+void
+ipc_conn_reply_commit(ipc_conn *conn, size_t size);
+
+/**
+ * @fn ipc_conn_reply_fds
+ * @brief Queue bytes to be sent along with descriptors (SCM_RIGHTS).
+ *
+ * Only one such reply may be pending. If owned is nonzero, the
+ * descriptors are closed by the server once sent or when the
+ * connection is dropped, even if this call fails. Otherwise they must
+ * stay open until they are sent.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+ipc_conn_reply_fds(ipc_conn *conn, const void *data, size_t size,
+                   const int *fds, unsigned fd_count, int owned);
+
+/**
+ * @fn ipc_conn_reply_mark
+ * @return position of the next queued byte, for ipc_conn_reply_patch().
+ */
+uint64_t
+ipc_conn_reply_mark(const ipc_conn *conn);
+
+/**
+ * @fn ipc_conn_reply_patch
+ * @brief Overwrite queued bytes that were not sent yet.
+ *
+ * Used to fill in a header once the size of what follows is known.
+ * Nothing is sent while a request handler runs, unless it calls
+ * ipc_conn_flush_wait().
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+ipc_conn_reply_patch(ipc_conn *conn, uint64_t mark, const void *data, size_t size);
+
+/**
+ * @fn ipc_conn_flush_wait
+ * @brief Send all queued bytes, waiting up to timeout_ms.
+ * @return 0 on success or an error code on failure.
+ */
+int
+ipc_conn_flush_wait(ipc_conn *conn, int timeout_ms);
+
+/**
+ * @fn ipc_conn_recv_wait
+ * @brief Read size bytes the client sends after its request, waiting up
+ *        to timeout_ms. Only for handlers expecting a follow-up, before
+ *        the client sends another request.
+ * @return 0 on success, EPIPE if the client closed the connection or
+ *         another error code on failure.
+ */
+int
+ipc_conn_recv_wait(ipc_conn *conn, void *data, size_t size, int timeout_ms);
+
+/**
+ * @fn ipc_conn_set_producer
+ * @brief Send a long reply in pieces as the client reads it.
+ *
+ * Called from a request handler. produce is called whenever less than
+ * IPC_OUT_LOW_WATERMARK bytes are pending, until it returns nonzero.
+ * ctx is malloc()'ed and freed by the server afterwards. Further
+ * requests of the connection wait until the reply is complete, so the
+ * daemon keeps at most a few pieces of it in memory.
+ */
+void
+ipc_conn_set_producer(ipc_conn *conn, ipc_produce_fn produce, void *ctx);
+
+/**
+ * @fn ipc_conn_send
+ * @brief Start sending what was queued outside of a request handler.
+ *
+ * Replies queued by request handlers are sent by the server, data
+ * pushed from a timer needs this. Not to be called from a request
+ * handler.
+ *
+ * @return nonzero if the connection failed and was dropped.
+ */
+int
+ipc_conn_send(ipc_conn *conn);
+
+/**
+ * @fn ipc_conn_drop
+ * @brief Close a connection right away, discarding pending output.
+ *
+ * Not to be called from a request handler.
+ */
+void
+ipc_conn_drop(ipc_conn *conn);
+
+/**
+ * @fn ipc_conn_close_when_done
+ * @brief Stop reading requests and close once replies are sent.
+ */
+void
+ipc_conn_close_when_done(ipc_conn *conn);
+
+#endif // IPC_MODULE_H
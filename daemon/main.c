@@ -19,13 +19,17 @@
 /* UNIX sockets */
 #include <sys/un.h>
 
+/* Command line */
+#include <getopt.h>
+
 /* Shared definition of a struct used to communicate */
 #include "custom_com_def.h"
 
-#define CONN_MAX 5
-
 int ipc_socket_fd;
 
+/* set when the state was handed over to a new daemon */
+int handed_off;
+
 /**
  * @fn daemonize
  * @brief Convert this process to a daemon.
@@ -70,343 +74,1086 @@ daemonize(void)
     freopen("/dev/null", "w", stderr);
 }
 
+/* Longest string argument accepted from clients */
+#define IPC_STR_ARG_MAX 256
+
+/* Framed connections are kept open longer */
+#define IPC_FRAMED_IDLE_TIMEOUT_MS (10 * 60 * 1000)
+
+/* ipc_conn.proto values */
+enum ipc_proto
+{
+    IPC_PROTO_PLAIN,    /* one command per connection */
+    IPC_PROTO_FRAMED,   /* dopt_frame_header around every command */
+    IPC_PROTO_WATCH     /* subscribed in plain mode, only deltas are sent */
+};
+
 /**
- * @fn sigterm_handler
- * @brief Handler of SIGTERM
- * @param signum value ignored.
+ * @fn copy_str_arg
+ * @brief Copy a string argument out of a request.
+ * @return 0 on success or an error code if it does not fit.
+ *
+ * Arguments are not NUL-terminated on the wire.
  */
-__attribute__((noreturn))
-void
-sigterm_handler(int signum)
+int
+copy_str_arg(char *dst, size_t dst_size, const char *arg, size_t arg_size)
 {
-    (void)signum;
-    syslog(LOG_DEBUG, "Exiting...");
-    close(ipc_socket_fd);
-    packet_capture_stop();
-    exit(EXIT_SUCCESS);
+    arg_size = strnlen(arg, arg_size);
+    if(arg_size >= dst_size)
+        return ENAMETOOLONG;
+
+    memcpy(dst, arg, arg_size);
+    dst[arg_size] = '\0';
+    return 0;
 }
 
-/* Custom wrappers */
+/*****************/
+/* DOPT handlers */
+/*****************/
+
+/*
+ * Handlers queue their replies on the connection. An error returned
+ * by a handler means the reply could not be queued and the connection
+ * is dropped, errors of the command itself are sent as the status.
+ */
 
 int
-recv_logged(int sock, void *buffer, int size)
+dopt_start_handler(ipc_conn *conn, const char *arg, size_t arg_size)
 {
-    int err;
-    ssize_t n = recv(sock, (void*) buffer, size, 0);
-    if(n <= 0)
+    int32_t reply_status = packet_capture_start();
+
+    return ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+}
+
+int
+dopt_stop_handler(ipc_conn *conn, const char *arg, size_t arg_size)
+{
+    int32_t reply_status = packet_capture_stop();
+
+    return ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+}
+
+int
+dopt_set_iface_handler(ipc_conn *conn, const char *arg, size_t arg_size)
+{
+    int32_t reply_status;
+    char iface[IPC_STR_ARG_MAX + 1];
+
+    reply_status = copy_str_arg(iface, sizeof(iface), arg, arg_size);
+    if(!reply_status && !iface[0])
+        reply_status = EINVAL;
+    if(!reply_status)
+        reply_status = packet_set_iface(iface);
+
+    return ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+}
+
+int
+dopt_ip_count_handler(ipc_conn *conn, const char *arg, size_t arg_size)
+{
+    int32_t reply_status = 0;
+    uint32_t reply_value;
+    char ip[INET_ADDRSTRLEN];
+    int err, count = 0;
+
+    reply_status = copy_str_arg(ip, sizeof(ip), arg, arg_size);
+    if(!reply_status)
     {
-        if (n < 0)
+        count = packet_get_ip_count(ip);
+        if(count < 0)
         {
-            err = errno;
-            syslog(LOG_ERR, "recv() failed: %s", strerror(err));
-            return err;
+            /* this error will be sent back */
+            reply_status = errno;
+            syslog(LOG_ERR, "DOPT_IP_COUNT: error occured on get_ip_stats: %s",
+                   strerror(reply_status));
         }
-        else
+    }
+
+    /* Send status */
+    err = ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+
+    /* Skip sending args if the status is nonzero */
+    if(err || reply_status)
+        return err;
+
+    reply_value = count;
+    syslog(LOG_DEBUG, "DOPT_IP_COUNT: sending value: %u", reply_value);
+
+    return ipc_conn_reply(conn, &reply_value, sizeof(reply_value));
+}
+
+int
+dopt_stat_handler(ipc_conn *conn, const char *arg, size_t arg_size)
+{
+    int32_t reply_status;
+    uint32_t iface_count, stats_count;
+    size_t iface_stats_size = 0;
+    packet_interface_stats *iface_stats = NULL;
+    char iface[IPC_STR_ARG_MAX + 1];
+    int err;
+
+    /* an empty name means all interfaces */
+    reply_status = copy_str_arg(iface, sizeof(iface), arg, arg_size);
+    if(!reply_status)
+    {
+        reply_status = packet_get_iface_stats(&iface_stats, &iface_stats_size,
+                                              iface[0] ? iface : NULL);
+        if(reply_status)
+            syslog(LOG_ERR, "DOPT_STAT: error occured on get_iface_stats: %s",
+                   strerror(reply_status));
+    }
+
+    /* Send status */
+    err = ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+    if(err || reply_status)
+        goto out;
+
+    /* Send iface_count. 0 here means no data was found. */
+    iface_count = iface_stats_size;
+    err = ipc_conn_reply(conn, &iface_count, sizeof(iface_count));
+
+    /* Send stats_count and iface_names */
+    for(size_t i = 0; !err && i < iface_stats_size; ++i)
+    {
+        stats_count = iface_stats[i].size;
+        err = ipc_conn_reply(conn, &stats_count, sizeof(stats_count));
+    }
+
+    for(size_t i = 0; !err && i < iface_stats_size; ++i)
+        err = ipc_conn_reply(conn, iface_stats[i].ifname, IFNAMSIZ);
+
+    /* Send iface_stats */
+    for(size_t i = 0; !err && i < iface_stats_size; ++i)
+    {
+        for(size_t j = 0; !err && j < iface_stats[i].size; ++j)
         {
-            syslog(LOG_WARNING, "recv(): Empty message recieved");
+            err = ipc_conn_reply(conn, iface_stats[i].stats[j].ip, INET_ADDRSTRLEN);
+            if(!err)
+                err = ipc_conn_reply(conn, &iface_stats[i].stats[j].count, sizeof(uint32_t));
         }
     }
 
+out:
+    for(size_t i = 0; i < iface_stats_size; ++i)
+        free(iface_stats[i].stats);
+    free(iface_stats);
+    return err;
+}
+
+/* Reserved reply of DOPT_STAT_V2: status, header and the entries */
+typedef struct s_stat_v2_reply
+{
+    ipc_conn *conn;
+    char *data;
+    size_t size;
+} stat_v2_reply;
+
+#define STAT_V2_PREFIX_SIZE (sizeof(int32_t) + sizeof(dopt_stat_v2_header))
+
+static int
+stat_v2_alloc_fn(void *ctx, size_t count, dopt_stat_entry **entries)
+{
+    stat_v2_reply *reply = ctx;
+    void *data;
+    int err;
+
+    reply->size = STAT_V2_PREFIX_SIZE + count * sizeof(dopt_stat_entry);
+    err = ipc_conn_reply_reserve(reply->conn, reply->size, &data);
+    if(err)
+        return err;
+
+    reply->data = data;
+    *entries = (dopt_stat_entry *)(reply->data + STAT_V2_PREFIX_SIZE);
     return 0;
 }
 
 int
-send_logged(int sock, void *buffer, int size)
+dopt_stat_v2_handler(ipc_conn *conn, const char *arg, size_t arg_size)
 {
-    int err;
-    ssize_t n = send(sock, buffer, size, 0);
-    if(n == -1)
+    int32_t reply_status;
+    char iface[IPC_STR_ARG_MAX + 1];
+    stat_v2_reply reply = { conn, NULL, 0 };
+    dopt_stat_v2_header header;
+
+    /* an empty name means the current interface */
+    reply_status = copy_str_arg(iface, sizeof(iface), arg, arg_size);
+    if(!reply_status)
     {
-        err = errno;
-        syslog(LOG_ERR, "send() failed: %s", strerror(err));
-        return err;
+        /* entries are copied from the table straight to the output */
+        reply_status = packet_stats_export(iface[0] ? iface : NULL, stat_v2_alloc_fn,
+                                           &reply, &header);
+        if(reply_status && reply_status != EAGAIN && reply_status != ENODEV)
+            syslog(LOG_ERR, "DOPT_STAT_V2: export failed: %s", strerror(reply_status));
     }
 
+    if(reply_status)
+        return ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+
+    memcpy(reply.data, &reply_status, sizeof(reply_status));
+    memcpy(reply.data + sizeof(reply_status), &header, sizeof(header));
+    ipc_conn_reply_commit(conn, STAT_V2_PREFIX_SIZE
+                                + header.entry_count * sizeof(dopt_stat_entry));
+    return 0;
+}
+
+/* Reserved page of DOPT_STAT_PAGE and DOPT_STAT_STREAM */
+typedef struct s_stat_page_reply
+{
+    ipc_conn *conn;
+    size_t lead;        /* bytes before the page header */
+    char *data;
+    int err;            /* of the output, not of the stats */
+} stat_page_reply;
+
+static int
+stat_page_alloc_fn(void *ctx, size_t count, dopt_stat_entry **entries)
+{
+    stat_page_reply *reply = ctx;
+    void *data;
+
+    reply->err = ipc_conn_reply_reserve(reply->conn,
+                                        reply->lead + sizeof(dopt_stat_page)
+                                        + count * sizeof(dopt_stat_entry), &data);
+    if(reply->err)
+        return reply->err;
+
+    reply->data = data;
+    *entries = (dopt_stat_entry *)(reply->data + reply->lead + sizeof(dopt_stat_page));
+    return 0;
+}
+
+/*
+ * Reserve and fill a page after lead bytes left to the caller, who
+ * commits it. Returns an output error, errors of the stats are in
+ * page->status and leave nothing reserved.
+ */
+static int
+stat_page_build(ipc_conn *conn, size_t lead, uint64_t cursor, uint32_t max,
+                dopt_stat_page *page, char **data)
+{
+    stat_page_reply reply = { conn, lead, NULL, 0 };
+
+    memset(page, 0, sizeof(*page));
+    page->status = packet_stats_page(cursor, max, stat_page_alloc_fn, &reply,
+                                     &page->entry_count, &page->cursor);
+    if(reply.err)
+        return reply.err;
+
+    *data = reply.data;
+    if(!page->status)
+        memcpy(reply.data + lead, page, sizeof(*page));
+
     return 0;
 }
 
 int
-read_str_arg(int socket_fd, char **str)
+dopt_stat_page_handler(ipc_conn *conn, const char *arg, size_t arg_size)
 {
+    int32_t reply_status = 0;
+    uint64_t cursor;
+    uint32_t max;
+    dopt_stat_page page;
+    char *data;
     int err;
-    uint32_t str_size;
-    err = recv_logged(socket_fd, &str_size, sizeof(str_size));
+
+    memcpy(&cursor, arg, sizeof(cursor));
+    memcpy(&max, arg + sizeof(cursor), sizeof(max));
+    /* an empty page would echo the cursor, or 0 which means the end */
+    if(!max)
+    {
+        reply_status = EINVAL;
+        return ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+    }
+    if(max > DOPT_STAT_PAGE_MAX)
+        max = DOPT_STAT_PAGE_MAX;
+
+    err = stat_page_build(conn, sizeof(reply_status), cursor, max, &page, &data);
     if(err)
         return err;
+    if(page.status)
+        return ipc_conn_reply(conn, &page.status, sizeof(page.status));
 
-    if(!str_size)
+    memcpy(data, &reply_status, sizeof(reply_status));
+    ipc_conn_reply_commit(conn, sizeof(reply_status) + sizeof(page)
+                                + page.entry_count * sizeof(dopt_stat_entry));
+    return 0;
+}
+
+/* State of a DOPT_STAT_STREAM reply */
+typedef struct s_stat_stream
+{
+    uint64_t cursor;
+    int framed;
+    uint32_t id;
+} stat_stream;
+
+/* Queue the next page of a stream, see ipc_produce_fn */
+static int
+stat_stream_produce(ipc_conn *conn, void *ctx)
+{
+    stat_stream *stream = ctx;
+    size_t lead = stream->framed ? sizeof(dopt_frame_header) : 0;
+    dopt_frame_header frame;
+    dopt_stat_page page;
+    char *data;
+    int err;
+
+    err = stat_page_build(conn, lead, stream->cursor, DOPT_STAT_PAGE_MAX, &page, &data);
+    if(err)
+        return -err;
+
+    frame.id = stream->id;
+    if(page.status)
     {
-        *str = NULL;
+        /* the stream ends with the reason */
+        page.cursor = 0;
+        frame.size = sizeof(page);
+        err = stream->framed ? ipc_conn_reply(conn, &frame, sizeof(frame)) : 0;
+        if(!err)
+            err = ipc_conn_reply(conn, &page, sizeof(page));
+        return err ? -err : 1;
+    }
+
+    /* a sparse part of the table, nothing worth sending */
+    if(!page.entry_count && page.cursor)
+    {
+        stream->cursor = page.cursor;
         return 0;
     }
 
-    *str = malloc(str_size);
-    if(!*str)
+    frame.size = sizeof(page) + page.entry_count * sizeof(dopt_stat_entry);
+    if(stream->framed)
+        memcpy(data, &frame, sizeof(frame));
+    ipc_conn_reply_commit(conn, lead + frame.size);
+
+    stream->cursor = page.cursor;
+    return page.cursor ? 0 : 1;
+}
+
+int
+dopt_stat_stream_handler(ipc_conn *conn, const char *arg, size_t arg_size)
+{
+    int32_t reply_status = 0;
+    stat_stream *stream;
+    int err;
+
+    /* !!! malloc !!! */
+    stream = malloc(sizeof(*stream));
+    if(!stream)
+        reply_status = ENOMEM;
+
+    err = ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+    if(err || reply_status)
     {
-        err = errno;
-        syslog(LOG_ERR, "malloc() failed: %s", strerror(err));
+        free(stream);
         return err;
     }
 
-    err = recv_logged(socket_fd, *str, str_size); // FIXME: test buffer size
-    if(err)
+    memcpy(&stream->cursor, arg, sizeof(stream->cursor));
+    stream->framed = conn->proto == IPC_PROTO_FRAMED;
+    stream->id = conn->request_id;
+
+    /* pages are produced as the client reads them */
+    ipc_conn_set_producer(conn, stat_stream_produce, stream);
+    return 0;
+}
+
+int
+dopt_snapshot_fd_handler(ipc_conn *conn, const char *arg, size_t arg_size)
+{
+    int32_t reply_status;
+    dopt_snapshot_info info;
+    int fd = -1, err;
+
+    reply_status = packet_stats_snapshot_fd(&fd, &info);
+    if(reply_status && reply_status != EAGAIN)
+        syslog(LOG_ERR, "DOPT_SNAPSHOT_FD: snapshot failed: %s", strerror(reply_status));
+
+    err = ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+    if(err || reply_status)
     {
-        free(str);
+        if(fd >= 0)
+            close(fd);
         return err;
     }
 
-    return 0;
+    /* the server closes our copy of the memfd once it is sent */
+    return ipc_conn_reply_fds(conn, &info, sizeof(info), &fd, 1, 1);
 }
 
-/*****************/
-/* DOPT handlers */
-/*****************/
+int
+dopt_load_status_handler(ipc_conn *conn, const char *arg, size_t arg_size)
+{
+    int err;
+    int32_t reply_status = 0;
+    packet_load_progress progress;
+    dopt_load_status reply;
+
+    packet_get_load_progress(&progress);
+    reply.state = progress.state;
+    reply.error = progress.error;
+    reply.bytes_total = progress.bytes_total;
+    reply.bytes_done = progress.bytes_done;
+    reply.entries = progress.entries;
+
+    err = ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+    if(err)
+        return err;
+
+    return ipc_conn_reply(conn, &reply, sizeof(reply));
+}
 
 int
-dopt_start_handler(int remote_connection_socket)
+dopt_handoff_handler(ipc_conn *conn, const char *arg, size_t arg_size)
 {
     int err;
-    int32_t reply_status = packet_capture_start();
+    int32_t reply_status, ack;
+    packet_handoff_state state;
+    dopt_handoff_state reply;
+    int fds[HANDOFF_FD_MAX];
 
-    err = send_logged(remote_connection_socket, &reply_status, sizeof(reply_status));
+    reply_status = packet_handoff_export(&state);
+
+    err = ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+    if(err || reply_status)
+    {
+        syslog(LOG_ERR, "DOPT_HANDOFF refused: %s",
+               strerror(reply_status ? reply_status : err));
+        packet_handoff_abort(&state);
+        return err;
+    }
+
+    memset(&reply, 0, sizeof(reply));
+    reply.version = HANDOFF_VERSION;
+    reply.capturing = state.capturing;
+    memcpy(reply.ifname, state.ifname, sizeof(reply.ifname));
+
+    /* descriptors are positional, stop at the first missing one */
+    fds[reply.fd_count++] = ipc_socket_fd;
+    if(state.table_fd >= 0)
+    {
+        fds[reply.fd_count++] = state.table_fd;
+        if(state.capture_fd >= 0)
+            fds[reply.fd_count++] = state.capture_fd;
+    }
+
+    /* whatever is queued must reach the disk before we go */
+    persist_flush();
+
+    /* the new daemon listens on the same metrics address */
+    metrics_stop();
+
+    /* the state is only gone once the new daemon says it adopted it */
+    err = ipc_conn_reply_fds(conn, &reply, sizeof(reply), fds, reply.fd_count, 0);
+    if(!err)
+        err = ipc_conn_flush_wait(conn, IPC_WRITE_TIMEOUT_MS);
+    if(!err)
+    {
+        err = ipc_conn_recv_wait(conn, &ack, sizeof(ack), HANDOFF_ACK_TIMEOUT_MS);
+        if(!err && ack)
+            err = ack;
+    }
     if(err)
     {
-        syslog(LOG_ERR, "DOPT_START reply failed!");
+        /* the table was not dumped, keep it alive by serving on */
+        syslog(LOG_ERR, "DOPT_HANDOFF failed, resuming: %s", strerror(err));
+        packet_handoff_abort(&state);
+        if(metrics_start())
+            syslog(LOG_WARNING, "metrics exporter not restarted");
         return err;
     }
 
+    handed_off = 1;
+    ipc_server_stop();
     return 0;
 }
 
 int
-dopt_stop_handler(int remote_connection_socket)
+dopt_ip_count_batch_handler(ipc_conn *conn, const char *arg, size_t arg_size)
 {
+    int32_t reply_status = 0;
+    uint32_t family, addr_count;
+    uint32_t *addrs;
+    uint64_t *counts;
     int err;
-    int32_t reply_status = packet_capture_stop();
 
-    err = send_logged(remote_connection_socket, &reply_status, sizeof(reply_status));
-    if(err)
+    /* sizes were checked by dopt_parse() */
+    memcpy(&family, arg, sizeof(family));
+    memcpy(&addr_count, arg + sizeof(family), sizeof(addr_count));
+    arg += sizeof(family) + sizeof(addr_count);
+
+    /* !!! malloc !!! */
+    addrs = malloc(2 * addr_count * sizeof(*addrs) + 1);
+    counts = malloc(addr_count * sizeof(*counts) + 1);
+    if(!addrs || !counts)
     {
-        syslog(LOG_ERR, "DOPT_STOP reply failed!");
-        return err;
+        reply_status = ENOMEM;
+        syslog(LOG_ERR, "DOPT_IP_COUNT_BATCH: malloc() failed");
     }
+    else if(family == AF_INET)
+    {
+        memcpy(addrs, arg, addr_count * sizeof(*addrs));
+        packet_get_ip_counts(addrs, addr_count, counts);
+    }
+    else
+    {
+        /* only IPv4 is counted, look up the mapped addresses... */
+        uint32_t v4_count = 0, next = addr_count;
+        uint32_t *positions = addrs + addr_count;
 
-    return 0;
+        for(uint32_t i = 0; i < addr_count; ++i)
+        {
+            struct in6_addr addr;
+            memcpy(&addr, arg + i * sizeof(addr), sizeof(addr));
+            if(IN6_IS_ADDR_V4MAPPED(&addr))
+            {
+                memcpy(&addrs[v4_count], &addr.s6_addr[12], sizeof(*addrs));
+                positions[v4_count++] = i;
+            }
+        }
+
+        packet_get_ip_counts(addrs, v4_count, counts);
+
+        /* ...and move their counts to their positions, back to front */
+        for(uint32_t k = v4_count; k-- > 0;)
+        {
+            uint64_t value = counts[k];
+            for(uint32_t j = positions[k] + 1; j < next; ++j)
+                counts[j] = 0;
+            counts[positions[k]] = value;
+            next = positions[k];
+        }
+        for(uint32_t j = 0; j < next; ++j)
+            counts[j] = 0;
+    }
+
+    err = ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+    if(!err && !reply_status)
+        err = ipc_conn_reply(conn, &addr_count, sizeof(addr_count));
+    if(!err && !reply_status)
+        err = ipc_conn_reply(conn, counts, addr_count * sizeof(*counts));
+
+    free(addrs);
+    free(counts);
+    return err;
 }
 
 int
-dopt_set_iface_handler(int remote_connection_socket)
+dopt_framed_handler(ipc_conn *conn, const char *arg, size_t arg_size)
+{
+    int32_t reply_status = 0;
+
+    conn->proto = IPC_PROTO_FRAMED;
+    conn->idle_timeout = IPC_FRAMED_IDLE_TIMEOUT_MS;
+
+    return ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+}
+
+int
+dopt_watch_handler(ipc_conn *conn, const char *arg, size_t arg_size)
 {
     int32_t reply_status;
-    char *arg = NULL;
+    dopt_watch_info info;
+    int framed = conn->proto == IPC_PROTO_FRAMED;
     int err;
 
-    err = read_str_arg(remote_connection_socket, &arg);
-    if(err || !arg)
-    {
-        syslog(LOG_ERR, "DOPT_SET_IFACE arg not received!");
-        if(arg)
-            free(arg);
+    reply_status = watch_subscribe(conn, framed, conn->request_id, &info);
+    if(reply_status && reply_status != EALREADY)
+        syslog(LOG_ERR, "DOPT_WATCH: subscribing failed: %s", strerror(reply_status));
 
+    err = ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+    if(err || reply_status)
         return err;
+
+    if(!framed)
+    {
+        /* the connection stays open for the deltas, which may be
+           further apart than the idle timeout */
+        conn->proto = IPC_PROTO_WATCH;
+        conn->idle_timeout = UINT32_MAX;
     }
 
-    reply_status = packet_set_iface(arg);
-    free(arg);
+    return ipc_conn_reply(conn, &info, sizeof(info));
+}
+
+#define QUERY_PREFIX_SIZE (sizeof(int32_t) + sizeof(dopt_query_result))
+
+/* Reserve the reply of DOPT_QUERY, laid out like the one of DOPT_STAT_V2 */
+static int
+query_alloc_fn(void *ctx, size_t count, dopt_stat_entry **entries)
+{
+    stat_v2_reply *reply = ctx;
+    void *data;
+    int err;
 
-    err = send_logged(remote_connection_socket, &reply_status, sizeof(reply_status));
+    reply->size = QUERY_PREFIX_SIZE + count * sizeof(dopt_stat_entry);
+    err = ipc_conn_reply_reserve(reply->conn, reply->size, &data);
     if(err)
-    {
-        syslog(LOG_ERR, "DOPT_SET_IFACE reply failed!");
         return err;
-    }
 
+    reply->data = data;
+    *entries = (dopt_stat_entry *)(reply->data + QUERY_PREFIX_SIZE);
     return 0;
 }
 
 int
-dopt_ip_count_handler(int remote_connection_socket)
+dopt_query_handler(ipc_conn *conn, const char *arg, size_t arg_size)
 {
     int32_t reply_status;
-    uint32_t reply_value;
-    char *arg = NULL;
-    int err, count;
+    stat_v2_reply reply = { conn, NULL, 0 };
+    dopt_query_result result;
+    dopt_query query;
+
+    memcpy(&query, arg, sizeof(query));
+
+    /* only the selected rows are written to the output */
+    reply_status = packet_stats_query(&query, query_alloc_fn, &reply, &result);
+    if(reply_status && reply_status != EAGAIN && reply_status != EINVAL)
+        syslog(LOG_ERR, "DOPT_QUERY: query failed: %s", strerror(reply_status));
+
+    if(reply_status)
+        return ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+
+    memcpy(reply.data, &reply_status, sizeof(reply_status));
+    memcpy(reply.data + sizeof(reply_status), &result, sizeof(result));
+    ipc_conn_reply_commit(conn, QUERY_PREFIX_SIZE
+                                + result.row_count * sizeof(dopt_stat_entry));
+    return 0;
+}
+
+int
+dopt_selfstat_handler(ipc_conn *conn, const char *arg, size_t arg_size)
+{
+    int32_t reply_status = 0;
+    dopt_selfstat stats;
+    uint64_t hist[HIST_BUCKETS];
+    int err;
+
+    packet_get_selfstat(&stats, hist);
+
+    err = ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
+    if(!err)
+        err = ipc_conn_reply(conn, &stats, sizeof(stats));
+    if(!err)
+        err = ipc_conn_reply(conn, hist, sizeof(hist));
+    return err;
+}
 
-    /* read arg */
-    err = read_str_arg(remote_connection_socket, &arg);
-    if(err || !arg)
+typedef int (*dopt_handler_fn)(ipc_conn *conn, const char *arg, size_t arg_size);
+
+/**
+ * @struct s_dopt_command
+ * @typedef dopt_command
+ * @brief A parsed command, arguments point into the request.
+ */
+typedef struct s_dopt_command
+{
+    uint32_t option;
+    const char *name;
+    dopt_handler_fn handler;
+    const char *arg;
+    size_t arg_size;
+} dopt_command;
+
+/**
+ * @fn dopt_parse
+ * @brief Parse one command laid out as described in `shared/custom_com_def.h`.
+ *
+ * @return size of the command, 0 if it is not complete or a negative
+ *         error code if it is malformed.
+ */
+ssize_t
+dopt_parse(const char *data, size_t size, dopt_command *cmd)
+{
+    uint32_t arg_size = 0;
+    size_t header = sizeof(cmd->option);
+
+    if(size < sizeof(cmd->option))
+        return 0;
+    memcpy(&cmd->option, data, sizeof(cmd->option));
+
+    switch(cmd->option)
     {
-        syslog(LOG_ERR, "DOPT_IP_COUNT arg not received!");
-        return err;
-    }
+    case DOPT_START:
+        cmd->name = "DOPT_START";
+        cmd->handler = dopt_start_handler;
+        break;
+
+    case DOPT_STOP:
+        cmd->name = "DOPT_STOP";
+        cmd->handler = dopt_stop_handler;
+        break;
+
+    case DOPT_SET_IFACE:
+    case DOPT_STAT:
+    case DOPT_STAT_V2:
+        if(cmd->option == DOPT_STAT)
+        {
+            cmd->name = "DOPT_STAT";
+            cmd->handler = dopt_stat_handler;
+        }
+        else if(cmd->option == DOPT_STAT_V2)
+        {
+            cmd->name = "DOPT_STAT_V2";
+            cmd->handler = dopt_stat_v2_handler;
+        }
+        else
+        {
+            cmd->name = "DOPT_SET_IFACE";
+            cmd->handler = dopt_set_iface_handler;
+        }
 
-    count = packet_get_ip_count(arg);
-    if(count < 0)
+        /* uint32_t size followed by the string */
+        if(size < sizeof(cmd->option) + sizeof(arg_size))
+            return 0;
+        memcpy(&arg_size, data + sizeof(cmd->option), sizeof(arg_size));
+        header += sizeof(arg_size);
+        if(arg_size > IPC_STR_ARG_MAX)
+        {
+            syslog(LOG_ERR, "%s: argument too long (%u)", cmd->name, arg_size);
+            return -EMSGSIZE;
+        }
+        break;
+
+    case DOPT_IP_COUNT:
+        cmd->name = "DOPT_IP_COUNT";
+        cmd->handler = dopt_ip_count_handler;
+        arg_size = INET_ADDRSTRLEN;
+        break;
+
+    case DOPT_STAT_PAGE:
+        cmd->name = "DOPT_STAT_PAGE";
+        cmd->handler = dopt_stat_page_handler;
+        arg_size = sizeof(uint64_t) + sizeof(uint32_t);
+        break;
+
+    case DOPT_STAT_STREAM:
+        cmd->name = "DOPT_STAT_STREAM";
+        cmd->handler = dopt_stat_stream_handler;
+        arg_size = sizeof(uint64_t);
+        break;
+
+    case DOPT_SNAPSHOT_FD:
+        cmd->name = "DOPT_SNAPSHOT_FD";
+        cmd->handler = dopt_snapshot_fd_handler;
+        break;
+
+    case DOPT_LOAD_STATUS:
+        cmd->name = "DOPT_LOAD_STATUS";
+        cmd->handler = dopt_load_status_handler;
+        break;
+
+    case DOPT_HANDOFF:
+        cmd->name = "DOPT_HANDOFF";
+        cmd->handler = dopt_handoff_handler;
+        break;
+
+    case DOPT_IP_COUNT_BATCH:
     {
-        /* this error will be sent back */
-        reply_status = errno;
-        syslog(LOG_ERR, "DOPT_IP_COUNT: error occured on get_ip_stats: %s",
-               strerror(reply_status));
-    }
+        uint32_t batch[2];  /* family, addr_count */
 
-    free(arg);
+        cmd->name = "DOPT_IP_COUNT_BATCH";
+        cmd->handler = dopt_ip_count_batch_handler;
 
-    /* Send status */
-    err = send_logged(remote_connection_socket, &reply_status, sizeof(reply_status));
-    if(err)
-    {
-        syslog(LOG_ERR, "DOPT_STOP status reply failed!");
-        return err;
+        /* the handler gets the family and count too */
+        if(size < sizeof(cmd->option) + sizeof(batch))
+            return 0;
+        memcpy(batch, data + sizeof(cmd->option), sizeof(batch));
+        if((batch[0] != AF_INET && batch[0] != AF_INET6) || batch[1] > DOPT_BATCH_MAX)
+        {
+            syslog(LOG_ERR, "%s: invalid batch (family %u, %u addresses)",
+                   cmd->name, batch[0], batch[1]);
+            return -EINVAL;
+        }
+        arg_size = sizeof(batch) + batch[1] * (batch[0] == AF_INET
+                                               ? sizeof(struct in_addr)
+                                               : sizeof(struct in6_addr));
+        break;
     }
 
-    /* Skip sending args if the status is nonzero */
-    if(reply_status)
+    case DOPT_FRAMED:
+        cmd->name = "DOPT_FRAMED";
+        cmd->handler = dopt_framed_handler;
+        break;
+
+    case DOPT_WATCH:
+        cmd->name = "DOPT_WATCH";
+        cmd->handler = dopt_watch_handler;
+        break;
+
+    case DOPT_QUERY:
+        cmd->name = "DOPT_QUERY";
+        cmd->handler = dopt_query_handler;
+        arg_size = sizeof(dopt_query);
+        break;
+
+    case DOPT_SELFSTAT:
+        cmd->name = "DOPT_SELFSTAT";
+        cmd->handler = dopt_selfstat_handler;
+        break;
+
+    default:
+        syslog(LOG_ERR, "Invalid option received!");
+        return -EOPNOTSUPP;
+    }
+
+    if(size < header + arg_size)
         return 0;
 
-    reply_value = count;
-    syslog(LOG_DEBUG, "DOPT_IP_COUNT: sending value: %d",
-           reply_value);
+    cmd->arg = data + header;
+    cmd->arg_size = arg_size;
+    return header + arg_size;
+}
 
-    /* Send value back */
-    err = send_logged(remote_connection_socket, &reply_value, sizeof(reply_value));
+/**
+ * @fn ipc_plain_request
+ * @brief Serve one unframed command, the connection is closed after it.
+ */
+ssize_t
+ipc_plain_request(ipc_conn *conn, const char *data, size_t size)
+{
+    dopt_command cmd;
+    ssize_t n;
+    int err;
+
+    n = dopt_parse(data, size, &cmd);
+    if(n <= 0)
+        return n;
+
+    syslog(LOG_DEBUG, "%s", cmd.name);
+    NETSNIFF_PROBE3(ipc__command__start, cmd.option, cmd.name, 0);
+    err = cmd.handler(conn, cmd.arg, cmd.arg_size);
+    NETSNIFF_PROBE2(ipc__command__done, cmd.option, err);
     if(err)
     {
-        syslog(LOG_ERR, "DOPT_STOP value reply failed!");
-        return err;
+        syslog(LOG_ERR, "%s reply failed!", cmd.name);
+        return -err;
     }
 
-    return 0;
+    /* unless the client asked to keep it */
+    if(conn->proto == IPC_PROTO_PLAIN)
+        ipc_conn_close_when_done(conn);
+
+    return n;
 }
 
-int
-dopt_stat_handler(int remote_connection_socket)
+/**
+ * @fn ipc_framed_request
+ * @brief Serve one framed command, the connection stays open.
+ *
+ * The reply header is queued first and its size filled in once the
+ * handler has queued the reply.
+ */
+ssize_t
+ipc_framed_request(ipc_conn *conn, const char *data, size_t size)
 {
-    int32_t reply_status;
-    uint32_t iface_stats_size;
-    char *arg = NULL;
+    dopt_frame_header frame, reply;
+    dopt_command cmd;
+    uint64_t mark;
+    int32_t reply_status = 0;
+    ssize_t n;
     int err;
-    packet_interface_stats *iface_stats = NULL;
-    uint32_t *stats_count, stats_count_size;
 
-    /* read arg */
-    err = read_str_arg(remote_connection_socket, &arg);
-    if(err) /* e don't care if arg is NULL here */
+    if(size < sizeof(frame))
+        return 0;
+    memcpy(&frame, data, sizeof(frame));
+
+    if(frame.size > DOPT_FRAME_MAX)
     {
-        syslog(LOG_ERR, "DOPT_IP_COUNT arg not received!");
-        return err;
+        syslog(LOG_ERR, "frame too large (%u)", frame.size);
+        return -EMSGSIZE;
     }
+    if(size < sizeof(frame) + frame.size)
+        return 0;
 
-    err = packet_get_iface_stats(&iface_stats, (size_t *) &iface_stats_size, arg);
+    reply.id = frame.id;
+    reply.size = 0;
+    mark = ipc_conn_reply_mark(conn);
+    err = ipc_conn_reply(conn, &reply, sizeof(reply));
     if(err)
+        return -err;
+
+    /* the command must fill the frame exactly */
+    n = dopt_parse(data + sizeof(frame), frame.size, &cmd);
+    if(n < 0)
+        reply_status = -n;
+    else if((size_t) n != frame.size)
+        reply_status = EPROTO;
+    else if(cmd.option == DOPT_HANDOFF)
+        reply_status = EOPNOTSUPP;
+
+    if(reply_status)
     {
-        /* this error will be sent back */
-        reply_status = err;
-        syslog(LOG_ERR, "DOPT_IP_COUNT: error occured on get_iface_stats: %s",
-               strerror(reply_status));
+        err = ipc_conn_reply(conn, &reply_status, sizeof(reply_status));
     }
-
-    /* pre-alloc stats_count to catch and report errors */
-    if(!reply_status && !iface_stats_size)
+    else
     {
-        stats_count_size = sizeof(*stats_count) * iface_stats_size;
-        stats_count = malloc(stats_count_size);
-        if(!stats_count)
-        {
-            reply_status = errno;
-            syslog(LOG_ERR, "DOPT_IP_COUNT: malloc() failed: %s",
-                   strerror(reply_status));
-        }
+        syslog(LOG_DEBUG, "%s #%u", cmd.name, frame.id);
+        conn->request_id = frame.id;
+        NETSNIFF_PROBE3(ipc__command__start, cmd.option, cmd.name, frame.id);
+        err = cmd.handler(conn, cmd.arg, cmd.arg_size);
+        NETSNIFF_PROBE2(ipc__command__done, cmd.option, err);
     }
 
-    /* Send status */
-    err = send_logged(remote_connection_socket, &reply_status, sizeof(reply_status));
     if(err)
     {
-        syslog(LOG_ERR, "DOPT_IP_COUNT status reply failed!");
-        return err;
+        syslog(LOG_ERR, "framed reply failed: %s", strerror(err));
+        return -err;
     }
 
-    /* Skip sending args if the status is nonzero */
-    if(reply_status)
-        return 0;
-
-    /* Send iface_count */
-    err = send_logged(remote_connection_socket, &iface_stats_size, sizeof(iface_stats_size));
+    reply.size = ipc_conn_reply_mark(conn) - mark - sizeof(reply);
+    err = ipc_conn_reply_patch(conn, mark, &reply, sizeof(reply));
     if(err)
+        return -err;
+
+    return sizeof(frame) + frame.size;
+}
+
+/**
+ * @fn ipc_request_handler
+ * @brief Parse and execute one command from a client.
+ */
+ssize_t
+ipc_request_handler(ipc_conn *conn, const char *data, size_t size)
+{
+    if(conn->proto == IPC_PROTO_FRAMED)
+        return ipc_framed_request(conn, data, size);
+
+    /* a plain subscription takes no more commands */
+    if(conn->proto == IPC_PROTO_WATCH)
+        return -EPROTO;
+
+    return ipc_plain_request(conn, data, size);
+}
+
+/**
+ * @fn handoff_receive
+ * @brief Take over the state of a running daemon.
+ * @return 0 on success or an error code on failure.
+ *
+ * Sends DOPT_HANDOFF to the running daemon and adopts its IPC socket,
+ * capture socket and counter table, then acknowledges. The old daemon
+ * only exits on a successful acknowledgement.
+ */
+int
+handoff_receive(void)
+{
+    struct sockaddr_un remote;
+    uint32_t option = DOPT_HANDOFF;
+    int32_t status, ack;
+    int sock, err;
+    int fds[HANDOFF_FD_MAX];
+    dopt_handoff_state reply;
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { &reply, sizeof(reply) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    packet_handoff_state state;
+    unsigned fd_count = 0;
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock == -1)
+        return errno;
+
+    memset(&remote, 0, sizeof(remote));
+    remote.sun_family = AF_UNIX;
+    strncpy(remote.sun_path, IPC_SOCKET_PATH, sizeof(remote.sun_path)-1);
+    if(connect(sock, (struct sockaddr *) &remote, sizeof(remote)) == -1
+       || send(sock, &option, sizeof(option), MSG_NOSIGNAL) != sizeof(option)
+       || recv(sock, &status, sizeof(status), MSG_WAITALL) != sizeof(status))
     {
-        syslog(LOG_ERR, "DOPT_IP_COUNT value reply failed!");
-        if(stats_count)
-            free(stats_count);
+        err = errno ? errno : EPROTO;
+        syslog(LOG_ERR, "handoff request failed: %s", strerror(err));
+        close(sock);
         return err;
     }
 
-    /* Skip other data. 0 here means no data was found.*/
-    if(iface_stats_size)
-        return 0;
-
-    /* Send stats_count */
-    for(int i = 0; i < iface_stats_size; ++i)
+    if(status)
     {
-        stats_count[i] = iface_stats[i].size;
+        syslog(LOG_ERR, "handoff refused: %s", strerror(status));
+        close(sock);
+        return status;
     }
 
-    err = send_logged(remote_connection_socket, &stats_count, sizeof(iface_stats_size));
-    if(err)
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if(recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(reply))
     {
-        syslog(LOG_ERR, "DOPT_IP_COUNT value reply failed!");
-        free(stats_count);
+        err = errno ? errno : EPROTO;
+        syslog(LOG_ERR, "handoff recvmsg() failed: %s", strerror(err));
+        close(sock);
         return err;
     }
 
-    /* Send iface_stats */
-    for(int i = 0; i < iface_stats_size; ++i)
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
     {
-        for(int j = 0; j < stats_count[i]; ++j)
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
         {
-            err = send_logged(remote_connection_socket,
-                              &iface_stats[i].stats[i].ip,
-                              INET_ADDRSTRLEN * sizeof(char));
-            if(err)
-            {
-                syslog(LOG_ERR, "DOPT_IP_COUNT value reply failed!");
-                free(stats_count);
-                return err;
-            }
-
-            err = send_logged(remote_connection_socket,
-                              &iface_stats[i].stats[i].count,
-                              sizeof(uint32_t));
-            if(err)
-            {
-                syslog(LOG_ERR, "DOPT_IP_COUNT value reply failed!");
-                free(stats_count);
-                return err;
-            }
+            fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), fd_count * sizeof(int));
         }
     }
 
-    free(stats_count);
+    if(reply.version != HANDOFF_VERSION || !fd_count || fd_count != reply.fd_count)
+    {
+        syslog(LOG_ERR, "handoff: unexpected reply (version %u, %u fds)",
+               reply.version, fd_count);
+        for(unsigned i = 0; i < fd_count; ++i)
+            close(fds[i]);
+        /* the old daemon resumes on EOF */
+        close(sock);
+        return EPROTO;
+    }
+
+    memset(&state, 0, sizeof(state));
+    memcpy(state.ifname, reply.ifname, sizeof(reply.ifname));
+    state.ifname[IFNAMSIZ - 1] = '\0';
+    state.capturing = reply.capturing;
+    state.table_fd = fd_count > 1 ? fds[1] : -1;
+    state.capture_fd = fd_count > 2 ? fds[2] : -1;
+
+    err = packet_handoff_import(&state);
+
+    /* The old daemon waits for this before it exits, and resumes on
+       anything but 0. A late ack finds the connection closed. */
+    ack = err;
+    if(send(sock, &ack, sizeof(ack), MSG_NOSIGNAL) != sizeof(ack) && !err)
+    {
+        err = errno;
+        syslog(LOG_ERR, "handoff ack failed: %s", strerror(err));
+    }
+    close(sock);
+    if(err)
+    {
+        syslog(LOG_ERR, "handoff import failed, the old daemon goes on: %s",
+               strerror(err));
+        return err;
+    }
+    ipc_socket_fd = fds[0];
+
+    syslog(LOG_INFO, "took over running daemon (capture %s)",
+           state.capturing ? "running" : "stopped");
     return 0;
 }
 
-int 
-main(void)
+/**
+ * @fn ipc_socket_create
+ * @brief Create, bind and listen on the IPC socket.
+ * @return 0 on success or an error code on failure.
+ */
+int
+ipc_socket_create(void)
 {
-    struct sockaddr_un local_addr, remote_addr;
-    int remote_connection_socket;
-
-    daemonize();
-    syslog(LOG_DEBUG, "Process running");
-
-    /* init signal handling */
-    signal(SIGTERM, sigterm_handler);
+    struct sockaddr_un local_addr;
 
     /* create IPC socket */
-    ipc_socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ipc_socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if(ipc_socket_fd == -1)
     {
         syslog(LOG_ERR, "socket() failed: %s", strerror(errno));
-        return 1;
+        return errno;
     }
 
     memset(&local_addr, 0, sizeof(local_addr));
@@ -417,107 +1164,315 @@ main(void)
     if(bind(ipc_socket_fd, (struct sockaddr*) &local_addr, sizeof(local_addr)) == -1)
     {
         syslog(LOG_ERR, "bind() failed: %s", strerror(errno));
-        return 1;
+        return errno;
     }
 
     /* listen */
-    if(listen(ipc_socket_fd, 5) == -1)
+    if(listen(ipc_socket_fd, SOMAXCONN) == -1)
     {
         syslog(LOG_ERR, "listen() failed: %s", strerror(errno));
-        return 1;
+        return errno;
     }
 
-    /* main loop */
-    for(;;)
-    {
-        int err;
-        uint32_t option;
-        socklen_t remote_size = sizeof(remote_addr);
+    return 0;
+}
 
-        /* waiting for connection */
-        syslog(LOG_DEBUG, "Waiting for connection");
-        remote_connection_socket = accept(ipc_socket_fd,
-                               (struct sockaddr *) &remote_addr,
-                               &remote_size);
-        if (remote_connection_socket == -1)
-        {
-           syslog(LOG_ERR, "accept() failed: %s", strerror(errno));
-           return EXIT_FAILURE;
-        }
-        syslog(LOG_DEBUG, "Connected!");
-        /* Now we are connected, read stream and reply */
-
-        /*
-        * Daemon now expects this connection to send a uint32_t
-        * with one of the passed_option values. It will expect
-        * more values depending on an option. They are defined
-        * in `shared/custom_com_def.h`.
-        */
-
-        /* reading passed_option */
-        err = recv_logged(remote_connection_socket, &option, sizeof(option));
-        if(err)
-        {
-            close(remote_connection_socket);
-            return EXIT_FAILURE;
-        }
+/**
+ * @fn usage
+ * @brief Print command line help.
+ */
+void
+usage(const char *name)
+{
+    printf("Usage: %s [--takeover] [--history N] [--history-days D]\n", name);
+    printf("       [--watch-interval MS] [--metrics ADDR] [--metrics-top N]\n");
+    printf("       [--capture-cpus LIST] [--aggregate-cpus LIST] [--ipc-cpus LIST]\n");
+    printf("       [--persist-cpus LIST] [--numa-node N|auto|none] [--rt-priority P]\n");
+    printf("       [--busy-poll USEC] [--backend socket|bpf|xdp]\n");
+    printf("       [--xdp-mode auto|native|generic] [--interface NAME]\n");
+    printf("--takeover          :   take over sockets and counters of a running\n");
+    printf("                        netsniffd without stopping capture.\n");
+    printf("--history N         :   keep N timestamped snapshots per interface\n");
+    printf("                        in %s (default %d, 0 disables).\n",
+           HISTORY_DIR, HISTORY_DEFAULT_KEEP);
+    printf("--history-days D    :   remove snapshots older than D days\n");
+    printf("                        (default %d, 0 means no limit).\n",
+           HISTORY_DEFAULT_MAX_AGE_DAYS);
+    printf("--watch-interval MS :   push deltas to DOPT_WATCH subscribers every\n");
+    printf("                        MS milliseconds (default %d, %d to %d).\n",
+           WATCH_DEFAULT_INTERVAL_MS, WATCH_MIN_INTERVAL_MS, WATCH_MAX_INTERVAL_MS);
+    printf("--metrics ADDR      :   serve OpenMetrics over HTTP on ADDR, which is\n");
+    printf("                        HOST:PORT, :PORT (loopback) or a socket path.\n");
+    printf("--metrics-top N     :   export counts of the N busiest IPs\n");
+    printf("                        (default %d, at most %d).\n",
+           METRICS_DEFAULT_TOP, METRICS_TOP_MAX);
+    printf("--capture-cpus LIST :   run the thread receiving packets on CPUs in\n");
+    printf("                        LIST, e.g. 0-3,8 (default: all).\n");
+    printf("--aggregate-cpus LIST : run the thread counting packets on LIST.\n");
+    printf("--ipc-cpus LIST     :   serve clients and the exporter on LIST.\n");
+    printf("--persist-cpus LIST :   save and load stats on LIST.\n");
+    printf("--numa-node N       :   keep the counter table and the capture ring on\n");
+    printf("                        node N, auto for the node of the interface\n");
+    printf("                        (default) or none.\n");
+    printf("--rt-priority P     :   receive packets under SCHED_FIFO priority P,\n");
+    printf("                        1 to 99. Put the counting thread on other\n");
+    printf("                        CPUs, or it may starve.\n");
+    printf("--busy-poll USEC    :   receive and count packets spinning, a CPU\n");
+    printf("                        each, rather than woken, until there is no\n");
+    printf("                        traffic for USEC (default 0, never spin).\n");
+    printf("--backend NAME      :   socket receives every packet (default), bpf\n");
+    printf("                        counts them in the kernel with an eBPF socket\n");
+    printf("                        filter and reads the counts every %d ms,\n",
+           CAPTURE_BPF_INTERVAL_MS);
+    printf("                        xdp receives on AF_XDP sockets; IPv4 TCP\n");
+    printf("                        then bypasses the host stack, use it on a\n");
+    printf("                        mirror port or tap.\n");
+    printf("--xdp-mode MODE     :   run the xdp program in the driver (native,\n");
+    printf("                        zero-copy where supported), after it on any\n");
+    printf("                        device (generic), or native if possible (auto,\n");
+    printf("                        default).\n");
+    printf("--interface NAME    :   capture on NAME (default %s).\n", DEFAULT_IFACE);
+}
+
+/* Parses a number of at most max, returns 0 or EINVAL if invalid */
+static int
+parse_unsigned(const char *arg, unsigned long max, unsigned *value)
+{
+    unsigned long n;
+    char *end;
+
+    errno = 0;
+    n = strtoul(arg, &end, 10);
+    if(end == arg || *end || errno || n > max || arg[0] == '-')
+        return EINVAL;
+
+    *value = n;
+    return 0;
+}
 
-        /* take action */
+/* Returns a placement_set_node() value, or INT_MIN if invalid */
+static int
+parse_numa_node(const char *arg)
+{
+    char *end;
+    long node;
+
+    if(!strcmp(arg, "auto"))
+        return PLACEMENT_NODE_AUTO;
+    if(!strcmp(arg, "none"))
+        return PLACEMENT_NODE_NONE;
+
+    node = strtol(arg, &end, 10);
+    if(end == arg || *end || node < 0 || node > INT_MAX)
+        return INT_MIN;
+    return node;
+}
 
-        /* We must send a status value back as well as other
-         * defined replies. */
-        switch (option)
+int 
+main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "takeover", no_argument, NULL, 't' },
+        { "history", required_argument, NULL, 'k' },
+        { "history-days", required_argument, NULL, 'd' },
+        { "watch-interval", required_argument, NULL, 'w' },
+        { "metrics", required_argument, NULL, 'm' },
+        { "metrics-top", required_argument, NULL, 'n' },
+        { "capture-cpus", required_argument, NULL, 'C' },
+        { "aggregate-cpus", required_argument, NULL, 'A' },
+        { "ipc-cpus", required_argument, NULL, 'I' },
+        { "persist-cpus", required_argument, NULL, 'P' },
+        { "numa-node", required_argument, NULL, 'N' },
+        { "rt-priority", required_argument, NULL, 'R' },
+        { "busy-poll", required_argument, NULL, 'b' },
+        { "backend", required_argument, NULL, 'B' },
+        { "xdp-mode", required_argument, NULL, 'X' },
+        { "interface", required_argument, NULL, 'i' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int takeover = 0, opt, err, node;
+    unsigned history_keep = HISTORY_DEFAULT_KEEP;
+    unsigned history_days = HISTORY_DEFAULT_MAX_AGE_DAYS;
+    unsigned watch_interval, rt_priority, busy_poll;
+    unsigned metrics_top = METRICS_DEFAULT_TOP;
+    const char *metrics_addr = NULL;
+    sigset_t stop_signals;
+
+    while((opt = getopt_long(argc, argv, "thk:d:w:m:n:C:A:I:P:N:R:b:B:X:i:", long_options, NULL)) != -1)
+    {
+        switch(opt)
         {
-        case DOPT_START:
-            syslog(LOG_DEBUG, "DOPT_START");
-            if(dopt_start_handler(remote_connection_socket))
+        case 't':
+            takeover = 1;
+            break;
+        case 'k':
+            if(parse_unsigned(optarg, UINT_MAX, &history_keep))
             {
-                close(remote_connection_socket);
+                fprintf(stderr, "%s: invalid number of snapshots: %s\n", argv[0], optarg);
                 return EXIT_FAILURE;
             }
             break;
-
-        case DOPT_STOP:
-            syslog(LOG_DEBUG, "DOPT_STOP");
-            if(dopt_stop_handler(remote_connection_socket))
+        case 'd':
+            if(parse_unsigned(optarg, UINT_MAX, &history_days))
             {
-                close(remote_connection_socket);
+                fprintf(stderr, "%s: invalid number of days: %s\n", argv[0], optarg);
                 return EXIT_FAILURE;
             }
             break;
-
-        case DOPT_SET_IFACE:
-            syslog(LOG_DEBUG, "DOPT_SET_IFACE");
-            if(dopt_set_iface_handler(remote_connection_socket))
+        case 'w':
+            if(parse_unsigned(optarg, UINT32_MAX, &watch_interval))
             {
-                close(remote_connection_socket);
+                fprintf(stderr, "%s: invalid watch interval: %s\n", argv[0], optarg);
                 return EXIT_FAILURE;
             }
+            watch_set_interval(watch_interval);
             break;
-
-        case DOPT_IP_COUNT:
-            syslog(LOG_DEBUG, "DOPT_IP_COUNT");
-            if(dopt_ip_count_handler(remote_connection_socket))
+        case 'm':
+            metrics_addr = optarg;
+            break;
+        case 'n':
+            if(parse_unsigned(optarg, METRICS_TOP_MAX, &metrics_top))
             {
-                close(remote_connection_socket);
+                fprintf(stderr, "%s: invalid number of IPs: %s\n", argv[0], optarg);
                 return EXIT_FAILURE;
             }
             break;
-
-        case DOPT_STAT:
-            syslog(LOG_DEBUG, "DOPT_STAT");
-            if(dopt_stat_handler(remote_connection_socket))
+        case 'C':
+        case 'A':
+        case 'I':
+        case 'P':
+            if(placement_set_cpus(opt == 'C' ? PLACEMENT_CAPTURE :
+                                  opt == 'A' ? PLACEMENT_AGGREGATE :
+                                  opt == 'I' ? PLACEMENT_IPC : PLACEMENT_PERSIST, optarg))
             {
-                close(remote_connection_socket);
+                fprintf(stderr, "%s: invalid CPU list: %s\n", argv[0], optarg);
                 return EXIT_FAILURE;
             }
             break;
-
+        case 'N':
+            node = parse_numa_node(optarg);
+            if(node == INT_MIN)
+            {
+                fprintf(stderr, "%s: invalid NUMA node: %s\n", argv[0], optarg);
+                return EXIT_FAILURE;
+            }
+            placement_set_node(node);
+            break;
+        case 'R':
+            if(parse_unsigned(optarg, INT_MAX, &rt_priority)
+               || placement_set_rt_priority(rt_priority))
+            {
+                fprintf(stderr, "%s: invalid real-time priority: %s\n", argv[0], optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            if(parse_unsigned(optarg, UINT_MAX, &busy_poll)
+               || packet_set_busy_poll(busy_poll))
+            {
+                fprintf(stderr, "%s: invalid busy poll time: %s\n", argv[0], optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'B':
+            if(packet_set_backend(optarg))
+            {
+                fprintf(stderr, "%s: unknown backend: %s\n", argv[0], optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'X':
+            if(packet_set_xdp_mode(optarg))
+            {
+                fprintf(stderr, "%s: unknown XDP mode: %s\n", argv[0], optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            if(packet_set_capture_iface(optarg))
+            {
+                fprintf(stderr, "%s: invalid interface name: %s\n", argv[0], optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
         default:
-           syslog(LOG_ERR, "Invalid option received!");
+            usage(argv[0]);
+            return EXIT_FAILURE;
         }
+    }
+
+    history_set_retention(history_keep, history_days);
+    if(metrics_addr && metrics_configure(metrics_addr, metrics_top))
+    {
+        fprintf(stderr, "%s: invalid metrics address: %s\n", argv[0], metrics_addr);
+        return EXIT_FAILURE;
+    }
+
+    daemonize();
+    syslog(LOG_DEBUG, "Process running");
+
+    /* SIGTERM is taken by the IPC loop. It is blocked before any thread
+       is started, so none of them is interrupted holding a lock that
+       stopping needs. */
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    err = ipc_server_set_stop_signals(&stop_signals);
+    if(err)
+    {
+        syslog(LOG_ERR, "signalfd failed: %s", strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    /* threads do not survive fork(), start them after daemonize() */
+    placement_init();
+    if(persist_init())
+        syslog(LOG_WARNING, "persistence engine not started, writing inline");
+
+    if(takeover)
+    {
+        if(handoff_receive())
+            return EXIT_FAILURE;
+    }
+    else if(ipc_socket_create())
+    {
+        return EXIT_FAILURE;
+    }
+
+    /* the daemon is useful without the exporter, so go on */
+    if(metrics_start())
+        syslog(LOG_WARNING, "metrics exporter not started");
 
-        syslog(LOG_DEBUG, "Options parsed.");
-        close(remote_connection_socket);
+    /* serve clients until stopped by a handoff or SIGTERM */
+    placement_apply(PLACEMENT_IPC);
+    ipc_server_set_timer(watch_get_interval(), watch_tick);
+    err = ipc_server_run(ipc_socket_fd, ipc_request_handler);
+    if(err)
+    {
+        syslog(LOG_ERR, "IPC server failed: %s", strerror(err));
+        return EXIT_FAILURE;
     }
+
+    if(handed_off)
+    {
+        /* the new daemon owns the sockets and the table now,
+           leave them and the socket path alone */
+        syslog(LOG_INFO, "state handed over, exiting");
+        close(ipc_socket_fd);
+        persist_shutdown();
+        return EXIT_SUCCESS;
+    }
+
+    syslog(LOG_DEBUG, "Exiting...");
+    close(ipc_socket_fd);
+    packet_capture_stop();
+    /* a stop during loading dumps once the load is merged */
+    packet_stats_load_wait();
+    /* let queued stats reach the disk */
+    persist_shutdown();
+    return EXIT_SUCCESS;
 }
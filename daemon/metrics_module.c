@@ -0,0 +1,850 @@
+/*
+ * OpenMetrics exporter of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include "stdafx.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/* how often an idle exporter checks whether it should stop */
+#define METRICS_POLL_MS 200
+/* a scraper that is slower than this is dropped */
+#define METRICS_IO_TIMEOUT_MS 2000
+#define METRICS_REQUEST_MAX 4096
+/* scans of a table that keeps changing give up after this many retries */
+#define METRICS_SCAN_ATTEMPTS 8
+/* initial room for everything but the per-IP series, the body grows
+   if it does not fit */
+#define METRICS_FIXED_MAX 8192
+/* longest per-IP sample, with a fully escaped interface name */
+#define METRICS_LINE_MAX 128
+
+#define METRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+/**
+ * @struct s_metrics_top
+ * @typedef metrics_top
+ * @brief Entry of the busiest addresses heap.
+ */
+typedef struct s_metrics_top
+{
+    uint32_t addr;
+    uint64_t count;
+} metrics_top;
+
+/**
+ * @struct s_metrics_out
+ * @typedef metrics_out
+ * @brief Buffer the text is formatted into.
+ *
+ * A growable buffer is reallocated when the text does not fit, so it
+ * is only allocated until it reached the size the text needs. Text
+ * that cannot be stored sets overflow, the output is then incomplete.
+ */
+typedef struct s_metrics_out
+{
+    char *buf;
+    size_t size;
+    size_t capacity;
+    int grow;           /* buf is from malloc() and may be reallocated */
+    int overflow;
+} metrics_out;
+
+static struct
+{
+    /* configuration */
+    int configured;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    unsigned top_max;
+
+    /* thread */
+    pthread_t thread;
+    int running;
+    int stopping;
+    int listen_fd;
+
+    /* read-only mapping of the counter table */
+    const shm_table_header *hdr;
+    size_t map_size;
+    int table_fd;
+
+    /* snapshot, owned by the thread */
+    metrics_top *top;
+    unsigned top_count;
+    char ifname[IFNAMSIZ];
+    uint64_t entries;
+    uint64_t packets;
+    uint32_t capacity;
+    int have_table;
+    uint64_t retries;       /* scans restarted because the table changed */
+    uint64_t scan_us;       /* duration of the last scan */
+
+    /* text rendered from the snapshot */
+    char *body;
+    size_t body_size;
+    size_t body_capacity;
+    int body_failed;        /* the last render did not fit in memory */
+    uint64_t taken_ms;
+} metrics = { .listen_fd = -1, .table_fd = -1 };
+
+static uint64_t
+now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**************/
+/* Formatting */
+/**************/
+
+static void
+out_mem(metrics_out *out, const char *data, size_t size)
+{
+    if(out->overflow)
+        return;
+
+    if(size > out->capacity - out->size)
+    {
+        size_t capacity = out->capacity;
+        char *buf = NULL;
+
+        while(size > capacity - out->size)
+            capacity *= 2;
+
+        /* !!! malloc !!! */
+        if(out->grow)
+            buf = realloc(out->buf, capacity);
+        if(!buf)
+        {
+            out->overflow = 1;
+            return;
+        }
+        out->buf = buf;
+        out->capacity = capacity;
+    }
+
+    memcpy(out->buf + out->size, data, size);
+    out->size += size;
+}
+
+static void
+out_str(metrics_out *out, const char *str)
+{
+    out_mem(out, str, strlen(str));
+}
+
+static void
+out_u64(metrics_out *out, uint64_t value)
+{
+    char digits[20];
+    char *p = digits + sizeof(digits);
+
+    do
+    {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while(value);
+
+    out_mem(out, p, digits + sizeof(digits) - p);
+}
+
+/* Seconds with microsecond precision */
+static void
+out_seconds(metrics_out *out, uint64_t us)
+{
+    char frac[7];
+
+    out_u64(out, us / 1000000);
+    frac[0] = '.';
+    for(int i = 6; i > 0; --i, us /= 10)
+        frac[i] = '0' + us % 10;
+    out_mem(out, frac, sizeof(frac));
+}
+
+/* addr in network byte order */
+static void
+out_ip(metrics_out *out, uint32_t addr)
+{
+    const uint8_t *octets = (const uint8_t *) &addr;
+
+    for(int i = 0; i < 4; ++i)
+    {
+        if(i)
+            out_mem(out, ".", 1);
+        out_u64(out, octets[i]);
+    }
+}
+
+/* Label value with \, " and newlines escaped */
+static void
+out_label_value(metrics_out *out, const char *value, size_t max)
+{
+    for(size_t i = 0; i < max && value[i]; ++i)
+    {
+        if(value[i] == '\\' || value[i] == '"')
+        {
+            out_mem(out, "\\", 1);
+            out_mem(out, &value[i], 1);
+        }
+        else if(value[i] == '\n')
+        {
+            out_mem(out, "\\n", 2);
+        }
+        else
+        {
+            out_mem(out, &value[i], 1);
+        }
+    }
+}
+
+static void
+out_family(metrics_out *out, const char *name, const char *type, const char *help)
+{
+    out_str(out, "# TYPE ");
+    out_str(out, name);
+    out_mem(out, " ", 1);
+    out_str(out, type);
+    out_str(out, "\n# HELP ");
+    out_str(out, name);
+    out_mem(out, " ", 1);
+    out_str(out, help);
+    out_mem(out, "\n", 1);
+}
+
+/* name{interface="..."} */
+static void
+out_iface_sample(metrics_out *out, const char *name)
+{
+    out_str(out, name);
+    out_str(out, "{interface=\"");
+    out_label_value(out, metrics.ifname, sizeof(metrics.ifname));
+    out_str(out, "\"} ");
+}
+
+static void
+out_gauge(metrics_out *out, const char *name, const char *help, uint64_t value)
+{
+    out_family(out, name, "gauge", help);
+    out_str(out, name);
+    out_mem(out, " ", 1);
+    out_u64(out, value);
+    out_mem(out, "\n", 1);
+}
+
+/*************/
+/* Snapshots */
+/*************/
+
+/* Map the table, or map it again if it grew. */
+static int
+table_map(void)
+{
+    struct stat st;
+    void *mem;
+
+    if(metrics.table_fd < 0)
+    {
+        metrics.table_fd = shm_open(SHM_TABLE_NAME, O_RDONLY | O_CLOEXEC, 0);
+        if(metrics.table_fd < 0)
+            return errno;
+    }
+
+    if(fstat(metrics.table_fd, &st))
+        return errno;
+    if((size_t) st.st_size < sizeof(shm_table_header))
+        return EAGAIN;
+
+    if(metrics.hdr && (size_t) st.st_size == metrics.map_size)
+        return 0;
+
+    if(metrics.hdr)
+        munmap((void *) metrics.hdr, metrics.map_size);
+    metrics.hdr = NULL;
+
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, metrics.table_fd, 0);
+    if(mem == MAP_FAILED)
+        return errno;
+
+    metrics.hdr = mem;
+    metrics.map_size = st.st_size;
+    if(__atomic_load_n(&metrics.hdr->magic, __ATOMIC_ACQUIRE) != SHM_TABLE_MAGIC
+       || metrics.hdr->version != SHM_TABLE_VERSION)
+        return EPROTO;
+
+    return 0;
+}
+
+/* Min-heap on count, its root is the smallest of the busiest */
+static void
+top_sift_down(metrics_top *heap, unsigned size, unsigned i)
+{
+    for(;;)
+    {
+        unsigned smallest = i, l = 2 * i + 1, r = l + 1;
+        metrics_top tmp;
+
+        if(l < size && heap[l].count < heap[smallest].count)
+            smallest = l;
+        if(r < size && heap[r].count < heap[smallest].count)
+            smallest = r;
+        if(smallest == i)
+            return;
+
+        tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static void
+top_push(uint32_t addr, uint64_t count)
+{
+    metrics_top *heap = metrics.top;
+    unsigned i;
+
+    if(metrics.top_count == metrics.top_max)
+    {
+        if(count <= heap[0].count)
+            return;
+        heap[0].addr = addr;
+        heap[0].count = count;
+        top_sift_down(heap, metrics.top_count, 0);
+        return;
+    }
+
+    for(i = metrics.top_count++; i; i = (i - 1) / 2)
+    {
+        if(heap[(i - 1) / 2].count <= count)
+            break;
+        heap[i] = heap[(i - 1) / 2];
+    }
+    heap[i].addr = addr;
+    heap[i].count = count;
+}
+
+/* Heap sort in place, the busiest first */
+static void
+top_sort(void)
+{
+    for(unsigned end = metrics.top_count; end > 1; --end)
+    {
+        metrics_top tmp = metrics.top[0];
+        metrics.top[0] = metrics.top[end - 1];
+        metrics.top[end - 1] = tmp;
+        top_sift_down(metrics.top, end - 1, 0);
+    }
+}
+
+/* Scan the table without locking, retrying if it changes under the scan */
+static void
+snapshot_take(void)
+{
+    uint64_t start = now_us();
+
+    metrics.have_table = 0;
+    metrics.top_count = 0;
+
+    for(int attempt = 0; attempt < METRICS_SCAN_ATTEMPTS; ++attempt)
+    {
+        const shm_table_entry *slots;
+        uint32_t seq, capacity;
+
+        if(table_map())
+            return;
+
+        seq = shm_table_read_begin(metrics.hdr);
+        capacity = __atomic_load_n(&metrics.hdr->capacity, __ATOMIC_RELAXED);
+        if(SHM_TABLE_SIZE(capacity) > metrics.map_size)
+            continue;   /* grew since it was mapped */
+
+        metrics.top_count = 0;
+        slots = SHM_TABLE_SLOTS(metrics.hdr);
+        for(uint32_t i = 0; i < capacity && metrics.top_max; ++i)
+        {
+            uint64_t count = __atomic_load_n(&slots[i].count, __ATOMIC_ACQUIRE);
+            if(count)
+                top_push(__atomic_load_n(&slots[i].addr, __ATOMIC_RELAXED), count);
+        }
+
+        memcpy(metrics.ifname, metrics.hdr->ifname, sizeof(metrics.ifname));
+        metrics.ifname[IFNAMSIZ - 1] = '\0';
+        metrics.entries = __atomic_load_n(&metrics.hdr->entries, __ATOMIC_RELAXED);
+        metrics.packets = __atomic_load_n(&metrics.hdr->packets, __ATOMIC_RELAXED);
+        metrics.capacity = capacity;
+        metrics.have_table = 1;
+
+        if(!shm_table_read_retry(metrics.hdr, seq))
+            break;
+        ++metrics.retries;
+    }
+
+    top_sort();
+    metrics.scan_us = now_us() - start;
+}
+
+/* Render the snapshot and the self-metrics as OpenMetrics text */
+static void
+snapshot_render(void)
+{
+    metrics_out out = { metrics.body, 0, metrics.body_capacity, 1, 0 };
+    packet_capture_info capture;
+    packet_load_progress load;
+    dopt_selfstat self;
+
+    packet_get_capture_info(&capture);
+    packet_get_load_progress(&load);
+    packet_get_selfstat(&self, NULL);
+
+    if(metrics.have_table)
+    {
+        out_family(&out, "netsniffd_packets", "counter",
+                   "Packets counted on the interface.");
+        out_iface_sample(&out, "netsniffd_packets_total");
+        out_u64(&out, metrics.packets);
+        out_mem(&out, "\n", 1);
+
+        out_family(&out, "netsniffd_addresses", "gauge",
+                   "Addresses counted on the interface.");
+        out_iface_sample(&out, "netsniffd_addresses");
+        out_u64(&out, metrics.entries);
+        out_mem(&out, "\n", 1);
+
+        out_family(&out, "netsniffd_table_capacity", "gauge",
+                   "Slots of the counter table.");
+        out_iface_sample(&out, "netsniffd_table_capacity");
+        out_u64(&out, metrics.capacity);
+        out_mem(&out, "\n", 1);
+
+        out_family(&out, "netsniffd_ip_packets", "counter",
+                   "Packets counted per address, for the busiest addresses only.");
+        for(unsigned i = 0; i < metrics.top_count; ++i)
+        {
+            out_str(&out, "netsniffd_ip_packets_total{interface=\"");
+            out_label_value(&out, metrics.ifname, sizeof(metrics.ifname));
+            out_str(&out, "\",ip=\"");
+            out_ip(&out, metrics.top[i].addr);
+            out_str(&out, "\"} ");
+            out_u64(&out, metrics.top[i].count);
+            out_mem(&out, "\n", 1);
+        }
+    }
+
+    out_gauge(&out, "netsniffd_ip_series_limit",
+              "Most per-address series exported.", metrics.top_max);
+    out_gauge(&out, "netsniffd_capture_running",
+              "1 if packets are being captured.", capture.running);
+    out_gauge(&out, "netsniffd_capture_last_error",
+              "errno code of the last failed receive, 0 if none.", capture.last_error);
+
+    out_family(&out, "netsniffd_capture_received", "counter",
+               "Packets received by the capture thread.");
+    out_str(&out, "netsniffd_capture_received_total ");
+    out_u64(&out, self.packets);
+    out_mem(&out, "\n", 1);
+
+    out_family(&out, "netsniffd_capture_kernel_drops", "counter",
+               "Packets dropped by the kernel before the capture thread read them.");
+    out_str(&out, "netsniffd_capture_kernel_drops_total ");
+    out_u64(&out, self.kernel_drops);
+    out_mem(&out, "\n", 1);
+
+    out_family(&out, "netsniffd_capture_lock_waits", "counter",
+               "Batches of packets that waited for the counter table lock.");
+    out_str(&out, "netsniffd_capture_lock_waits_total ");
+    out_u64(&out, self.lock_waits);
+    out_mem(&out, "\n", 1);
+
+    out_family(&out, "netsniffd_capture_ring_overflows", "counter",
+               "Packets received but lost because the capture ring was full.");
+    out_str(&out, "netsniffd_capture_ring_overflows_total ");
+    out_u64(&out, self.ring_overflows);
+    out_mem(&out, "\n", 1);
+
+    out_gauge(&out, "netsniffd_capture_ring_used",
+              "Received packets waiting in the capture ring.", self.ring_used);
+    out_gauge(&out, "netsniffd_capture_ring_max_used",
+              "Most packets seen waiting in the capture ring.", self.ring_max_used);
+    out_gauge(&out, "netsniffd_capture_ring_capacity",
+              "Size of the capture ring, in packets.", self.ring_capacity);
+
+    out_family(&out, "netsniffd_capture_spin_seconds", "counter",
+               "Time capture threads spent polling with nothing to do.");
+    out_str(&out, "netsniffd_capture_spin_seconds_total{stage=\"receive\"} ");
+    out_seconds(&out, self.recv_spin_ns / 1000);
+    out_str(&out, "\nnetsniffd_capture_spin_seconds_total{stage=\"aggregate\"} ");
+    out_seconds(&out, self.aggregate_spin_ns / 1000);
+    out_mem(&out, "\n", 1);
+
+    out_family(&out, "netsniffd_capture_work_seconds", "counter",
+               "Time capture threads spent on packets, receive only while spinning.");
+    out_str(&out, "netsniffd_capture_work_seconds_total{stage=\"receive\"} ");
+    out_seconds(&out, self.recv_work_ns / 1000);
+    out_str(&out, "\nnetsniffd_capture_work_seconds_total{stage=\"aggregate\"} ");
+    out_seconds(&out, self.aggregate_work_ns / 1000);
+    out_mem(&out, "\n", 1);
+
+    out_gauge(&out, "netsniffd_capture_bpf_entries",
+              "Addresses counted in the kernel by the bpf backend.", self.bpf_entries);
+    out_family(&out, "netsniffd_capture_bpf_misses", "counter",
+               "Packets the bpf backend could not count, its map being full.");
+    out_str(&out, "netsniffd_capture_bpf_misses_total ");
+    out_u64(&out, self.bpf_misses);
+    out_mem(&out, "\n", 1);
+
+    out_gauge(&out, "netsniffd_capture_xdp_queues",
+              "AF_XDP sockets of the xdp backend, one per receive queue.", self.xdp_queues);
+    out_gauge(&out, "netsniffd_capture_xdp_zerocopy",
+              "1 if the xdp backend receives frames without copying them.",
+              (self.xdp_flags & CAPTURE_XDP_ZEROCOPY) != 0);
+    out_family(&out, "netsniffd_capture_xdp_drops", "counter",
+               "Frames the kernel could not hand to the AF_XDP sockets.");
+    out_str(&out, "netsniffd_capture_xdp_drops_total{reason=\"rx_dropped\"} ");
+    out_u64(&out, self.xdp_rx_dropped);
+    out_str(&out, "\nnetsniffd_capture_xdp_drops_total{reason=\"rx_ring_full\"} ");
+    out_u64(&out, self.xdp_rx_ring_full);
+    out_mem(&out, "\n", 1);
+    out_family(&out, "netsniffd_capture_xdp_fill_ring_empty", "counter",
+               "Times the kernel found no free frame on an AF_XDP fill ring.");
+    out_str(&out, "netsniffd_capture_xdp_fill_ring_empty_total ");
+    out_u64(&out, self.xdp_fill_ring_empty);
+    out_mem(&out, "\n", 1);
+
+    out_family(&out, "netsniffd_capture_busy_poll_fallbacks", "counter",
+               "Times a spinning capture thread found no traffic and blocked.");
+    out_str(&out, "netsniffd_capture_busy_poll_fallbacks_total ");
+    out_u64(&out, self.busy_poll_fallbacks);
+    out_mem(&out, "\n", 1);
+
+    out_gauge(&out, "netsniffd_load_state",
+              "Loading of saved stats: 0 idle, 1 reading, 2 parsing, 3 merging, "
+              "4 done, 5 failed.", load.state);
+    out_gauge(&out, "netsniffd_load_file_bytes",
+              "Size of the saved stats being loaded.", load.bytes_total);
+    out_gauge(&out, "netsniffd_load_done_bytes",
+              "Bytes of the saved stats parsed so far.", load.bytes_done);
+
+    out_family(&out, "netsniffd_exporter_scan_retries", "counter",
+               "Table scans restarted because the table was resized or cleared.");
+    out_str(&out, "netsniffd_exporter_scan_retries_total ");
+    out_u64(&out, metrics.retries);
+    out_mem(&out, "\n", 1);
+
+    out_family(&out, "netsniffd_exporter_scan_seconds", "gauge",
+               "Time the last table scan took.");
+    out_str(&out, "netsniffd_exporter_scan_seconds ");
+    out_seconds(&out, metrics.scan_us);
+    out_mem(&out, "\n", 1);
+
+    out_str(&out, "# EOF\n");
+
+    metrics.body = out.buf;
+    metrics.body_capacity = out.capacity;
+    metrics.body_size = out.size;
+    metrics.body_failed = out.overflow;
+    if(out.overflow)
+        syslog(LOG_ERR, "metrics exposition of %zu bytes does not fit in memory",
+               out.size);
+}
+
+/***********/
+/* Serving */
+/***********/
+
+static int
+send_all(int fd, const char *data, size_t size)
+{
+    while(size)
+    {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+        data += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+/* Read the request head, returns its size or 0 if it did not come */
+static size_t
+request_read(int fd, char *request, size_t capacity)
+{
+    size_t size = 0;
+
+    while(size < capacity - 1)
+    {
+        ssize_t n = recv(fd, request + size, capacity - 1 - size, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return 0;
+
+        size += n;
+        request[size] = '\0';
+        if(strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            return size;
+    }
+
+    /* only the request line matters */
+    return size;
+}
+
+static void
+serve_client(int fd)
+{
+    char request[METRICS_REQUEST_MAX];
+    char head_buf[256];
+    metrics_out head = { head_buf, 0, sizeof(head_buf), 0, 0 };
+    const char *status = "200 OK";
+    uint64_t now;
+
+    if(!request_read(fd, request, sizeof(request)))
+        return;
+
+    if(strncmp(request, "GET ", 4))
+        status = "405 Method Not Allowed";
+    else if(strncmp(request + 4, "/metrics ", 9) && strncmp(request + 4, "/ ", 2))
+        status = "404 Not Found";
+
+    if(*status == '2')
+    {
+        /* scrapes in quick succession share one scan */
+        now = now_us() / 1000;
+        if(!metrics.taken_ms || now - metrics.taken_ms >= METRICS_CACHE_MS)
+        {
+            snapshot_take();
+            snapshot_render();
+            metrics.taken_ms = now;
+        }
+
+        /* a clipped exposition would be taken for a complete one */
+        if(metrics.body_failed)
+            status = "500 Internal Server Error";
+    }
+
+    if(*status != '2')
+    {
+        out_str(&head, "HTTP/1.1 ");
+        out_str(&head, status);
+        out_str(&head, "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        send_all(fd, head.buf, head.size);
+        return;
+    }
+
+    out_str(&head, "HTTP/1.1 200 OK\r\nContent-Type: " METRICS_CONTENT_TYPE
+                   "\r\nContent-Length: ");
+    out_u64(&head, metrics.body_size);
+    out_str(&head, "\r\nConnection: close\r\n\r\n");
+
+    if(!send_all(fd, head.buf, head.size))
+        send_all(fd, metrics.body, metrics.body_size);
+}
+
+/* Returns NULL */
+static void *
+metrics_loop_fn(void *arg)
+{
+    struct timeval timeout = {
+        .tv_sec = METRICS_IO_TIMEOUT_MS / 1000,
+        .tv_usec = METRICS_IO_TIMEOUT_MS % 1000 * 1000
+    };
+
+    (void) arg;
+
+    /* scrapes are served like IPC requests */
+    placement_apply(PLACEMENT_IPC);
+
+    /* one scrape at a time, scrapers are few and answered from cache */
+    while(!__atomic_load_n(&metrics.stopping, __ATOMIC_ACQUIRE))
+    {
+        struct pollfd pfd = { metrics.listen_fd, POLLIN, 0 };
+        int fd;
+
+        if(poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+            continue;
+
+        fd = accept4(metrics.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(fd < 0)
+            continue;
+
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_client(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/*********************/
+/* Library interface */
+/*********************/
+
+int
+metrics_configure(const char *addr, unsigned top)
+{
+    struct sockaddr_in *in4 = (struct sockaddr_in *) &metrics.addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &metrics.addr;
+    char host[INET6_ADDRSTRLEN];
+    const char *colon;
+    unsigned long port;
+    size_t host_len;
+    char *end;
+
+    memset(&metrics.addr, 0, sizeof(metrics.addr));
+    metrics.top_max = top < METRICS_TOP_MAX ? top : METRICS_TOP_MAX;
+
+    if(addr[0] == '/')
+    {
+        struct sockaddr_un *un = (struct sockaddr_un *) &metrics.addr;
+
+        if(strlen(addr) >= sizeof(un->sun_path))
+            return EINVAL;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, addr);
+        metrics.addr_len = sizeof(*un);
+        metrics.configured = 1;
+        return 0;
+    }
+
+    /* [v6]:port, v4:port or :port */
+    colon = strrchr(addr, ':');
+    if(!colon)
+        return EINVAL;
+    port = strtoul(colon + 1, &end, 10);
+    if(*end || !port || port > 65535)
+        return EINVAL;
+
+    host_len = colon - addr;
+    if(host_len >= 2 && addr[0] == '[' && addr[host_len - 1] == ']')
+    {
+        ++addr;
+        host_len -= 2;
+    }
+    if(host_len >= sizeof(host))
+        return EINVAL;
+    memcpy(host, addr, host_len);
+    host[host_len] = '\0';
+
+    if(!host_len)
+        strcpy(host, "127.0.0.1");
+
+    if(inet_pton(AF_INET, host, &in4->sin_addr) == 1)
+    {
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons(port);
+        metrics.addr_len = sizeof(*in4);
+    }
+    else if(inet_pton(AF_INET6, host, &in6->sin6_addr) == 1)
+    {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        metrics.addr_len = sizeof(*in6);
+    }
+    else
+    {
+        return EINVAL;
+    }
+
+    metrics.configured = 1;
+    return 0;
+}
+
+int
+metrics_start(void)
+{
+    int family = metrics.addr.ss_family;
+    int one = 1, err;
+
+    if(!metrics.configured || metrics.running)
+        return 0;
+
+    /* buffers live as long as the process, they are reused on restarts */
+    if(!metrics.body)
+    {
+        /* !!! malloc !!! */
+        metrics.top = malloc((metrics.top_max + 1) * sizeof(*metrics.top));
+        metrics.body_capacity = METRICS_FIXED_MAX + metrics.top_max * METRICS_LINE_MAX;
+        metrics.body = malloc(metrics.body_capacity);
+        if(!metrics.top || !metrics.body)
+        {
+            free(metrics.top);
+            free(metrics.body);
+            metrics.top = NULL;
+            metrics.body = NULL;
+            return ENOMEM;
+        }
+    }
+
+    metrics.listen_fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(metrics.listen_fd < 0)
+        return errno;
+
+    if(family == AF_UNIX)
+        unlink(((struct sockaddr_un *) &metrics.addr)->sun_path);
+    else
+        setsockopt(metrics.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if(bind(metrics.listen_fd, (struct sockaddr *) &metrics.addr, metrics.addr_len)
+       || listen(metrics.listen_fd, 16))
+    {
+        err = errno;
+        syslog(LOG_ERR, "metrics: cannot listen: %s", strerror(err));
+        goto fail;
+    }
+
+    /* !!! create thread !!! */
+    metrics.stopping = 0;
+    err = pthread_create(&metrics.thread, NULL, metrics_loop_fn, NULL);
+    if(err)
+    {
+        syslog(LOG_ERR, "metrics: pthread_create failed: %s", strerror(err));
+        goto fail;
+    }
+
+    metrics.running = 1;
+    syslog(LOG_INFO, "metrics: exporter started");
+    return 0;
+
+fail:
+    close(metrics.listen_fd);
+    metrics.listen_fd = -1;
+    return err;
+}
+
+void
+metrics_stop(void)
+{
+    if(!metrics.running)
+        return;
+
+    /* !!! join thread !!! */
+    __atomic_store_n(&metrics.stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(metrics.thread, NULL);
+    metrics.running = 0;
+
+    close(metrics.listen_fd);
+    metrics.listen_fd = -1;
+    if(metrics.addr.ss_family == AF_UNIX)
+        unlink(((struct sockaddr_un *) &metrics.addr)->sun_path);
+}
@@ -0,0 +1,56 @@
+/*
+ * Header for OpenMetrics exporter of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef METRICS_MODULE_H
+#define METRICS_MODULE_H
+
+#define METRICS_DEFAULT_TOP 100
+/* cardinality cap, per-IP series beyond it are never exported */
+#define METRICS_TOP_MAX 10000
+/* scrapes within this time of a snapshot are served from it */
+#define METRICS_CACHE_MS 1000
+
+/**
+ * @fn metrics_configure
+ * @brief Set where and what the exporter serves.
+ *
+ * @param addr  "HOST:PORT" or ":PORT" (loopback) for TCP, an absolute
+ *              path for a Unix socket.
+ * @param top   Number of per-IP series, the busiest addresses, capped
+ *              at METRICS_TOP_MAX.
+ *
+ * @return 0 on success or EINVAL if addr cannot be parsed.
+ */
+int
+metrics_configure(const char *addr, unsigned top);
+
+/**
+ * @fn metrics_start
+ * @brief Start the exporter thread if it is configured.
+ *
+ * The thread answers HTTP GET requests with OpenMetrics text. It reads
+ * the shared counter table like any other reader, without the stats
+ * lock, so scrapes never block capture. Must be called after
+ * daemonize().
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+metrics_start(void);
+
+/**
+ * @fn metrics_stop
+ * @brief Stop the exporter thread and close its socket.
+ *
+ * metrics_start() may be called again afterwards.
+ */
+void
+metrics_stop(void);
+
+#endif // METRICS_MODULE_H
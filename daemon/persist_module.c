@@ -0,0 +1,1033 @@
+/*
+ * Asynchronous persistence engine for netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include "stdafx.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define PERSIST_RING_ENTRIES 32
+/* registered buffers, every queued write is copied through them */
+#define PERSIST_BUF_COUNT 8
+#define PERSIST_BUF_SIZE (1 << 20)
+/* thread pool used when io_uring is not available */
+#define PERSIST_POOL_THREADS 2
+
+enum persist_job_type
+{
+    PERSIST_JOB_WRITE,
+    PERSIST_JOB_READ
+};
+
+/**
+ * @struct s_persist_job
+ * @typedef persist_job
+ */
+typedef struct s_persist_job {
+    int type;
+    char path[FILENAME_MAX];
+    char *data;
+    size_t size;
+    persist_render_fn render;
+    persist_write_done_fn write_done;
+    persist_read_done_fn read_done;
+    void *ctx;
+    int busy;
+    struct s_persist_job *next;
+} persist_job;
+
+/**
+ * @struct s_persist_uring
+ * @typedef persist_uring
+ *
+ * Raw io_uring state. liburing is not required, rings are mapped by hand.
+ */
+typedef struct s_persist_uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned sq_entries;
+    int fixed;  /* buffers were registered */
+    int refused;    /* SQEs of the current job were taken back */
+    char *bufs[PERSIST_BUF_COUNT];
+    int buf_free[PERSIST_BUF_COUNT];
+    off_t buf_off[PERSIST_BUF_COUNT];
+    size_t buf_len[PERSIST_BUF_COUNT];
+} persist_uring;
+
+enum persist_backend
+{
+    PERSIST_BACKEND_INLINE,
+    PERSIST_BACKEND_URING,
+    PERSIST_BACKEND_POOL
+};
+
+static int backend = PERSIST_BACKEND_INLINE;
+static persist_uring ring;
+
+static pthread_t workers[PERSIST_POOL_THREADS];
+static int workers_count;
+
+/* job queue, protected by queue_mutex */
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static persist_job *queue_head, *queue_tail;
+static int jobs_pending;
+static int shutting_down;
+
+/*************************/
+/* Plain (blocking) I/O  */
+/*************************/
+
+static int
+write_all(int fd, const char *data, size_t size, off_t offset)
+{
+    while(size)
+    {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+        data += n;
+        offset += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static int
+read_all(int fd, char *data, size_t size, off_t offset)
+{
+    while(size)
+    {
+        ssize_t n = pread(fd, data, size, offset);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+        if(n == 0)
+            return EIO; /* file was truncated under us */
+        data += n;
+        offset += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+/* Opens the temporary file next to the target a write job goes to. */
+static int
+job_open_target(persist_job *job, char *tmp_path)
+{
+    if(snprintf(tmp_path, FILENAME_MAX, "%s.tmp", job->path) >= FILENAME_MAX)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+static int
+job_commit_target(persist_job *job, int fd, const char *tmp_path, int err)
+{
+    char dir[FILENAME_MAX];
+    char *slash;
+
+    if(close(fd) && !err)
+        err = errno;
+
+    if(err)
+    {
+        unlink(tmp_path);
+        return err;
+    }
+
+    if(rename(tmp_path, job->path))
+    {
+        err = errno;
+        unlink(tmp_path);
+        return err;
+    }
+
+    /* the rename is only on disk once its directory is */
+    strcpy(dir, job->path);
+    slash = strrchr(dir, '/');
+    if(!slash)
+        strcpy(dir, ".");
+    else if(slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+
+    return persist_fsync_dir(dir);
+}
+
+static int
+pool_run_write(persist_job *job)
+{
+    char tmp_path[FILENAME_MAX];
+    int err;
+    int fd = job_open_target(job, tmp_path);
+    if(fd < 0)
+        return errno;
+
+    err = write_all(fd, job->data, job->size, 0);
+    if(!err && fsync(fd))
+        err = errno;
+
+    return job_commit_target(job, fd, tmp_path, err);
+}
+
+static int
+pool_run_read(persist_job *job)
+{
+    struct stat st;
+    int err;
+    int fd = open(job->path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return errno;
+
+    if(fstat(fd, &st))
+    {
+        err = errno;
+        close(fd);
+        return err;
+    }
+
+    job->size = st.st_size;
+    job->data = malloc(job->size + 1);
+    if(!job->data)
+    {
+        close(fd);
+        return ENOMEM;
+    }
+
+    err = read_all(fd, job->data, job->size, 0);
+    close(fd);
+    job->data[job->size] = '\0';
+
+    return err;
+}
+
+/*****************/
+/* io_uring I/O  */
+/*****************/
+
+static int
+uring_setup(persist_uring *r)
+{
+    struct io_uring_params p;
+    struct iovec iov[PERSIST_BUF_COUNT];
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+
+    r->fd = syscall(__NR_io_uring_setup, PERSIST_RING_ENTRIES, &p);
+    if(r->fd < 0)
+        return errno;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_ptr == MAP_FAILED)
+        goto fail;
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        r->cq_ptr = r->sq_ptr;
+    }
+    else
+    {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if(r->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED)
+        goto fail;
+
+    r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+
+    for(int i = 0; i < PERSIST_BUF_COUNT; ++i)
+    {
+        /* !!! mmap !!! */
+        r->bufs[i] = mmap(NULL, PERSIST_BUF_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(r->bufs[i] == MAP_FAILED)
+        {
+            r->bufs[i] = NULL;
+            goto fail;
+        }
+        r->buf_free[i] = 1;
+        iov[i].iov_base = r->bufs[i];
+        iov[i].iov_len = PERSIST_BUF_SIZE;
+    }
+
+    /* Registering may fail on a low RLIMIT_MEMLOCK,
+       plain IORING_OP_WRITE is used then */
+    r->fixed = !syscall(__NR_io_uring_register, r->fd,
+                        IORING_REGISTER_BUFFERS, iov, PERSIST_BUF_COUNT);
+    if(!r->fixed)
+        syslog(LOG_WARNING, "io_uring buffer registration failed: %s",
+               strerror(errno));
+
+    return 0;
+
+fail:
+    {
+        int err = errno;
+        for(int i = 0; i < PERSIST_BUF_COUNT; ++i)
+            if(r->bufs[i])
+                munmap(r->bufs[i], PERSIST_BUF_SIZE);
+        if(r->sqes && r->sqes != MAP_FAILED)
+            munmap(r->sqes, r->sqes_len);
+        if(r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+            munmap(r->cq_ptr, r->cq_len);
+        if(r->sq_ptr && r->sq_ptr != MAP_FAILED)
+            munmap(r->sq_ptr, r->sq_len);
+        close(r->fd);
+        return err;
+    }
+}
+
+static void
+uring_teardown(persist_uring *r)
+{
+    close(r->fd);
+    for(int i = 0; i < PERSIST_BUF_COUNT; ++i)
+        munmap(r->bufs[i], PERSIST_BUF_SIZE);
+    munmap(r->sqes, r->sqes_len);
+    if(r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+}
+
+/* Returns a zeroed SQE or NULL if the submission queue is full. */
+static struct io_uring_sqe *
+uring_get_sqe(persist_uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *r->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if(tail - head >= r->sq_entries)
+        return NULL;
+
+    sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+/* Takes back the last n SQEs. The ring has no SQ polling thread, so
+ * the kernel only looks at them in io_uring_enter(). */
+static void
+uring_unqueue(persist_uring *r, unsigned n)
+{
+    __atomic_store_n(r->sq_tail, *r->sq_tail - n, __ATOMIC_RELEASE);
+}
+
+/* submitted receives the number of SQEs the kernel took, which may be
+ * fewer than to_submit even on success. */
+static int
+uring_enter(persist_uring *r, unsigned to_submit, unsigned min_complete,
+            unsigned *submitted)
+{
+    *submitted = 0;
+    for(;;)
+    {
+        int n = syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+                        min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(n >= 0)
+        {
+            *submitted = to_submit ? n : 0;
+            return 0;
+        }
+        if(errno != EINTR)
+            return errno;
+    }
+}
+
+/* Submit the queued SQEs and wait for a completion if anything is in
+ * flight. Only the SQEs the kernel took move from queued to inflight,
+ * the others are submitted again next time. If the kernel refuses them
+ * (EBUSY with a full CQ, EAGAIN, ENOMEM) while nothing is in flight to
+ * make room, they are taken back from the ring, r->refused is set and
+ * the error returned. */
+static int
+uring_submit_wait(persist_uring *r, unsigned *queued, unsigned *inflight)
+{
+    unsigned submitted;
+    int err;
+
+    err = uring_enter(r, *queued, *queued || *inflight ? 1 : 0, &submitted);
+    *queued -= submitted;
+    *inflight += submitted;
+    if(!err)
+        return 0;
+
+    if(*inflight)
+        return uring_enter(r, 0, 1, &submitted);
+
+    uring_unqueue(r, *queued);
+    *queued = 0;
+    r->refused = 1;
+    return err;
+}
+
+/* Pops one completion, returns 0 if the CQ is empty. */
+static int
+uring_pop_cqe(persist_uring *r, struct io_uring_cqe *out)
+{
+    unsigned head = *r->cq_head;
+    if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    *out = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int
+uring_run_write(persist_uring *r, persist_job *job)
+{
+    char tmp_path[FILENAME_MAX];
+    size_t done = 0;
+    unsigned queued = 0, inflight = 0;
+    int err = 0;
+    int fd = job_open_target(job, tmp_path);
+    if(fd < 0)
+        return errno;
+
+    while((done < job->size && !err) || queued || inflight)
+    {
+        struct io_uring_cqe cqe;
+
+        /* fill every free registered buffer */
+        for(int b = 0; b < PERSIST_BUF_COUNT && done < job->size && !err; ++b)
+        {
+            struct io_uring_sqe *sqe;
+            size_t n;
+
+            if(!r->buf_free[b])
+                continue;
+
+            sqe = uring_get_sqe(r);
+            if(!sqe)
+                break;
+
+            n = job->size - done;
+            if(n > PERSIST_BUF_SIZE)
+                n = PERSIST_BUF_SIZE;
+            memcpy(r->bufs[b], job->data + done, n);
+
+            sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+            sqe->fd = fd;
+            sqe->addr = (unsigned long) r->bufs[b];
+            sqe->len = n;
+            sqe->off = done;
+            sqe->buf_index = r->fixed ? b : 0;
+            sqe->user_data = b;
+
+            r->buf_free[b] = 0;
+            r->buf_off[b] = done;
+            r->buf_len[b] = n;
+            done += n;
+            ++queued;
+        }
+
+        /* submit and wait for at least one buffer to come back */
+        err = uring_submit_wait(r, &queued, &inflight) ? : err;
+
+        while(uring_pop_cqe(r, &cqe))
+        {
+            int b = cqe.user_data;
+            if(cqe.res < 0)
+            {
+                if(!err)
+                    err = -cqe.res;
+            }
+            else if((size_t) cqe.res < r->buf_len[b] && !err)
+            {
+                /* short write, finish it synchronously */
+                err = write_all(fd, r->bufs[b] + cqe.res,
+                                r->buf_len[b] - cqe.res,
+                                r->buf_off[b] + cqe.res);
+            }
+            r->buf_free[b] = 1;
+            --inflight;
+        }
+    }
+
+    /* buffers of SQEs taken back never completed */
+    for(int b = 0; b < PERSIST_BUF_COUNT; ++b)
+        r->buf_free[b] = 1;
+
+    if(!err)
+    {
+        struct io_uring_sqe *sqe = uring_get_sqe(r);
+        struct io_uring_cqe cqe;
+
+        if(sqe)
+        {
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = fd;
+            sqe->user_data = PERSIST_BUF_COUNT;
+            queued = 1;
+            while(!err && !uring_pop_cqe(r, &cqe))
+                err = uring_submit_wait(r, &queued, &inflight);
+            if(!err && cqe.res < 0)
+                err = -cqe.res;
+        }
+        else if(fsync(fd))
+        {
+            err = errno;
+        }
+    }
+
+    return job_commit_target(job, fd, tmp_path, err);
+}
+
+static int
+uring_run_read(persist_uring *r, persist_job *job)
+{
+    struct stat st;
+    size_t done = 0;
+    unsigned queued = 0, inflight = 0;
+    int err = 0;
+    int fd = open(job->path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return errno;
+
+    if(fstat(fd, &st))
+    {
+        err = errno;
+        close(fd);
+        return err;
+    }
+
+    job->size = st.st_size;
+    job->data = malloc(job->size + 1);
+    if(!job->data)
+    {
+        close(fd);
+        return ENOMEM;
+    }
+
+    /* read straight into the destination in PERSIST_BUF_SIZE chunks */
+    while((done < job->size && !err) || queued || inflight)
+    {
+        struct io_uring_cqe cqe;
+        struct io_uring_sqe *sqe;
+
+        while(done < job->size && !err && (sqe = uring_get_sqe(r)))
+        {
+            size_t n = job->size - done;
+            if(n > PERSIST_BUF_SIZE)
+                n = PERSIST_BUF_SIZE;
+
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (unsigned long)(job->data + done);
+            sqe->len = n;
+            sqe->off = done;
+            /* encode the chunk so a short read can be completed */
+            sqe->user_data = ((uint64_t) done << 24) | n;
+            done += n;
+            ++queued;
+        }
+
+        err = uring_submit_wait(r, &queued, &inflight) ? : err;
+
+        while(uring_pop_cqe(r, &cqe))
+        {
+            size_t off = cqe.user_data >> 24;
+            size_t len = cqe.user_data & ((1 << 24) - 1);
+            if(cqe.res < 0)
+            {
+                if(!err)
+                    err = -cqe.res;
+            }
+            else if((size_t) cqe.res < len && !err)
+            {
+                err = read_all(fd, job->data + off + cqe.res,
+                               len - cqe.res, off + cqe.res);
+            }
+            --inflight;
+        }
+    }
+
+    close(fd);
+    job->data[job->size] = '\0';
+    return err;
+}
+
+/****************/
+/* Job handling */
+/****************/
+
+static void
+job_complete(persist_job *job, int err)
+{
+    if(err)
+        syslog(LOG_ERR, "persist: %s %s failed: %s",
+               job->type == PERSIST_JOB_WRITE ? "write" : "read",
+               job->path, strerror(err));
+
+    if(job->type == PERSIST_JOB_WRITE)
+    {
+        free(job->data);
+        if(job->write_done)
+            job->write_done(err, job->ctx);
+    }
+    else
+    {
+        if(err)
+        {
+            free(job->data);
+            job->data = NULL;
+            job->size = 0;
+        }
+        /* data ownership goes to the callback */
+        job->read_done(err, job->data, job->size, job->ctx);
+    }
+}
+
+static void
+job_run(persist_job *job)
+{
+    int err;
+
+    if(job->render)
+    {
+        err = job->render(job->ctx, &job->data, &job->size);
+        if(err)
+        {
+            job_complete(job, err);
+            return;
+        }
+    }
+
+    if(backend == PERSIST_BACKEND_URING)
+    {
+        ring.refused = 0;
+        err = job->type == PERSIST_JOB_WRITE ? uring_run_write(&ring, job)
+                                             : uring_run_read(&ring, job);
+        if(err && ring.refused)
+        {
+            /* the ring is short of room, not the disk: do it without it */
+            syslog(LOG_WARNING, "persist: io_uring refused %s: %s, retrying with plain I/O",
+                   job->path, strerror(err));
+            if(job->type == PERSIST_JOB_READ)
+            {
+                free(job->data);
+                job->data = NULL;
+            }
+            err = job->type == PERSIST_JOB_WRITE ? pool_run_write(job)
+                                                 : pool_run_read(job);
+        }
+    }
+    else
+        err = job->type == PERSIST_JOB_WRITE ? pool_run_write(job)
+                                             : pool_run_read(job);
+
+    job_complete(job, err);
+}
+
+/* Takes the first job whose path is not being worked on by another
+ * worker, so writes to one file are always applied in order.
+ * Called with queue_mutex held. */
+static persist_job *
+queue_take(void)
+{
+    for(persist_job **pp = &queue_head; *pp; pp = &(*pp)->next)
+    {
+        persist_job *job = *pp;
+        int blocked = job->busy;
+
+        for(persist_job *it = queue_head; it != job && !blocked; it = it->next)
+            if(!strcmp(it->path, job->path))
+                blocked = 1;
+
+        if(blocked)
+            continue;
+
+        job->busy = 1;
+        return job;
+    }
+
+    return NULL;
+}
+
+/* Unlinks a finished job. Called with queue_mutex held. */
+static void
+queue_remove(persist_job *job)
+{
+    persist_job *prev = NULL;
+    for(persist_job *it = queue_head; it; prev = it, it = it->next)
+    {
+        if(it != job)
+            continue;
+
+        if(prev)
+            prev->next = it->next;
+        else
+            queue_head = it->next;
+        if(queue_tail == it)
+            queue_tail = prev;
+        break;
+    }
+}
+
+/* Returns NULL */
+static void *
+persist_worker_fn(void *arg)
+{
+    (void) arg;
+
+    placement_apply(PLACEMENT_PERSIST);
+
+    pthread_mutex_lock(&queue_mutex);
+    for(;;)
+    {
+        persist_job *job = queue_take();
+        if(!job)
+        {
+            if(shutting_down)
+                break;
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+            continue;
+        }
+
+        /* the job stays queued while running to block same-path jobs */
+        pthread_mutex_unlock(&queue_mutex);
+        job_run(job);
+        pthread_mutex_lock(&queue_mutex);
+
+        queue_remove(job);
+        free(job);
+        --jobs_pending;
+        if(!jobs_pending)
+            pthread_cond_broadcast(&idle_cond);
+        /* a same-path job might be runnable now */
+        pthread_cond_broadcast(&queue_cond);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+
+    return NULL;
+}
+
+static int
+queue_push(persist_job *job)
+{
+    if(backend == PERSIST_BACKEND_INLINE)
+    {
+        job_run(job);
+        free(job);
+        return 0;
+    }
+
+    pthread_mutex_lock(&queue_mutex);
+    if(shutting_down)
+    {
+        pthread_mutex_unlock(&queue_mutex);
+        return ESHUTDOWN;
+    }
+
+    job->next = NULL;
+    if(queue_tail)
+        queue_tail->next = job;
+    else
+        queue_head = job;
+    queue_tail = job;
+    ++jobs_pending;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+
+    return 0;
+}
+
+static persist_job *
+job_new(int type, const char *path)
+{
+    /* !!! malloc !!! */
+    persist_job *job = calloc(1, sizeof(*job));
+    if(!job)
+        return NULL;
+
+    job->type = type;
+    strncpy(job->path, path, FILENAME_MAX - 1);
+    job->path[FILENAME_MAX - 1] = '\0';
+
+    return job;
+}
+
+/*********************/
+/* Library interface */
+/*********************/
+
+int
+persist_init(void)
+{
+    int err, threads;
+
+    if(backend != PERSIST_BACKEND_INLINE)
+        return 0;
+
+    err = uring_setup(&ring);
+    if(!err)
+    {
+        backend = PERSIST_BACKEND_URING;
+        /* one thread owns the ring */
+        threads = 1;
+    }
+    else
+    {
+        syslog(LOG_INFO, "io_uring unavailable (%s), using thread pool",
+               strerror(err));
+        backend = PERSIST_BACKEND_POOL;
+        threads = PERSIST_POOL_THREADS;
+    }
+
+    shutting_down = 0;
+    for(workers_count = 0; workers_count < threads; ++workers_count)
+    {
+        /* !!! create thread !!! */
+        err = pthread_create(&workers[workers_count], NULL,
+                             &persist_worker_fn, NULL);
+        if(err)
+        {
+            syslog(LOG_ERR, "pthread_create failed: %s", strerror(err));
+            break;
+        }
+    }
+
+    if(!workers_count)
+    {
+        if(backend == PERSIST_BACKEND_URING)
+            uring_teardown(&ring);
+        backend = PERSIST_BACKEND_INLINE;
+        return err;
+    }
+
+    syslog(LOG_DEBUG, "persistence engine: %s", persist_backend_name());
+    return 0;
+}
+
+void
+persist_flush(void)
+{
+    pthread_mutex_lock(&queue_mutex);
+    while(jobs_pending)
+        pthread_cond_wait(&idle_cond, &queue_mutex);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+void
+persist_shutdown(void)
+{
+    if(backend == PERSIST_BACKEND_INLINE)
+        return;
+
+    pthread_mutex_lock(&queue_mutex);
+    shutting_down = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+
+    /* workers leave only when the queue is drained */
+    for(int i = 0; i < workers_count; ++i)
+        pthread_join(workers[i], NULL);
+    workers_count = 0;
+
+    if(backend == PERSIST_BACKEND_URING)
+        uring_teardown(&ring);
+    backend = PERSIST_BACKEND_INLINE;
+}
+
+const char *
+persist_backend_name(void)
+{
+    switch(backend)
+    {
+    case PERSIST_BACKEND_URING:
+        return "io_uring";
+    case PERSIST_BACKEND_POOL:
+        return "threadpool";
+    }
+
+    return "inline";
+}
+
+int
+persist_write_file(const char *path, char *data, size_t size,
+                   persist_write_done_fn done, void *ctx)
+{
+    int err;
+    persist_job *job = job_new(PERSIST_JOB_WRITE, path);
+    if(!job)
+    {
+        free(data);
+        return ENOMEM;
+    }
+
+    job->data = data;
+    job->size = size;
+    job->write_done = done;
+    job->ctx = ctx;
+
+    err = queue_push(job);
+    if(err)
+    {
+        free(data);
+        free(job);
+    }
+
+    return err;
+}
+
+int
+persist_write_rendered(const char *path, persist_render_fn render,
+                       persist_write_done_fn done, void *ctx)
+{
+    int err;
+    persist_job *job = job_new(PERSIST_JOB_WRITE, path);
+    if(!job)
+        return ENOMEM;
+
+    job->render = render;
+    job->write_done = done;
+    job->ctx = ctx;
+
+    err = queue_push(job);
+    if(err)
+        free(job);
+
+    return err;
+}
+
+int
+persist_fsync_dir(const char *dir)
+{
+    int err = 0;
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+        return errno;
+
+    if(fsync(fd))
+        err = errno;
+    close(fd);
+    return err;
+}
+
+int
+persist_read_file(const char *path, persist_read_done_fn done, void *ctx)
+{
+    int err;
+    persist_job *job = job_new(PERSIST_JOB_READ, path);
+    if(!job)
+        return ENOMEM;
+
+    job->read_done = done;
+    job->ctx = ctx;
+
+    err = queue_push(job);
+    if(err)
+        free(job);
+
+    return err;
+}
+
+/**
+ * @struct s_read_waiter
+ * @typedef read_waiter
+ */
+typedef struct s_read_waiter {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int done;
+    int err;
+    char *data;
+    size_t size;
+} read_waiter;
+
+static void
+read_wait_done_fn(int err, char *data, size_t size, void *ctx)
+{
+    read_waiter *w = ctx;
+
+    pthread_mutex_lock(&w->mutex);
+    w->err = err;
+    w->data = data;
+    w->size = size;
+    w->done = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+int
+persist_read_file_wait(const char *path, char **data_out, size_t *size_out)
+{
+    int err;
+    read_waiter w = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+    };
+
+    err = persist_read_file(path, read_wait_done_fn, &w);
+    if(err)
+        return err;
+
+    pthread_mutex_lock(&w.mutex);
+    while(!w.done)
+        pthread_cond_wait(&w.cond, &w.mutex);
+    pthread_mutex_unlock(&w.mutex);
+
+    *data_out = w.data;
+    *size_out = w.size;
+    return w.err;
+}
@@ -0,0 +1,141 @@
+/*
+ * Header for asynchronous persistence engine for netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef PERSIST_MODULE_H
+#define PERSIST_MODULE_H
+
+/**
+ * @brief Completion callback for a queued write.
+ *
+ * Called from a persistence thread with 0 or an errno code.
+ */
+typedef void (*persist_write_done_fn)(int err, void *ctx);
+
+/**
+ * @brief Producer of the data of a queued write.
+ *
+ * Called from a persistence thread before the write. On success, data
+ * receives a malloc()'ed buffer of size bytes owned by the engine.
+ */
+typedef int (*persist_render_fn)(void *ctx, char **data, size_t *size);
+
+/**
+ * @brief Completion callback for a queued read.
+ *
+ * Called from a persistence thread. On success, data points to a
+ * malloc()'ed NUL-terminated buffer of size bytes owned by the callee.
+ */
+typedef void (*persist_read_done_fn)(int err, char *data, size_t size, void *ctx);
+
+/**
+ * @fn persist_init
+ * @brief Start the persistence engine.
+ * @return 0 on success or an error code on failure.
+ *
+ * Sets up an io_uring with registered buffers. If io_uring is not
+ * available, a small pool of worker threads doing plain write()/read()
+ * is started instead. Must be called after daemonize().
+ */
+int
+persist_init(void);
+
+/**
+ * @fn persist_shutdown
+ * @brief Finish all queued jobs and stop the engine threads.
+ */
+void
+persist_shutdown(void);
+
+/**
+ * @fn persist_flush
+ * @brief Block until every job queued so far is completed.
+ */
+void
+persist_flush(void);
+
+/**
+ * @fn persist_backend_name
+ * @return "io_uring", "threadpool" or "inline" if the engine is not running.
+ */
+const char *
+persist_backend_name(void);
+
+/**
+ * @fn persist_write_file
+ * @brief Queue a write of a buffer to a file.
+ *
+ * The data goes to a temporary file next to the target, which is
+ * fsynced and renamed over it, then the directory is fsynced. After a
+ * crash the file is either the old one or the new one.
+ *
+ * @param path      Target file path.
+ * @param data      malloc()'ed buffer, ownership is passed to the engine.
+ * @param size      Size of data in bytes.
+ * @param done      Optional completion callback.
+ * @param ctx       Argument for done.
+ *
+ * @return 0 if the job was queued or an error code on failure.
+ *
+ * Returns immediately, the caller never waits on disk I/O.
+ * If the engine is not running, the write is done inline.
+ */
+int
+persist_write_file(const char *path, char *data, size_t size,
+                   persist_write_done_fn done, void *ctx);
+
+/**
+ * @fn persist_write_rendered
+ * @brief Queue a write of a buffer made by render to a file.
+ *
+ * Same as persist_write_file(), but the buffer is made on the engine's
+ * thread, so the caller does not pay for serializing it.
+ *
+ * @param render    Makes the data, its error fails the write.
+ * @param done      Completion callback, called with ctx after render
+ *                  in any case, so it can free ctx.
+ *
+ * @return 0 if the job was queued or an error code on failure, then
+ *         neither render nor done is called.
+ */
+int
+persist_write_rendered(const char *path, persist_render_fn render,
+                       persist_write_done_fn done, void *ctx);
+
+/**
+ * @fn persist_fsync_dir
+ * @brief Make the entries created, renamed or linked in a directory
+ *        durable.
+ * @return 0 on success or an error code on failure.
+ */
+int
+persist_fsync_dir(const char *dir);
+
+/**
+ * @fn persist_read_file
+ * @brief Queue a read of a whole file.
+ *
+ * @return 0 if the job was queued or an error code on failure.
+ */
+int
+persist_read_file(const char *path, persist_read_done_fn done, void *ctx);
+
+/**
+ * @fn persist_read_file_wait
+ * @brief Read a whole file through the engine and wait for it.
+ *
+ * @param path      File path.
+ * @param data_out  Receives a malloc()'ed NUL-terminated buffer.
+ * @param size_out  Receives the size of the file.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+persist_read_file_wait(const char *path, char **data_out, size_t *size_out);
+
+#endif // PERSIST_MODULE_H
@@ -0,0 +1,204 @@
+/*
+ * CPU and NUMA placement of netsniffd threads
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include "stdafx.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+/* nodes placement_bind() can name, as many as the kernel supports */
+#define PLACEMENT_NODES_MAX 1024
+#define PLACEMENT_NODE_WORDS (PLACEMENT_NODES_MAX / (8 * sizeof(unsigned long)))
+
+static const char *role_names[PLACEMENT_ROLES] = {
+    "capture", "aggregate", "ipc", "persist"
+};
+
+static struct
+{
+    cpu_set_t cpus[PLACEMENT_ROLES];
+    int cpus_set[PLACEMENT_ROLES];
+    cpu_set_t initial;          /* CPUs the process started with */
+    int initial_valid;
+    int rt_priority;            /* of the capture thread, 0 if not real-time */
+    int node_config;            /* as set, PLACEMENT_NODE_AUTO by default */
+    int node;                   /* resolved by placement_select_node() */
+} placement = {
+    .node_config = PLACEMENT_NODE_AUTO,
+    .node = PLACEMENT_NODE_NONE
+};
+
+int
+placement_set_cpus(placement_role role, const char *list)
+{
+    cpu_set_t set;
+    const char *p = list;
+
+    if(role >= PLACEMENT_ROLES || !list || !*list)
+        return EINVAL;
+
+    /* "N", "N-M", separated by commas */
+    CPU_ZERO(&set);
+    while(*p)
+    {
+        unsigned long first, last;
+        char *end;
+
+        first = strtoul(p, &end, 10);
+        if(end == p)
+            return EINVAL;
+        last = first;
+        p = end;
+        if(*p == '-')
+        {
+            last = strtoul(++p, &end, 10);
+            if(end == p)
+                return EINVAL;
+            p = end;
+        }
+        if(first > last || last >= CPU_SETSIZE)
+            return EINVAL;
+
+        for(unsigned long cpu = first; cpu <= last; ++cpu)
+            CPU_SET(cpu, &set);
+
+        if(*p == ',')
+            ++p;
+        else if(*p)
+            return EINVAL;
+    }
+
+    placement.cpus[role] = set;
+    placement.cpus_set[role] = 1;
+    return 0;
+}
+
+int
+placement_set_rt_priority(int priority)
+{
+    if(priority && (priority < sched_get_priority_min(SCHED_FIFO)
+                    || priority > sched_get_priority_max(SCHED_FIFO)))
+        return EINVAL;
+
+    placement.rt_priority = priority;
+    return 0;
+}
+
+void
+placement_set_node(int node)
+{
+    placement.node_config = node;
+}
+
+void
+placement_init(void)
+{
+    if(sched_getaffinity(0, sizeof(placement.initial), &placement.initial) == 0)
+        placement.initial_valid = 1;
+    else
+        syslog(LOG_WARNING, "sched_getaffinity failed: %s", strerror(errno));
+}
+
+int
+placement_apply(placement_role role)
+{
+    const cpu_set_t *set = NULL;
+    int err = 0;
+
+    if(role >= PLACEMENT_ROLES)
+        return EINVAL;
+
+    if(placement.cpus_set[role])
+        set = &placement.cpus[role];
+    else if(placement.initial_valid)
+        set = &placement.initial;
+
+    if(set)
+    {
+        err = pthread_setaffinity_np(pthread_self(), sizeof(*set), set);
+        if(err)
+            syslog(LOG_WARNING, "%s thread: CPU affinity not set: %s",
+                   role_names[role], strerror(err));
+    }
+
+    if(role == PLACEMENT_CAPTURE && placement.rt_priority)
+    {
+        struct sched_param param = { .sched_priority = placement.rt_priority };
+        int rt_err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+        if(rt_err)
+        {
+            syslog(LOG_WARNING, "capture thread: SCHED_FIFO %d not set: %s",
+                   placement.rt_priority, strerror(rt_err));
+            err = err ? err : rt_err;
+        }
+    }
+
+    return err;
+}
+
+/* Returns the node of a network device, PLACEMENT_NODE_NONE if it has
+ * none, e.g. a virtual device or a single node machine. */
+static int
+iface_node(const char *iface)
+{
+    char path[PATH_MAX];
+    FILE *file;
+    int node = PLACEMENT_NODE_NONE;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", iface);
+    file = fopen(path, "re");
+    if(!file)
+        return PLACEMENT_NODE_NONE;
+
+    if(fscanf(file, "%d", &node) != 1 || node < 0)
+        node = PLACEMENT_NODE_NONE;
+    fclose(file);
+    return node;
+}
+
+int
+placement_select_node(const char *iface)
+{
+    int node = placement.node_config;
+
+    if(node == PLACEMENT_NODE_AUTO)
+        node = iface_node(iface);
+
+    if(node >= PLACEMENT_NODES_MAX)
+    {
+        syslog(LOG_WARNING, "NUMA node %d not supported, memory is not placed", node);
+        node = PLACEMENT_NODE_NONE;
+    }
+
+    if(node != placement.node && node >= 0)
+        syslog(LOG_INFO, "capture memory on NUMA node %d", node);
+    placement.node = node;
+    return node;
+}
+
+int
+placement_bind(void *addr, size_t len)
+{
+    unsigned long mask[PLACEMENT_NODE_WORDS] = { 0 };
+    int node = placement.node;
+
+    if(node < 0 || !len)
+        return 0;
+
+    mask[node / (8 * sizeof(*mask))] = 1UL << (node % (8 * sizeof(*mask)));
+    /* glibc has no wrapper, libnuma is not needed for one call */
+    if(syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+               (unsigned long) PLACEMENT_NODES_MAX, MPOL_MF_MOVE) == -1)
+        return errno;
+
+    return 0;
+}
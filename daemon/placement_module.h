@@ -0,0 +1,109 @@
+/*
+ * Header for CPU and NUMA placement of netsniffd threads
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef PLACEMENT_MODULE_H
+#define PLACEMENT_MODULE_H
+
+#include <stddef.h>
+
+/* placement_set_node() values besides a node number */
+#define PLACEMENT_NODE_NONE (-1)    /* leave memory to the kernel */
+#define PLACEMENT_NODE_AUTO (-2)    /* the node of the capture interface */
+
+/**
+ * @enum e_placement_role
+ * @typedef placement_role
+ * @brief Groups of threads placed together.
+ */
+typedef enum e_placement_role
+{
+    PLACEMENT_CAPTURE,      /* receive stage */
+    PLACEMENT_AGGREGATE,    /* aggregation stage */
+    PLACEMENT_IPC,          /* IPC server and metrics exporter */
+    PLACEMENT_PERSIST,      /* persistence workers and the stats loader */
+    PLACEMENT_ROLES
+} placement_role;
+
+/**
+ * @fn placement_set_cpus
+ * @brief Set the CPUs threads of a role run on.
+ *
+ * @param list  CPU numbers and ranges, e.g. "0-3,8".
+ *
+ * @return 0 on success or EINVAL if list cannot be parsed.
+ */
+int
+placement_set_cpus(placement_role role, const char *list);
+
+/**
+ * @fn placement_set_rt_priority
+ * @brief Run the capture thread under SCHED_FIFO.
+ *
+ * @param priority  1 to 99, 0 keeps the default policy.
+ *
+ * @return 0 on success or EINVAL if priority is out of range.
+ */
+int
+placement_set_rt_priority(int priority);
+
+/**
+ * @fn placement_set_node
+ * @brief Set the NUMA node of the counter table and the capture ring.
+ *
+ * @param node  Node number, PLACEMENT_NODE_AUTO (the default) or
+ *              PLACEMENT_NODE_NONE.
+ */
+void
+placement_set_node(int node);
+
+/**
+ * @fn placement_init
+ * @brief Remember the CPUs the process may use, for threads of roles
+ *        with no CPUs set. Must be called before any thread is placed.
+ */
+void
+placement_init(void);
+
+/**
+ * @fn placement_apply
+ * @brief Place the calling thread as a thread of role.
+ *
+ * A thread inherits the CPUs of the thread creating it, so a role with
+ * no CPUs set is given back all CPUs the process started with.
+ * Failures are logged, the thread runs on unplaced.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+placement_apply(placement_role role);
+
+/**
+ * @fn placement_select_node
+ * @brief Resolve the node memory is placed on for capture on iface.
+ * @return node number, or PLACEMENT_NODE_NONE if memory is not placed.
+ */
+int
+placement_select_node(const char *iface);
+
+/**
+ * @fn placement_bind
+ * @brief Prefer the selected node for pages of a mapping.
+ *
+ * Pages not yet touched are allocated there, those already in memory
+ * are moved if they can be. Does nothing before placement_select_node()
+ * chose a node.
+ *
+ * @param addr  Page aligned.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+placement_bind(void *addr, size_t len);
+
+#endif // PLACEMENT_MODULE_H
@@ -0,0 +1,62 @@
+/*
+ * Static tracepoints of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT probes of provider "netsniffd", see tools/trace/ for bpftrace
+ * scripts using them. A probe is a single nop until a tracer attaches;
+ * its arguments are evaluated either way, so they are kept to values
+ * already at hand. Without <sys/sdt.h> (systemtap-sdt-dev), or with
+ * NETSNIFF_NO_PROBES defined, probes compile to nothing.
+ *
+ * Probes, with their arguments:
+ *   packet__receive         addr (network order), size
+ *   ring__overflow          addr of the packet lost
+ *   capture__lock__acquire  1 if the lock was contended
+ *   capture__lock__release
+ *   aggregate__batch        packets counted, packets queued when taken
+ *   table__insert           addr, entries after the insert
+ *   table__hit              addr, count after the add
+ *   table__resize__start    capacity, entries
+ *   table__resize__done     new capacity, error code
+ *   snapshot__start         kind ("dump" or "memfd")
+ *   snapshot__done          kind, error code, entries
+ *   ipc__command__start     option, name, frame id (0 if unframed)
+ *   ipc__command__done      option, error code
+ */
+#if !defined(NETSNIFF_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define NETSNIFF_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef NETSNIFF_HAVE_PROBES
+
+#include <sys/sdt.h>
+
+#define NETSNIFF_PROBE(name) DTRACE_PROBE(netsniffd, name)
+#define NETSNIFF_PROBE1(name, a1) DTRACE_PROBE1(netsniffd, name, a1)
+#define NETSNIFF_PROBE2(name, a1, a2) DTRACE_PROBE2(netsniffd, name, a1, a2)
+#define NETSNIFF_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(netsniffd, name, a1, a2, a3)
+
+#else
+
+/* arguments are type checked but never evaluated */
+#define NETSNIFF_PROBE(name) do { } while(0)
+#define NETSNIFF_PROBE1(name, a1) do { if(0) { (void)(a1); } } while(0)
+#define NETSNIFF_PROBE2(name, a1, a2) \
+    do { if(0) { (void)(a1); (void)(a2); } } while(0)
+#define NETSNIFF_PROBE3(name, a1, a2, a3) \
+    do { if(0) { (void)(a1); (void)(a2); (void)(a3); } } while(0)
+
+#endif
+
+#endif // PROBES_H
@@ -0,0 +1,147 @@
+/*
+ * Stat queries of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include "stdafx.h"
+
+#include <arpa/inet.h>
+
+/* ranges this small are sorted rather than partitioned further */
+#define QUERY_SELECT_SMALL 16
+
+int
+query_validate(const dopt_query *query)
+{
+    if(query->prefix_len > 32 || query->sort > DOPT_SORT_ADDR_DESC)
+        return EINVAL;
+
+    if(query->count_max && query->count_max < query->count_min)
+        return EINVAL;
+
+    return 0;
+}
+
+uint32_t
+query_mask(const dopt_query *query)
+{
+    return query->prefix_len ? htonl(UINT32_MAX << (32 - query->prefix_len)) : 0;
+}
+
+/* Orders rows by a dopt_query_sort key, addresses are unique */
+static int
+row_compare(const dopt_stat_entry *a, const dopt_stat_entry *b, uint32_t sort)
+{
+    uint32_t x = ntohl(a->addr), y = ntohl(b->addr);
+    uint64_t cx = a->count, cy = b->count;
+
+    switch(sort)
+    {
+    case DOPT_SORT_COUNT_DESC:
+        if(cx != cy)
+            return cx > cy ? -1 : 1;
+        break;
+
+    case DOPT_SORT_COUNT_ASC:
+        if(cx != cy)
+            return cx < cy ? -1 : 1;
+        break;
+
+    case DOPT_SORT_ADDR_DESC:
+        return (x < y) - (x > y);
+    }
+
+    return (x > y) - (x < y);
+}
+
+static int
+row_compare_fn(const void *a, const void *b, void *sort)
+{
+    return row_compare(a, b, *(const uint32_t *) sort);
+}
+
+static inline void
+row_swap(dopt_stat_entry *a, dopt_stat_entry *b)
+{
+    dopt_stat_entry t = *a;
+    *a = *b;
+    *b = t;
+}
+
+/**
+ * @fn select_first
+ * @brief Move the k first rows in sort order to the front, unordered.
+ *
+ * Quickselect with a median of three. Should the partitions keep
+ * coming out lopsided, the remaining range is sorted instead, which
+ * bounds the worst case at O(n log n).
+ */
+static void
+select_first(dopt_stat_entry *rows, size_t count, size_t k, uint32_t sort)
+{
+    size_t lo = 0, hi = count;
+    unsigned depth = 0;
+
+    for(size_t n = count; n; n >>= 1)
+        depth += 2;
+
+    while(hi - lo > QUERY_SELECT_SMALL)
+    {
+        size_t mid = lo + (hi - lo) / 2, lt = lo, i = lo, gt = hi;
+        dopt_stat_entry pivot;
+
+        if(!depth--)
+            break;
+
+        /* median of the first, middle and last row */
+        if(row_compare(&rows[mid], &rows[lo], sort) < 0)
+            row_swap(&rows[mid], &rows[lo]);
+        if(row_compare(&rows[hi - 1], &rows[lo], sort) < 0)
+            row_swap(&rows[hi - 1], &rows[lo]);
+        if(row_compare(&rows[hi - 1], &rows[mid], sort) < 0)
+            row_swap(&rows[hi - 1], &rows[mid]);
+        pivot = rows[mid];
+
+        /* [lo, lt) before the pivot, [gt, hi) after it */
+        while(i < gt)
+        {
+            int c = row_compare(&rows[i], &pivot, sort);
+            if(c < 0)
+                row_swap(&rows[lt++], &rows[i++]);
+            else if(c > 0)
+                row_swap(&rows[i], &rows[--gt]);
+            else
+                ++i;
+        }
+
+        if(k <= lt)
+            hi = lt;
+        else if(k >= gt)
+            lo = gt;
+        else
+            return;
+    }
+
+    qsort_r(rows + lo, hi - lo, sizeof(*rows), row_compare_fn, &sort);
+}
+
+size_t
+query_select(dopt_stat_entry *rows, size_t count, const dopt_query *query)
+{
+    size_t k = query->limit && query->limit < count ? query->limit : count;
+    uint32_t sort = query->sort;
+
+    /* unsorted queries take the first matches as they are */
+    if(sort == DOPT_SORT_NONE)
+        return k;
+
+    if(k < count)
+        select_first(rows, count, k, sort);
+    qsort_r(rows, k, sizeof(*rows), row_compare_fn, &sort);
+
+    return k;
+}
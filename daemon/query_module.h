@@ -0,0 +1,53 @@
+/*
+ * Header for stat queries of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef QUERY_MODULE_H
+#define QUERY_MODULE_H
+
+/**
+ * @fn query_validate
+ * @brief Check a DOPT_QUERY argument.
+ * @return 0 if it can be run or EINVAL.
+ */
+int
+query_validate(const dopt_query *query);
+
+/**
+ * @fn query_mask
+ * @return netmask of the query prefix, network byte order.
+ */
+uint32_t
+query_mask(const dopt_query *query);
+
+/**
+ * @fn query_match
+ * @brief Check an entry against the predicates of a query.
+ * @param mask  query_mask() of the query, taken once per scan.
+ */
+static inline int
+query_match(const dopt_query *query, uint32_t mask, uint32_t addr, uint64_t count)
+{
+    return !((addr ^ query->prefix) & mask) && count >= query->count_min
+           && (!query->count_max || count <= query->count_max);
+}
+
+/**
+ * @fn query_select
+ * @brief Put the rows to send first, in the order of the query.
+ *
+ * Only the first query->limit rows are sorted, the rest is just
+ * partitioned away from them, so a top-N query over many matches
+ * costs about a linear pass.
+ *
+ * @return number of rows to send.
+ */
+size_t
+query_select(dopt_stat_entry *rows, size_t count, const dopt_query *query);
+
+#endif // QUERY_MODULE_H
@@ -18,6 +18,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <limits.h>
+#include <inttypes.h>
 
 /* Log writer */
 #include <syslog.h>
@@ -28,10 +30,20 @@
 #include <net/if.h>
 #include <netinet/in.h>
 
-/* Red-Black tree from glibc */
-/* Note: using radix trees would be much better here */
-#include <search.h>
-
+#include "custom_com_def.h"
+#include "hist_def.h"
+#include "probes.h"
+#include "counter_table.h"
+#include "capture_ring.h"
 #include "capture_module.h"
+#include "persist_module.h"
+#include "history_module.h"
+#include "ipc_module.h"
+#include "watch_module.h"
+#include "metrics_module.h"
+#include "placement_module.h"
+#include "bpf_module.h"
+#include "xdp_module.h"
+#include "query_module.h"
 
 #endif // STDAFX_H
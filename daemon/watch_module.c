@@ -0,0 +1,203 @@
+/*
+ * Change subscriptions of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include "stdafx.h"
+
+/**
+ * @struct s_watch_sub
+ * @typedef watch_sub
+ * @brief A connection subscribed with DOPT_WATCH.
+ */
+typedef struct s_watch_sub
+{
+    ipc_conn *conn;
+    int framed;
+    uint32_t id;
+    /* output positions where the last two deltas end */
+    uint64_t prev_end;
+    uint64_t last_end;
+    struct s_watch_sub *next;
+} watch_sub;
+
+static struct
+{
+    uint32_t interval_ms;
+    uint64_t sequence;      /* of the next delta */
+    watch_sub *subs;
+    /* the delta being pushed, reused between intervals */
+    char *buf;
+    size_t capacity;
+} watch = { WATCH_DEFAULT_INTERVAL_MS, 1 };
+
+void
+watch_set_interval(uint32_t interval_ms)
+{
+    if(interval_ms < WATCH_MIN_INTERVAL_MS)
+        interval_ms = WATCH_MIN_INTERVAL_MS;
+    if(interval_ms > WATCH_MAX_INTERVAL_MS)
+        interval_ms = WATCH_MAX_INTERVAL_MS;
+
+    watch.interval_ms = interval_ms;
+}
+
+uint32_t
+watch_get_interval(void)
+{
+    return watch.interval_ms;
+}
+
+static watch_sub *
+watch_find(const ipc_conn *conn, watch_sub ***link)
+{
+    watch_sub **p = &watch.subs;
+
+    for(; *p; p = &(*p)->next)
+        if((*p)->conn == conn)
+            break;
+
+    if(link)
+        *link = p;
+    return *p;
+}
+
+/* Unsubscribes a connection as it is closed, see ipc_conn.on_close */
+static void
+watch_on_close(ipc_conn *conn)
+{
+    watch_sub **link;
+    watch_sub *sub = watch_find(conn, &link);
+
+    if(!sub)
+        return;
+
+    *link = sub->next;
+    free(sub);
+
+    if(!watch.subs)
+    {
+        /* nobody is left, stop paying for the tracking */
+        packet_stats_track(0);
+        free(watch.buf);
+        watch.buf = NULL;
+        watch.capacity = 0;
+    }
+}
+
+int
+watch_subscribe(ipc_conn *conn, int framed, uint32_t id, dopt_watch_info *info)
+{
+    watch_sub *sub;
+    int err;
+
+    if(watch_find(conn, NULL))
+        return EALREADY;
+
+    /* !!! calloc !!! */
+    sub = calloc(1, sizeof(*sub));
+    if(!sub)
+        return ENOMEM;
+
+    if(!watch.subs)
+    {
+        err = packet_stats_track(1);
+        if(err)
+        {
+            free(sub);
+            return err;
+        }
+    }
+
+    sub->conn = conn;
+    sub->framed = framed;
+    sub->id = id;
+    sub->next = watch.subs;
+    watch.subs = sub;
+    conn->on_close = watch_on_close;
+
+    memset(info, 0, sizeof(*info));
+    info->interval_ms = watch.interval_ms;
+    info->sequence = watch.sequence;
+    return 0;
+}
+
+/* Room for the header and count entries, see packet_changes_alloc_fn */
+static int
+watch_alloc_fn(void *ctx, size_t count, dopt_watch_entry **entries)
+{
+    size_t size = sizeof(dopt_watch_header) + count * sizeof(dopt_watch_entry);
+
+    if(size > watch.capacity)
+    {
+        /* !!! realloc !!! */
+        char *buf = realloc(watch.buf, size);
+        if(!buf)
+            return ENOMEM;
+        watch.buf = buf;
+        watch.capacity = size;
+    }
+
+    *entries = (dopt_watch_entry *) (watch.buf + sizeof(dopt_watch_header));
+    return 0;
+}
+
+void
+watch_tick(void)
+{
+    dopt_watch_header header;
+    dopt_frame_header frame;
+    watch_sub *sub, *next;
+    size_t size;
+    int err;
+
+    if(!watch.subs)
+        return;
+
+    /* changes stay marked if this fails, the next interval has them */
+    err = packet_stats_changes(watch_alloc_fn, NULL, &header);
+    if(err)
+    {
+        syslog(LOG_ERR, "watch: collecting changes failed: %s", strerror(err));
+        return;
+    }
+
+    header.sequence = watch.sequence++;
+    size = sizeof(header) + header.entry_count * sizeof(dopt_watch_entry);
+    memcpy(watch.buf, &header, sizeof(header));
+
+    for(sub = watch.subs; sub; sub = next)
+    {
+        ipc_conn *conn = sub->conn;
+
+        /* dropping a connection unsubscribes it */
+        next = sub->next;
+
+        if(conn->out_sent < sub->prev_end)
+        {
+            syslog(LOG_WARNING, "watch: subscriber is %" PRIu64 " bytes behind, dropping it",
+                   conn->out_queued - conn->out_sent);
+            ipc_conn_drop(conn);
+            continue;
+        }
+
+        frame.size = size;
+        frame.id = sub->id;
+        err = sub->framed ? ipc_conn_reply(conn, &frame, sizeof(frame)) : 0;
+        if(!err)
+            err = ipc_conn_reply(conn, watch.buf, size);
+        if(err)
+        {
+            ipc_conn_drop(conn);
+            continue;
+        }
+
+        sub->prev_end = sub->last_end;
+        sub->last_end = ipc_conn_reply_mark(conn);
+        ipc_conn_send(conn);
+    }
+}
@@ -0,0 +1,58 @@
+/*
+ * Header for change subscriptions of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef WATCH_MODULE_H
+#define WATCH_MODULE_H
+
+#define WATCH_DEFAULT_INTERVAL_MS 1000
+#define WATCH_MIN_INTERVAL_MS 100
+#define WATCH_MAX_INTERVAL_MS 60000
+
+/**
+ * @fn watch_set_interval
+ * @brief Set how often deltas are pushed, clamped to the limits above.
+ */
+void
+watch_set_interval(uint32_t interval_ms);
+
+/**
+ * @fn watch_get_interval
+ * @return how often deltas are pushed, in ms.
+ */
+uint32_t
+watch_get_interval(void);
+
+/**
+ * @fn watch_subscribe
+ * @brief Push deltas to a connection until it is closed.
+ *
+ * Called from a request handler. Change tracking of the counter table
+ * is on while there are subscribers.
+ *
+ * @param framed    Send every delta in a frame with the given id.
+ * @param info      Receives the interval and the first sequence number.
+ *
+ * @return 0 on success or an error code on failure. EALREADY if the
+ *         connection is subscribed already.
+ */
+int
+watch_subscribe(ipc_conn *conn, int framed, uint32_t id, dopt_watch_info *info);
+
+/**
+ * @fn watch_tick
+ * @brief Collect the changes of the interval and push them.
+ *
+ * Called by the IPC server timer. Subscribers still behind with the
+ * delta before the previous one are dropped, so a slow client costs
+ * at most two deltas of memory.
+ */
+void
+watch_tick(void);
+
+#endif // WATCH_MODULE_H
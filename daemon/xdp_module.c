@@ -0,0 +1,485 @@
+/*
+ * AF_XDP packet capture of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include "stdafx.h"
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <netinet/ip.h>
+#include <net/ethernet.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include "bpf_insn.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/* Frames per queue, all of them fit on the fill ring. 2048 bytes hold
+ * a 1500 byte MTU frame and are the smallest the kernel accepts. */
+#define XDP_FRAME_SIZE 2048
+#define XDP_FRAME_COUNT 4096
+#define XDP_RX_RING_SIZE XDP_FRAME_COUNT
+/* nothing is transmitted, the kernel wants one anyway */
+#define XDP_COMPLETION_RING_SIZE 64
+/* sockets opened at most, one per receive queue */
+#define XDP_QUEUES_MAX 256
+
+/* Receive queues in use, one socket is needed for each */
+static uint32_t
+rx_queue_count(const char *ifname)
+{
+    char path[PATH_MAX];
+    struct dirent *entry;
+    uint32_t count = 0;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", ifname);
+    dir = opendir(path);
+    if(!dir)
+        return 1;
+
+    while((entry = readdir(dir)))
+        if(!strncmp(entry->d_name, "rx-", 3))
+            ++count;
+    closedir(dir);
+
+    if(!count)
+        return 1;
+    return count < XDP_QUEUES_MAX ? count : XDP_QUEUES_MAX;
+}
+
+static int
+xskmap_create(uint32_t queues)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(int);
+    attr.max_entries = queues;
+    memcpy(attr.map_name, "netsniffd_xsks", sizeof("netsniffd_xsks"));
+
+    return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int
+prog_load(int map_fd)
+{
+    /*
+     * if(data + ETH_HLEN + sizeof(struct iphdr) <= data_end
+     *    && eth->h_proto == htons(ETH_P_IP) && ip->protocol == IPPROTO_TCP)
+     *     return bpf_redirect_map(xsks, rx_queue_index, XDP_PASS);
+     * return XDP_PASS;
+     *
+     * A queue without a socket passes its frames to the stack.
+     */
+    struct bpf_insn prog[] = {
+        LDX_W(BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data)),
+        LDX_W(BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end)),
+        MOV64_REG(BPF_REG_4, BPF_REG_2),
+        ADD64_IMM(BPF_REG_4, ETH_HLEN + sizeof(struct iphdr)),
+        JGT_REG(BPF_REG_4, BPF_REG_3, 10),      /* to 15 */
+        LDX_H(BPF_REG_4, BPF_REG_2, offsetof(struct ether_header, ether_type)),
+        JNE_IMM(BPF_REG_4, htons(ETH_P_IP), 8), /* to 15 */
+        LDX_B(BPF_REG_4, BPF_REG_2, ETH_HLEN + offsetof(struct iphdr, protocol)),
+        JNE_IMM(BPF_REG_4, IPPROTO_TCP, 6),     /* to 15 */
+        /* 9: redirect */
+        LDX_W(BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index)),
+        LD_MAP_FD(BPF_REG_1, map_fd),
+        MOV64_IMM(BPF_REG_3, XDP_PASS),
+        CALL(BPF_FUNC_redirect_map),
+        EXIT(),
+        /* 15: pass */
+        MOV64_IMM(BPF_REG_0, XDP_PASS),
+        EXIT(),
+    };
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (uintptr_t) prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(*prog);
+    attr.license = (uintptr_t) "GPL";
+    memcpy(attr.prog_name, "netsniffd_xdp", sizeof("netsniffd_xdp"));
+
+    return bpf_prog_load_logged(&attr);
+}
+
+/* Attach with a link, which the kernel removes when the daemon dies */
+static int
+prog_attach(int prog_fd, int ifindex, uint32_t flags)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = flags;
+
+    return sys_bpf(BPF_LINK_CREATE, &attr);
+}
+
+static int
+ring_map(xdp_ring *ring, int fd, const struct xdp_ring_offset *off, uint32_t size,
+         size_t desc_size, off_t pgoff)
+{
+    ring->map_size = off->desc + size * desc_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if(ring->map == MAP_FAILED)
+    {
+        ring->map = NULL;
+        return errno;
+    }
+
+    ring->producer = (uint32_t *)((char *) ring->map + off->producer);
+    ring->consumer = (uint32_t *)((char *) ring->map + off->consumer);
+    ring->flags = (uint32_t *)((char *) ring->map + off->flags);
+    ring->descs = (char *) ring->map + off->desc;
+    ring->mask = size - 1;
+    ring->cached = 0;
+    return 0;
+}
+
+static void
+ring_unmap(xdp_ring *ring)
+{
+    if(ring->map)
+        munmap(ring->map, ring->map_size);
+    ring->map = NULL;
+}
+
+static void
+socket_close(xdp_socket *sock)
+{
+    ring_unmap(&sock->rx);
+    ring_unmap(&sock->completion);
+    ring_unmap(&sock->fill);
+    if(sock->fd >= 0)
+        close(sock->fd);
+    if(sock->umem)
+        munmap(sock->umem, sock->umem_size);
+    sock->fd = -1;
+    sock->umem = NULL;
+}
+
+/* Register the UMEM, map the rings and hand every frame to the kernel */
+static int
+socket_setup(xdp_socket *sock)
+{
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    socklen_t len = sizeof(off);
+    uint64_t *fill;
+    int err;
+
+    sock->umem_size = (size_t) XDP_FRAME_COUNT * XDP_FRAME_SIZE;
+    sock->umem = mmap(NULL, sock->umem_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(sock->umem == MAP_FAILED)
+    {
+        sock->umem = NULL;
+        return errno;
+    }
+
+    /* frames are written by the device, keep them on its node */
+    err = placement_bind(sock->umem, sock->umem_size);
+    if(err)
+        syslog(LOG_WARNING, "XDP frame placement failed: %s", strerror(err));
+
+    sock->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if(sock->fd < 0)
+        return errno;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uintptr_t) sock->umem;
+    reg.len = sock->umem_size;
+    reg.chunk_size = XDP_FRAME_SIZE;
+    if(setsockopt(sock->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg))
+       || setsockopt(sock->fd, SOL_XDP, XDP_UMEM_FILL_RING,
+                     &(int){ XDP_FRAME_COUNT }, sizeof(int))
+       || setsockopt(sock->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+                     &(int){ XDP_COMPLETION_RING_SIZE }, sizeof(int))
+       || setsockopt(sock->fd, SOL_XDP, XDP_RX_RING,
+                     &(int){ XDP_RX_RING_SIZE }, sizeof(int))
+       || getsockopt(sock->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len))
+        return errno;
+
+    err = ring_map(&sock->fill, sock->fd, &off.fr, XDP_FRAME_COUNT,
+                   sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING);
+    if(!err)
+        err = ring_map(&sock->completion, sock->fd, &off.cr, XDP_COMPLETION_RING_SIZE,
+                       sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING);
+    if(!err)
+        err = ring_map(&sock->rx, sock->fd, &off.rx, XDP_RX_RING_SIZE,
+                       sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+    if(err)
+        return err;
+
+    fill = sock->fill.descs;
+    for(uint32_t i = 0; i < XDP_FRAME_COUNT; ++i)
+        fill[i] = (uint64_t) i * XDP_FRAME_SIZE;
+    sock->fill.cached = XDP_FRAME_COUNT;
+    __atomic_store_n(sock->fill.producer, sock->fill.cached, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static int
+socket_bind(xdp_socket *sock, int ifindex, uint16_t flags)
+{
+    struct sockaddr_xdp addr = {
+        .sxdp_family = AF_XDP,
+        .sxdp_flags = flags | XDP_USE_NEED_WAKEUP,
+        .sxdp_ifindex = ifindex,
+        .sxdp_queue_id = sock->queue_id
+    };
+
+    if(bind(sock->fd, (struct sockaddr *) &addr, sizeof(addr)))
+        return errno;
+
+    return 0;
+}
+
+/* Open and bind the socket of a queue, zero-copy if it is allowed and
+ * the driver can */
+static int
+socket_open(xdp_capture *xdp, xdp_socket *sock)
+{
+    union bpf_attr attr;
+    int err;
+
+    err = socket_setup(sock);
+    if(err)
+        return err;
+
+    err = xdp->zerocopy ? socket_bind(sock, xdp->ifindex, XDP_ZEROCOPY) : EOPNOTSUPP;
+    if(err)
+    {
+        /* the first socket decides for all of them */
+        if(xdp->zerocopy && sock != xdp->sockets)
+            return err;
+        xdp->zerocopy = 0;
+        err = socket_bind(sock, xdp->ifindex, XDP_COPY);
+        if(err)
+            return err;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xdp->map_fd;
+    attr.key = (uintptr_t) &sock->queue_id;
+    attr.value = (uintptr_t) &sock->fd;
+    if(sys_bpf(BPF_MAP_UPDATE_ELEM, &attr))
+        return errno;
+
+    return 0;
+}
+
+int
+xdp_capture_open(xdp_capture *xdp, const char *ifname, int mode)
+{
+    int err;
+
+    memset(xdp, 0, sizeof(*xdp));
+    xdp->prog_fd = xdp->map_fd = xdp->link_fd = -1;
+
+    xdp->ifindex = if_nametoindex(ifname);
+    if(!xdp->ifindex)
+        return errno;
+
+    xdp->queue_count = rx_queue_count(ifname);
+    xdp->map_fd = xskmap_create(xdp->queue_count);
+    if(xdp->map_fd < 0)
+        goto fail;
+
+    xdp->prog_fd = prog_load(xdp->map_fd);
+    if(xdp->prog_fd < 0)
+        goto fail;
+
+    /* Attached before the sockets are bound: until then frames find no
+       socket and go to the stack */
+    if(mode != XDP_CAPTURE_GENERIC)
+    {
+        xdp->link_fd = prog_attach(xdp->prog_fd, xdp->ifindex, XDP_FLAGS_DRV_MODE);
+        if(xdp->link_fd < 0 && mode == XDP_CAPTURE_NATIVE)
+            goto fail;
+        xdp->native = xdp->link_fd >= 0;
+    }
+    if(xdp->link_fd < 0)
+    {
+        xdp->link_fd = prog_attach(xdp->prog_fd, xdp->ifindex, XDP_FLAGS_SKB_MODE);
+        if(xdp->link_fd < 0)
+            goto fail;
+    }
+    xdp->zerocopy = xdp->native;
+
+    /* !!! malloc !!! */
+    xdp->sockets = calloc(xdp->queue_count, sizeof(*xdp->sockets));
+    if(!xdp->sockets)
+        goto fail;
+    for(uint32_t q = 0; q < xdp->queue_count; ++q)
+        xdp->sockets[q].fd = -1;
+
+    for(uint32_t q = 0; q < xdp->queue_count; ++q)
+    {
+        xdp->sockets[q].queue_id = q;
+        err = socket_open(xdp, &xdp->sockets[q]);
+        if(err)
+        {
+            xdp_capture_close(xdp);
+            return err;
+        }
+    }
+
+    syslog(LOG_INFO, "AF_XDP capture on %s: %u queues, %s mode, %s", ifname,
+           xdp->queue_count, xdp->native ? "native" : "generic",
+           xdp->zerocopy ? "zero-copy" : "copying frames");
+    return 0;
+
+fail:
+    err = errno;
+    xdp_capture_close(xdp);
+    return err;
+}
+
+void
+xdp_capture_close(xdp_capture *xdp)
+{
+    /* detach first, frames go to the stack rather than to dead sockets */
+    if(xdp->link_fd >= 0)
+        close(xdp->link_fd);
+    for(uint32_t q = 0; xdp->sockets && q < xdp->queue_count; ++q)
+        socket_close(&xdp->sockets[q]);
+    free(xdp->sockets);
+    if(xdp->prog_fd >= 0)
+        close(xdp->prog_fd);
+    if(xdp->map_fd >= 0)
+        close(xdp->map_fd);
+
+    xdp->sockets = NULL;
+    xdp->prog_fd = xdp->map_fd = xdp->link_fd = -1;
+}
+
+/* Read up to max descriptors of one socket, recycling their frames */
+static uint32_t
+socket_receive(xdp_socket *sock, capture_record *records, uint32_t max, uint32_t *frames)
+{
+    const struct xdp_desc *descs = sock->rx.descs;
+    uint64_t *fill = sock->fill.descs;
+    uint32_t cons = sock->rx.cached, avail, n = 0;
+
+    avail = __atomic_load_n(sock->rx.producer, __ATOMIC_ACQUIRE) - cons;
+    if(!avail)
+        return 0;
+    if(avail > max)
+        avail = max;
+
+    for(uint32_t i = 0; i < avail; ++i)
+    {
+        const struct xdp_desc *desc = &descs[(cons + i) & sock->rx.mask];
+        const unsigned char *frame = sock->umem + desc->addr;
+        uint16_t type;
+
+        /* the program only redirects IPv4 TCP, be safe anyway */
+        memcpy(&type, frame + offsetof(struct ether_header, ether_type), sizeof(type));
+        if(desc->len >= ETH_HLEN + sizeof(struct iphdr) && type == htons(ETH_P_IP))
+        {
+            memcpy(&records[n].addr, frame + ETH_HLEN + offsetof(struct iphdr, saddr),
+                   sizeof(records[n].addr));
+            records[n].size = desc->len - ETH_HLEN;
+            ++n;
+        }
+
+        /* Every frame is either on the fill ring or with us, so there is
+           always room for it. In aligned mode any address within the
+           frame gives it back. */
+        fill[(sock->fill.cached + i) & sock->fill.mask] = desc->addr;
+    }
+
+    sock->rx.cached = cons + avail;
+    sock->fill.cached += avail;
+    __atomic_store_n(sock->fill.producer, sock->fill.cached, __ATOMIC_RELEASE);
+    __atomic_store_n(sock->rx.consumer, sock->rx.cached, __ATOMIC_RELEASE);
+
+    /* a zero-copy driver may have stopped for want of frames */
+    if(__atomic_load_n(sock->fill.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)
+        recvfrom(sock->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+
+    *frames += avail;
+    return n;
+}
+
+uint32_t
+xdp_capture_receive(xdp_capture *xdp, capture_record *records, uint32_t max,
+                    uint32_t *frames)
+{
+    uint32_t n = 0, taken = 0;
+
+    for(uint32_t i = 0; i < xdp->queue_count && n < max; ++i)
+    {
+        xdp_socket *sock = &xdp->sockets[(xdp->next + i) % xdp->queue_count];
+
+        n += socket_receive(sock, records + n, max - n, &taken);
+    }
+    xdp->next = xdp->next + 1 < xdp->queue_count ? xdp->next + 1 : 0;
+
+    if(frames)
+        *frames = taken;
+    return n;
+}
+
+int
+xdp_capture_wait(xdp_capture *xdp, int timeout_ms)
+{
+    struct pollfd fds[xdp->queue_count];
+
+    for(uint32_t q = 0; q < xdp->queue_count; ++q)
+    {
+        fds[q].fd = xdp->sockets[q].fd;
+        fds[q].events = POLLIN;
+    }
+
+    /* also kicks drivers waiting for a wakeup */
+    if(poll(fds, xdp->queue_count, timeout_ms) == -1 && errno != EINTR)
+        return errno;
+
+    return 0;
+}
+
+int
+xdp_capture_read_stats(const xdp_capture *xdp, xdp_capture_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    for(uint32_t q = 0; q < xdp->queue_count; ++q)
+    {
+        struct xdp_statistics xs;
+        socklen_t len = sizeof(xs);
+
+        if(getsockopt(xdp->sockets[q].fd, SOL_XDP, XDP_STATISTICS, &xs, &len))
+            return errno;
+
+        stats->rx_dropped += xs.rx_dropped;
+        stats->rx_invalid_descs += xs.rx_invalid_descs;
+        stats->rx_ring_full += xs.rx_ring_full;
+        /* not reported by kernels before 5.9 */
+        if(len >= offsetof(struct xdp_statistics, tx_ring_empty_descs))
+            stats->fill_ring_empty += xs.rx_fill_ring_empty_descs;
+    }
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Header for AF_XDP packet capture of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef XDP_MODULE_H
+#define XDP_MODULE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "capture_ring.h"
+
+/* xdp_capture_open() modes */
+#define XDP_CAPTURE_AUTO 0      /* native if the driver has it, else generic */
+#define XDP_CAPTURE_NATIVE 1    /* in the driver, zero-copy where supported */
+#define XDP_CAPTURE_GENERIC 2   /* after the driver, any device, copies */
+
+/**
+ * @struct s_xdp_ring
+ * @typedef xdp_ring
+ * @brief One of the rings an AF_XDP socket shares with the kernel.
+ *
+ * Each side owns one index and only reads the other's. cached is our
+ * own index, published when a batch is done.
+ */
+typedef struct s_xdp_ring
+{
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;            /* uint64_t frame addresses or struct xdp_desc */
+    uint32_t mask;
+    uint32_t cached;
+    void *map;
+    size_t map_size;
+} xdp_ring;
+
+/**
+ * @struct s_xdp_socket
+ * @typedef xdp_socket
+ * @brief AF_XDP socket of one receive queue and the frames it owns.
+ *
+ * Every frame of the UMEM is on the fill ring, with the kernel, or on
+ * the RX ring, with us, and goes back to the fill ring once read. The
+ * completion ring is only used by transmission, it stays empty.
+ */
+typedef struct s_xdp_socket
+{
+    int fd;
+    uint32_t queue_id;
+    unsigned char *umem;
+    size_t umem_size;
+    xdp_ring fill;
+    xdp_ring completion;
+    xdp_ring rx;
+} xdp_socket;
+
+/**
+ * @struct s_xdp_capture
+ * @typedef xdp_capture
+ * @brief AF_XDP capture on every receive queue of a device.
+ *
+ * An XDP program redirects IPv4 TCP frames to the socket of the queue
+ * they came in on and passes all others to the network stack.
+ * Redirected frames do not reach the stack: capture is meant for a
+ * mirror port or a tap, not for the traffic of the host itself.
+ */
+typedef struct s_xdp_capture
+{
+    int prog_fd;
+    int map_fd;             /* XSKMAP, queue -> socket */
+    int link_fd;            /* the program stays attached while it is open */
+    int ifindex;
+    int native;             /* attached in the driver rather than generic */
+    int zerocopy;           /* frames are DMAed into the UMEM */
+    uint32_t queue_count;
+    uint32_t next;          /* socket to read first, for fairness */
+    xdp_socket *sockets;
+} xdp_capture;
+
+/**
+ * @struct s_xdp_capture_stats
+ * @typedef xdp_capture_stats
+ * @brief Kernel counters summed over the sockets, since they were opened.
+ */
+typedef struct s_xdp_capture_stats
+{
+    uint64_t rx_dropped;        /* no fill ring frame, among others */
+    uint64_t rx_invalid_descs;
+    uint64_t rx_ring_full;      /* we did not read the RX ring fast enough */
+    uint64_t fill_ring_empty;   /* the kernel found no frame to use */
+} xdp_capture_stats;
+
+/**
+ * @fn xdp_capture_open
+ * @brief Attach the program to ifname and open a socket per queue.
+ *
+ * @param mode  XDP_CAPTURE_*. Zero-copy is tried in native mode and
+ *              falls back to copying frames.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+int
+xdp_capture_open(xdp_capture *xdp, const char *ifname, int mode);
+
+/**
+ * @fn xdp_capture_close
+ * @brief Detach the program and close the sockets, frames on the
+ *        rings are lost.
+ */
+void
+xdp_capture_close(xdp_capture *xdp);
+
+/**
+ * @fn xdp_capture_receive
+ * @brief Take up to max received frames off the RX rings, without
+ *        blocking, and give their frames back to the kernel.
+ *
+ * records are filled with the source address and the size of the IP
+ * packet, recv_ns is left to the caller.
+ *
+ * @param frames  Optional, receives the frames taken, some may not
+ *                have been IPv4 and have no record.
+ *
+ * @return number of records.
+ */
+uint32_t
+xdp_capture_receive(xdp_capture *xdp, capture_record *records, uint32_t max,
+                    uint32_t *frames);
+
+/**
+ * @fn xdp_capture_wait
+ * @brief Sleep until a socket has frames or the timeout expires.
+ * @return 0 on success or an error code on failure.
+ */
+int
+xdp_capture_wait(xdp_capture *xdp, int timeout_ms);
+
+/**
+ * @fn xdp_capture_read_stats
+ * @return 0 on success or an error code on failure.
+ */
+int
+xdp_capture_read_stats(const xdp_capture *xdp, xdp_capture_stats *stats);
+
+#endif // XDP_MODULE_H
@@ -0,0 +1,536 @@
+/*
+ * Non-blocking client of libnetsniff
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "netsniff.h"
+#include "netsniff_int.h"
+
+#define ASYNC_RECV_CHUNK 65536
+/* Largest reply frame taken, a full batch is far below it */
+#define ASYNC_REPLY_MAX (1 << 20)
+
+enum async_kind
+{
+    ASYNC_RAW,
+    ASYNC_COUNT,
+    ASYNC_COUNTS,
+    ASYNC_LOAD_STATUS
+};
+
+/**
+ * @struct s_async_request
+ * @typedef async_request
+ * @brief A request waiting for its reply.
+ */
+typedef struct s_async_request
+{
+    uint32_t id;
+    uint32_t kind;          /* async_kind */
+    uint32_t expect;        /* addresses of ASYNC_COUNTS */
+    union
+    {
+        netsniff_reply_fn raw;
+        netsniff_count_fn count;
+        netsniff_counts_fn counts;
+        netsniff_load_status_fn load_status;
+    } fn;
+    void *ctx;
+} async_request;
+
+struct s_netsniff_async
+{
+    int fd;
+    int framed;             /* DOPT_FRAMED was answered */
+    int error;              /* the connection failed */
+    uint32_t next_id;
+
+    char *out;              /* requests not sent yet */
+    size_t out_size, out_sent, out_capacity;
+    char *in;               /* replies not parsed yet */
+    size_t in_size, in_capacity;
+    uint64_t *counts;       /* aligned copy of a batch reply */
+
+    async_request *pending; /* ring in request order */
+    size_t pending_head, pending_count, pending_capacity;
+};
+
+/* Make room for size more bytes in a buffer */
+static int
+buf_reserve(char **buf, size_t *capacity, size_t used, size_t size)
+{
+    size_t grown = *capacity ? *capacity : 4096;
+    char *mem;
+
+    if(used + size <= *capacity)
+        return 0;
+
+    while(grown < used + size)
+        grown *= 2;
+
+    mem = realloc(*buf, grown);
+    if(!mem)
+        return ENOMEM;
+
+    *buf = mem;
+    *capacity = grown;
+    return 0;
+}
+
+/* Take the oldest pending request */
+static async_request
+pending_pop(netsniff_async *async)
+{
+    async_request request = async->pending[async->pending_head];
+
+    async->pending_head = (async->pending_head + 1) % async->pending_capacity;
+    --async->pending_count;
+    return request;
+}
+
+static int
+pending_push(netsniff_async *async, const async_request *request)
+{
+    if(async->pending_count == async->pending_capacity)
+    {
+        size_t capacity = async->pending_capacity ? async->pending_capacity * 2 : 64;
+        async_request *ring = malloc(capacity * sizeof(*ring));
+        if(!ring)
+            return ENOMEM;
+
+        /* unwrap the ring */
+        for(size_t i = 0; i < async->pending_count; ++i)
+            ring[i] = async->pending[(async->pending_head + i) % async->pending_capacity];
+
+        free(async->pending);
+        async->pending = ring;
+        async->pending_head = 0;
+        async->pending_capacity = capacity;
+    }
+
+    async->pending[(async->pending_head + async->pending_count) % async->pending_capacity]
+        = *request;
+    ++async->pending_count;
+    return 0;
+}
+
+/**
+ * @fn request_complete
+ * @brief Call the callback of a request with its reply.
+ *
+ * @param status    Status of the reply, or why there is none.
+ * @param reply     Values following the status.
+ */
+static void
+request_complete(netsniff_async *async, const async_request *request, int status,
+                 const char *reply, size_t size)
+{
+    switch(request->kind)
+    {
+    case ASYNC_RAW:
+        request->fn.raw(request->ctx, status, reply, size);
+        break;
+
+    case ASYNC_COUNT:
+    {
+        uint32_t count = 0;
+
+        if(!status && size != sizeof(count))
+            status = EPROTO;
+        if(!status)
+            memcpy(&count, reply, sizeof(count));
+        request->fn.count(request->ctx, status, count);
+        break;
+    }
+
+    case ASYNC_COUNTS:
+    {
+        uint32_t count = 0;
+
+        if(!status && size >= sizeof(count))
+            memcpy(&count, reply, sizeof(count));
+        if(!status && (count != request->expect
+                       || size != sizeof(count) + count * sizeof(uint64_t)))
+            status = EPROTO;
+
+        /* the frame may sit anywhere in the input */
+        if(!status)
+            memcpy(async->counts, reply + sizeof(count), count * sizeof(uint64_t));
+        request->fn.counts(request->ctx, status, status ? NULL : async->counts,
+                           status ? 0 : count);
+        break;
+    }
+
+    case ASYNC_LOAD_STATUS:
+    {
+        dopt_load_status progress = { 0 };
+
+        if(!status && size != sizeof(progress))
+            status = EPROTO;
+        if(!status)
+            memcpy(&progress, reply, sizeof(progress));
+        request->fn.load_status(request->ctx, status, status ? NULL : &progress);
+        break;
+    }
+    }
+}
+
+/**
+ * @fn async_fail
+ * @brief Fail the connection and every pending request.
+ */
+static int
+async_fail(netsniff_async *async, int err)
+{
+    if(!async->error)
+        async->error = err;
+
+    while(async->pending_count)
+    {
+        async_request request = pending_pop(async);
+        request_complete(async, &request, async->error, NULL, 0);
+    }
+
+    return async->error;
+}
+
+/* Send what the socket takes */
+static int
+async_flush(netsniff_async *async)
+{
+    while(async->out_sent < async->out_size)
+    {
+        ssize_t n = send(async->fd, async->out + async->out_sent,
+                         async->out_size - async->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return errno;
+        }
+
+        async->out_sent += n;
+    }
+
+    async->out_size = async->out_sent = 0;
+    return 0;
+}
+
+/* Parse every complete reply received so far */
+static int
+async_parse(netsniff_async *async)
+{
+    size_t used = 0;
+    int32_t status;
+
+    if(!async->framed)
+    {
+        /* the reply to DOPT_FRAMED comes unframed */
+        if(async->in_size < sizeof(status))
+            return 0;
+
+        memcpy(&status, async->in, sizeof(status));
+        if(status)
+            return status;
+
+        async->framed = 1;
+        used = sizeof(status);
+    }
+
+    while(async->in_size - used >= sizeof(dopt_frame_header))
+    {
+        dopt_frame_header frame;
+        async_request request;
+        const char *data;
+
+        memcpy(&frame, async->in + used, sizeof(frame));
+        if(frame.size > ASYNC_REPLY_MAX || frame.size < sizeof(status)
+           || !async->pending_count || async->pending[async->pending_head].id != frame.id)
+            return EPROTO;
+        if(async->in_size - used < sizeof(frame) + frame.size)
+            break;
+
+        data = async->in + used + sizeof(frame);
+        memcpy(&status, data, sizeof(status));
+        request = pending_pop(async);
+        request_complete(async, &request, status, data + sizeof(status),
+                         frame.size - sizeof(status));
+
+        used += sizeof(frame) + frame.size;
+    }
+
+    memmove(async->in, async->in + used, async->in_size - used);
+    async->in_size -= used;
+    return 0;
+}
+
+/* Receive what the socket has */
+static int
+async_receive(netsniff_async *async)
+{
+    for(;;)
+    {
+        ssize_t n;
+        int err;
+
+        err = buf_reserve(&async->in, &async->in_capacity, async->in_size, ASYNC_RECV_CHUNK);
+        if(err)
+            return err;
+
+        n = recv(async->fd, async->in + async->in_size, async->in_capacity - async->in_size,
+                 MSG_DONTWAIT);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return errno;
+        }
+        if(!n)
+            return ECONNRESET;
+
+        async->in_size += n;
+        err = async_parse(async);
+        if(err)
+            return err;
+    }
+}
+
+/**
+ * @fn async_queue
+ * @brief Append a framed command made of two parts and its request.
+ */
+static int
+async_queue(netsniff_async *async, const void *head, size_t head_size,
+            const void *tail, size_t tail_size, async_request *request)
+{
+    dopt_frame_header frame = { head_size + tail_size, async->next_id };
+    int err;
+
+    if(async->error)
+        return async->error;
+
+    err = buf_reserve(&async->out, &async->out_capacity, async->out_size,
+                      sizeof(frame) + frame.size);
+    if(!err)
+    {
+        request->id = frame.id;
+        err = pending_push(async, request);
+    }
+    if(err)
+        return err;
+
+    memcpy(async->out + async->out_size, &frame, sizeof(frame));
+    memcpy(async->out + async->out_size + sizeof(frame), head, head_size);
+    if(tail_size)
+        memcpy(async->out + async->out_size + sizeof(frame) + head_size, tail, tail_size);
+    async->out_size += sizeof(frame) + frame.size;
+    ++async->next_id;
+    return 0;
+}
+
+int
+netsniff_async_open(netsniff_async **asyncp, const char *socket_path)
+{
+    uint32_t command = DOPT_FRAMED;
+    netsniff_async *async;
+    int err;
+
+    async = calloc(1, sizeof(*async));
+    if(!async)
+        return ENOMEM;
+
+    async->counts = malloc(DOPT_BATCH_MAX * sizeof(*async->counts));
+    err = async->counts ? netsniff_socket_connect(socket_path, &async->fd) : ENOMEM;
+    if(err)
+    {
+        free(async->counts);
+        free(async);
+        return err;
+    }
+
+    /* the switch to framed mode goes out first, nothing waits for it */
+    err = buf_reserve(&async->out, &async->out_capacity, 0, sizeof(command));
+    if(!err && fcntl(async->fd, F_SETFL, fcntl(async->fd, F_GETFL) | O_NONBLOCK) == -1)
+        err = errno;
+    if(err)
+    {
+        close(async->fd);
+        free(async->out);
+        free(async->counts);
+        free(async);
+        return err;
+    }
+
+    memcpy(async->out, &command, sizeof(command));
+    async->out_size = sizeof(command);
+
+    *asyncp = async;
+    return 0;
+}
+
+void
+netsniff_async_close(netsniff_async *async)
+{
+    if(!async)
+        return;
+
+    async_fail(async, ECANCELED);
+    close(async->fd);
+    free(async->out);
+    free(async->in);
+    free(async->counts);
+    free(async->pending);
+    free(async);
+}
+
+int
+netsniff_async_fd(const netsniff_async *async)
+{
+    return async->fd;
+}
+
+short
+netsniff_async_events(const netsniff_async *async)
+{
+    if(async->error)
+        return 0;
+
+    return POLLIN | (async->out_size > async->out_sent ? POLLOUT : 0);
+}
+
+size_t
+netsniff_async_pending(const netsniff_async *async)
+{
+    return async->pending_count;
+}
+
+int
+netsniff_async_process(netsniff_async *async)
+{
+    int err;
+
+    if(async->error)
+        return async->error;
+
+    err = async_flush(async);
+    if(!err)
+        err = async_receive(async);
+    if(err)
+        return async_fail(async, err);
+
+    return 0;
+}
+
+int
+netsniff_async_run(netsniff_async *async, int timeout_ms)
+{
+    struct timespec start, now;
+    int err;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(;;)
+    {
+        struct pollfd pfd = { async->fd, netsniff_async_events(async), 0 };
+        int wait = -1;
+
+        err = netsniff_async_process(async);
+        if(err || !async->pending_count)
+            return err;
+
+        if(timeout_ms >= 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            wait = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000
+                                 + (now.tv_nsec - start.tv_nsec) / 1000000);
+            if(wait <= 0)
+                return ETIMEDOUT;
+        }
+
+        if(poll(&pfd, 1, wait) == -1 && errno != EINTR)
+            return errno;
+    }
+}
+
+int
+netsniff_async_request(netsniff_async *async, const void *command, size_t size,
+                       netsniff_reply_fn fn, void *ctx)
+{
+    async_request request = { .kind = ASYNC_RAW, .fn.raw = fn, .ctx = ctx };
+    uint32_t option;
+
+    if(size < sizeof(option) || size > DOPT_FRAME_MAX)
+        return EINVAL;
+
+    /* one reply per request, without descriptors */
+    memcpy(&option, command, sizeof(option));
+    switch(option)
+    {
+    case DOPT_HANDOFF:
+    case DOPT_FRAMED:
+    case DOPT_STAT_STREAM:
+    case DOPT_SNAPSHOT_FD:
+    case DOPT_WATCH:
+        return EINVAL;
+    }
+
+    return async_queue(async, command, size, NULL, 0, &request);
+}
+
+int
+netsniff_async_ip_count(netsniff_async *async, const char *ip, netsniff_count_fn fn,
+                        void *ctx)
+{
+    async_request request = { .kind = ASYNC_COUNT, .fn.count = fn, .ctx = ctx };
+    struct __attribute__((packed))
+    {
+        uint32_t option;
+        char ip[INET_ADDRSTRLEN];
+    } command = { DOPT_IP_COUNT };
+
+    strncpy(command.ip, ip, INET_ADDRSTRLEN - 1);
+    return async_queue(async, &command, sizeof(command), NULL, 0, &request);
+}
+
+int
+netsniff_async_ip_counts(netsniff_async *async, int family, const void *addrs,
+                         uint32_t count, netsniff_counts_fn fn, void *ctx)
+{
+    async_request request = { .kind = ASYNC_COUNTS, .expect = count, .fn.counts = fn,
+                              .ctx = ctx };
+    uint32_t header[3] = { DOPT_IP_COUNT_BATCH, family, count };
+    size_t addr_size = family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+
+    if((family != AF_INET && family != AF_INET6) || !count || count > DOPT_BATCH_MAX)
+        return EINVAL;
+
+    return async_queue(async, header, sizeof(header), addrs, count * addr_size, &request);
+}
+
+int
+netsniff_async_load_status(netsniff_async *async, netsniff_load_status_fn fn, void *ctx)
+{
+    async_request request = { .kind = ASYNC_LOAD_STATUS, .fn.load_status = fn, .ctx = ctx };
+    uint32_t command = DOPT_LOAD_STATUS;
+
+    return async_queue(async, &command, sizeof(command), NULL, 0, &request);
+}
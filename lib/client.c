@@ -0,0 +1,1089 @@
+/*
+ * Blocking client of libnetsniff
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "netsniff.h"
+#include "netsniff_int.h"
+
+/**
+ * @struct s_netsniff_conn
+ * @typedef netsniff_conn
+ * @brief Framed connection owned by one request at a time.
+ */
+typedef struct s_netsniff_conn
+{
+    int fd;
+    int fd_received;        /* last descriptor that came with a reply */
+    int reused;             /* taken from the pool */
+    uint32_t next_id;
+    char *buf;              /* reply being read */
+    size_t buf_capacity;
+    struct s_netsniff_conn *next;
+} netsniff_conn;
+
+struct s_netsniff_client
+{
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    pthread_mutex_t pool_mutex;
+    netsniff_conn *pool;    /* idle connections */
+    unsigned pool_count;
+    unsigned pool_size;
+};
+
+struct s_netsniff_watch
+{
+    int fd;
+    dopt_watch_entry *entries;
+    size_t capacity;
+};
+
+/***************/
+/* Connections */
+/***************/
+
+int
+netsniff_socket_connect(const char *path, int *fd)
+{
+    struct sockaddr_un remote = { .sun_family = AF_UNIX };
+    int err;
+
+    if(!path)
+        path = IPC_SOCKET_PATH;
+    if(strlen(path) >= sizeof(remote.sun_path))
+        return ENAMETOOLONG;
+    strcpy(remote.sun_path, path);
+
+    *fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(*fd == -1)
+        return errno;
+
+    if(connect(*fd, (struct sockaddr *) &remote, sizeof(remote)) == -1)
+    {
+        err = errno;
+        close(*fd);
+        return err;
+    }
+
+    return 0;
+}
+
+/* Send the whole buffer */
+static int
+socket_send(int fd, const void *data, size_t size)
+{
+    while(size)
+    {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+
+        data = (const char *) data + n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+/* Receive exactly size bytes */
+static int
+socket_recv(int fd, void *data, size_t size)
+{
+    while(size)
+    {
+        ssize_t n = recv(fd, data, size, MSG_WAITALL);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+        if(!n)
+            return ECONNRESET;
+
+        data = (char *) data + n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static void
+conn_close(netsniff_conn *conn)
+{
+    close(conn->fd);
+    if(conn->fd_received >= 0)
+        close(conn->fd_received);
+    free(conn->buf);
+    free(conn);
+}
+
+/**
+ * @fn conn_open
+ * @brief Connect and switch the connection to framed mode.
+ */
+static int
+conn_open(const char *path, netsniff_conn **connp)
+{
+    uint32_t command = DOPT_FRAMED;
+    int32_t status;
+    netsniff_conn *conn;
+    int err;
+
+    conn = calloc(1, sizeof(*conn));
+    if(!conn)
+        return ENOMEM;
+    conn->fd_received = -1;
+
+    err = netsniff_socket_connect(path, &conn->fd);
+    if(err)
+    {
+        free(conn);
+        return err;
+    }
+
+    err = socket_send(conn->fd, &command, sizeof(command));
+    if(!err)
+        err = socket_recv(conn->fd, &status, sizeof(status));
+    if(!err)
+        err = status;
+    if(err)
+    {
+        conn_close(conn);
+        return err;
+    }
+
+    *connp = conn;
+    return 0;
+}
+
+/**
+ * @fn conn_acquire
+ * @brief Take an idle connection, or open one if none is left or
+ *        fresh is set.
+ */
+static int
+conn_acquire(netsniff_client *client, int fresh, netsniff_conn **conn)
+{
+    if(!fresh)
+    {
+        pthread_mutex_lock(&client->pool_mutex);
+        *conn = client->pool;
+        if(*conn)
+        {
+            client->pool = (*conn)->next;
+            --client->pool_count;
+        }
+        pthread_mutex_unlock(&client->pool_mutex);
+
+        if(*conn)
+        {
+            (*conn)->reused = 1;
+            return 0;
+        }
+    }
+
+    return conn_open(client->path, conn);
+}
+
+/**
+ * @fn conn_release
+ * @brief Put a connection whose replies were all read back to the pool.
+ */
+static void
+conn_release(netsniff_client *client, netsniff_conn *conn)
+{
+    if(conn->fd_received >= 0)
+    {
+        close(conn->fd_received);
+        conn->fd_received = -1;
+    }
+
+    pthread_mutex_lock(&client->pool_mutex);
+    if(client->pool_count < client->pool_size)
+    {
+        conn->next = client->pool;
+        client->pool = conn;
+        ++client->pool_count;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&client->pool_mutex);
+
+    if(conn)
+        conn_close(conn);
+}
+
+/**
+ * @fn conn_send
+ * @brief Send a command made of iovcnt parts in one frame.
+ * @param id    Receives the id of the frame.
+ */
+static int
+conn_send(netsniff_conn *conn, const struct iovec *iov, int iovcnt, uint32_t *id)
+{
+    struct iovec parts[4];
+    dopt_frame_header frame = { 0, conn->next_id++ };
+    struct msghdr msg = { 0 };
+    size_t left;
+
+    if(iovcnt > 3)
+        return EINVAL;
+
+    parts[0].iov_base = &frame;
+    parts[0].iov_len = sizeof(frame);
+    for(int i = 0; i < iovcnt; ++i)
+    {
+        parts[i + 1] = iov[i];
+        frame.size += iov[i].iov_len;
+    }
+    if(frame.size > DOPT_FRAME_MAX)
+        return EMSGSIZE;
+
+    msg.msg_iov = parts;
+    msg.msg_iovlen = iovcnt + 1;
+    left = sizeof(frame) + frame.size;
+    while(left)
+    {
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+
+        /* skip what went out */
+        left -= n;
+        while(msg.msg_iovlen && (size_t) n >= msg.msg_iov->iov_len)
+        {
+            n -= msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+        if(msg.msg_iovlen)
+        {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+
+    *id = frame.id;
+    return 0;
+}
+
+/**
+ * @fn conn_recv
+ * @brief Receive exactly size bytes, keeping descriptors that come along.
+ *
+ * A message carrying descriptors ends a read early, so this does not
+ * rely on MSG_WAITALL.
+ */
+static int
+conn_recv(netsniff_conn *conn, void *data, size_t size)
+{
+    char control[CMSG_SPACE(HANDOFF_FD_MAX * sizeof(int))];
+
+    while(size)
+    {
+        struct iovec iov = { data, size };
+        struct msghdr msg = { 0 };
+        struct cmsghdr *cmsg;
+        ssize_t n;
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        n = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+        if(!n)
+            return ECONNRESET;
+
+        for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+            if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+
+            for(size_t i = 0; i < count; ++i)
+            {
+                if(conn->fd_received >= 0)
+                    close(conn->fd_received);
+                memcpy(&conn->fd_received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            }
+        }
+
+        data = (char *) data + n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * @fn conn_recv_header
+ * @brief Receive the header of the reply frame with the given id.
+ * @param size  Receives the number of bytes following it.
+ */
+static int
+conn_recv_header(netsniff_conn *conn, uint32_t id, size_t *size)
+{
+    dopt_frame_header frame;
+    int err;
+
+    err = conn_recv(conn, &frame, sizeof(frame));
+    if(err)
+        return err;
+
+    /* replies come back in the order of the requests */
+    if(frame.id != id)
+        return EPROTO;
+
+    *size = frame.size;
+    return 0;
+}
+
+/**
+ * @fn conn_recv_body
+ * @brief Receive size bytes of a reply into the connection buffer.
+ */
+static int
+conn_recv_body(netsniff_conn *conn, size_t size, const char **data)
+{
+    if(size > conn->buf_capacity)
+    {
+        char *buf = realloc(conn->buf, size);
+        if(!buf)
+            return ENOMEM;
+
+        conn->buf = buf;
+        conn->buf_capacity = size;
+    }
+
+    *data = conn->buf;
+    return conn_recv(conn, conn->buf, size);
+}
+
+/* Receive the status of a reply, taking it out of its size */
+static int
+conn_recv_status(netsniff_conn *conn, size_t *size, int32_t *status)
+{
+    if(*size < sizeof(*status))
+        return EPROTO;
+
+    *size -= sizeof(*status);
+    return conn_recv(conn, status, sizeof(*status));
+}
+
+/**
+ * @fn client_transact
+ * @brief Send a command and receive the status of its reply.
+ *
+ * On success the connection is returned with `left` bytes of the reply
+ * still to be read. The caller then releases or closes it. On failure
+ * the connection is already dealt with. A pooled connection that turns
+ * out to be closed by the daemon is replaced once.
+ */
+static int
+client_transact(netsniff_client *client, const struct iovec *iov, int iovcnt,
+                netsniff_conn **connp, uint32_t *idp, size_t *left)
+{
+    for(int attempt = 0; ; ++attempt)
+    {
+        netsniff_conn *conn;
+        int32_t status;
+        uint32_t id;
+        int err;
+
+        err = conn_acquire(client, attempt, &conn);
+        if(err)
+            return err;
+
+        err = conn_send(conn, iov, iovcnt, &id);
+        if(!err)
+            err = conn_recv_header(conn, id, left);
+        if(!err)
+            err = conn_recv_status(conn, left, &status);
+        if(err)
+        {
+            int stale = conn->reused && err != EPROTO && err != EMSGSIZE && err != ENOMEM;
+
+            conn_close(conn);
+            if(stale && !attempt)
+                continue;
+            return err;
+        }
+
+        if(status)
+        {
+            /* errors come without values */
+            if(*left)
+            {
+                conn_close(conn);
+                return EPROTO;
+            }
+
+            conn_release(client, conn);
+            return status;
+        }
+
+        *connp = conn;
+        if(idp)
+            *idp = id;
+        return 0;
+    }
+}
+
+/**
+ * @fn client_call
+ * @brief Send a command whose reply has exactly reply_size bytes of values.
+ */
+static int
+client_call(netsniff_client *client, const void *command, size_t size,
+            void *reply, size_t reply_size)
+{
+    struct iovec iov = { (void *) command, size };
+    netsniff_conn *conn;
+    size_t left;
+    int err;
+
+    err = client_transact(client, &iov, 1, &conn, NULL, &left);
+    if(err)
+        return err;
+
+    if(left != reply_size)
+    {
+        conn_close(conn);
+        return EPROTO;
+    }
+
+    err = reply_size ? conn_recv(conn, reply, reply_size) : 0;
+    if(err)
+    {
+        conn_close(conn);
+        return err;
+    }
+
+    conn_release(client, conn);
+    return 0;
+}
+
+/**********/
+/* Client */
+/**********/
+
+int
+netsniff_client_open(netsniff_client **clientp, const char *socket_path, unsigned pool_size)
+{
+    netsniff_client *client;
+
+    if(!socket_path)
+        socket_path = IPC_SOCKET_PATH;
+    if(strlen(socket_path) >= sizeof(client->path))
+        return ENAMETOOLONG;
+
+    client = calloc(1, sizeof(*client));
+    if(!client)
+        return ENOMEM;
+
+    strcpy(client->path, socket_path);
+    pthread_mutex_init(&client->pool_mutex, NULL);
+    client->pool_size = pool_size;
+
+    *clientp = client;
+    return 0;
+}
+
+void
+netsniff_client_close(netsniff_client *client)
+{
+    if(!client)
+        return;
+
+    while(client->pool)
+    {
+        netsniff_conn *conn = client->pool;
+        client->pool = conn->next;
+        conn_close(conn);
+    }
+
+    pthread_mutex_destroy(&client->pool_mutex);
+    free(client);
+}
+
+int
+netsniff_start(netsniff_client *client)
+{
+    uint32_t command = DOPT_START;
+
+    return client_call(client, &command, sizeof(command), NULL, 0);
+}
+
+int
+netsniff_stop(netsniff_client *client)
+{
+    uint32_t command = DOPT_STOP;
+
+    return client_call(client, &command, sizeof(command), NULL, 0);
+}
+
+int
+netsniff_ip_count(netsniff_client *client, const char *ip, uint32_t *count)
+{
+    struct __attribute__((packed))
+    {
+        uint32_t option;
+        char ip[INET_ADDRSTRLEN];
+    } command = { DOPT_IP_COUNT };
+
+    strncpy(command.ip, ip, INET_ADDRSTRLEN - 1);
+    return client_call(client, &command, sizeof(command), count, sizeof(*count));
+}
+
+int
+netsniff_load_status(netsniff_client *client, dopt_load_status *progress)
+{
+    uint32_t command = DOPT_LOAD_STATUS;
+
+    return client_call(client, &command, sizeof(command), progress, sizeof(*progress));
+}
+
+/**
+ * @fn ip_counts_run
+ * @brief Pipeline the batches of netsniff_ip_counts() over one connection.
+ * @param received  Receives the number of replies read.
+ */
+static int
+ip_counts_run(netsniff_conn *conn, uint32_t family, const char *addrs, size_t count,
+              uint64_t *counts, uint32_t *received)
+{
+    size_t addr_size = family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+    size_t next = 0, done = 0;
+    uint32_t first_id = conn->next_id;
+    uint32_t sent = 0;
+    int err;
+
+    *received = 0;
+    while(done < count)
+    {
+        size_t left;
+        int32_t status;
+        uint32_t reply_count;
+
+        /* keep a few batches in flight */
+        while(next < count && sent - *received < NETSNIFF_BATCH_WINDOW)
+        {
+            uint32_t header[3] = { DOPT_IP_COUNT_BATCH, family, 0 };
+            struct iovec iov[2];
+            uint32_t id;
+
+            header[2] = count - next < DOPT_BATCH_MAX ? count - next : DOPT_BATCH_MAX;
+            iov[0].iov_base = header;
+            iov[0].iov_len = sizeof(header);
+            iov[1].iov_base = (void *) (addrs + next * addr_size);
+            iov[1].iov_len = header[2] * addr_size;
+
+            err = conn_send(conn, iov, 2, &id);
+            if(err)
+                return err;
+
+            next += header[2];
+            ++sent;
+        }
+
+        err = conn_recv_header(conn, first_id + *received, &left);
+        if(!err)
+            err = conn_recv_status(conn, &left, &status);
+        if(err)
+            return err;
+        ++*received;
+
+        if(status)
+            return left ? EPROTO : status;
+
+        /* replies come back in order, each one fills the next counts */
+        if(left < sizeof(reply_count))
+            return EPROTO;
+        err = conn_recv(conn, &reply_count, sizeof(reply_count));
+        if(err)
+            return err;
+
+        left -= sizeof(reply_count);
+        if(reply_count != (count - done < DOPT_BATCH_MAX ? count - done : DOPT_BATCH_MAX)
+           || left != reply_count * sizeof(*counts))
+            return EPROTO;
+
+        err = conn_recv(conn, counts + done, left);
+        if(err)
+            return err;
+        done += reply_count;
+    }
+
+    return 0;
+}
+
+int
+netsniff_ip_counts(netsniff_client *client, int family, const void *addrs, size_t count,
+                   uint64_t *counts)
+{
+    if(family != AF_INET && family != AF_INET6)
+        return EINVAL;
+    if(!count)
+        return 0;
+
+    for(int attempt = 0; ; ++attempt)
+    {
+        netsniff_conn *conn;
+        uint32_t received;
+        int err;
+
+        err = conn_acquire(client, attempt, &conn);
+        if(err)
+            return err;
+
+        err = ip_counts_run(conn, family, addrs, count, counts, &received);
+        if(!err)
+        {
+            conn_release(client, conn);
+            return 0;
+        }
+
+        /* replies of the batches sent after a failed one are still
+           in flight, so the connection is never reused */
+        if(!received && conn->reused && !attempt && err != EPROTO && err != EMSGSIZE)
+        {
+            conn_close(conn);
+            continue;
+        }
+
+        conn_close(conn);
+        return err;
+    }
+}
+
+int
+netsniff_stat(netsniff_client *client, const char *iface, dopt_stat_v2_header *header,
+              dopt_stat_entry **entries)
+{
+    uint32_t command[2] = { DOPT_STAT_V2, iface ? strlen(iface) : 0 };
+    struct iovec iov[2] = { { command, sizeof(command) }, { (void *) iface, command[1] } };
+    netsniff_conn *conn;
+    size_t left, size;
+    int err;
+
+    err = client_transact(client, iov, iface ? 2 : 1, &conn, NULL, &left);
+    if(err)
+        return err;
+
+    if(left < sizeof(*header))
+    {
+        conn_close(conn);
+        return EPROTO;
+    }
+
+    err = conn_recv(conn, header, sizeof(*header));
+    if(err)
+    {
+        conn_close(conn);
+        return err;
+    }
+
+    /* the whole table comes as one block of packed records */
+    size = (size_t) header->entry_count * sizeof(**entries);
+    if(left - sizeof(*header) != size)
+    {
+        conn_close(conn);
+        return EPROTO;
+    }
+
+    *entries = malloc(size + 1);
+    if(!*entries)
+    {
+        conn_close(conn);
+        return ENOMEM;
+    }
+
+    err = conn_recv(conn, *entries, size);
+    if(err)
+    {
+        free(*entries);
+        *entries = NULL;
+        conn_close(conn);
+        return err;
+    }
+
+    conn_release(client, conn);
+    header->ifname[IFNAMSIZ - 1] = '\0';
+    return 0;
+}
+
+int
+netsniff_query(netsniff_client *client, const dopt_query *query, dopt_query_result *result,
+               dopt_stat_entry **rows)
+{
+    uint32_t option = DOPT_QUERY;
+    struct iovec iov[2] = { { &option, sizeof(option) }, { (void *) query, sizeof(*query) } };
+    netsniff_conn *conn;
+    size_t left, size;
+    int err;
+
+    err = client_transact(client, iov, 2, &conn, NULL, &left);
+    if(err)
+        return err;
+
+    err = left >= sizeof(*result) ? conn_recv(conn, result, sizeof(*result)) : EPROTO;
+    if(err)
+    {
+        conn_close(conn);
+        return err;
+    }
+
+    size = (size_t) result->row_count * sizeof(**rows);
+    if(left - sizeof(*result) != size)
+    {
+        conn_close(conn);
+        return EPROTO;
+    }
+
+    *rows = malloc(size + 1);
+    if(!*rows)
+    {
+        conn_close(conn);
+        return ENOMEM;
+    }
+
+    err = conn_recv(conn, *rows, size);
+    if(err)
+    {
+        free(*rows);
+        *rows = NULL;
+        conn_close(conn);
+        return err;
+    }
+
+    conn_release(client, conn);
+    return 0;
+}
+
+int
+netsniff_selfstat(netsniff_client *client, dopt_selfstat *stats, uint64_t **hist)
+{
+    uint32_t command = DOPT_SELFSTAT;
+    struct iovec iov = { &command, sizeof(command) };
+    netsniff_conn *conn;
+    size_t left, size;
+    int err;
+
+    err = client_transact(client, &iov, 1, &conn, NULL, &left);
+    if(err)
+        return err;
+
+    err = left >= sizeof(*stats) ? conn_recv(conn, stats, sizeof(*stats)) : EPROTO;
+    if(err)
+    {
+        conn_close(conn);
+        return err;
+    }
+
+    /* buckets are only understood with the same layout */
+    size = (size_t) stats->hist_buckets * sizeof(**hist);
+    if(left - sizeof(*stats) != size || stats->hist_sub_bits != HIST_SUB_BITS
+       || stats->hist_buckets != HIST_BUCKETS)
+    {
+        conn_close(conn);
+        return EPROTO;
+    }
+
+    *hist = malloc(size);
+    if(!*hist)
+    {
+        conn_close(conn);
+        return ENOMEM;
+    }
+
+    err = conn_recv(conn, *hist, size);
+    if(err)
+    {
+        free(*hist);
+        *hist = NULL;
+        conn_close(conn);
+        return err;
+    }
+
+    conn_release(client, conn);
+    return 0;
+}
+
+uint64_t
+netsniff_hist_percentile(const uint64_t *hist, double q)
+{
+    uint64_t total = 0, rank, seen = 0;
+
+    for(uint32_t i = 0; i < HIST_BUCKETS; ++i)
+        total += hist[i];
+    if(!total)
+        return 0;
+
+    /* the sample at rank q * total, counting from 1 */
+    rank = q * total;
+    if(rank < 1)
+        rank = 1;
+    if(rank > total)
+        rank = total;
+
+    for(uint32_t i = 0; i < HIST_BUCKETS; ++i)
+    {
+        seen += hist[i];
+        if(seen >= rank)
+            return hist_bucket_high(i);
+    }
+
+    return 0;
+}
+
+int
+netsniff_dump(netsniff_client *client, uint64_t cursor, netsniff_page_fn fn, void *ctx)
+{
+    struct __attribute__((packed))
+    {
+        uint32_t option;
+        uint64_t cursor;
+    } command = { DOPT_STAT_STREAM, cursor };
+    struct iovec iov = { &command, sizeof(command) };
+    netsniff_conn *conn;
+    dopt_stat_page page;
+    uint32_t id;
+    size_t left;
+    int err;
+
+    err = client_transact(client, &iov, 1, &conn, &id, &left);
+    if(err)
+        return err;
+    if(left)
+    {
+        conn_close(conn);
+        return EPROTO;
+    }
+
+    /* every page comes in a frame with the id of the request */
+    do
+    {
+        const char *data;
+
+        err = conn_recv_header(conn, id, &left);
+        if(!err && left < sizeof(page))
+            err = EPROTO;
+        if(!err)
+            err = conn_recv_body(conn, left, &data);
+        if(err)
+            break;
+
+        memcpy(&page, data, sizeof(page));
+        if(page.entry_count > DOPT_STAT_PAGE_MAX
+           || left != sizeof(page) + page.entry_count * sizeof(dopt_stat_entry))
+        {
+            err = EPROTO;
+            break;
+        }
+
+        if(page.status)
+        {
+            /* the stream ended with the reason, the connection is fine */
+            conn_release(client, conn);
+            return page.status;
+        }
+
+        /* a stream cut short leaves pages in flight */
+        if(fn(ctx, (const dopt_stat_entry *) (data + sizeof(page)), page.entry_count,
+              page.cursor))
+        {
+            err = ECANCELED;
+            break;
+        }
+    } while(page.cursor);
+
+    if(err)
+    {
+        conn_close(conn);
+        return err;
+    }
+
+    conn_release(client, conn);
+    return 0;
+}
+
+int
+netsniff_snapshot_take(netsniff_client *client, netsniff_snapshot *snapshot)
+{
+    uint32_t command = DOPT_SNAPSHOT_FD;
+    struct iovec iov = { &command, sizeof(command) };
+    netsniff_conn *conn;
+    const shm_table_header *hdr;
+    size_t left;
+    int fd, err;
+
+    err = client_transact(client, &iov, 1, &conn, NULL, &left);
+    if(err)
+        return err;
+
+    if(left == sizeof(snapshot->info))
+        err = conn_recv(conn, &snapshot->info, sizeof(snapshot->info));
+    else
+        err = EPROTO;
+    if(err)
+    {
+        conn_close(conn);
+        return err;
+    }
+
+    /* the memfd comes with the info */
+    fd = conn->fd_received;
+    conn->fd_received = -1;
+    conn_release(client, conn);
+
+    if(fd < 0 || snapshot->info.size < SHM_TABLE_SIZE(snapshot->info.capacity))
+    {
+        if(fd >= 0)
+            close(fd);
+        return EPROTO;
+    }
+
+    hdr = mmap(NULL, snapshot->info.size, PROT_READ, MAP_SHARED, fd, 0);
+    err = errno;
+    close(fd);
+    if(hdr == MAP_FAILED)
+        return err;
+
+    if(hdr->magic != SHM_TABLE_MAGIC || hdr->version != SHM_TABLE_VERSION)
+    {
+        munmap((void *) hdr, snapshot->info.size);
+        return EPROTO;
+    }
+
+    snapshot->hdr = hdr;
+    return 0;
+}
+
+void
+netsniff_snapshot_release(netsniff_snapshot *snapshot)
+{
+    if(snapshot->hdr)
+        munmap((void *) snapshot->hdr, snapshot->info.size);
+    snapshot->hdr = NULL;
+}
+
+/*********/
+/* Watch */
+/*********/
+
+int
+netsniff_watch_open(netsniff_client *client, netsniff_watch **watchp, dopt_watch_info *info)
+{
+    uint32_t command = DOPT_WATCH;
+    netsniff_watch *watch;
+    int32_t status;
+    int err;
+
+    watch = calloc(1, sizeof(*watch));
+    if(!watch)
+        return ENOMEM;
+
+    /* an unframed subscription carries nothing but deltas */
+    err = netsniff_socket_connect(client->path, &watch->fd);
+    if(err)
+    {
+        free(watch);
+        return err;
+    }
+
+    err = socket_send(watch->fd, &command, sizeof(command));
+    if(!err)
+        err = socket_recv(watch->fd, &status, sizeof(status));
+    if(!err)
+        err = status;
+    if(!err)
+        err = socket_recv(watch->fd, info, sizeof(*info));
+    if(err)
+    {
+        netsniff_watch_close(watch);
+        return err;
+    }
+
+    *watchp = watch;
+    return 0;
+}
+
+int
+netsniff_watch_next(netsniff_watch *watch, dopt_watch_header *header,
+                    const dopt_watch_entry **entries)
+{
+    size_t size;
+    int err;
+
+    err = socket_recv(watch->fd, header, sizeof(*header));
+    if(err)
+        return err;
+
+    if(header->entry_count > watch->capacity)
+    {
+        dopt_watch_entry *grown = realloc(watch->entries,
+                                          header->entry_count * sizeof(*grown));
+        if(!grown)
+            return ENOMEM;
+
+        watch->entries = grown;
+        watch->capacity = header->entry_count;
+    }
+
+    size = header->entry_count * sizeof(**entries);
+    err = size ? socket_recv(watch->fd, watch->entries, size) : 0;
+    if(err)
+        return err;
+
+    *entries = watch->entries;
+    return 0;
+}
+
+int
+netsniff_watch_fd(const netsniff_watch *watch)
+{
+    return watch->fd;
+}
+
+void
+netsniff_watch_close(netsniff_watch *watch)
+{
+    if(!watch)
+        return;
+
+    close(watch->fd);
+    free(watch->entries);
+    free(watch);
+}
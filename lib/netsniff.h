@@ -0,0 +1,362 @@
+/*
+ * libnetsniff - client library for netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef NETSNIFF_H
+#define NETSNIFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include "custom_com_def.h"
+#include "shm_table_def.h"
+#include "hist_def.h"
+
+/*
+ * All functions return 0 on success or an errno code: either the
+ * status sent by the daemon or the error of the connection to it.
+ * Nothing is printed and the process is never exited.
+ */
+
+/*******************/
+/* Blocking client */
+/*******************/
+
+/**
+ * @typedef netsniff_client
+ * @brief Handle to the daemon with a pool of framed connections.
+ *
+ * Every request borrows a connection from the pool, or opens one, and
+ * puts it back once its reply is read, so consecutive requests do not
+ * pay for a connect. A client may be used by several threads at once,
+ * each request then runs on its own connection. A pooled connection
+ * the daemon closed meanwhile is replaced transparently.
+ */
+typedef struct s_netsniff_client netsniff_client;
+
+/**
+ * @fn netsniff_client_open
+ * @brief Create a client, nothing is connected yet.
+ *
+ * @param socket_path   Daemon socket, NULL for IPC_SOCKET_PATH.
+ * @param pool_size     Idle connections kept for reuse, 0 for none.
+ */
+int
+netsniff_client_open(netsniff_client **client, const char *socket_path, unsigned pool_size);
+
+/**
+ * @fn netsniff_client_close
+ * @brief Close the pooled connections and free the client.
+ */
+void
+netsniff_client_close(netsniff_client *client);
+
+int
+netsniff_start(netsniff_client *client);
+
+int
+netsniff_stop(netsniff_client *client);
+
+/**
+ * @fn netsniff_ip_count
+ * @brief Get the packet count of an IPv4 address given as a string.
+ */
+int
+netsniff_ip_count(netsniff_client *client, const char *ip, uint32_t *count);
+
+/**
+ * @fn netsniff_ip_counts
+ * @brief Get the packet counts of many binary addresses.
+ *
+ * @param family    AF_INET (in_addr) or AF_INET6 (in6_addr) addresses.
+ * @param counts    Receives count values, in order.
+ *
+ * Any number of addresses may be given, they are sent in batches of
+ * DOPT_BATCH_MAX pipelined over one connection.
+ */
+int
+netsniff_ip_counts(netsniff_client *client, int family, const void *addrs, size_t count,
+                   uint64_t *counts);
+
+int
+netsniff_load_status(netsniff_client *client, dopt_load_status *progress);
+
+/**
+ * @fn netsniff_stat
+ * @brief Get all entries of an interface.
+ *
+ * @param iface     Interface name, NULL for the sniffed one.
+ * @param entries   Receives a malloc()'ed array of header->entry_count
+ *                  records, in no particular order.
+ */
+int
+netsniff_stat(netsniff_client *client, const char *iface, dopt_stat_v2_header *header,
+              dopt_stat_entry **entries);
+
+/**
+ * @fn netsniff_query
+ * @brief Get the entries matching a query, filtered and sorted by the daemon.
+ *
+ * @param rows  Receives a malloc()'ed array of result->row_count
+ *              records, in the order of query->sort.
+ */
+int
+netsniff_query(netsniff_client *client, const dopt_query *query, dopt_query_result *result,
+               dopt_stat_entry **rows);
+
+/**
+ * @fn netsniff_selfstat
+ * @brief Get the health counters of the capture thread.
+ *
+ * @param hist  Receives a malloc()'ed histogram of stats->hist_buckets
+ *              values, bucketed as described in hist_def.h.
+ */
+int
+netsniff_selfstat(netsniff_client *client, dopt_selfstat *stats, uint64_t **hist);
+
+/**
+ * @fn netsniff_hist_percentile
+ * @brief Get a percentile of a histogram of HIST_BUCKETS values.
+ * @param q     Fraction of the samples, 0 to 1.
+ * @return highest value of the bucket holding it, 0 without samples.
+ */
+uint64_t
+netsniff_hist_percentile(const uint64_t *hist, double q);
+
+/**
+ * @brief Receives a page of netsniff_dump().
+ * @param cursor    To resume after this page, 0 after the last one.
+ * @return 0 to go on, nonzero to stop the dump.
+ */
+typedef int (*netsniff_page_fn)(void *ctx, const dopt_stat_entry *entries, uint32_t count,
+                                uint64_t cursor);
+
+/**
+ * @fn netsniff_dump
+ * @brief Stream all entries page by page, see DOPT_STAT_STREAM.
+ *
+ * @param cursor    0, or the cursor of a page to resume after.
+ *
+ * @return 0 after the last page, ECANCELED if fn stopped the dump.
+ */
+int
+netsniff_dump(netsniff_client *client, uint64_t cursor, netsniff_page_fn fn, void *ctx);
+
+/**
+ * @struct s_netsniff_snapshot
+ * @typedef netsniff_snapshot
+ * @brief Read-only mapping of a table copy, see DOPT_SNAPSHOT_FD.
+ */
+typedef struct s_netsniff_snapshot
+{
+    const shm_table_header *hdr;
+    dopt_snapshot_info info;
+} netsniff_snapshot;
+
+/**
+ * @fn netsniff_snapshot_take
+ * @brief Get a point-in-time copy of the table, mapped in place.
+ *
+ * Release it with netsniff_snapshot_release().
+ */
+int
+netsniff_snapshot_take(netsniff_client *client, netsniff_snapshot *snapshot);
+
+void
+netsniff_snapshot_release(netsniff_snapshot *snapshot);
+
+/**
+ * @typedef netsniff_watch
+ * @brief Subscription to counter deltas on a connection of its own.
+ */
+typedef struct s_netsniff_watch netsniff_watch;
+
+/**
+ * @fn netsniff_watch_open
+ * @brief Subscribe to deltas, see DOPT_WATCH.
+ * @param info  Receives the interval and the first sequence number.
+ */
+int
+netsniff_watch_open(netsniff_client *client, netsniff_watch **watch, dopt_watch_info *info);
+
+/**
+ * @fn netsniff_watch_next
+ * @brief Wait for the next delta.
+ *
+ * @param entries   Receives header->entry_count records, valid until
+ *                  the next call.
+ */
+int
+netsniff_watch_next(netsniff_watch *watch, dopt_watch_header *header,
+                    const dopt_watch_entry **entries);
+
+/**
+ * @fn netsniff_watch_fd
+ * @return descriptor to poll for readability before netsniff_watch_next().
+ */
+int
+netsniff_watch_fd(const netsniff_watch *watch);
+
+void
+netsniff_watch_close(netsniff_watch *watch);
+
+/****************/
+/* Async client */
+/****************/
+
+/**
+ * @typedef netsniff_async
+ * @brief Non-blocking framed connection with many requests in flight.
+ *
+ * Requests are queued with the functions below and their callbacks
+ * are called from netsniff_async_process() in request order. The
+ * descriptor can be added to the caller's poll()/epoll loop, or
+ * netsniff_async_run() can drive it. Not thread safe.
+ */
+typedef struct s_netsniff_async netsniff_async;
+
+/**
+ * @brief Receives a raw reply.
+ * @param status    0, the status of the reply or a connection error.
+ * @param reply     Values following the status, valid during the call.
+ */
+typedef void (*netsniff_reply_fn)(void *ctx, int status, const void *reply, size_t size);
+typedef void (*netsniff_count_fn)(void *ctx, int status, uint32_t count);
+typedef void (*netsniff_counts_fn)(void *ctx, int status, const uint64_t *counts,
+                                   uint32_t count);
+typedef void (*netsniff_load_status_fn)(void *ctx, int status,
+                                        const dopt_load_status *progress);
+
+/**
+ * @fn netsniff_async_open
+ * @param socket_path   Daemon socket, NULL for IPC_SOCKET_PATH.
+ */
+int
+netsniff_async_open(netsniff_async **async, const char *socket_path);
+
+/**
+ * @fn netsniff_async_close
+ * @brief Close the connection, pending callbacks get ECANCELED.
+ */
+void
+netsniff_async_close(netsniff_async *async);
+
+int
+netsniff_async_fd(const netsniff_async *async);
+
+/**
+ * @fn netsniff_async_events
+ * @return poll() events the connection waits for.
+ */
+short
+netsniff_async_events(const netsniff_async *async);
+
+/**
+ * @fn netsniff_async_pending
+ * @return number of requests whose callback was not called yet.
+ */
+size_t
+netsniff_async_pending(const netsniff_async *async);
+
+/**
+ * @fn netsniff_async_process
+ * @brief Send and receive what the socket allows, calling callbacks.
+ *
+ * Never blocks. If the connection fails, every pending callback gets
+ * the error and so does the caller; the handle can only be closed.
+ */
+int
+netsniff_async_process(netsniff_async *async);
+
+/**
+ * @fn netsniff_async_run
+ * @brief Process until nothing is pending or timeout_ms passed.
+ * @param timeout_ms    -1 to wait as long as needed.
+ * @return 0, ETIMEDOUT or the error of the connection.
+ */
+int
+netsniff_async_run(netsniff_async *async, int timeout_ms);
+
+/**
+ * @fn netsniff_async_request
+ * @brief Queue a command laid out as in custom_com_def.h.
+ *
+ * Commands with more than one reply or with descriptors (streams,
+ * snapshots, subscriptions, handoff) are refused with EINVAL.
+ */
+int
+netsniff_async_request(netsniff_async *async, const void *command, size_t size,
+                       netsniff_reply_fn fn, void *ctx);
+
+int
+netsniff_async_ip_count(netsniff_async *async, const char *ip, netsniff_count_fn fn,
+                        void *ctx);
+
+/**
+ * @fn netsniff_async_ip_counts
+ * @brief Queue one batch of up to DOPT_BATCH_MAX addresses.
+ */
+int
+netsniff_async_ip_counts(netsniff_async *async, int family, const void *addrs,
+                         uint32_t count, netsniff_counts_fn fn, void *ctx);
+
+int
+netsniff_async_load_status(netsniff_async *async, netsniff_load_status_fn fn, void *ctx);
+
+/*********************************/
+/* Read-only shared table access */
+/*********************************/
+
+/**
+ * @struct s_netsniff_shm
+ * @typedef netsniff_shm
+ * @brief Read-only mapping of the daemon's counter table.
+ *
+ * Reads take no lock and do not involve the daemon, see
+ * shm_table_def.h for the protocol.
+ */
+typedef struct s_netsniff_shm
+{
+    const shm_table_header *hdr;
+    size_t size;
+    int fd;
+} netsniff_shm;
+
+/**
+ * @fn netsniff_shm_open
+ * @return 0 on success, ENOENT if the table is not published yet or
+ *         EPROTO if its version is not supported.
+ */
+int
+netsniff_shm_open(netsniff_shm *shm);
+
+void
+netsniff_shm_close(netsniff_shm *shm);
+
+/**
+ * @fn netsniff_shm_ip_count
+ * @param addr  IPv4 address in network byte order.
+ */
+int
+netsniff_shm_ip_count(netsniff_shm *shm, uint32_t addr, uint64_t *count);
+
+/**
+ * @fn netsniff_shm_copy
+ * @brief Copy all entries consistently, retrying if the table changes.
+ *
+ * @param entries   Receives a malloc()'ed array of *count entries.
+ * @param packets   Receives the total, can be NULL.
+ * @param ifname    Receives the interface name, can be NULL.
+ */
+int
+netsniff_shm_copy(netsniff_shm *shm, shm_table_entry **entries, uint64_t *count,
+                  uint64_t *packets, char ifname[IFNAMSIZ]);
+
+#endif // NETSNIFF_H
@@ -0,0 +1,29 @@
+/*
+ * Internal definitions of libnetsniff
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef NETSNIFF_INT_H
+#define NETSNIFF_INT_H
+
+#define NETSNIFF_HIDDEN __attribute__((visibility("hidden")))
+
+/* Batches in flight, small enough that replies never fill the daemon's buffers */
+#define NETSNIFF_BATCH_WINDOW 4
+
+/**
+ * @fn netsniff_socket_connect
+ * @brief Open a blocking, unframed connection to the daemon.
+ *
+ * @param path  Daemon socket, NULL for IPC_SOCKET_PATH.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+NETSNIFF_HIDDEN int
+netsniff_socket_connect(const char *path, int *fd);
+
+#endif // NETSNIFF_INT_H
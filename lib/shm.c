@@ -0,0 +1,167 @@
+/*
+ * Read-only access to the shared counter table of netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "netsniff.h"
+
+/* (Re)map the segment with at least size bytes */
+static int
+shm_map(netsniff_shm *shm, size_t size)
+{
+    void *mem;
+
+    if(shm->hdr)
+        munmap((void *) shm->hdr, shm->size);
+    shm->hdr = NULL;
+
+    mem = mmap(NULL, size, PROT_READ, MAP_SHARED, shm->fd, 0);
+    if(mem == MAP_FAILED)
+        return errno;
+
+    shm->hdr = mem;
+    shm->size = size;
+    return 0;
+}
+
+/* Start a read section, remapping if the table grew */
+static int
+shm_read_begin(netsniff_shm *shm, uint32_t *seq, uint32_t *capacity)
+{
+    for(;;)
+    {
+        int err;
+
+        *seq = shm_table_read_begin(shm->hdr);
+        *capacity = __atomic_load_n(&shm->hdr->capacity, __ATOMIC_RELAXED);
+        if(SHM_TABLE_SIZE(*capacity) <= shm->size)
+            return 0;
+
+        err = shm_map(shm, SHM_TABLE_SIZE(*capacity));
+        if(err)
+            return err;
+    }
+}
+
+int
+netsniff_shm_open(netsniff_shm *shm)
+{
+    struct stat st;
+    int err;
+
+    shm->hdr = NULL;
+    shm->fd = shm_open(SHM_TABLE_NAME, O_RDONLY | O_CLOEXEC, 0);
+    if(shm->fd == -1)
+        return errno;
+
+    if(fstat(shm->fd, &st) == -1)
+        err = errno;
+    else if((size_t) st.st_size < sizeof(shm_table_header))
+        err = ENOENT;   /* created but not initialized yet */
+    else
+        err = shm_map(shm, st.st_size);
+
+    if(!err && (__atomic_load_n(&shm->hdr->magic, __ATOMIC_ACQUIRE) != SHM_TABLE_MAGIC
+                || shm->hdr->version != SHM_TABLE_VERSION))
+        err = EPROTO;
+
+    if(err)
+    {
+        netsniff_shm_close(shm);
+        return err;
+    }
+
+    return 0;
+}
+
+void
+netsniff_shm_close(netsniff_shm *shm)
+{
+    if(shm->hdr)
+        munmap((void *) shm->hdr, shm->size);
+    if(shm->fd >= 0)
+        close(shm->fd);
+    shm->hdr = NULL;
+    shm->fd = -1;
+}
+
+int
+netsniff_shm_ip_count(netsniff_shm *shm, uint32_t addr, uint64_t *count)
+{
+    uint32_t seq, capacity;
+    int err;
+
+    do
+    {
+        err = shm_read_begin(shm, &seq, &capacity);
+        if(err)
+            return err;
+
+        *count = shm_table_lookup(shm->hdr, capacity, addr);
+    } while(shm_table_read_retry(shm->hdr, seq));
+
+    return 0;
+}
+
+int
+netsniff_shm_copy(netsniff_shm *shm, shm_table_entry **entries, uint64_t *count,
+                  uint64_t *packets, char ifname[IFNAMSIZ])
+{
+    shm_table_entry *copy = NULL;
+    uint32_t seq, capacity;
+    uint64_t total;
+    int err;
+
+    do
+    {
+        const shm_table_entry *slots;
+
+        err = shm_read_begin(shm, &seq, &capacity);
+        if(err)
+        {
+            free(copy);
+            return err;
+        }
+        slots = SHM_TABLE_SLOTS(shm->hdr);
+
+        free(copy);
+        copy = malloc(((size_t) capacity + 1) * sizeof(*copy));
+        if(!copy)
+            return ENOMEM;
+
+        *count = 0;
+        for(uint32_t i = 0; i < capacity; ++i)
+        {
+            shm_table_entry slot = { 0 };
+            slot.count = __atomic_load_n(&slots[i].count, __ATOMIC_ACQUIRE);
+            if(!slot.count)
+                continue;
+            slot.addr = __atomic_load_n(&slots[i].addr, __ATOMIC_RELAXED);
+            copy[(*count)++] = slot;
+        }
+        total = __atomic_load_n(&shm->hdr->packets, __ATOMIC_RELAXED);
+        if(ifname)
+            memcpy(ifname, shm->hdr->ifname, IFNAMSIZ);
+    } while(shm_table_read_retry(shm->hdr, seq));
+
+    if(packets)
+        *packets = total;
+    if(ifname)
+        ifname[IFNAMSIZ - 1] = '\0';
+    *entries = copy;
+    return 0;
+}
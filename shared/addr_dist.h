@@ -0,0 +1,117 @@
+/*
+ * Source address distributions of the traffic generator and the benchmarks
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef ADDR_DIST_H
+#define ADDR_DIST_H
+
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * @enum e_addr_dist
+ * @brief Distribution of the source addresses of a stream.
+ */
+typedef enum e_addr_dist
+{
+    DIST_UNIFORM,   /* any address of the population, equally likely */
+    DIST_ZIPF,      /* a few addresses take most of the packets */
+    DIST_SCAN,      /* the population in order, every address once per sweep */
+    DIST_COUNT
+} addr_dist;
+
+static const char *const addr_dist_names[DIST_COUNT] = { "uniform", "zipf", "scan" };
+
+/* xorshift64*, fast and good enough to pick addresses. state must not be 0. */
+static inline uint64_t
+addr_rng_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/* uniform in [0, 1) */
+static inline double
+addr_rng_double(uint64_t *state)
+{
+    return (addr_rng_next(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* Ranks drawn with P(rank k) proportional to 1 / k^s, by inverting the CDF */
+static inline int
+addr_dist_fill_zipf(uint32_t *indexes, size_t length, uint32_t size, double s,
+                    uint64_t *state)
+{
+    double *cdf, total = 0;
+
+    /* !!! malloc !!! */
+    cdf = malloc(size * sizeof(*cdf));
+    if(!cdf)
+        return ENOMEM;
+
+    for(uint32_t k = 0; k < size; ++k)
+    {
+        total += 1.0 / pow(k + 1, s);
+        cdf[k] = total;
+    }
+
+    for(size_t i = 0; i < length; ++i)
+    {
+        double u = addr_rng_double(state) * total;
+        uint32_t lo = 0, hi = size - 1;
+
+        while(lo < hi)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if(cdf[mid] <= u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        indexes[i] = lo;
+    }
+
+    free(cdf);
+    return 0;
+}
+
+/**
+ * @fn addr_dist_fill
+ * @brief Draw length indexes into a population of size addresses.
+ *
+ * @param zipf_s  Exponent of DIST_ZIPF, ignored otherwise.
+ * @param state   State of addr_rng_next(), advanced.
+ *
+ * @return 0 on success or an error code on failure.
+ */
+static inline int
+addr_dist_fill(uint32_t *indexes, size_t length, addr_dist dist, uint32_t size,
+               double zipf_s, uint64_t *state)
+{
+    switch(dist)
+    {
+    case DIST_UNIFORM:
+        for(size_t i = 0; i < length; ++i)
+            indexes[i] = addr_rng_next(state) % size;
+        return 0;
+    case DIST_ZIPF:
+        return addr_dist_fill_zipf(indexes, length, size, zipf_s, state);
+    case DIST_SCAN:
+    default:
+        for(size_t i = 0; i < length; ++i)
+            indexes[i] = i % size;
+        return 0;
+    }
+}
+
+#endif // ADDR_DIST_H
@@ -10,6 +10,8 @@
 #ifndef CUSTOM_COM_DEF_H
 #define CUSTOM_COM_DEF_H
 
+#include <stdint.h>
+
 #define IPC_SOCKET_PATH "/tmp/netsniffd.sock"
 
 /**
@@ -25,6 +27,17 @@
  * DOPT_SET_IFACE   set interface for sniffing
  * DOPT_IP_COUNT    request hit count for an IP
  * DOPT_STAT        request stats for the interface or for all interfaces
+ * DOPT_LOAD_STATUS request progress of loading saved stats
+ * DOPT_HANDOFF     hand the running state over to a new daemon process
+ * DOPT_FRAMED      switch the connection to framed mode (see below)
+ * DOPT_IP_COUNT_BATCH request hit counts for many binary addresses
+ * DOPT_STAT_V2     request stats in the compact binary format
+ * DOPT_STAT_PAGE   request one page of stats at a cursor
+ * DOPT_STAT_STREAM request all stats as a stream of pages
+ * DOPT_SNAPSHOT_FD request a sealed memfd holding a copy of the table
+ * DOPT_WATCH       subscribe to per-interval deltas of the counters
+ * DOPT_QUERY       request entries matching a filter, sorted and limited
+ * DOPT_SELFSTAT    request health counters of the capture thread
  *
  * Arguments (in order):
  * DOPT_START       -
@@ -39,6 +52,29 @@
  * DOPT_STAT        uint32_t              iface_name_size (can be 0)
  *                  char[ip_str_size]     iface_name      (can be NULL)
  *
+ * DOPT_LOAD_STATUS -
+ * DOPT_HANDOFF     -
+ * DOPT_FRAMED      -
+ *
+ * DOPT_IP_COUNT_BATCH uint32_t        family (AF_INET or AF_INET6)
+ *                  uint32_t              addr_count (up to DOPT_BATCH_MAX)
+ *                  addresses             addr_count in6_addr (16 bytes) or
+ *                                        in_addr (4 bytes), network order
+ *
+ * DOPT_STAT_V2     same as DOPT_STAT
+ *
+ * DOPT_STAT_PAGE   uint64_t              cursor (0 for the first page)
+ *                  uint32_t              max_entries (1 to DOPT_STAT_PAGE_MAX,
+ *                                        EINVAL if 0)
+ *
+ * DOPT_STAT_STREAM uint64_t              cursor (0 to start, or a cursor
+ *                                        of a page to resume after)
+ *
+ * DOPT_SNAPSHOT_FD -
+ * DOPT_WATCH       -
+ * DOPT_QUERY       dopt_query            query
+ * DOPT_SELFSTAT    -
+ *
  * All options except DOPT_STOP send int32_t `status_code` first to
  * indicate if they succeeded or failed. If they succeed, reply is
  * sent afterwards if needed. Failure statuses should match errno codes.
@@ -62,6 +98,114 @@
  *                      }
  *                  }
  *
+ * DOPT_LOAD_STATUS dopt_load_status       progress
+ *
+ * DOPT_HANDOFF     dopt_handoff_state     state
+ *                  The message carries SCM_RIGHTS with state.fd_count
+ *                  descriptors, in order: IPC listening socket, counter
+ *                  table segment, capture socket (none from a daemon
+ *                  using the xdp backend). The receiver then
+ *                  sends an int32_t status: 0 once it adopted the
+ *                  state, after which the sender exits, or an error
+ *                  code. On an error, EOF or no status within
+ *                  HANDOFF_ACK_TIMEOUT_MS the sender resumes.
+ *
+ * DOPT_FRAMED      -
+ *
+ * DOPT_IP_COUNT_BATCH uint32_t        addr_count
+ *                  uint64_t[addr_count]  counts, in the order of the
+ *                                        addresses. Only IPv4 is counted,
+ *                                        IPv6 addresses other than
+ *                                        IPv4-mapped ones count 0.
+ *
+ * DOPT_STAT_V2     dopt_stat_v2_header    header
+ *                  dopt_stat_entry[header.entry_count] entries
+ *                  Entries are in no particular order, saved stats not
+ *                  merged yet included. ENODEV if the interface is not
+ *                  the one being sniffed.
+ *
+ * DOPT_STAT_PAGE   dopt_stat_page         page
+ *                  dopt_stat_entry[page.entry_count] entries
+ *
+ * DOPT_STAT_STREAM (repeated until page.cursor is 0) {
+ *                      dopt_stat_page         page
+ *                      dopt_stat_entry[page.entry_count] entries
+ *                  }
+ *                  In framed mode the status comes in its own frame
+ *                  and every page in another frame with the same id.
+ *
+ *                  Pages walk the live table in slot order. Every entry
+ *                  present during the whole walk is sent exactly once,
+ *                  entries added meanwhile may be missed. A page may
+ *                  hold fewer entries than asked for, even none, while
+ *                  its cursor is not 0. While saved stats are merged,
+ *                  pages walk a merged copy of the table instead. If
+ *                  the table was resized or cleared, or the copy
+ *                  remade, since the cursor was issued, DOPT_STAT_PAGE
+ *                  fails with ESTALE and a stream ends with a page of
+ *                  status ESTALE: start over from cursor 0.
+ *
+ * DOPT_SNAPSHOT_FD dopt_snapshot_info     info
+ *                  The message carries SCM_RIGHTS with one descriptor:
+ *                  a memfd of info.size bytes laid out as the shared
+ *                  counter table (see shm_table_def.h), copied at one
+ *                  point in time. It is sealed against writes and
+ *                  resizing and can be mmap()'ed read-only as is.
+ *                  Saved stats not merged yet are included.
+ *
+ * DOPT_WATCH       dopt_watch_info        info
+ *                  then, every info.interval_ms, one delta {
+ *                      dopt_watch_header      header
+ *                      dopt_watch_entry[header.entry_count] entries
+ *                  }
+ *                  Entries are the addresses counted since the previous
+ *                  delta, in no particular order. They carry the current
+ *                  count besides the increase, so applying them to any
+ *                  earlier copy of the table brings it up to date. A
+ *                  delta is sent even if nothing changed. Saved stats
+ *                  merged after a start show up as increases too.
+ *                  In plain mode the connection carries nothing but
+ *                  deltas afterwards and the subscription ends when it
+ *                  is closed; anything sent on it closes it. In framed
+ *                  mode every delta comes in a frame with the id of the
+ *                  DOPT_WATCH request, interleaved with other replies.
+ *                  A subscriber that falls more than one delta behind
+ *                  is disconnected.
+ *
+ * DOPT_QUERY       dopt_query_result      result
+ *                  dopt_stat_entry[result.row_count] rows
+ *                  Rows are the entries matching the query, in the
+ *                  order of query.sort, at most query.limit of them.
+ *                  The query runs on a consistent copy of the matching
+ *                  entries, saved stats not merged yet included.
+ *                  EINVAL if the query is malformed.
+ *
+ * DOPT_SELFSTAT    dopt_selfstat          stats
+ *                  uint64_t[stats.hist_buckets] histogram of the time
+ *                  to process a packet, in ns, bucketed as described
+ *                  in hist_def.h
+ *                  Counters start with the daemon and are read one by
+ *                  one while capture goes on, so they may be a packet
+ *                  apart from each other.
+ *
+ * Connections:
+ * The daemon serves one command per connection and closes it once the
+ * reply is sent. Clients that send nothing for 30 seconds or do not
+ * read their replies for 10 seconds are disconnected.
+ *
+ * Framed mode:
+ * After a successful DOPT_FRAMED the connection stays open and every
+ * command is wrapped in a frame: a dopt_frame_header followed by
+ * `size` bytes holding the command as described above (option and
+ * arguments). Each reply is a dopt_frame_header with the `id` of its
+ * request followed by `size` bytes of the reply as described above
+ * (status and values). Requests may be pipelined, i.e. sent without
+ * waiting for the previous replies; replies come back in the order of
+ * the requests. A frame that cannot be parsed gets a status of EPROTO,
+ * an unknown option EOPNOTSUPP. DOPT_HANDOFF is not available in
+ * framed mode. Frames larger than DOPT_FRAME_MAX close the connection.
+ * Idle framed connections are closed after 10 minutes.
+ *
  * Notes:
  * INET_ADDRSTRLEN is defined in <netinet/in.h>
  * IFNAMSIZ is defined in <net/if.h>
@@ -72,9 +216,276 @@ enum passed_option
     DOPT_STOP,
     DOPT_SET_IFACE,
     DOPT_STAT,
-    DOPT_IP_COUNT
+    DOPT_IP_COUNT,
+    DOPT_LOAD_STATUS,
+    DOPT_HANDOFF,
+    DOPT_FRAMED,
+    DOPT_IP_COUNT_BATCH,
+    DOPT_STAT_V2,
+    DOPT_STAT_PAGE,
+    DOPT_STAT_STREAM,
+    DOPT_SNAPSHOT_FD,
+    DOPT_WATCH,
+    DOPT_QUERY,
+    DOPT_SELFSTAT
+};
+
+/* Most addresses in one DOPT_IP_COUNT_BATCH */
+#define DOPT_BATCH_MAX 4096
+
+/* Largest `size` of a request frame, fits a full IPv6 batch */
+#define DOPT_FRAME_MAX 131072
+
+/**
+ * @struct s_dopt_frame_header
+ * @typedef dopt_frame_header
+ * @brief Header of requests and replies in framed mode.
+ */
+typedef struct s_dopt_frame_header
+{
+    uint32_t size;      /* bytes following the header */
+    uint32_t id;        /* chosen by the client, echoed in the reply */
+} dopt_frame_header;
+
+/**
+ * @enum load_state
+ * @brief State of loading saved stats in background.
+ */
+enum load_state
+{
+    LOAD_IDLE,      /* nothing was started yet */
+    LOAD_READING,   /* reading the stats file */
+    LOAD_PARSING,   /* parsing into a private table */
+    LOAD_MERGING,   /* merging into the live table */
+    LOAD_DONE,
+    LOAD_FAILED     /* error holds the errno code */
 };
 
+/**
+ * @struct s_dopt_load_status
+ * @typedef dopt_load_status
+ * @brief Reply of DOPT_LOAD_STATUS.
+ */
+typedef struct s_dopt_load_status
+{
+    uint32_t state;         /* load_state */
+    int32_t error;
+    uint64_t bytes_total;   /* size of the stats file */
+    uint64_t bytes_done;    /* bytes parsed so far */
+    uint64_t entries;       /* entries parsed so far */
+} dopt_load_status;
+
+/**
+ * @struct s_dopt_stat_v2_header
+ * @typedef dopt_stat_v2_header
+ * @brief Reply header of DOPT_STAT_V2.
+ */
+typedef struct s_dopt_stat_v2_header
+{
+    uint32_t entry_count;
+    uint32_t reserved;
+    uint64_t packets;       /* sum of all counts */
+    char ifname[16];        /* IFNAMSIZ */
+} dopt_stat_v2_header;
+
+/**
+ * @struct s_dopt_stat_entry
+ * @typedef dopt_stat_entry
+ * @brief Packed 12 byte record of DOPT_STAT_V2.
+ */
+typedef struct s_dopt_stat_entry
+{
+    uint32_t addr;          /* IPv4 address, network byte order */
+    uint64_t count;
+} __attribute__((packed)) dopt_stat_entry;
+
+/* Most entries in one page */
+#define DOPT_STAT_PAGE_MAX 4096
+
+/**
+ * @struct s_dopt_stat_page
+ * @typedef dopt_stat_page
+ * @brief Page header of DOPT_STAT_PAGE and DOPT_STAT_STREAM.
+ */
+typedef struct s_dopt_stat_page
+{
+    uint64_t cursor;        /* of the next page, 0 after the last one */
+    uint32_t entry_count;
+    int32_t status;         /* 0, or why a stream ended early */
+} dopt_stat_page;
+
+/**
+ * @struct s_dopt_snapshot_info
+ * @typedef dopt_snapshot_info
+ * @brief Reply of DOPT_SNAPSHOT_FD.
+ */
+typedef struct s_dopt_snapshot_info
+{
+    uint64_t size;          /* of the memfd */
+    uint64_t entries;
+    uint64_t packets;
+    uint32_t capacity;      /* slots in the memfd */
+    uint32_t reserved;
+} dopt_snapshot_info;
+
+/**
+ * @struct s_dopt_watch_info
+ * @typedef dopt_watch_info
+ * @brief Reply of DOPT_WATCH.
+ */
+typedef struct s_dopt_watch_info
+{
+    uint32_t interval_ms;   /* between deltas */
+    uint32_t reserved;
+    uint64_t sequence;      /* of the first delta */
+} dopt_watch_info;
+
+/* dopt_watch_header.flags */
+#define DOPT_WATCH_RESET 0x1    /* the table was cleared, counts start over */
+
+/**
+ * @struct s_dopt_watch_header
+ * @typedef dopt_watch_header
+ * @brief Header of a delta pushed to DOPT_WATCH subscribers.
+ */
+typedef struct s_dopt_watch_header
+{
+    uint64_t sequence;      /* one more than the previous delta */
+    uint64_t packets;       /* sum of all counts */
+    uint32_t entry_count;
+    uint32_t flags;         /* DOPT_WATCH_* */
+} dopt_watch_header;
+
+/* dopt_watch_entry.flags */
+#define DOPT_WATCH_NEW 0x1      /* first counted in this interval */
+
+/**
+ * @struct s_dopt_watch_entry
+ * @typedef dopt_watch_entry
+ * @brief Changed counter in a DOPT_WATCH delta.
+ */
+typedef struct s_dopt_watch_entry
+{
+    uint32_t addr;          /* IPv4 address, network byte order */
+    uint32_t flags;         /* DOPT_WATCH_* */
+    uint64_t count;         /* current */
+    uint64_t delta;         /* increase since the previous delta */
+} dopt_watch_entry;
+
+/**
+ * @enum dopt_query_sort
+ * @brief Order of DOPT_QUERY rows, ties are broken by address.
+ */
+enum dopt_query_sort
+{
+    DOPT_SORT_NONE,         /* table order, the first matches found */
+    DOPT_SORT_COUNT_DESC,   /* busiest first */
+    DOPT_SORT_COUNT_ASC,
+    DOPT_SORT_ADDR_ASC,
+    DOPT_SORT_ADDR_DESC
+};
+
+/**
+ * @struct s_dopt_query
+ * @typedef dopt_query
+ * @brief Argument of DOPT_QUERY, an entry matches all predicates.
+ */
+typedef struct s_dopt_query
+{
+    uint32_t prefix;        /* IPv4 network, network byte order */
+    uint32_t prefix_len;    /* 0 to 32, 0 matches any address */
+    uint64_t count_min;     /* counts from count_min ... */
+    uint64_t count_max;     /* ... to count_max, 0 for no upper bound */
+    uint32_t sort;          /* dopt_query_sort */
+    uint32_t limit;         /* most rows, 0 for all matches */
+} dopt_query;
+
+/**
+ * @struct s_dopt_query_result
+ * @typedef dopt_query_result
+ * @brief Reply header of DOPT_QUERY.
+ */
+typedef struct s_dopt_query_result
+{
+    uint64_t matched;       /* entries matching, sent or not */
+    uint64_t packets;       /* sum of their counts */
+    uint32_t row_count;     /* entries following */
+    uint32_t reserved;
+} dopt_query_result;
+
+/* how the daemon counts packets, dopt_selfstat.backend */
+#define CAPTURE_BACKEND_SOCKET 0    /* received by the capture thread */
+#define CAPTURE_BACKEND_BPF 1       /* counted in the kernel by eBPF */
+#define CAPTURE_BACKEND_XDP 2       /* received on AF_XDP sockets */
+
+/* dopt_selfstat.xdp_flags */
+#define CAPTURE_XDP_NATIVE 1        /* the XDP program runs in the driver */
+#define CAPTURE_XDP_ZEROCOPY 2      /* frames are not copied to the sockets */
+
+/**
+ * @struct s_dopt_selfstat
+ * @typedef dopt_selfstat
+ * @brief Reply of DOPT_SELFSTAT.
+ */
+typedef struct s_dopt_selfstat
+{
+    uint64_t elapsed_ms;        /* since the counters started */
+    uint64_t packets;           /* received by the capture thread */
+    uint64_t bytes;
+    uint64_t kernel_drops;      /* dropped by the kernel, queue full */
+    uint64_t recv_errors;
+    uint64_t lock_waits;        /* batches that found the stats lock taken */
+    uint64_t lock_wait_ns;      /* total time waited for it */
+    uint64_t lock_wait_max_ns;
+    uint64_t process_max_ns;    /* slowest packet, received until counted */
+    uint64_t process_total_ns;
+    uint64_t ring_overflows;    /* received, lost because the ring was full */
+    uint64_t batches;           /* taken from the ring and counted */
+    uint32_t ring_capacity;     /* records, 0 before the first start */
+    uint32_t ring_used;         /* records waiting to be counted */
+    uint32_t ring_max_used;     /* most records seen waiting */
+    uint32_t busy_poll_us;      /* 0 if the capture threads never spin */
+    uint64_t spin_packets;      /* received while spinning, not woken */
+    uint64_t recv_spin_ns;      /* receive stage polling an empty socket */
+    uint64_t recv_work_ns;      /* receive stage taking packets, when spinning */
+    uint64_t aggregate_spin_ns; /* aggregation stage polling an empty ring */
+    uint64_t aggregate_work_ns; /* aggregation stage counting batches */
+    uint64_t busy_poll_fallbacks;   /* times a stage went idle and blocked */
+    uint32_t backend;           /* CAPTURE_BACKEND_* */
+    uint32_t bpf_entries;       /* addresses counted in the kernel */
+    uint64_t bpf_misses;        /* packets not counted, in-kernel map full */
+    uint32_t xdp_queues;        /* AF_XDP sockets, one per receive queue */
+    uint32_t xdp_flags;         /* CAPTURE_XDP_* */
+    uint64_t xdp_rx_dropped;    /* frames the kernel could not give a socket */
+    uint64_t xdp_rx_ring_full;  /* frames dropped, RX ring full */
+    uint64_t xdp_fill_ring_empty;   /* times no frame was on the fill ring */
+    uint64_t xdp_invalid_descs; /* bad descriptors on the fill ring */
+    uint32_t running;           /* capture thread is running */
+    int32_t last_error;         /* errno code of the last capture error */
+    uint32_t hist_sub_bits;     /* HIST_SUB_BITS */
+    uint32_t hist_buckets;      /* values following */
+} dopt_selfstat;
+
 /* TODO: maybe send confirmation bit? */
 
+#define HANDOFF_VERSION 1
+#define HANDOFF_FD_MAX 3
+/* how long the old daemon waits for the new one to adopt its state */
+#define HANDOFF_ACK_TIMEOUT_MS 10000
+
+/**
+ * @struct s_dopt_handoff_state
+ * @typedef dopt_handoff_state
+ * @brief Reply of DOPT_HANDOFF.
+ *
+ * IFNAMSIZ is defined in <net/if.h>
+ */
+typedef struct s_dopt_handoff_state
+{
+    uint32_t version;       /* HANDOFF_VERSION */
+    uint32_t capturing;     /* capture was running */
+    uint32_t fd_count;      /* descriptors attached */
+    char ifname[16];        /* IFNAMSIZ */
+} dopt_handoff_state;
+
 #endif // CUSTOM_COM_DEF_H
@@ -0,0 +1,63 @@
+/*
+ * Layout of the latency histograms reported by netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef HIST_DEF_H
+#define HIST_DEF_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear buckets in the manner of HdrHistogram: every power of two
+ * is split into 2^HIST_SUB_BITS buckets of equal width, so a value is
+ * known within 1/2^HIST_SUB_BITS (6.25%) whatever its magnitude. Values
+ * below 2^HIST_SUB_BITS get a bucket each. Values of 2^HIST_MAX_BITS
+ * and more share the last bucket.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_MAX_BITS 36    /* 2^36 ns is about 69 s */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/* Bucket of a value */
+static inline uint32_t
+hist_bucket(uint64_t value)
+{
+    uint32_t msb;
+
+    if(value < (1U << HIST_SUB_BITS))
+        return value;
+    if(value >> HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+
+    msb = 63 - __builtin_clzll(value);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+           + ((value >> (msb - HIST_SUB_BITS)) & ((1U << HIST_SUB_BITS) - 1));
+}
+
+/* Smallest value of a bucket */
+static inline uint64_t
+hist_bucket_low(uint32_t bucket)
+{
+    uint32_t shift = bucket >> HIST_SUB_BITS;
+    uint64_t sub = bucket & ((1U << HIST_SUB_BITS) - 1);
+
+    if(!shift)
+        return sub;
+    return (sub | 1U << HIST_SUB_BITS) << (shift - 1);
+}
+
+/* Largest value of a bucket */
+static inline uint64_t
+hist_bucket_high(uint32_t bucket)
+{
+    if(bucket == HIST_BUCKETS - 1)
+        return UINT64_MAX;
+    return hist_bucket_low(bucket + 1) - 1;
+}
+
+#endif // HIST_DEF_H
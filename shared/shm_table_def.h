@@ -0,0 +1,125 @@
+/*
+ * Layout of the counter table shared between netsniffd and its readers
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#ifndef SHM_TABLE_DEF_H
+#define SHM_TABLE_DEF_H
+
+#include <stdint.h>
+#include <net/if.h>
+
+#define SHM_TABLE_NAME "/netsniffd.table"
+#define SHM_TABLE_MAGIC 0x4e53544eU /* "NSTN" */
+#define SHM_TABLE_VERSION 1
+
+/**
+ * @struct s_shm_table_header
+ * @typedef shm_table_header
+ * @brief Header at the start of the shared segment.
+ *
+ * The header is followed by `capacity` shm_table_entry slots.
+ * The table is an open addressing hash table with linear probing,
+ * written by a single daemon thread and read lock-free by anyone.
+ *
+ * Versioning:
+ * - counts of existing slots are updated in place with atomic stores,
+ *   so readers never see a torn counter;
+ * - a new slot gets its address first and its count last, a slot with
+ *   a zero count is empty;
+ * - `seq` is a seqlock for structural changes (resize, clear). It is
+ *   odd while the layout is being rebuilt. A reader that saw `seq`
+ *   change must retry;
+ * - the segment only grows. A reader takes `capacity` once per read
+ *   section and must map the segment again if SHM_TABLE_SIZE(capacity)
+ *   does not fit its mapping, before looking at the slots.
+ */
+typedef struct s_shm_table_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    uint32_t capacity;  /* number of slots, power of two */
+    uint64_t entries;   /* occupied slots */
+    uint64_t packets;   /* sum of all counts */
+    uint64_t map_size;  /* current size of the segment in bytes */
+    char ifname[IFNAMSIZ];
+    uint8_t reserved[8];
+} shm_table_header;
+
+/**
+ * @struct s_shm_table_entry
+ * @typedef shm_table_entry
+ */
+typedef struct s_shm_table_entry
+{
+    uint32_t addr;      /* IPv4 address, network byte order */
+    uint32_t reserved;
+    uint64_t count;     /* 0 means the slot is empty */
+} shm_table_entry;
+
+#define SHM_TABLE_SLOTS(hdr) ((shm_table_entry *)((char *)(hdr) + sizeof(shm_table_header)))
+#define SHM_TABLE_SIZE(capacity) (sizeof(shm_table_header) + (size_t)(capacity) * sizeof(shm_table_entry))
+
+/* murmur3 finalizer, spreads IPv4 addresses over the low bits */
+static inline uint32_t
+shm_table_hash(uint32_t addr)
+{
+    addr ^= addr >> 16;
+    addr *= 0x85ebca6bU;
+    addr ^= addr >> 13;
+    addr *= 0xc2b2ae35U;
+    addr ^= addr >> 16;
+    return addr;
+}
+
+/* Begin a read section, waits while a resize is in progress. */
+static inline uint32_t
+shm_table_read_begin(const shm_table_header *hdr)
+{
+    uint32_t seq;
+    while((seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    return seq;
+}
+
+/* Returns nonzero if the read section saw a structural change. */
+static inline int
+shm_table_read_retry(const shm_table_header *hdr, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/**
+ * @fn shm_table_lookup
+ * @brief Find a count for an address without locking.
+ * @return count, 0 if the address is not in the table.
+ *
+ * Must be called inside a read section with the capacity taken in
+ * it, the caller retries if shm_table_read_retry() says so.
+ */
+static inline uint64_t
+shm_table_lookup(const shm_table_header *hdr, uint32_t capacity, uint32_t addr)
+{
+    const shm_table_entry *slots = SHM_TABLE_SLOTS(hdr);
+    uint32_t mask = capacity - 1;
+    uint32_t i = shm_table_hash(addr) & mask;
+
+    for(uint32_t probes = 0; probes <= mask; ++probes, i = (i + 1) & mask)
+    {
+        uint64_t count = __atomic_load_n(&slots[i].count, __ATOMIC_ACQUIRE);
+        if(!count)
+            return 0;
+        if(__atomic_load_n(&slots[i].addr, __ATOMIC_RELAXED) == addr)
+            return count;
+    }
+
+    return 0;
+}
+
+#endif // SHM_TABLE_DEF_H
@@ -0,0 +1,473 @@
+/*
+ * netsniff-gen - TCP/IP traffic generator for load testing netsniffd
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "addr_dist.h"
+
+const char *program_name = "netsniff-gen";
+
+#define GEN_DEFAULT_DST "127.0.0.1"
+#define GEN_DEFAULT_NET "10.0.0.0"
+#define GEN_DEFAULT_SIZE 65536
+#define GEN_DEFAULT_SECONDS 5
+#define GEN_DEFAULT_PORT 9
+#define GEN_SIZE_MAX (1U << 24)
+/* packets handed to the kernel per sendmmsg() */
+#define GEN_BATCH 64
+/* source addresses drawn in advance, the stream repeats after that */
+#define GEN_STREAM_MAX (1U << 22)
+/* longest sleep of the rate limiter, so late batches are caught up evenly */
+#define GEN_SLEEP_MAX_NS 1000000
+
+/**
+ * @struct s_gen_packet
+ * @typedef gen_packet
+ * @brief IPv4 header and an empty TCP segment, as put on the wire.
+ */
+typedef struct s_gen_packet
+{
+    struct iphdr ip;
+    struct tcphdr tcp;
+} gen_packet;
+
+/**
+ * @struct s_gen_options
+ * @typedef gen_options
+ */
+typedef struct s_gen_options
+{
+    struct in_addr dst;
+    struct in_addr net;     /* first source address */
+    const char *iface;
+    addr_dist dist;
+    uint32_t size;          /* source addresses */
+    double zipf_s;
+    uint64_t rate;          /* packets per second, 0 for as fast as possible */
+    uint64_t count;         /* packets to send, 0 to use seconds */
+    double seconds;
+    uint64_t seed;
+} gen_options;
+
+static inline uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/***********/
+/* Sources */
+/***********/
+
+/* Source addresses in network byte order, drawn before sending starts */
+static int
+sources_create(const gen_options *opts, uint32_t **sources_out, size_t *length_out)
+{
+    size_t length = GEN_STREAM_MAX;
+    uint64_t state = opts->seed;
+    uint32_t *sources;
+    int err;
+
+    /* a sweep is exact, whatever its length */
+    if(opts->dist == DIST_SCAN)
+        length = opts->size;
+
+    sources = malloc(length * sizeof(*sources));
+    if(!sources)
+        return ENOMEM;
+
+    err = addr_dist_fill(sources, length, opts->dist, opts->size, opts->zipf_s, &state);
+    if(err)
+    {
+        free(sources);
+        return err;
+    }
+
+    for(size_t i = 0; i < length; ++i)
+        sources[i] = htonl(ntohl(opts->net.s_addr) + sources[i]);
+
+    *sources_out = sources;
+    *length_out = length;
+    return 0;
+}
+
+/***********/
+/* Packets */
+/***********/
+
+static uint16_t
+checksum_fold(uint32_t sum)
+{
+    while(sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+static uint32_t
+checksum_add(uint32_t sum, const void *data, size_t size)
+{
+    const uint16_t *words = data;
+
+    for(size_t i = 0; i < size / 2; ++i)
+        sum += words[i];
+    return sum;
+}
+
+/*
+ * Every packet carries RST: a segment with RST to a closed port is
+ * dropped silently, so the spoofed sources never get a reply sent to
+ * them, while a raw TCP socket still sees every packet.
+ */
+static void
+packet_init(gen_packet *pkt, struct in_addr dst)
+{
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->ip.version = 4;
+    pkt->ip.ihl = sizeof(pkt->ip) / 4;
+    pkt->ip.tot_len = htons(sizeof(*pkt));
+    pkt->ip.ttl = 64;
+    pkt->ip.protocol = IPPROTO_TCP;
+    pkt->ip.daddr = dst.s_addr;
+
+    pkt->tcp.source = htons(GEN_DEFAULT_PORT);
+    pkt->tcp.dest = htons(GEN_DEFAULT_PORT);
+    pkt->tcp.doff = sizeof(pkt->tcp) / 4;
+    pkt->tcp.rst = 1;
+}
+
+static void
+packet_set_source(gen_packet *pkt, uint32_t saddr, uint32_t seq)
+{
+    struct
+    {
+        uint32_t saddr;
+        uint32_t daddr;
+        uint8_t zero;
+        uint8_t protocol;
+        uint16_t length;
+    } __attribute__((packed)) pseudo;
+    uint32_t sum;
+
+    pkt->ip.saddr = saddr;
+    pkt->ip.id = htons(seq);
+    pkt->ip.check = 0;
+    pkt->ip.check = checksum_fold(checksum_add(0, &pkt->ip, sizeof(pkt->ip)));
+
+    pseudo.saddr = saddr;
+    pseudo.daddr = pkt->ip.daddr;
+    pseudo.zero = 0;
+    pseudo.protocol = IPPROTO_TCP;
+    pseudo.length = htons(sizeof(pkt->tcp));
+
+    pkt->tcp.seq = htonl(seq);
+    pkt->tcp.check = 0;
+    sum = checksum_add(0, &pseudo, sizeof(pseudo));
+    pkt->tcp.check = checksum_fold(checksum_add(sum, &pkt->tcp, sizeof(pkt->tcp)));
+}
+
+static int
+socket_open(const gen_options *opts, int *fd_out)
+{
+    int fd, on = 1;
+
+    fd = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+    if(fd == -1)
+        return errno;
+
+    if(setsockopt(fd, IPPROTO_IP, IP_HDRINCL, &on, sizeof(on))
+       || (opts->iface && setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE,
+                                     opts->iface, strlen(opts->iface) + 1)))
+    {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+
+    *fd_out = fd;
+    return 0;
+}
+
+/********/
+/* Send */
+/********/
+
+/**
+ * @struct s_gen_result
+ * @typedef gen_result
+ */
+typedef struct s_gen_result
+{
+    uint64_t sent;
+    uint64_t dropped;   /* refused by the kernel, e.g. ENOBUFS */
+    uint64_t elapsed_ns;
+} gen_result;
+
+static int
+generate(const gen_options *opts, int fd, const uint32_t *sources, size_t length,
+         gen_result *result)
+{
+    gen_packet packets[GEN_BATCH];
+    struct iovec iovs[GEN_BATCH];
+    struct mmsghdr msgs[GEN_BATCH];
+    struct sockaddr_in dst = { 0 };
+    uint64_t start, deadline, seq = 0;
+    size_t next = 0;
+
+    dst.sin_family = AF_INET;
+    dst.sin_addr = opts->dst;
+
+    for(int i = 0; i < GEN_BATCH; ++i)
+    {
+        packet_init(&packets[i], opts->dst);
+        iovs[i].iov_base = &packets[i];
+        iovs[i].iov_len = sizeof(packets[i]);
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &dst;
+        msgs[i].msg_hdr.msg_namelen = sizeof(dst);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    memset(result, 0, sizeof(*result));
+    start = monotonic_ns();
+    deadline = start + (uint64_t)(opts->seconds * 1e9);
+
+    for(;;)
+    {
+        uint64_t done = result->sent + result->dropped;
+        unsigned batch = GEN_BATCH;
+        uint64_t now = monotonic_ns();
+        int n;
+
+        if(opts->count ? done >= opts->count : now >= deadline)
+            break;
+        if(opts->count && opts->count - done < batch)
+            batch = opts->count - done;
+
+        /* pace against the start, so a late batch is made up for */
+        if(opts->rate)
+        {
+            uint64_t due = start + done / opts->rate * 1000000000
+                           + done % opts->rate * 1000000000 / opts->rate;
+            if(due > now)
+            {
+                struct timespec ts;
+                uint64_t sleep = due - now;
+
+                if(sleep > GEN_SLEEP_MAX_NS)
+                    sleep = GEN_SLEEP_MAX_NS;
+                ts.tv_sec = 0;
+                ts.tv_nsec = sleep;
+                nanosleep(&ts, NULL);
+                continue;
+            }
+        }
+
+        for(unsigned i = 0; i < batch; ++i)
+        {
+            packet_set_source(&packets[i], sources[next], seq++);
+            if(++next == length)
+                next = 0;
+        }
+
+        n = sendmmsg(fd, msgs, batch, 0);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != ENOBUFS && errno != EAGAIN)
+                return errno;
+
+            /* the first packet did not fit, count it and move on */
+            ++result->dropped;
+            continue;
+        }
+
+        result->sent += n;
+    }
+
+    result->elapsed_ns = monotonic_ns() - start;
+    return 0;
+}
+
+/*****************/
+/* Documentation */
+/*****************/
+
+void
+doc_usage(void)
+{
+    printf("Usage: %s [-d DST] [-i IFACE] [-r RATE] [-t SECONDS | -n COUNT]\n",
+           program_name);
+    printf("       [-s uniform|zipf|scan] [-N SIZE] [-b NET] [-z S] [-S SEED]\n");
+    printf("\n");
+    printf("-d DST      :   destination, default %s.\n", GEN_DEFAULT_DST);
+    printf("-i IFACE    :   send through IFACE, e.g. one end of a veth pair.\n");
+    printf("-r RATE     :   packets per second, default as fast as possible.\n");
+    printf("-t SECONDS  :   how long to send, default %d.\n", GEN_DEFAULT_SECONDS);
+    printf("-n COUNT    :   how many packets to send, instead of -t.\n");
+    printf("-s DIST     :   distribution of the source addresses, default uniform.\n");
+    printf("-N SIZE     :   number of source addresses, default %d.\n", GEN_DEFAULT_SIZE);
+    printf("-b NET      :   first source address, default %s.\n", GEN_DEFAULT_NET);
+    printf("-z S        :   exponent of the Zipf distribution, default 1.0.\n");
+    printf("-S SEED     :   seed of the address generator.\n");
+    printf("\n");
+    printf("Packets are 40-byte TCP segments with RST set, which closed ports\n");
+    printf("drop without a reply. A raw socket is needed, so run as root.\n");
+    printf("The result is printed as one JSON object.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    gen_options opts = { 0 };
+    gen_result result;
+    uint32_t *sources;
+    size_t length;
+    int opt, fd, err;
+
+    inet_pton(AF_INET, GEN_DEFAULT_DST, &opts.dst);
+    inet_pton(AF_INET, GEN_DEFAULT_NET, &opts.net);
+    opts.dist = DIST_UNIFORM;
+    opts.size = GEN_DEFAULT_SIZE;
+    opts.zipf_s = 1.0;
+    opts.seconds = GEN_DEFAULT_SECONDS;
+    opts.seed = 0x9e3779b97f4a7c15ULL;
+
+    while((opt = getopt(argc, argv, "d:i:r:t:n:s:N:b:z:S:h")) != -1)
+    {
+        char *endptr = NULL;
+        int found;
+
+        errno = 0;
+        switch(opt)
+        {
+        case 'd':
+            if(inet_pton(AF_INET, optarg, &opts.dst) != 1)
+                goto invalid;
+            break;
+        case 'b':
+            if(inet_pton(AF_INET, optarg, &opts.net) != 1)
+                goto invalid;
+            break;
+        case 'i':
+            if(strlen(optarg) >= IFNAMSIZ)
+                goto invalid;
+            opts.iface = optarg;
+            break;
+        case 'r':
+            opts.rate = strtoull(optarg, &endptr, 10);
+            break;
+        case 't':
+            opts.seconds = strtod(optarg, &endptr);
+            if(opts.seconds <= 0)
+                goto invalid;
+            break;
+        case 'n':
+            opts.count = strtoull(optarg, &endptr, 10);
+            if(!opts.count)
+                goto invalid;
+            break;
+        case 's':
+            found = 0;
+            for(int d = 0; d < DIST_COUNT; ++d)
+            {
+                if(!strcmp(optarg, addr_dist_names[d]))
+                {
+                    opts.dist = d;
+                    found = 1;
+                }
+            }
+            if(!found)
+                goto invalid;
+            break;
+        case 'N':
+            opts.size = strtoul(optarg, &endptr, 10);
+            if(!opts.size || opts.size > GEN_SIZE_MAX)
+                goto invalid;
+            break;
+        case 'z':
+            opts.zipf_s = strtod(optarg, &endptr);
+            if(opts.zipf_s <= 0)
+                goto invalid;
+            break;
+        case 'S':
+            opts.seed = strtoull(optarg, &endptr, 0);
+            if(!opts.seed)
+                goto invalid;
+            break;
+        default:
+            doc_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+
+        if(errno || (endptr && *endptr))
+            goto invalid;
+    }
+
+    if(optind != argc)
+        goto invalid;
+
+    /* the population must not wrap around the address space */
+    if((uint64_t) ntohl(opts.net.s_addr) + opts.size > UINT32_MAX)
+        goto invalid;
+
+    err = sources_create(&opts, &sources, &length);
+    if(err)
+    {
+        fprintf(stderr, "%s: %s\n", program_name, strerror(err));
+        return 1;
+    }
+
+    err = socket_open(&opts, &fd);
+    if(err)
+    {
+        fprintf(stderr, "%s: raw socket: %s\n", program_name, strerror(err));
+        return 1;
+    }
+
+    err = generate(&opts, fd, sources, length, &result);
+    close(fd);
+    free(sources);
+    if(err)
+    {
+        fprintf(stderr, "%s: sendmmsg: %s\n", program_name, strerror(err));
+        return 1;
+    }
+
+    printf("{\"dist\":\"%s\",\"size\":%u,\"rate\":%" PRIu64 ",\"sent\":%" PRIu64
+           ",\"dropped\":%" PRIu64 ",\"seconds\":%.3f,\"pps\":%.0f}\n",
+           addr_dist_names[opts.dist], opts.size, opts.rate, result.sent, result.dropped,
+           result.elapsed_ns / 1e9,
+           result.elapsed_ns ? result.sent * 1e9 / result.elapsed_ns : 0);
+    return 0;
+
+invalid:
+    doc_usage();
+    return 1;
+}
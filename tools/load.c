@@ -0,0 +1,495 @@
+/*
+ * netsniff-load - latency of control commands under concurrent load
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+
+#include "netsniff.h"
+
+const char *program_name = "netsniff-load";
+
+#define LOAD_DEFAULT_CLIENTS 8
+#define LOAD_DEFAULT_SECONDS 10
+#define LOAD_DEFAULT_MIX "count=90,stat=10"
+#define LOAD_DEFAULT_NET "10.0.0.0"
+#define LOAD_DEFAULT_SIZE 65536
+#define LOAD_CLIENTS_MAX 1024
+
+/**
+ * @enum e_load_op
+ * @brief Commands sent by the clients.
+ */
+typedef enum e_load_op
+{
+    OP_COUNT,   /* DOPT_IP_COUNT of an address of the population */
+    OP_STAT,    /* the whole table, in the binary format */
+    OP_START,
+    OP_STOP,
+    OP_COUNT_MAX
+} load_op;
+
+const char *op_names[OP_COUNT_MAX] = { "count", "stat", "start", "stop" };
+
+/**
+ * @struct s_load_options
+ * @typedef load_options
+ */
+typedef struct s_load_options
+{
+    const char *socket_path;
+    unsigned clients;
+    uint64_t rate;              /* commands per second of all clients, 0 for closed loop */
+    double seconds;
+    unsigned weights[OP_COUNT_MAX];
+    unsigned weight_total;
+    uint32_t net;               /* host byte order */
+    uint32_t size;
+    unsigned fresh;             /* connect for every command */
+} load_options;
+
+/**
+ * @struct s_load_stats
+ * @typedef load_stats
+ * @brief Latencies of one command, in nanoseconds.
+ */
+typedef struct s_load_stats
+{
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[HIST_BUCKETS];
+} load_stats;
+
+/**
+ * @struct s_load_worker
+ * @typedef load_worker
+ */
+typedef struct s_load_worker
+{
+    pthread_t thread;
+    const load_options *opts;
+    unsigned index;
+    uint64_t start_ns;
+    uint64_t deadline_ns;
+    uint64_t rng;
+    int err;                    /* could not connect */
+    load_stats stats[OP_COUNT_MAX];
+} load_worker;
+
+static inline uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleep_until(uint64_t when_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = when_ns / 1000000000;
+    ts.tv_nsec = when_ns % 1000000000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* xorshift64* */
+static inline uint64_t
+rng_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/***********/
+/* Workers */
+/***********/
+
+static load_op
+op_pick(load_worker *worker)
+{
+    unsigned pick = rng_next(&worker->rng) % worker->opts->weight_total;
+    load_op op = 0;
+
+    while(pick >= worker->opts->weights[op])
+        pick -= worker->opts->weights[op++];
+    return op;
+}
+
+static int
+op_run(load_worker *worker, netsniff_client *client, load_op op)
+{
+    dopt_stat_v2_header header;
+    dopt_stat_entry *entries;
+    char ip[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    uint32_t count;
+    int err;
+
+    switch(op)
+    {
+    case OP_COUNT:
+        addr.s_addr = htonl(worker->opts->net + rng_next(&worker->rng) % worker->opts->size);
+        inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+        return netsniff_ip_count(client, ip, &count);
+    case OP_STAT:
+        err = netsniff_stat(client, NULL, &header, &entries);
+        if(!err)
+            free(entries);
+        return err;
+    case OP_START:
+        return netsniff_start(client);
+    case OP_STOP:
+    default:
+        return netsniff_stop(client);
+    }
+}
+
+/*
+ * With a rate, every client has a schedule and latency counts from the
+ * time a command was due, so a slow reply also delays the ones behind
+ * it as it would for real clients. Without a rate, commands are sent
+ * back to back.
+ */
+static void *
+worker_fn(void *arg)
+{
+    load_worker *worker = arg;
+    const load_options *opts = worker->opts;
+    netsniff_client *client;
+    uint64_t due = worker->start_ns, interval = 0;
+
+    worker->err = netsniff_client_open(&client, opts->socket_path, opts->fresh ? 0 : 1);
+    if(worker->err)
+        return NULL;
+
+    if(opts->rate)
+    {
+        interval = 1000000000ULL * opts->clients / opts->rate;
+        /* spread the clients over one interval */
+        due += interval * worker->index / opts->clients;
+    }
+
+    for(;;)
+    {
+        load_op op = op_pick(worker);
+        load_stats *stats = &worker->stats[op];
+        uint64_t start, latency;
+        int err;
+
+        if(interval)
+        {
+            if(due >= worker->deadline_ns)
+                break;
+            sleep_until(due);
+            start = due;
+            due += interval;
+        }
+        else
+        {
+            start = monotonic_ns();
+            if(start >= worker->deadline_ns)
+                break;
+        }
+
+        err = op_run(worker, client, op);
+        latency = monotonic_ns() - start;
+
+        ++stats->requests;
+        if(err)
+            ++stats->errors;
+        stats->total_ns += latency;
+        if(latency > stats->max_ns)
+            stats->max_ns = latency;
+        ++stats->hist[hist_bucket(latency)];
+    }
+
+    netsniff_client_close(client);
+    return NULL;
+}
+
+/**********/
+/* Output */
+/**********/
+
+/* Upper bound of the bucket, but no more than what was seen */
+static double
+percentile_us(const load_stats *stats, double q)
+{
+    uint64_t ns = netsniff_hist_percentile(stats->hist, q);
+
+    return (ns > stats->max_ns ? stats->max_ns : ns) / 1e3;
+}
+
+static void
+stats_print(load_op op, const load_stats *stats, double seconds)
+{
+    printf("{\"op\":\"%s\",\"requests\":%" PRIu64 ",\"errors\":%" PRIu64
+           ",\"per_second\":%.1f,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f"
+           ",\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+           op_names[op], stats->requests, stats->errors, stats->requests / seconds,
+           stats->requests ? stats->total_ns / 1e3 / stats->requests : 0,
+           percentile_us(stats, 0.5), percentile_us(stats, 0.99),
+           percentile_us(stats, 0.999),
+           stats->max_ns / 1e3);
+}
+
+static void
+stats_merge(load_stats *into, const load_stats *stats)
+{
+    into->requests += stats->requests;
+    into->errors += stats->errors;
+    into->total_ns += stats->total_ns;
+    if(stats->max_ns > into->max_ns)
+        into->max_ns = stats->max_ns;
+    for(uint32_t i = 0; i < HIST_BUCKETS; ++i)
+        into->hist[i] += stats->hist[i];
+}
+
+/*****************/
+/* Documentation */
+/*****************/
+
+void
+doc_usage(void)
+{
+    printf("Usage: %s [-c CLIENTS] [-r RATE] [-t SECONDS] [-m OP=WEIGHT,...]\n",
+           program_name);
+    printf("       [-b NET] [-N SIZE] [-p SOCKET] [-f]\n");
+    printf("\n");
+    printf("-c CLIENTS  :   concurrent clients, default %d.\n", LOAD_DEFAULT_CLIENTS);
+    printf("-r RATE     :   commands per second of all clients together,\n");
+    printf("                default as fast as replies come.\n");
+    printf("-t SECONDS  :   length of the run, default %d.\n", LOAD_DEFAULT_SECONDS);
+    printf("-m MIX      :   relative weights of count, stat, start and stop,\n");
+    printf("                default %s.\n", LOAD_DEFAULT_MIX);
+    printf("-b NET      :   first address looked up by count, default %s.\n",
+           LOAD_DEFAULT_NET);
+    printf("-N SIZE     :   addresses looked up by count, default %d.\n",
+           LOAD_DEFAULT_SIZE);
+    printf("-p SOCKET   :   daemon socket, default %s.\n", IPC_SOCKET_PATH);
+    printf("-f          :   connect for every command instead of keeping\n");
+    printf("                one connection per client.\n");
+    printf("\n");
+    printf("Latencies of every command and the packets the kernel dropped\n");
+    printf("meanwhile are printed as one JSON object per line. With a rate,\n");
+    printf("latency counts from the time a command was due.\n");
+}
+
+/* Parse "op=weight,..." */
+static int
+mix_parse(char *mix, load_options *opts)
+{
+    memset(opts->weights, 0, sizeof(opts->weights));
+    opts->weight_total = 0;
+
+    for(char *tok = strtok(mix, ","); tok; tok = strtok(NULL, ","))
+    {
+        char *sep = strchr(tok, '='), *endptr;
+        unsigned long weight;
+        int op;
+
+        if(!sep)
+            return EINVAL;
+        *sep = '\0';
+
+        for(op = 0; op < OP_COUNT_MAX && strcmp(tok, op_names[op]); ++op)
+            ;
+        if(op == OP_COUNT_MAX)
+            return EINVAL;
+
+        errno = 0;
+        weight = strtoul(sep + 1, &endptr, 10);
+        if(errno || *endptr || endptr == sep + 1 || weight > 1000000)
+            return EINVAL;
+
+        opts->weights[op] = weight;
+        opts->weight_total += weight;
+    }
+
+    return opts->weight_total ? 0 : EINVAL;
+}
+
+int
+main(int argc, char **argv)
+{
+    char default_mix[] = LOAD_DEFAULT_MIX;
+    load_options opts = { 0 };
+    load_stats all = { 0 };
+    load_worker *workers;
+    netsniff_client *client;
+    dopt_selfstat before, after;
+    uint64_t *hist, start, received, drops;
+    struct in_addr net;
+    double seconds;
+    int opt, err;
+
+    opts.clients = LOAD_DEFAULT_CLIENTS;
+    opts.seconds = LOAD_DEFAULT_SECONDS;
+    opts.size = LOAD_DEFAULT_SIZE;
+    inet_pton(AF_INET, LOAD_DEFAULT_NET, &net);
+    mix_parse(default_mix, &opts);
+
+    while((opt = getopt(argc, argv, "c:r:t:m:b:N:p:fh")) != -1)
+    {
+        char *endptr = NULL;
+
+        errno = 0;
+        switch(opt)
+        {
+        case 'c':
+            opts.clients = strtoul(optarg, &endptr, 10);
+            if(!opts.clients || opts.clients > LOAD_CLIENTS_MAX)
+                goto invalid;
+            break;
+        case 'r':
+            opts.rate = strtoull(optarg, &endptr, 10);
+            break;
+        case 't':
+            opts.seconds = strtod(optarg, &endptr);
+            if(opts.seconds <= 0)
+                goto invalid;
+            break;
+        case 'm':
+            if(mix_parse(optarg, &opts))
+                goto invalid;
+            break;
+        case 'b':
+            if(inet_pton(AF_INET, optarg, &net) != 1)
+                goto invalid;
+            break;
+        case 'N':
+            opts.size = strtoul(optarg, &endptr, 10);
+            if(!opts.size)
+                goto invalid;
+            break;
+        case 'p':
+            opts.socket_path = optarg;
+            break;
+        case 'f':
+            opts.fresh = 1;
+            break;
+        default:
+            doc_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+
+        if(errno || (endptr && *endptr))
+            goto invalid;
+    }
+
+    if(optind != argc)
+        goto invalid;
+    opts.net = ntohl(net.s_addr);
+
+    workers = calloc(opts.clients, sizeof(*workers));
+    if(!workers)
+    {
+        perror("calloc");
+        return 1;
+    }
+
+    /* capture counters around the run show what it cost the hot path */
+    err = netsniff_client_open(&client, opts.socket_path, 1);
+    if(!err)
+        err = netsniff_selfstat(client, &before, &hist);
+    if(err)
+    {
+        fprintf(stderr, "%s: %s\n", program_name, strerror(err));
+        return 1;
+    }
+    free(hist);
+
+    start = monotonic_ns();
+    for(unsigned i = 0; i < opts.clients; ++i)
+    {
+        workers[i].opts = &opts;
+        workers[i].index = i;
+        workers[i].start_ns = start;
+        workers[i].deadline_ns = start + (uint64_t)(opts.seconds * 1e9);
+        workers[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+
+        err = pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]);
+        if(err)
+        {
+            fprintf(stderr, "%s: pthread_create: %s\n", program_name, strerror(err));
+            return 1;
+        }
+    }
+
+    for(unsigned i = 0; i < opts.clients; ++i)
+        pthread_join(workers[i].thread, NULL);
+    seconds = (monotonic_ns() - start) / 1e9;
+
+    err = netsniff_selfstat(client, &after, &hist);
+    netsniff_client_close(client);
+    if(err)
+    {
+        fprintf(stderr, "%s: %s\n", program_name, strerror(err));
+        return 1;
+    }
+    free(hist);
+
+    for(unsigned i = 0; i < opts.clients; ++i)
+    {
+        if(workers[i].err)
+        {
+            fprintf(stderr, "%s: client %u: %s\n", program_name, i, strerror(workers[i].err));
+            return 1;
+        }
+    }
+
+    for(int op = 0; op < OP_COUNT_MAX; ++op)
+    {
+        load_stats stats = { 0 };
+
+        if(!opts.weights[op])
+            continue;
+
+        for(unsigned i = 0; i < opts.clients; ++i)
+            stats_merge(&stats, &workers[i].stats[op]);
+        stats_print(op, &stats, seconds);
+        stats_merge(&all, &stats);
+    }
+
+    received = after.packets - before.packets;
+    drops = after.kernel_drops - before.kernel_drops;
+    printf("{\"clients\":%u,\"rate\":%" PRIu64 ",\"seconds\":%.3f,\"requests\":%" PRIu64
+           ",\"errors\":%" PRIu64 ",\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f"
+           ",\"capture_running\":%u,\"received\":%" PRIu64 ",\"kernel_drops\":%" PRIu64
+           ",\"drop_percent\":%.3f,\"lock_waits\":%" PRIu64 "}\n",
+           opts.clients, opts.rate, seconds, all.requests, all.errors,
+           percentile_us(&all, 0.5), percentile_us(&all, 0.99),
+           percentile_us(&all, 0.999),
+           after.running, received, drops,
+           received + drops ? 100.0 * drops / (received + drops) : 0,
+           after.lock_waits - before.lock_waits);
+
+    free(workers);
+    return 0;
+
+invalid:
+    doc_usage();
+    return 1;
+}
@@ -0,0 +1,413 @@
+/*
+ * netsniff-merge - streaming merge and diff of netsniffd snapshots
+ *
+ * Copyright (c) 2017 Alexander Shaposhnikov <sanchaez@hotmail.com>
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const char *program_name = "netsniff-merge";
+
+#define OUTPUT_BUFSIZ (1 << 20)
+/* "255.255.255.255;-18446744073709551615\n" */
+#define OUTPUT_LINE_MAX 64
+
+/**
+ * @struct s_merge_input
+ * @typedef merge_input
+ * @brief One mmapped snapshot and the entry it is positioned at.
+ *
+ * Snapshots are "a.b.c.d;count\n" lines sorted by address, as written
+ * by netsniffd.
+ */
+typedef struct s_merge_input
+{
+    const char *path;
+    const char *data;
+    size_t size;
+    const char *pos;
+    const char *end;
+    unsigned long line;
+    uint32_t addr;      /* host byte order, for ordering */
+    uint64_t count;
+    int sign;           /* +1 or -1 */
+} merge_input;
+
+/**
+ * @struct s_output
+ * @typedef output
+ */
+typedef struct s_output
+{
+    int fd;
+    char *buf;
+    size_t size;
+} output;
+
+/***********/
+/* Output  */
+/***********/
+
+static void
+output_flush(output *out)
+{
+    size_t done = 0;
+    while(done < out->size)
+    {
+        ssize_t n = write(out->fd, out->buf + done, out->size - done);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("write");
+            exit(1);
+        }
+        done += n;
+    }
+    out->size = 0;
+}
+
+/* Writes digits of value backwards, returns the start */
+static char *
+format_u64(char *end, uint64_t value)
+{
+    do
+    {
+        *--end = '0' + value % 10;
+        value /= 10;
+    } while(value);
+
+    return end;
+}
+
+static void
+output_entry(output *out, uint32_t addr, uint64_t magnitude, int negative)
+{
+    char digits[24];
+    char *p, *line;
+
+    if(out->size + OUTPUT_LINE_MAX > OUTPUT_BUFSIZ)
+        output_flush(out);
+
+    line = out->buf + out->size;
+    for(int shift = 24; shift >= 0; shift -= 8)
+    {
+        p = format_u64(digits + sizeof(digits), (addr >> shift) & 0xff);
+        memcpy(line, p, digits + sizeof(digits) - p);
+        line += digits + sizeof(digits) - p;
+        *line++ = shift ? '.' : ';';
+    }
+
+    if(negative)
+        *line++ = '-';
+    p = format_u64(digits + sizeof(digits), magnitude);
+    memcpy(line, p, digits + sizeof(digits) - p);
+    line += digits + sizeof(digits) - p;
+    *line++ = '\n';
+
+    out->size = line - out->buf;
+}
+
+/**********/
+/* Input  */
+/**********/
+
+static void
+input_open(merge_input *in, const char *path, int sign)
+{
+    struct stat st;
+    int fd;
+
+    memset(in, 0, sizeof(*in));
+    in->path = path;
+    in->sign = sign;
+
+    fd = open(path, O_RDONLY);
+    if(fd == -1 || fstat(fd, &st) == -1)
+    {
+        fprintf(stderr, "%s: %s: %s\n", program_name, path, strerror(errno));
+        exit(1);
+    }
+
+    in->size = st.st_size;
+    if(in->size)
+    {
+        in->data = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(in->data == MAP_FAILED)
+        {
+            fprintf(stderr, "%s: mmap %s: %s\n", program_name, path, strerror(errno));
+            exit(1);
+        }
+        madvise((void *) in->data, in->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    in->pos = in->data;
+    in->end = in->data + in->size;
+}
+
+static void
+input_close(merge_input *in)
+{
+    if(in->size)
+        munmap((void *) in->data, in->size);
+}
+
+__attribute__((noreturn))
+static void
+input_error(const merge_input *in, const char *what)
+{
+    fprintf(stderr, "%s: %s:%lu: %s\n", program_name, in->path, in->line, what);
+    exit(1);
+}
+
+static uint64_t
+parse_number(merge_input *in, const char **pos, uint64_t max)
+{
+    const char *p = *pos;
+    uint64_t value = 0;
+
+    if(p == in->end || *p < '0' || *p > '9')
+        input_error(in, "number expected");
+
+    while(p != in->end && *p >= '0' && *p <= '9')
+    {
+        uint64_t digit = *p++ - '0';
+        if(value > (max - digit) / 10)
+            input_error(in, "number out of range");
+        value = value * 10 + digit;
+    }
+
+    *pos = p;
+    return value;
+}
+
+/* Moves to the next entry, returns 0 at the end of the input */
+static int
+input_next(merge_input *in)
+{
+    const char *p = in->pos;
+    uint32_t addr = 0;
+
+    if(p == in->end)
+        return 0;
+
+    ++in->line;
+    for(int octet = 0; octet < 4; ++octet)
+    {
+        addr = addr << 8 | parse_number(in, &p, 255);
+        if(p == in->end || *p != (octet < 3 ? '.' : ';'))
+            input_error(in, "malformed address");
+        ++p;
+    }
+
+    in->count = parse_number(in, &p, UINT64_MAX);
+    if(p != in->end)
+    {
+        if(*p != '\n')
+            input_error(in, "malformed count");
+        ++p;
+    }
+
+    /* the merge relies on the order */
+    if(in->line > 1 && addr <= in->addr)
+        input_error(in, "snapshot is not sorted by address");
+
+    in->addr = addr;
+    in->pos = p;
+    return 1;
+}
+
+/*********/
+/* Merge */
+/*********/
+
+/* Binary min-heap of inputs ordered by the current address */
+static void
+heap_sift_down(merge_input **heap, size_t size, size_t i)
+{
+    for(;;)
+    {
+        size_t smallest = i, l = 2 * i + 1, r = l + 1;
+
+        if(l < size && heap[l]->addr < heap[smallest]->addr)
+            smallest = l;
+        if(r < size && heap[r]->addr < heap[smallest]->addr)
+            smallest = r;
+        if(smallest == i)
+            return;
+
+        merge_input *tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+/*
+ * Streams all inputs in address order, adding counts of every address
+ * multiplied by the input sign. Totals of zero are skipped in diffs.
+ */
+static void
+merge(merge_input *inputs, size_t count, output *out, int diff)
+{
+    merge_input **heap = malloc(count * sizeof(*heap));
+    size_t size = 0;
+
+    if(!heap)
+    {
+        perror("malloc");
+        exit(1);
+    }
+
+    for(size_t i = 0; i < count; ++i)
+        if(input_next(&inputs[i]))
+            heap[size++] = &inputs[i];
+
+    for(size_t i = size / 2; i-- > 0;)
+        heap_sift_down(heap, size, i);
+
+    while(size)
+    {
+        uint32_t addr = heap[0]->addr;
+        uint64_t plus = 0, minus = 0;
+
+        /* take the address from every input that has it */
+        while(size && heap[0]->addr == addr)
+        {
+            merge_input *in = heap[0];
+            if(in->sign > 0)
+                plus += in->count;
+            else
+                minus += in->count;
+
+            if(input_next(in))
+                heap_sift_down(heap, size, 0);
+            else
+            {
+                heap[0] = heap[--size];
+                heap_sift_down(heap, size, 0);
+            }
+        }
+
+        if(plus >= minus)
+        {
+            if(plus - minus || !diff)
+                output_entry(out, addr, plus - minus, 0);
+        }
+        else
+        {
+            output_entry(out, addr, minus - plus, 1);
+        }
+    }
+
+    free(heap);
+}
+
+/*****************/
+/* Documentation */
+/*****************/
+
+void
+doc_usage(void)
+{
+    printf("Usage: %s [-o FILE] sum SNAPSHOT...\n", program_name);
+    printf("       %s [-o FILE] diff OLD NEW\n", program_name);
+    printf("\n");
+    printf("sum     :   add counts of all snapshots per IP.\n");
+    printf("diff    :   print NEW minus OLD per IP, only for IPs that changed.\n");
+    printf("-o FILE :   write to FILE instead of stdout.\n");
+    printf("\n");
+    printf("Snapshots must be sorted by address, as netsniffd writes them.\n");
+    printf("The output of sum is a snapshot itself.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *out_path = NULL;
+    merge_input *inputs;
+    output out;
+    int opt, diff;
+    size_t count;
+
+    while((opt = getopt(argc, argv, "o:h")) != -1)
+    {
+        switch(opt)
+        {
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            doc_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+    if(argc < 2 || (strcmp(argv[0], "sum") && strcmp(argv[0], "diff")))
+    {
+        doc_usage();
+        return 1;
+    }
+
+    diff = !strcmp(argv[0], "diff");
+    count = argc - 1;
+    if(diff && count != 2)
+    {
+        doc_usage();
+        return 1;
+    }
+
+    inputs = calloc(count, sizeof(*inputs));
+    out.buf = malloc(OUTPUT_BUFSIZ);
+    if(!inputs || !out.buf)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    for(size_t i = 0; i < count; ++i)
+        input_open(&inputs[i], argv[i + 1], diff && i == 0 ? -1 : 1);
+
+    out.size = 0;
+    out.fd = STDOUT_FILENO;
+    if(out_path)
+    {
+        out.fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(out.fd == -1)
+        {
+            fprintf(stderr, "%s: %s: %s\n", program_name, out_path, strerror(errno));
+            return 1;
+        }
+    }
+
+    merge(inputs, count, &out, diff);
+    output_flush(&out);
+
+    for(size_t i = 0; i < count; ++i)
+        input_close(&inputs[i]);
+    free(inputs);
+    free(out.buf);
+
+    if(out_path && close(out.fd))
+    {
+        perror("close");
+        return 1;
+    }
+
+    return 0;
+}